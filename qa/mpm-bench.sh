@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Compare detection throughput for a set of mpm-algo values.
+#
+# Usage: mpm-bench.sh <suricata binary> <suricata.yaml> <rules> <pcap> [algos]
+#
+# Every algo is run RUNS times (default 3) in single runmode against the
+# rules file given (e.g. an ET open snapshot). The packets/s reported by the
+# pcap-file module at exit is printed for each run. The sgh-mpm-context
+# of the yaml is used, "auto" picks "full" for teddy and "single" for ac.
+
+if [ $# -lt 4 ]; then
+    echo "usage: $0 <suricata> <suricata.yaml> <rules> <pcap> [algos]"
+    exit 1
+fi
+
+SURICATA=$1
+YAML=$2
+RULES=$3
+PCAP=$4
+shift 4
+ALGOS=${*:-"ac ac-bs teddy"}
+RUNS=${RUNS:-3}
+
+LOGDIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$LOGDIR"' EXIT
+
+for ALGO in $ALGOS; do
+    RUN=1
+    while [ $RUN -le $RUNS ]; do
+        $SURICATA -c "$YAML" -S "$RULES" -r "$PCAP" -l "$LOGDIR" \
+            --runmode single --set mpm-algo=$ALGO -v > "$LOGDIR/out" 2>&1
+        PPS=$(sed -n 's/.*processed \([0-9]*\) packets\/s.*/\1/p' "$LOGDIR/out")
+        echo "mpm-algo $ALGO run $RUN: ${PPS:-failed} packets/s"
+        RUN=$((RUN + 1))
+    done
+done
@@ -116,6 +116,7 @@ static void AlertDebugLogFlowBits(AlertDebugLogThread *aft, Packet *p)
         if (p->debuglog_flowbits_names[i] != NULL) {
             MemBufferWriteString(aft->buffer, "FLOWBIT:           %s\n",
                                  p->debuglog_flowbits_names[i]);
+            SCFree((char *)p->debuglog_flowbits_names[i]);
         }
     }
 
@@ -66,6 +66,10 @@
 #include "output.h"
 #include "output-flow.h"
 
+#include "flow-private.h"
+#include "flow-queue.h"
+#include "flow-hash.h"
+
 int DecodeTunnel(ThreadVars *tv, DecodeThreadVars *dtv, Packet *p,
         uint8_t *pkt, uint16_t len, PacketQueue *pq, uint8_t proto)
 {
@@ -355,6 +359,25 @@ void PacketDefragPktSetupParent(Packet *parent)
     DecodeSetNoPayloadInspectionFlag(parent);
 }
 
+/**
+ *  \brief ask the capture method to bypass the packets of the flow
+ *         of this packet.
+ *
+ *  Packets from tunnels and reassembled fragments are not bypassed, as
+ *  the capture method only sees the outer headers.
+ *
+ *  \retval 1 the flow is now bypassed by the capture method
+ *  \retval 0 not supported or failed
+ */
+int PacketBypassCallback(Packet *p)
+{
+    if (p->BypassPacketsFlow == NULL || p->root != NULL ||
+            IS_TUNNEL_PKT(p))
+        return 0;
+
+    return p->BypassPacketsFlow(p);
+}
+
 void DecodeRegisterPerfCounters(DecodeThreadVars *dtv, ThreadVars *tv)
 {
     /* register counters */
@@ -429,6 +452,28 @@ void DecodeRegisterPerfCounters(DecodeThreadVars *dtv, ThreadVars *tv)
         SCPerfTVRegisterCounter("defrag.max_frag_hits", tv,
             SC_PERF_TYPE_UINT64, "NULL");
 
+    dtv->counter_flow_hash_lockless =
+        SCPerfTVRegisterCounter("flow.hash.lookup_lockless", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    dtv->counter_flow_hash_locked =
+        SCPerfTVRegisterCounter("flow.hash.lookup_locked", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    dtv->counter_flow_hash_contention =
+        SCPerfTVRegisterCounter("flow.hash.bucket_contention", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    dtv->counter_flow_spare_cache_hit =
+        SCPerfTVRegisterCounter("flow.spare_cache.hit", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    dtv->counter_flow_spare_cache_miss =
+        SCPerfTVRegisterCounter("flow.spare_cache.miss", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    dtv->counter_flow_hash_thread =
+        SCPerfTVRegisterCounter("flow.hash.lookup_thread", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    dtv->counter_flow_thread_table_timeouts =
+        SCPerfTVRegisterCounter("flow.thread_table.timeouts", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+
     return;
 }
 
@@ -479,6 +524,30 @@ DecodeThreadVars *DecodeThreadVarsAlloc(ThreadVars *tv)
     }
     SCLogDebug("vlan tracking is %s", dtv->vlan_disabled == 0 ? "enabled" : "disabled");
 
+    if (flow_config.spare_cache_size > 0) {
+        dtv->flow_spare_cache = FlowSpareCacheNew(flow_config.spare_cache_size);
+        if (dtv->flow_spare_cache == NULL) {
+            DecodeThreadVarsFree(tv, dtv);
+            return NULL;
+        }
+    }
+
+    /* only set if the runmode runs the full pipeline in each thread,
+     * see FlowInitThreadTables() */
+    if (flow_config.thread_tables) {
+        dtv->flow_table = FlowThreadTableNew();
+        if (dtv->flow_table == NULL) {
+            DecodeThreadVarsFree(tv, dtv);
+            return NULL;
+        }
+    } else if (flow_config.lockless_lookup) {
+        dtv->flow_reader = FlowLocklessReaderRegister();
+        if (dtv->flow_reader == NULL) {
+            DecodeThreadVarsFree(tv, dtv);
+            return NULL;
+        }
+    }
+
     return dtv;
 }
 
@@ -491,6 +560,16 @@ void DecodeThreadVarsFree(ThreadVars *tv, DecodeThreadVars *dtv)
         if (dtv->output_flow_thread_data != NULL)
             OutputFlowLogThreadDeinit(tv, dtv->output_flow_thread_data);
 
+        /* hand the cached flows back to the global spare queue */
+        if (dtv->flow_spare_cache != NULL)
+            FlowSpareCacheFree(dtv->flow_spare_cache);
+
+        if (dtv->flow_table != NULL)
+            FlowThreadTableFree(dtv->flow_table);
+
+        if (dtv->flow_reader != NULL)
+            FlowLocklessReaderDeregister(dtv->flow_reader);
+
         SCFree(dtv);
     }
 }
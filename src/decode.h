@@ -421,6 +421,9 @@ typedef struct Packet_
 
     /** The release function for packet structure and data */
     void (*ReleasePacket)(struct Packet_ *);
+    /** Function asking the capture method to bypass the packets of this
+     *  packet's flow. NULL if the capture method doesn't support it. */
+    int (*BypassPacketsFlow)(struct Packet_ *);
 
     /* pkt vars */
     PktVar *pktvar;
@@ -576,6 +579,15 @@ typedef struct DecodeThreadVars_
     /* thread data for flow logging api */
     void *output_flow_thread_data;
 
+    /** thread local cache of spare flows, NULL if disabled */
+    struct FlowSpareCache_ *flow_spare_cache;
+
+    /** flow table owned by this thread, NULL if the global hash is used */
+    struct FlowThreadTable_ *flow_table;
+
+    /** set if this thread does lockless lookups in the global flow hash */
+    struct FlowLocklessReader_ *flow_reader;
+
     /** stats/counters */
     uint16_t counter_pkts;
     uint16_t counter_bytes;
@@ -611,6 +623,15 @@ typedef struct DecodeThreadVars_
     uint16_t counter_defrag_ipv6_timeouts;
     uint16_t counter_defrag_max_hit;
 
+    /** flow hash stats - the flow lookup runs in the context of the decoder. */
+    uint16_t counter_flow_hash_lockless;
+    uint16_t counter_flow_hash_locked;
+    uint16_t counter_flow_hash_contention;
+    uint16_t counter_flow_spare_cache_hit;
+    uint16_t counter_flow_spare_cache_miss;
+    uint16_t counter_flow_hash_thread;
+    uint16_t counter_flow_thread_table_timeouts;
+
 #ifdef __SC_CUDA_SUPPORT__
     CudaThreadVars cuda_vars;
 #endif
@@ -729,6 +750,7 @@ typedef struct DecodeThreadVars_
         (p)->prev = NULL;                       \
         (p)->root = NULL;                       \
         (p)->livedev = NULL;                    \
+        (p)->BypassPacketsFlow = NULL;          \
         PACKET_RESET_CHECKSUMS((p));            \
         PACKET_PROFILING_RESET((p));            \
     } while (0)
@@ -826,6 +848,7 @@ Packet *PacketTunnelPktSetup(ThreadVars *tv, DecodeThreadVars *dtv, Packet *pare
                              uint8_t *pkt, uint16_t len, uint8_t proto, PacketQueue *pq);
 Packet *PacketDefragPktSetup(Packet *parent, uint8_t *pkt, uint16_t len, uint8_t proto);
 void PacketDefragPktSetupParent(Packet *parent);
+int PacketBypassCallback(Packet *p);
 Packet *PacketGetFromQueueOrAlloc(void);
 Packet *PacketGetFromAlloc(void);
 void PacketDecodeFinalize(ThreadVars *tv, DecodeThreadVars *dtv, Packet *p);
@@ -1515,6 +1515,16 @@ void DetectAddressHeadCleanup(DetectAddressHead *gh)
             DetectAddressCleanupList(gh->ipv6_head);
             gh->ipv6_head = NULL;
         }
+        if (gh->ipv4_lookup != NULL) {
+            SCFree(gh->ipv4_lookup);
+            gh->ipv4_lookup = NULL;
+        }
+        gh->ipv4_lookup_cnt = 0;
+        if (gh->ipv6_lookup != NULL) {
+            SCFree(gh->ipv6_lookup);
+            gh->ipv6_lookup = NULL;
+        }
+        gh->ipv6_lookup_cnt = 0;
     }
 
     return;
@@ -1849,6 +1859,147 @@ void DetectAddressPrint(DetectAddress *gr)
     return;
 }
 
+/** \internal
+ *  \brief compare two ipv6 addresses in host order
+ *  \retval -1, 0 or 1 if a is smaller, equal or bigger than b */
+static inline int DetectAddressCmpIPv6HostOrder(const uint32_t *a, const uint32_t *b)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        if (a[i] < b[i])
+            return -1;
+        if (a[i] > b[i])
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Compile the ipv4 and ipv6 lists of a group head into sorted
+ *        range arrays used by DetectAddressLookupInHead().
+ *
+ *        Only done for lists that are sorted and don't overlap, which is
+ *        the case after the sgh build has cut the groups. Other lists are
+ *        left to the list walk, which returns the first match.
+ *
+ * \param gh Pointer to the address group head.
+ *
+ * \retval 0 on success or if the lists are left uncompiled
+ * \retval -1 on memory allocation error
+ */
+int DetectAddressHeadCompile(DetectAddressHead *gh)
+{
+    DetectAddress *ag;
+    uint32_t cnt, i;
+
+    if (gh == NULL)
+        return 0;
+
+    if (gh->ipv4_head != NULL && gh->ipv4_lookup == NULL) {
+        uint32_t last = 0;
+        cnt = 0;
+        for (ag = gh->ipv4_head; ag != NULL; ag = ag->next) {
+            uint32_t ip = ntohl(ag->ip.addr_data32[0]);
+            uint32_t ip2 = ntohl(ag->ip2.addr_data32[0]);
+            if (ip > ip2 || (cnt > 0 && ip <= last))
+                break;
+            last = ip2;
+            cnt++;
+        }
+
+        if (ag == NULL) {
+            DetectAddressLookupIPv4 *lookup = SCMalloc(cnt * sizeof(DetectAddressLookupIPv4));
+            if (unlikely(lookup == NULL))
+                return -1;
+
+            for (ag = gh->ipv4_head, i = 0; ag != NULL; ag = ag->next, i++) {
+                lookup[i].ip = ntohl(ag->ip.addr_data32[0]);
+                lookup[i].ip2 = ntohl(ag->ip2.addr_data32[0]);
+                lookup[i].ag = ag;
+            }
+            gh->ipv4_lookup = lookup;
+            gh->ipv4_lookup_cnt = cnt;
+        }
+    }
+
+    if (gh->ipv6_head != NULL && gh->ipv6_lookup == NULL) {
+        uint32_t ip[4], ip2[4], last[4];
+        cnt = 0;
+        for (ag = gh->ipv6_head; ag != NULL; ag = ag->next) {
+            for (i = 0; i < 4; i++) {
+                ip[i] = ntohl(ag->ip.addr_data32[i]);
+                ip2[i] = ntohl(ag->ip2.addr_data32[i]);
+            }
+            if (DetectAddressCmpIPv6HostOrder(ip, ip2) > 0 ||
+                (cnt > 0 && DetectAddressCmpIPv6HostOrder(ip, last) <= 0))
+                break;
+            memcpy(last, ip2, sizeof(last));
+            cnt++;
+        }
+
+        if (ag == NULL) {
+            DetectAddressLookupIPv6 *lookup = SCMalloc(cnt * sizeof(DetectAddressLookupIPv6));
+            if (unlikely(lookup == NULL))
+                return -1;
+
+            uint32_t u = 0;
+            for (ag = gh->ipv6_head; ag != NULL; ag = ag->next, u++) {
+                for (i = 0; i < 4; i++) {
+                    lookup[u].ip[i] = ntohl(ag->ip.addr_data32[i]);
+                    lookup[u].ip2[i] = ntohl(ag->ip2.addr_data32[i]);
+                }
+                lookup[u].ag = ag;
+            }
+            gh->ipv6_lookup = lookup;
+            gh->ipv6_lookup_cnt = cnt;
+        }
+    }
+
+    return 0;
+}
+
+/** \internal
+ *  \brief binary search the compiled ipv4 array for the range holding a */
+static DetectAddress *DetectAddressLookupIPv4InArray(DetectAddressHead *gh, Address *a)
+{
+    uint32_t addr = ntohl(a->addr_data32[0]);
+    uint32_t lo = 0, hi = gh->ipv4_lookup_cnt;
+
+    /* find the last range starting at or below addr */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (gh->ipv4_lookup[mid].ip <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0 && addr <= gh->ipv4_lookup[lo - 1].ip2)
+        return gh->ipv4_lookup[lo - 1].ag;
+    return NULL;
+}
+
+/** \internal
+ *  \brief binary search the compiled ipv6 array for the range holding a */
+static DetectAddress *DetectAddressLookupIPv6InArray(DetectAddressHead *gh, Address *a)
+{
+    uint32_t addr[4] = { ntohl(a->addr_data32[0]), ntohl(a->addr_data32[1]),
+                         ntohl(a->addr_data32[2]), ntohl(a->addr_data32[3]) };
+    uint32_t lo = 0, hi = gh->ipv6_lookup_cnt;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (DetectAddressCmpIPv6HostOrder(gh->ipv6_lookup[mid].ip, addr) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0 && DetectAddressCmpIPv6HostOrder(addr, gh->ipv6_lookup[lo - 1].ip2) <= 0)
+        return gh->ipv6_lookup[lo - 1].ag;
+    return NULL;
+}
+
 /**
  * \brief Find the group matching address in a group head.
  *
@@ -1871,9 +2022,15 @@ DetectAddress *DetectAddressLookupInHead(DetectAddressHead *gh, Address *a)
     /* XXX should we really do this check every time we run this function? */
     if (a->family == AF_INET) {
         SCLogDebug("IPv4");
+        if (gh->ipv4_lookup != NULL) {
+            SCReturnPtr(DetectAddressLookupIPv4InArray(gh, a), "DetectAddress");
+        }
         g = gh->ipv4_head;
     } else if (a->family == AF_INET6) {
         SCLogDebug("IPv6");
+        if (gh->ipv6_lookup != NULL) {
+            SCReturnPtr(DetectAddressLookupIPv6InArray(gh, a), "DetectAddress");
+        }
         g = gh->ipv6_head;
     } else {
         SCLogDebug("ANY");
@@ -5202,6 +5359,75 @@ end:
     return result;
 }
 
+/**
+ * \test compiled lookup arrays return the same groups as the list walk
+ */
+static int AddressTestFunctions05(void)
+{
+    const char *addrs[] = { "1.2.3.4", "1.2.3.5", "10.0.0.0", "10.255.255.255",
+                            "11.0.0.1", "192.168.1.77", "192.168.2.1",
+                            "0.0.0.0", "255.255.255.255",
+                            "2001:db8::1", "2001:db9::1", "::1", "::2",
+                            "ffff::1", NULL };
+    DetectAddress *walk[16];
+    Address a;
+    int result = 0;
+    int i;
+
+    DetectAddressHead *gh = DetectAddressHeadInit();
+    if (gh == NULL)
+        goto end;
+
+    if (DetectAddressParse(gh, "[1.2.3.4,10.0.0.0/8,192.168.1.0/24,"
+                "2001:db8::/32,::1,ffff::/16]") != 0) {
+        printf("parse failed: ");
+        goto end;
+    }
+
+    for (i = 0; addrs[i] != NULL; i++) {
+        memset(&a, 0, sizeof(a));
+        if (inet_pton(AF_INET, addrs[i], &a.addr_data32[0]) == 1) {
+            a.family = AF_INET;
+        } else if (inet_pton(AF_INET6, addrs[i], &a.addr_data32[0]) == 1) {
+            a.family = AF_INET6;
+        }
+        walk[i] = DetectAddressLookupInHead(gh, &a);
+    }
+
+    if (DetectAddressHeadCompile(gh) != 0 ||
+        gh->ipv4_lookup == NULL || gh->ipv4_lookup_cnt != 3 ||
+        gh->ipv6_lookup == NULL || gh->ipv6_lookup_cnt != 3) {
+        printf("compile failed: ");
+        goto end;
+    }
+
+    for (i = 0; addrs[i] != NULL; i++) {
+        memset(&a, 0, sizeof(a));
+        if (inet_pton(AF_INET, addrs[i], &a.addr_data32[0]) == 1) {
+            a.family = AF_INET;
+        } else if (inet_pton(AF_INET6, addrs[i], &a.addr_data32[0]) == 1) {
+            a.family = AF_INET6;
+        }
+        if (DetectAddressLookupInHead(gh, &a) != walk[i]) {
+            printf("lookup mismatch for %s: ", addrs[i]);
+            goto end;
+        }
+    }
+
+    /* spot check that the walk itself found what we expect */
+    if (walk[0] == NULL || walk[1] != NULL || walk[3] == NULL ||
+        walk[4] != NULL || walk[9] == NULL || walk[12] != NULL) {
+        printf("unexpected list walk result: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (gh != NULL)
+        DetectAddressHeadFree(gh);
+    return result;
+}
+
 #endif /* UNITTESTS */
 
 void DetectAddressTests(void)
@@ -5409,5 +5635,6 @@ void DetectAddressTests(void)
     UtRegisterTest("AddressTestFunctions02", AddressTestFunctions02, 1);
     UtRegisterTest("AddressTestFunctions03", AddressTestFunctions03, 1);
     UtRegisterTest("AddressTestFunctions04", AddressTestFunctions04, 1);
+    UtRegisterTest("AddressTestFunctions05", AddressTestFunctions05, 1);
 #endif /* UNITTESTS */
 }
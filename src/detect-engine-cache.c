@@ -0,0 +1,664 @@
+/* Copyright (C) 2014 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * On disk cache of the prepared mpm ctxs of a detection engine.
+ *
+ * Preparing the mpm ctxs is the bulk of SigGroupBuild. When
+ * detect-engine.cache-dir is set, the prepared ctxs are written to a file
+ * named after a hash of the loaded rules, the engine settings and the
+ * build. On the next start or reload with the same rules the file is
+ * mmap'd and the mpm's CacheMap callback uses the tables in place instead
+ * of building them.
+ *
+ * The ctxs are stored in the order they are queued for preparation, which
+ * only depends on the rules and settings. Each entry carries a digest of
+ * the ctx's pattern set that has to match as well. Any mismatch or a
+ * broken file just means the ctx is prepared the normal way, after which
+ * a new cache file replaces the old one.
+ */
+
+#include "suricata-common.h"
+#include "suricata.h"
+
+#include "detect.h"
+#include "detect-parse.h"
+#include "detect-engine.h"
+#include "detect-engine-cache.h"
+
+#include "conf.h"
+#include "util-mpm.h"
+#include "util-debug.h"
+#include "util-unittest.h"
+#include "util-unittest-helper.h"
+
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/** alignment of the ctx blocks in the file */
+#define DETECT_ENGINE_CACHE_ALIGN   64
+
+/**
+ * \brief Add data to the cache key of the detect engine.
+ */
+void DetectEngineCacheKeyUpdate(DetectEngineCtx *de_ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t key = de_ctx->cache_key;
+    size_t u;
+
+    for (u = 0; u < len; u++) {
+        key ^= p[u];
+        key *= 0x100000001b3ULL;
+    }
+    de_ctx->cache_key = key;
+}
+
+/**
+ * \brief Add a string to the cache key, length first so that the
+ *        boundaries between strings are part of the key.
+ */
+void DetectEngineCacheKeyUpdateString(DetectEngineCtx *de_ctx, const char *str)
+{
+    uint64_t len = (str != NULL) ? strlen(str) : UINT64_MAX;
+
+    DetectEngineCacheKeyUpdate(de_ctx, &len, sizeof(len));
+    if (str != NULL)
+        DetectEngineCacheKeyUpdate(de_ctx, str, len);
+}
+
+/* the rules refer to the address and port vars by name, so their values
+ * have to be part of the key as well */
+static void DetectEngineCacheKeyConfNode(DetectEngineCtx *de_ctx, ConfNode *node)
+{
+    ConfNode *child;
+
+    DetectEngineCacheKeyUpdateString(de_ctx, node->name);
+    DetectEngineCacheKeyUpdateString(de_ctx, node->val);
+    TAILQ_FOREACH(child, &node->head, next) {
+        DetectEngineCacheKeyConfNode(de_ctx, child);
+    }
+    /* end of the children */
+    DetectEngineCacheKeyUpdateString(de_ctx, NULL);
+}
+
+static void DetectEngineCacheKeyFinal(DetectEngineCtx *de_ctx)
+{
+    ConfNode *vars = ConfGetNode("vars");
+    if (vars != NULL)
+        DetectEngineCacheKeyConfNode(de_ctx, vars);
+
+    uint32_t v[16];
+    int i = 0;
+
+#ifdef REVISION
+    DetectEngineCacheKeyUpdateString(de_ctx, xstr(REVISION));
+#endif
+    DetectEngineCacheKeyUpdateString(de_ctx, PROG_VER);
+
+    v[i++] = DETECT_ENGINE_CACHE_VERSION;
+    v[i++] = sizeof(void *);
+    v[i++] = de_ctx->mpm_matcher;
+    v[i++] = de_ctx->sgh_mpm_context;
+    v[i++] = de_ctx->max_uniq_toclient_src_groups;
+    v[i++] = de_ctx->max_uniq_toclient_dst_groups;
+    v[i++] = de_ctx->max_uniq_toclient_sp_groups;
+    v[i++] = de_ctx->max_uniq_toclient_dp_groups;
+    v[i++] = de_ctx->max_uniq_toserver_src_groups;
+    v[i++] = de_ctx->max_uniq_toserver_dst_groups;
+    v[i++] = de_ctx->max_uniq_toserver_sp_groups;
+    v[i++] = de_ctx->max_uniq_toserver_dp_groups;
+    v[i++] = de_ctx->signum;
+    DetectEngineCacheKeyUpdate(de_ctx, v, i * sizeof(uint32_t));
+}
+
+/**
+ * \brief Set up the cache for this detect engine and map the cache file
+ *        for its rules, if there is a valid one.
+ *
+ *        Called once all rules are loaded.
+ *
+ * \retval 0 if a cache file was mapped, -1 otherwise
+ */
+int DetectEngineCacheOpen(DetectEngineCtx *de_ctx)
+{
+    if (de_ctx->cache_dir == NULL || de_ctx->cache != NULL)
+        return -1;
+
+    DetectEngineCacheKeyFinal(de_ctx);
+
+    DetectEngineCache *cache = SCMalloc(sizeof(DetectEngineCache));
+    if (cache == NULL)
+        return -1;
+    memset(cache, 0, sizeof(DetectEngineCache));
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/detect-%016"PRIx64".cache",
+             de_ctx->cache_dir, de_ctx->cache_key);
+    cache->path = SCStrdup(path);
+    if (cache->path == NULL) {
+        SCFree(cache);
+        return -1;
+    }
+    de_ctx->cache = cache;
+
+#if HAVE_SYS_MMAN_H
+    int fd = open(cache->path, O_RDONLY);
+    if (fd < 0) {
+        SCLogDebug("no detect engine cache %s: %s", cache->path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(DetectEngineCacheHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SCLogWarning(SC_ERR_MEM_ALLOC, "mapping detect engine cache %s "
+                "failed: %s", cache->path, strerror(errno));
+        return -1;
+    }
+
+    const DetectEngineCacheHeader *hdr = map;
+    if (memcmp(hdr->magic, DETECT_ENGINE_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != DETECT_ENGINE_CACHE_VERSION ||
+        hdr->key != de_ctx->cache_key ||
+        hdr->table_offset > (uint64_t)st.st_size ||
+        (uint64_t)hdr->entries * sizeof(DetectEngineCacheEntry) >
+            (uint64_t)st.st_size - hdr->table_offset ||
+        (hdr->table_offset & 7)) {
+        SCLogInfo("detect engine cache %s is not valid, rebuilding", cache->path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    cache->map = map;
+    cache->map_len = st.st_size;
+    cache->hdr = hdr;
+    cache->table = (const DetectEngineCacheEntry *)(cache->map + hdr->table_offset);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * \brief Try to use the cached version of the idx'th ctx prepared by
+ *        this engine.
+ *
+ * \retval 0 the ctx is ready to use, -1 it still needs to be prepared
+ */
+int DetectEngineCacheMapMpmCtx(DetectEngineCtx *de_ctx, uint32_t idx,
+                               MpmCtx *mpm_ctx, uint64_t digest)
+{
+    DetectEngineCache *cache = de_ctx->cache;
+    if (cache == NULL)
+        return -1;
+
+    /* not a miss if the mpm can't be cached at all, otherwise the file
+     * would be rewritten on every start */
+    if (mpm_table[mpm_ctx->mpm_type].CacheMap == NULL ||
+        mpm_table[mpm_ctx->mpm_type].CacheWrite == NULL)
+        return -1;
+
+    if (cache->map == NULL || idx >= cache->hdr->entries)
+        goto miss;
+
+    const DetectEngineCacheEntry *e = &cache->table[idx];
+    if (e->mpm_type != mpm_ctx->mpm_type || e->digest != digest ||
+        e->len == 0)
+        goto miss;
+    if (e->offset > cache->map_len || e->len > cache->map_len - e->offset)
+        goto miss;
+
+    if (mpm_table[mpm_ctx->mpm_type].CacheMap(mpm_ctx, cache->map + e->offset,
+                                              e->len) != 0)
+        goto miss;
+
+    cache->mapped++;
+    return 0;
+
+miss:
+    cache->missed++;
+    return -1;
+}
+
+/**
+ * \brief Start writing a new cache file, if anything had to be prepared.
+ *
+ * \retval 0 if DetectEngineCacheWriteMpmCtx() should be called for all
+ *         ctxs, -1 if there is nothing to write
+ */
+int DetectEngineCacheWriteBegin(DetectEngineCtx *de_ctx)
+{
+    DetectEngineCache *cache = de_ctx->cache;
+    if (cache == NULL || cache->missed == 0)
+        return -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.%d.tmp", cache->path, (int)getpid());
+    cache->tmp_path = SCStrdup(path);
+    if (cache->tmp_path == NULL)
+        return -1;
+
+    cache->fp = fopen(cache->tmp_path, "w");
+    if (cache->fp == NULL) {
+        SCLogWarning(SC_ERR_FOPEN, "can't write detect engine cache %s: %s",
+                     cache->tmp_path, strerror(errno));
+        SCFree(cache->tmp_path);
+        cache->tmp_path = NULL;
+        return -1;
+    }
+
+    /* the header is written last, when the table location is known */
+    DetectEngineCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    if (fwrite(&hdr, sizeof(hdr), 1, cache->fp) != 1)
+        cache->write_error = 1;
+    return 0;
+}
+
+static void DetectEngineCachePad(DetectEngineCache *cache, long align)
+{
+    long pos = ftell(cache->fp);
+    if (pos < 0) {
+        cache->write_error = 1;
+        return;
+    }
+    for ( ; pos % align; pos++) {
+        if (fputc(0, cache->fp) == EOF) {
+            cache->write_error = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * \brief Add the next prepared ctx to the cache file.
+ */
+void DetectEngineCacheWriteMpmCtx(DetectEngineCtx *de_ctx, MpmCtx *mpm_ctx,
+                                  uint64_t digest)
+{
+    DetectEngineCache *cache = de_ctx->cache;
+    if (cache == NULL || cache->fp == NULL || cache->write_error)
+        return;
+
+    if (cache->wtable_cnt == cache->wtable_size) {
+        uint32_t size = cache->wtable_size ? cache->wtable_size * 2 : 256;
+        void *ptmp = SCRealloc(cache->wtable, size * sizeof(DetectEngineCacheEntry));
+        if (ptmp == NULL) {
+            cache->write_error = 1;
+            return;
+        }
+        cache->wtable = ptmp;
+        cache->wtable_size = size;
+    }
+
+    DetectEngineCacheEntry *e = &cache->wtable[cache->wtable_cnt++];
+    memset(e, 0, sizeof(*e));
+    e->mpm_type = mpm_ctx->mpm_type;
+    e->digest = digest;
+
+    if (mpm_table[mpm_ctx->mpm_type].CacheWrite == NULL)
+        return;
+
+    DetectEngineCachePad(cache, DETECT_ENGINE_CACHE_ALIGN);
+    long start = ftell(cache->fp);
+    if (start < 0 || cache->write_error ||
+        mpm_table[mpm_ctx->mpm_type].CacheWrite(mpm_ctx, cache->fp) != 0) {
+        cache->write_error = 1;
+        return;
+    }
+    long end = ftell(cache->fp);
+    if (end < start) {
+        cache->write_error = 1;
+        return;
+    }
+
+    e->offset = start;
+    e->len = end - start;
+}
+
+/**
+ * \brief Finish the cache file and put it in place.
+ *
+ *        The new file is renamed over the old one, so engines that still
+ *        have the old file mapped are not affected.
+ */
+void DetectEngineCacheWriteEnd(DetectEngineCtx *de_ctx)
+{
+    DetectEngineCache *cache = de_ctx->cache;
+    if (cache == NULL || cache->fp == NULL)
+        return;
+
+    DetectEngineCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DETECT_ENGINE_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = DETECT_ENGINE_CACHE_VERSION;
+    hdr.entries = cache->wtable_cnt;
+    hdr.key = de_ctx->cache_key;
+
+    DetectEngineCachePad(cache, 8);
+    long pos = ftell(cache->fp);
+    if (pos < 0)
+        cache->write_error = 1;
+    hdr.table_offset = pos;
+
+    if (!cache->write_error && cache->wtable_cnt > 0 &&
+        fwrite(cache->wtable, sizeof(DetectEngineCacheEntry), cache->wtable_cnt,
+               cache->fp) != cache->wtable_cnt)
+        cache->write_error = 1;
+    if (!cache->write_error &&
+        (fseek(cache->fp, 0, SEEK_SET) != 0 ||
+         fwrite(&hdr, sizeof(hdr), 1, cache->fp) != 1))
+        cache->write_error = 1;
+    if (fclose(cache->fp) != 0)
+        cache->write_error = 1;
+    cache->fp = NULL;
+
+    if (cache->write_error || rename(cache->tmp_path, cache->path) != 0) {
+        SCLogWarning(SC_ERR_FWRITE, "writing detect engine cache %s failed",
+                     cache->path);
+        unlink(cache->tmp_path);
+    } else if (!(de_ctx->flags & DE_QUIET)) {
+        SCLogInfo("detect engine cache written to %s (%"PRIu32" mpm ctxs)",
+                  cache->path, cache->wtable_cnt);
+    }
+
+    SCFree(cache->tmp_path);
+    cache->tmp_path = NULL;
+    SCFree(cache->wtable);
+    cache->wtable = NULL;
+    cache->wtable_cnt = cache->wtable_size = 0;
+}
+
+/**
+ * \brief Unmap the cache file. Only safe once all ctxs using it are
+ *        destroyed.
+ */
+void DetectEngineCacheClose(DetectEngineCtx *de_ctx)
+{
+    DetectEngineCache *cache = de_ctx->cache;
+    if (cache == NULL)
+        return;
+
+#if HAVE_SYS_MMAN_H
+    if (cache->map != NULL)
+        munmap(cache->map, cache->map_len);
+#endif
+    if (cache->fp != NULL) {
+        fclose(cache->fp);
+        unlink(cache->tmp_path);
+    }
+    if (cache->tmp_path != NULL)
+        SCFree(cache->tmp_path);
+    if (cache->wtable != NULL)
+        SCFree(cache->wtable);
+    SCFree(cache->path);
+    SCFree(cache);
+    de_ctx->cache = NULL;
+}
+
+/************************************Unittests*********************************/
+
+#ifdef UNITTESTS
+
+/**
+ * \test a second engine with the same rules uses the cached ctxs and
+ *       still matches.
+ */
+static int DetectEngineCacheTest01(void)
+{
+    int result = 0;
+    char dir[] = "/tmp/suricata-de-cache-XXXXXX";
+    DetectEngineCtx *de_ctx[2] = { NULL, NULL };
+    DetectEngineThreadCtx *det_ctx = NULL;
+    ThreadVars th_v;
+    Packet *p = NULL;
+    uint8_t buf[] = "GET /one/two HTTP/1.0\r\n";
+    char *path = NULL;
+    int i;
+
+    memset(&th_v, 0, sizeof(th_v));
+
+    if (mkdtemp(dir) == NULL)
+        return 0;
+
+    for (i = 0; i < 2; i++) {
+        de_ctx[i] = DetectEngineCtxInit();
+        if (de_ctx[i] == NULL)
+            goto end;
+        de_ctx[i]->flags |= DE_QUIET;
+        de_ctx[i]->mpm_matcher = MPM_AC;
+        de_ctx[i]->cache_dir = SCStrdup(dir);
+        if (de_ctx[i]->cache_dir == NULL)
+            goto end;
+
+        if (DetectEngineAppendSig(de_ctx[i], "alert tcp any any -> any any "
+                    "(content:\"/one/\"; sid:1;)") == NULL)
+            goto end;
+        if (DetectEngineAppendSig(de_ctx[i], "alert tcp any any -> any any "
+                    "(content:\"three\"; nocase; sid:2;)") == NULL)
+            goto end;
+        if (DetectEngineAppendSig(de_ctx[i], "alert udp any any -> any any "
+                    "(content:\"/one/\"; sid:3;)") == NULL)
+            goto end;
+
+        SigGroupBuild(de_ctx[i]);
+        if (de_ctx[i]->cache == NULL)
+            goto end;
+    }
+
+    path = de_ctx[1]->cache->path;
+    if (de_ctx[0]->cache->mapped != 0 || de_ctx[0]->cache->missed == 0) {
+        printf("first engine: mapped %"PRIu32" missed %"PRIu32": ",
+               de_ctx[0]->cache->mapped, de_ctx[0]->cache->missed);
+        goto end;
+    }
+    if (de_ctx[1]->cache->mapped == 0 || de_ctx[1]->cache->missed != 0) {
+        printf("second engine: mapped %"PRIu32" missed %"PRIu32": ",
+               de_ctx[1]->cache->mapped, de_ctx[1]->cache->missed);
+        goto end;
+    }
+    if (de_ctx[0]->cache_key != de_ctx[1]->cache_key)
+        goto end;
+
+    p = UTHBuildPacket(buf, sizeof(buf) - 1, IPPROTO_TCP);
+    if (p == NULL)
+        goto end;
+
+    DetectEngineThreadCtxInit(&th_v, (void *)de_ctx[1], (void *)&det_ctx);
+    SigMatchSignatures(&th_v, de_ctx[1], det_ctx, p);
+    if (PacketAlertCheck(p, 1) != 1 || PacketAlertCheck(p, 2) != 0) {
+        printf("wrong alerts from the cached engine: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (det_ctx != NULL)
+        DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
+    if (p != NULL)
+        UTHFreePacket(p);
+    if (path != NULL)
+        unlink(path);
+    for (i = 0; i < 2; i++) {
+        if (de_ctx[i] != NULL) {
+            SigGroupCleanup(de_ctx[i]);
+            SigCleanSignatures(de_ctx[i]);
+            DetectEngineCtxFree(de_ctx[i]);
+        }
+    }
+    rmdir(dir);
+    return result;
+}
+
+/**
+ * \test a cache file written for other rules is not used.
+ */
+static int DetectEngineCacheTest02(void)
+{
+    int result = 0;
+    char dir[] = "/tmp/suricata-de-cache-XXXXXX";
+    DetectEngineCtx *de_ctx[2] = { NULL, NULL };
+    char *path[2] = { NULL, NULL };
+    int i;
+
+    if (mkdtemp(dir) == NULL)
+        return 0;
+
+    for (i = 0; i < 2; i++) {
+        de_ctx[i] = DetectEngineCtxInit();
+        if (de_ctx[i] == NULL)
+            goto end;
+        de_ctx[i]->flags |= DE_QUIET;
+        de_ctx[i]->mpm_matcher = MPM_AC;
+        de_ctx[i]->cache_dir = SCStrdup(dir);
+        if (de_ctx[i]->cache_dir == NULL)
+            goto end;
+
+        if (DetectEngineAppendSig(de_ctx[i], i == 0 ?
+                    "alert tcp any any -> any any (content:\"abc\"; sid:1;)" :
+                    "alert tcp any any -> any any (content:\"abd\"; sid:1;)") == NULL)
+            goto end;
+
+        SigGroupBuild(de_ctx[i]);
+        if (de_ctx[i]->cache == NULL)
+            goto end;
+        path[i] = de_ctx[i]->cache->path;
+    }
+
+    if (strcmp(path[0], path[1]) == 0 || de_ctx[1]->cache->mapped != 0) {
+        printf("cache of other rules used: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    for (i = 0; i < 2; i++) {
+        if (path[i] != NULL)
+            unlink(path[i]);
+        if (de_ctx[i] != NULL) {
+            SigGroupCleanup(de_ctx[i]);
+            SigCleanSignatures(de_ctx[i]);
+            DetectEngineCtxFree(de_ctx[i]);
+        }
+    }
+    rmdir(dir);
+    return result;
+}
+
+/**
+ * \test rule boundaries are part of the cache key.
+ */
+static int DetectEngineCacheTest03(void)
+{
+    int result = 0;
+    DetectEngineCtx *de_ctx[2] = { NULL, NULL };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        de_ctx[i] = DetectEngineCtxInit();
+        if (de_ctx[i] == NULL)
+            goto end;
+        de_ctx[i]->flags |= DE_QUIET;
+    }
+
+    /* not valid rules, but they still go into the key */
+    (void)DetectEngineAppendSig(de_ctx[0], "alert tcp");
+    (void)DetectEngineAppendSig(de_ctx[0], " any any");
+    (void)DetectEngineAppendSig(de_ctx[1], "alert tcp any");
+    (void)DetectEngineAppendSig(de_ctx[1], " any");
+
+    if (de_ctx[0]->cache_key == de_ctx[1]->cache_key) {
+        printf("same key for differently split rules: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    for (i = 0; i < 2; i++) {
+        if (de_ctx[i] != NULL)
+            DetectEngineCtxFree(de_ctx[i]);
+    }
+    return result;
+}
+
+/**
+ * \test no cache file is written for a mpm that can't be cached.
+ */
+static int DetectEngineCacheTest04(void)
+{
+    int result = 0;
+    char dir[] = "/tmp/suricata-de-cache-XXXXXX";
+    DetectEngineCtx *de_ctx = NULL;
+
+    if (mkdtemp(dir) == NULL)
+        return 0;
+
+    de_ctx = DetectEngineCtxInit();
+    if (de_ctx == NULL)
+        goto end;
+    de_ctx->flags |= DE_QUIET;
+    de_ctx->mpm_matcher = MPM_B2G;
+    de_ctx->cache_dir = SCStrdup(dir);
+    if (de_ctx->cache_dir == NULL)
+        goto end;
+
+    if (DetectEngineAppendSig(de_ctx, "alert tcp any any -> any any "
+                "(content:\"abc\"; sid:1;)") == NULL)
+        goto end;
+
+    SigGroupBuild(de_ctx);
+    if (de_ctx->cache == NULL)
+        goto end;
+
+    if (de_ctx->cache->missed != 0 || access(de_ctx->cache->path, F_OK) == 0) {
+        printf("cache written for a mpm without CacheWrite: ");
+        unlink(de_ctx->cache->path);
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (de_ctx != NULL) {
+        SigGroupCleanup(de_ctx);
+        SigCleanSignatures(de_ctx);
+        DetectEngineCtxFree(de_ctx);
+    }
+    rmdir(dir);
+    return result;
+}
+
+#endif /* UNITTESTS */
+
+void DetectEngineCacheRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("DetectEngineCacheTest01", DetectEngineCacheTest01, 1);
+    UtRegisterTest("DetectEngineCacheTest02", DetectEngineCacheTest02, 1);
+    UtRegisterTest("DetectEngineCacheTest03", DetectEngineCacheTest03, 1);
+    UtRegisterTest("DetectEngineCacheTest04", DetectEngineCacheTest04, 1);
+#endif /* UNITTESTS */
+}
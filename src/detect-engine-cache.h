@@ -0,0 +1,88 @@
+/* Copyright (C) 2014 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * On disk cache of the prepared mpm ctxs of a detection engine.
+ */
+
+#ifndef __DETECT_ENGINE_CACHE_H__
+#define __DETECT_ENGINE_CACHE_H__
+
+#define DETECT_ENGINE_CACHE_MAGIC       "SCDECACH"
+/** bump when the file layout or a CacheWrite format changes */
+#define DETECT_ENGINE_CACHE_VERSION     2
+
+/** FNV-1a 64 offset basis, start value of DetectEngineCtx::cache_key */
+#define DETECT_ENGINE_CACHE_KEY_INIT    0xcbf29ce484222325ULL
+
+typedef struct DetectEngineCacheHeader_ {
+    char magic[8];
+    uint32_t version;
+    /* number of entries in the table */
+    uint32_t entries;
+    /* hash of the rules, config and build */
+    uint64_t key;
+    /* file offset of the entry table */
+    uint64_t table_offset;
+} DetectEngineCacheHeader;
+
+typedef struct DetectEngineCacheEntry_ {
+    uint16_t mpm_type;
+    uint16_t pad;
+    uint32_t pad2;
+    /* identifies the pattern set of the ctx */
+    uint64_t digest;
+    /* location of the block written by CacheWrite, len 0 if none */
+    uint64_t offset;
+    uint64_t len;
+} DetectEngineCacheEntry;
+
+typedef struct DetectEngineCache_ {
+    char *path;
+
+    /* mapped cache file, NULL if there was no usable one */
+    uint8_t *map;
+    size_t map_len;
+    const DetectEngineCacheHeader *hdr;
+    const DetectEngineCacheEntry *table;
+
+    /* new cache file being written */
+    FILE *fp;
+    char *tmp_path;
+    int write_error;
+    DetectEngineCacheEntry *wtable;
+    uint32_t wtable_cnt;
+    uint32_t wtable_size;
+
+    /* ctxs loaded from and missing in the mapped file */
+    uint32_t mapped;
+    uint32_t missed;
+} DetectEngineCache;
+
+void DetectEngineCacheKeyUpdate(DetectEngineCtx *, const void *, size_t);
+void DetectEngineCacheKeyUpdateString(DetectEngineCtx *, const char *);
+int DetectEngineCacheOpen(DetectEngineCtx *);
+int DetectEngineCacheMapMpmCtx(DetectEngineCtx *, uint32_t, MpmCtx *, uint64_t);
+int DetectEngineCacheWriteBegin(DetectEngineCtx *);
+void DetectEngineCacheWriteMpmCtx(DetectEngineCtx *, MpmCtx *, uint64_t);
+void DetectEngineCacheWriteEnd(DetectEngineCtx *);
+void DetectEngineCacheClose(DetectEngineCtx *);
+void DetectEngineCacheRegisterTests(void);
+
+#endif /* __DETECT_ENGINE_CACHE_H__ */
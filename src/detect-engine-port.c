@@ -103,6 +103,12 @@ void DetectPortFree(DetectPort *dp)
     }
     dp->dst_ph = NULL;
 
+    if (dp->lookup != NULL) {
+        SCFree(dp->lookup);
+        dp->lookup = NULL;
+    }
+    dp->lookup_cnt = 0;
+
     //BUG_ON(dp->next != NULL);
 
     detect_port_memory -= sizeof(DetectPort);
@@ -871,6 +877,21 @@ DetectPortLookupGroup(DetectPort *dp, uint16_t port)
     if (dp == NULL)
         return NULL;
 
+    if (dp->lookup != NULL) {
+        /* binary search for the last range starting at or below port */
+        uint32_t lo = 0, hi = dp->lookup_cnt;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (dp->lookup[mid].port <= port)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo > 0 && port <= dp->lookup[lo - 1].port2)
+            return dp->lookup[lo - 1].dp;
+        return NULL;
+    }
+
     for ( ; p != NULL; p = p->next) {
         if (DetectPortMatch(p,port) == 1) {
             //SCLogDebug("match, port %" PRIu32 ", dp ", port);
@@ -882,6 +903,52 @@ DetectPortLookupGroup(DetectPort *dp, uint16_t port)
     return NULL;
 }
 
+/**
+ * \brief Compile a port list into a sorted range array that is used by
+ *        DetectPortLookupGroup() instead of walking the list.
+ *
+ *        The array is stored on the first port of the list. Lists that
+ *        are not sorted or have overlapping ranges are left alone as
+ *        the list walk returns the first match in that case.
+ *
+ * \param head first port of the list, may already be compiled if the
+ *             list is shared between groups
+ *
+ * \retval 0 on success or if the list is left uncompiled
+ * \retval -1 on memory allocation error
+ */
+int DetectPortCompileList(DetectPort *head)
+{
+    DetectPort *p, *last = NULL;
+    uint32_t cnt = 0, i = 0;
+
+    if (head == NULL || head->lookup != NULL)
+        return 0;
+
+    /* prev is shared with the hash next ptr, so track the last port here */
+    for (p = head; p != NULL; last = p, p = p->next) {
+        if (p->port > p->port2)
+            return 0;
+        if (last != NULL && p->port <= last->port2)
+            return 0;
+        cnt++;
+    }
+
+    DetectPortLookupEntry *lookup = SCMalloc(cnt * sizeof(DetectPortLookupEntry));
+    if (unlikely(lookup == NULL))
+        return -1;
+
+    for (p = head; p != NULL; p = p->next, i++) {
+        lookup[i].port = p->port;
+        lookup[i].port2 = p->port2;
+        lookup[i].dp = p;
+    }
+
+    head->lookup = lookup;
+    head->lookup_cnt = cnt;
+    return 0;
+}
+
 /**
  * \brief Function to join the source group to the target and its members
  *
@@ -2793,6 +2860,47 @@ static int PortTestMatchDoubleNegation(void)
     return result;
 }
 
+/**
+ * \test compiled port lookup returns the same groups as the list walk
+ */
+static int PortTestLookupCompiled01(void)
+{
+    int result = 0;
+    DetectPort *head = NULL;
+    DetectPort **walk = SCMalloc(65536 * sizeof(DetectPort *));
+    uint32_t port;
+
+    if (walk == NULL)
+        return 0;
+    if (DetectPortParse(&head, "[80,443,1000:2000,8080,65535]") != 0)
+        goto end;
+
+    for (port = 0; port <= 65535; port++)
+        walk[port] = DetectPortLookupGroup(head, (uint16_t)port);
+
+    if (DetectPortCompileList(head) != 0 || head->lookup == NULL ||
+        head->lookup_cnt != 5)
+        goto end;
+
+    for (port = 0; port <= 65535; port++) {
+        if (DetectPortLookupGroup(head, (uint16_t)port) != walk[port]) {
+            printf("lookup mismatch for port %u: ", port);
+            goto end;
+        }
+    }
+
+    if (walk[80] == NULL || walk[81] != NULL || walk[1500] == NULL ||
+        walk[65535] == NULL || walk[0] != NULL)
+        goto end;
+
+    result = 1;
+end:
+    if (head != NULL)
+        DetectPortCleanupList(head);
+    SCFree(walk);
+    return result;
+}
+
 #endif /* UNITTESTS */
 
 void DetectPortTests(void)
@@ -2841,6 +2949,7 @@ void DetectPortTests(void)
     UtRegisterTest("PortTestMatchReal19",
                    PortTestMatchReal19, 1);
     UtRegisterTest("PortTestMatchDoubleNegation", PortTestMatchDoubleNegation, 1);
+    UtRegisterTest("PortTestLookupCompiled01", PortTestLookupCompiled01, 1);
 
 
 #endif /* UNITTESTS */
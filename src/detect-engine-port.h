@@ -37,6 +37,7 @@ DetectPort *DetectPortLookup(DetectPort *head, DetectPort *dp);
 int DetectPortAdd(DetectPort **head, DetectPort *dp);
 
 DetectPort *DetectPortLookupGroup(DetectPort *dp, uint16_t port);
+int DetectPortCompileList(DetectPort *);
 
 void DetectPortPrintMemory(void);
 
@@ -0,0 +1,328 @@
+/* Copyright (C) 2014 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Prefilter engines for signatures without a fast pattern.
+ *
+ * Signatures with a fast pattern are narrowed down by the mpm before
+ * SigMatchSignatures runs their match lists. Signatures without one are
+ * added to the match array of every packet of their sgh. For those, a
+ * cheap packet keyword (flags, ttl, itype, icode, flow) can take the role
+ * of the fast pattern.
+ *
+ * A keyword supports this by setting the PrefilterGetValue and
+ * PrefilterMatchValue callbacks in its sigmatch_table entry. The value is
+ * a single byte, so at SigGroupBuild time every sgh gets one engine per
+ * keyword, holding a table with a row of sig bits for each of the 256
+ * values. Per packet the engine looks up the row for the packet's value
+ * and marks the sigs that passed. The sigs are flagged SIG_FLAG_PREFILTER
+ * and SigMatchSignaturesBuildMatchArrayAddSignature() skips the ones that
+ * weren't marked.
+ *
+ * The full match list still runs for the sigs that pass, so an engine only
+ * has to never reject a sig that could match.
+ */
+
+#include "suricata-common.h"
+#include "suricata.h"
+
+#include "decode.h"
+#include "detect.h"
+#include "detect-parse.h"
+#include "detect-engine.h"
+#include "detect-engine-prefilter.h"
+
+#include "util-debug.h"
+#include "util-unittest.h"
+#include "util-unittest-helper.h"
+
+/** \internal
+ *  \brief get the first sigmatch of the sig's packet match list that
+ *         supports prefiltering */
+static SigMatch *DetectPrefilterGetSigMatch(const Signature *s)
+{
+    SigMatch *sm = s->sm_lists[DETECT_SM_LIST_MATCH];
+
+    for ( ; sm != NULL; sm = sm->next) {
+        if (sigmatch_table[sm->type].PrefilterGetValue != NULL &&
+            sigmatch_table[sm->type].PrefilterMatchValue != NULL)
+            return sm;
+    }
+    return NULL;
+}
+
+/**
+ *  \brief Flag a signature for prefiltering if it has no fast pattern
+ *         but does have a keyword supporting the prefilter.
+ *
+ *  Called for all sigs before the sgh head arrays are built, as those
+ *  copy the sig flags.
+ */
+void DetectPrefilterSetupSignature(Signature *s)
+{
+    s->flags &= ~SIG_FLAG_PREFILTER;
+
+    if (s->flags & (SIG_FLAG_IPONLY|SIG_FLAG_MPM_PACKET|
+                    SIG_FLAG_MPM_STREAM|SIG_FLAG_MPM_APPLAYER))
+        return;
+
+    SigMatch *sm = DetectPrefilterGetSigMatch(s);
+    if (sm != NULL) {
+        SCLogDebug("sig %"PRIu32" uses prefilter keyword %s", s->id,
+                sigmatch_table[sm->type].name);
+        s->flags |= SIG_FLAG_PREFILTER;
+    }
+}
+
+static void DetectPrefilterEngineFree(DetectPrefilterEngine *pe)
+{
+    if (pe->sig_nums != NULL)
+        SCFree(pe->sig_nums);
+    if (pe->table != NULL)
+        SCFree(pe->table);
+    SCFree(pe);
+}
+
+/**
+ *  \brief Build the prefilter engines for the flagged sigs of a sgh.
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int DetectPrefilterBuildEngines(DetectEngineCtx *de_ctx, SigGroupHead *sgh)
+{
+    DetectPrefilterEngine *pe;
+    uint32_t sig;
+
+    if (sgh == NULL)
+        return 0;
+
+    BUG_ON(sgh->prefilter_engines != NULL);
+
+    /* pass 1: an engine per keyword, count its sigs */
+    for (sig = 0; sig < sgh->sig_cnt; sig++) {
+        Signature *s = sgh->match_array[sig];
+        if (s == NULL || !(s->flags & SIG_FLAG_PREFILTER))
+            continue;
+
+        SigMatch *sm = DetectPrefilterGetSigMatch(s);
+        BUG_ON(sm == NULL);
+
+        for (pe = sgh->prefilter_engines; pe != NULL; pe = pe->next) {
+            if (pe->sm_type == sm->type)
+                break;
+        }
+        if (pe == NULL) {
+            pe = SCMalloc(sizeof(DetectPrefilterEngine));
+            if (unlikely(pe == NULL))
+                goto error;
+            memset(pe, 0, sizeof(DetectPrefilterEngine));
+            pe->sm_type = sm->type;
+            pe->next = sgh->prefilter_engines;
+            sgh->prefilter_engines = pe;
+        }
+        pe->sig_cnt++;
+    }
+
+    for (pe = sgh->prefilter_engines; pe != NULL; pe = pe->next) {
+        pe->words = (pe->sig_cnt + 63) / 64;
+        pe->sig_nums = SCMalloc(pe->sig_cnt * sizeof(SigIntId));
+        pe->table = SCMalloc(DETECT_PREFILTER_VALUES * pe->words * sizeof(uint64_t));
+        if (pe->sig_nums == NULL || pe->table == NULL)
+            goto error;
+        memset(pe->table, 0, DETECT_PREFILTER_VALUES * pe->words * sizeof(uint64_t));
+        /* reused as fill index in pass 2 */
+        pe->sig_cnt = 0;
+    }
+
+    /* pass 2: fill the tables */
+    for (sig = 0; sig < sgh->sig_cnt; sig++) {
+        Signature *s = sgh->match_array[sig];
+        if (s == NULL || !(s->flags & SIG_FLAG_PREFILTER))
+            continue;
+
+        SigMatch *sm = DetectPrefilterGetSigMatch(s);
+        for (pe = sgh->prefilter_engines; pe->sm_type != sm->type; pe = pe->next)
+            ;
+
+        uint32_t i = pe->sig_cnt++;
+        uint32_t v;
+
+        pe->sig_nums[i] = s->num;
+        for (v = 0; v < DETECT_PREFILTER_VALUES; v++) {
+            if (sigmatch_table[sm->type].PrefilterMatchValue((uint8_t)v, sm->ctx)) {
+                pe->table[v * pe->words + i / 64] |= ((uint64_t)1 << (i % 64));
+            }
+        }
+    }
+
+    for (pe = sgh->prefilter_engines; pe != NULL; pe = pe->next) {
+        SCLogDebug("sgh %p: prefilter engine %s with %u sigs", sgh,
+                sigmatch_table[pe->sm_type].name, pe->sig_cnt);
+    }
+    return 0;
+
+error:
+    DetectPrefilterFreeEngines(sgh);
+    return -1;
+}
+
+void DetectPrefilterFreeEngines(SigGroupHead *sgh)
+{
+    DetectPrefilterEngine *pe = sgh->prefilter_engines;
+
+    while (pe != NULL) {
+        DetectPrefilterEngine *next = pe->next;
+        DetectPrefilterEngineFree(pe);
+        pe = next;
+    }
+    sgh->prefilter_engines = NULL;
+}
+
+/**
+ *  \brief Run the prefilter engines of the packet's sgh, marking the sigs
+ *         that passed in det_ctx->prefilter_sig_array.
+ */
+void DetectPrefilterRun(DetectEngineThreadCtx *det_ctx, Packet *p)
+{
+    DetectPrefilterEngine *pe;
+
+    if (det_ctx->prefilter_sig_array == NULL)
+        return;
+
+    /* a new id invalidates the marks of the previous packet */
+    det_ctx->prefilter_id++;
+    if (unlikely(det_ctx->prefilter_id == 0)) {
+        memset(det_ctx->prefilter_sig_array, 0,
+               det_ctx->de_state_sig_array_len * sizeof(uint32_t));
+        det_ctx->prefilter_id = 1;
+    }
+    const uint32_t id = det_ctx->prefilter_id;
+
+    for (pe = det_ctx->sgh->prefilter_engines; pe != NULL; pe = pe->next) {
+        int v = sigmatch_table[pe->sm_type].PrefilterGetValue(p);
+        if (v < 0)
+            continue;
+
+        const uint64_t *row = pe->table + (uint32_t)v * pe->words;
+        uint32_t w;
+        for (w = 0; w < pe->words; w++) {
+            uint64_t bits = row[w];
+            while (bits) {
+                uint32_t i = w * 64 + (uint32_t)__builtin_ctzll(bits);
+                bits &= bits - 1;
+                det_ctx->prefilter_sig_array[pe->sig_nums[i]] = id;
+            }
+        }
+    }
+}
+
+#ifdef UNITTESTS
+/** \test sigs without content are only added to the match array if their
+ *        prefilter keyword matches the packet */
+static int DetectPrefilterTest01(void)
+{
+    int result = 0;
+    Packet *p = NULL;
+    ThreadVars tv;
+    DetectEngineThreadCtx *det_ctx = NULL;
+
+    memset(&tv, 0, sizeof(tv));
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    if (de_ctx == NULL)
+        goto end;
+    de_ctx->flags |= DE_QUIET;
+
+    Signature *s1 = DetectEngineAppendSig(de_ctx, "alert tcp any any -> any any "
+            "(flags:S; sid:1;)");
+    Signature *s2 = DetectEngineAppendSig(de_ctx, "alert tcp any any -> any any "
+            "(flags:A; sid:2;)");
+    Signature *s3 = DetectEngineAppendSig(de_ctx, "alert tcp any any -> any any "
+            "(ttl:<10; sid:3;)");
+    Signature *s4 = DetectEngineAppendSig(de_ctx, "alert tcp any any -> any any "
+            "(content:\"abc\"; sid:4;)");
+    if (s1 == NULL || s2 == NULL || s3 == NULL || s4 == NULL) {
+        printf("sig parse failed: ");
+        goto end;
+    }
+
+    SigGroupBuild(de_ctx);
+    DetectEngineThreadCtxInit(&tv, (void *)de_ctx, (void *)&det_ctx);
+
+    if (!(s1->flags & SIG_FLAG_PREFILTER) || !(s3->flags & SIG_FLAG_PREFILTER) ||
+        (s4->flags & SIG_FLAG_PREFILTER)) {
+        printf("prefilter flag not set as expected: ");
+        goto end;
+    }
+
+    p = UTHBuildPacket((uint8_t *)"xyz", 3, IPPROTO_TCP);
+    if (p == NULL)
+        goto end;
+    p->tcph->th_flags = TH_ACK;
+    p->ip4h->ip_ttl = 64;
+
+    SigMatchSignatures(&tv, de_ctx, det_ctx, p);
+    if (PacketAlertCheck(p, 1) || !PacketAlertCheck(p, 2) || PacketAlertCheck(p, 3)) {
+        printf("wrong alerts for ack packet: ");
+        goto end;
+    }
+    /* only sig 2 passes the prefilter, sig 4 has no mpm match */
+    if (det_ctx->match_array_cnt != 1 || det_ctx->match_array[0]->id != 2) {
+        printf("expected only sig 2 in the match array, got %u: ",
+                det_ctx->match_array_cnt);
+        goto end;
+    }
+
+    p->alerts.cnt = 0;
+    p->tcph->th_flags = TH_SYN;
+    p->ip4h->ip_ttl = 5;
+
+    SigMatchSignatures(&tv, de_ctx, det_ctx, p);
+    if (!PacketAlertCheck(p, 1) || PacketAlertCheck(p, 2) || !PacketAlertCheck(p, 3)) {
+        printf("wrong alerts for syn packet: ");
+        goto end;
+    }
+    if (det_ctx->match_array_cnt != 2) {
+        printf("expected 2 sigs in the match array, got %u: ",
+                det_ctx->match_array_cnt);
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (p != NULL)
+        UTHFreePacket(p);
+    if (de_ctx != NULL) {
+        SigGroupCleanup(de_ctx);
+        SigCleanSignatures(de_ctx);
+        if (det_ctx != NULL)
+            DetectEngineThreadCtxDeinit(&tv, (void *)det_ctx);
+        DetectEngineCtxFree(de_ctx);
+    }
+    return result;
+}
+#endif /* UNITTESTS */
+
+void DetectPrefilterRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("DetectPrefilterTest01", DetectPrefilterTest01, 1);
+#endif /* UNITTESTS */
+}
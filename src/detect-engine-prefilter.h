@@ -0,0 +1,53 @@
+/* Copyright (C) 2014 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Prefilter engines for signatures without a fast pattern.
+ */
+
+#ifndef __DETECT_ENGINE_PREFILTER_H__
+#define __DETECT_ENGINE_PREFILTER_H__
+
+/** number of values a prefilter keyword can inspect */
+#define DETECT_PREFILTER_VALUES     256
+
+/** prefilter engine for one keyword in a sgh */
+typedef struct DetectPrefilterEngine_ {
+    /** keyword, index in sigmatch_table */
+    int sm_type;
+
+    /** number of sigs in the engine and their Signature::num */
+    uint32_t sig_cnt;
+    SigIntId *sig_nums;
+
+    /** DETECT_PREFILTER_VALUES rows of sig_cnt bits: bit i of row v is
+     *  set if the keyword of sig i matches value v */
+    uint32_t words;
+    uint64_t *table;
+
+    struct DetectPrefilterEngine_ *next;
+} DetectPrefilterEngine;
+
+void DetectPrefilterSetupSignature(Signature *);
+int DetectPrefilterBuildEngines(DetectEngineCtx *, SigGroupHead *);
+void DetectPrefilterFreeEngines(SigGroupHead *);
+void DetectPrefilterRun(DetectEngineThreadCtx *, Packet *);
+void DetectPrefilterRegisterTests(void);
+
+#endif /* __DETECT_ENGINE_PREFILTER_H__ */
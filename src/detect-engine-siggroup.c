@@ -35,6 +35,7 @@
 #include "detect-engine.h"
 #include "detect-engine-address.h"
 #include "detect-engine-mpm.h"
+#include "detect-engine-prefilter.h"
 #include "detect-engine-siggroup.h"
 
 #include "detect-content.h"
@@ -198,6 +199,8 @@ void SigGroupHeadFree(SigGroupHead *sgh)
         sgh->head_array = NULL;
     }
 
+    DetectPrefilterFreeEngines(sgh);
+
     if (sgh->match_array != NULL) {
         detect_siggroup_matcharray_free_cnt++;
         detect_siggroup_matcharray_memory -= (sgh->sig_cnt * sizeof(Signature *));
@@ -1709,8 +1712,8 @@ int SigGroupHeadBuildHeadArray(DetectEngineCtx *de_ctx, SigGroupHead *sgh)
 #if defined(__SSE3__) || defined(__tile__)
     BUG_ON(sgh->mask_array != NULL);
 
-    /* mask array is 16 byte aligned for SIMD checking, also we always
-     * alloc a multiple of 32/64 bytes */
+    /* mask array is 16 byte aligned for SIMD checking (32 for AVX2), also
+     * we always alloc a multiple of 32/64 bytes */
     int cnt = sgh->sig_cnt;
 #if __WORDSIZE == 32
     if (cnt % 32 != 0) {
@@ -1722,7 +1725,11 @@ int SigGroupHeadBuildHeadArray(DetectEngineCtx *de_ctx, SigGroupHead *sgh)
     }
 #endif /* __WORDSIZE */
 
+#if defined(__AVX2__)
+    sgh->mask_array = (SignatureMask *)SCMallocAligned((cnt * sizeof(SignatureMask)), 32);
+#else
     sgh->mask_array = (SignatureMask *)SCMallocAligned((cnt * sizeof(SignatureMask)), 16);
+#endif
     if (sgh->mask_array == NULL)
         return -1;
 
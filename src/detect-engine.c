@@ -62,6 +62,7 @@
 #include "detect-engine-modbus.h"
 
 #include "detect-engine.h"
+#include "detect-engine-cache.h"
 #include "detect-engine-state.h"
 
 #include "detect-byte-extract.h"
@@ -75,6 +76,7 @@
 #include "util-error.h"
 #include "util-hash.h"
 #include "util-byte.h"
+#include "util-cpu.h"
 #include "util-debug.h"
 #include "util-unittest.h"
 #include "util-action.h"
@@ -927,6 +929,7 @@ void DetectEngineCtxFree(DetectEngineCtx *de_ctx)
     SigCleanSignatures(de_ctx);
 
     VariableNameFreeHash(de_ctx);
+    FlowBitsMapRelease(de_ctx->flowbits_map);
     if (de_ctx->sig_array)
         SCFree(de_ctx->sig_array);
 
@@ -934,11 +937,17 @@ void DetectEngineCtxFree(DetectEngineCtx *de_ctx)
     SCRConfDeInitContext(de_ctx);
 
     SigGroupCleanup(de_ctx);
+    MpmStoreFree(de_ctx);
 
     if (de_ctx->sgh_mpm_context == ENGINE_SGH_MPM_FACTORY_CONTEXT_SINGLE) {
         MpmFactoryDeRegisterAllMpmCtxProfiles(de_ctx);
     }
 
+    /* after all mpm ctxs are gone, they may use the mapped cache */
+    DetectEngineCacheClose(de_ctx);
+    if (de_ctx->cache_dir != NULL)
+        SCFree(de_ctx->cache_dir);
+
     DetectEngineCtxFreeThreadKeywordData(de_ctx);
     SRepDestroy(de_ctx);
     SCFree(de_ctx);
@@ -968,6 +977,8 @@ static uint8_t DetectEngineCtxLoadConf(DetectEngineCtx *de_ctx)
     const char *max_uniq_toserver_dp_groups_str = NULL;
 
     char *sgh_mpm_context = NULL;
+    char *prepare_threads = NULL;
+    char *cache_dir = NULL;
 
     ConfNode *de_ctx_custom = ConfGetNode("detect-engine");
     ConfNode *opt = NULL;
@@ -978,6 +989,10 @@ static uint8_t DetectEngineCtxLoadConf(DetectEngineCtx *de_ctx)
                 de_ctx_profile = opt->head.tqh_first->val;
             } else if (strcmp(opt->val, "sgh-mpm-context") == 0) {
                 sgh_mpm_context = opt->head.tqh_first->val;
+            } else if (strcmp(opt->val, "prepare-threads") == 0) {
+                prepare_threads = opt->head.tqh_first->val;
+            } else if (strcmp(opt->val, "cache-dir") == 0) {
+                cache_dir = opt->head.tqh_first->val;
             }
         }
     }
@@ -1039,6 +1054,29 @@ static uint8_t DetectEngineCtxLoadConf(DetectEngineCtx *de_ctx)
         de_ctx->sgh_mpm_context = ENGINE_SGH_MPM_FACTORY_CONTEXT_FULL;
     }
 
+    /* detect-engine.prepare-threads option parsing */
+    if (prepare_threads == NULL || strcmp(prepare_threads, "auto") == 0) {
+        de_ctx->prepare_threads = UtilCpuGetNumProcessorsOnline();
+    } else if (ByteExtractStringUint16(&de_ctx->prepare_threads, 10,
+                strlen(prepare_threads), prepare_threads) <= 0) {
+        SCLogError(SC_ERR_INVALID_YAML_CONF_ENTRY, "You have supplied an "
+                   "invalid conf value for detect-engine.prepare-threads-"
+                   "%s", prepare_threads);
+        exit(EXIT_FAILURE);
+    }
+    if (de_ctx->prepare_threads == 0)
+        de_ctx->prepare_threads = 1;
+
+    /* detect-engine.cache-dir option parsing */
+    de_ctx->cache_key = DETECT_ENGINE_CACHE_KEY_INIT;
+    if (cache_dir != NULL && run_mode != RUNMODE_UNITTEST) {
+        de_ctx->cache_dir = SCStrdup(cache_dir);
+        if (de_ctx->cache_dir == NULL) {
+            SCLogError(SC_ERR_MEM_ALLOC, "Error allocating memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     opt = NULL;
     switch (profile) {
         case ENGINE_PROFILE_LOW:
@@ -1303,6 +1341,13 @@ static TmEcode ThreadCtxDoInit (DetectEngineCtx *de_ctx, DetectEngineThreadCtx *
         memset(det_ctx->de_state_sig_array, 0,
                det_ctx->de_state_sig_array_len * sizeof(uint8_t));
 
+        det_ctx->prefilter_sig_array = SCMalloc(det_ctx->de_state_sig_array_len * sizeof(uint32_t));
+        if (det_ctx->prefilter_sig_array == NULL) {
+            return TM_ECODE_FAILED;
+        }
+        memset(det_ctx->prefilter_sig_array, 0,
+               det_ctx->de_state_sig_array_len * sizeof(uint32_t));
+
         det_ctx->match_array_len = de_ctx->sig_array_len;
         det_ctx->match_array = SCMalloc(det_ctx->match_array_len * sizeof(Signature *));
         if (det_ctx->match_array == NULL) {
@@ -1356,6 +1401,10 @@ TmEcode DetectEngineThreadCtxInit(ThreadVars *tv, void *initdata, void **data)
      * rules haven't been loaded yet. */
     uint16_t counter_alerts = SCPerfTVRegisterCounter("detect.alert", tv,
                                                       SC_PERF_TYPE_UINT64, "NULL");
+    uint16_t counter_sgh_cache_hit = SCPerfTVRegisterCounter("detect.sgh_cache.hit", tv,
+                                                      SC_PERF_TYPE_UINT64, "NULL");
+    uint16_t counter_sgh_cache_miss = SCPerfTVRegisterCounter("detect.sgh_cache.miss", tv,
+                                                      SC_PERF_TYPE_UINT64, "NULL");
     if (de_ctx->delayed_detect == 1 && de_ctx->delayed_detect_initialized == 0) {
         *data = NULL;
         return TM_ECODE_OK;
@@ -1374,6 +1423,8 @@ TmEcode DetectEngineThreadCtxInit(ThreadVars *tv, void *initdata, void **data)
 
     /** alert counter setup */
     det_ctx->counter_alerts = counter_alerts;
+    det_ctx->counter_sgh_cache_hit = counter_sgh_cache_hit;
+    det_ctx->counter_sgh_cache_miss = counter_sgh_cache_miss;
 
     /* pass thread data back to caller */
     *data = (void *)det_ctx;
@@ -1410,6 +1461,10 @@ static TmEcode DetectEngineThreadCtxInitForLiveRuleSwap(ThreadVars *tv, void *in
     /** alert counter setup */
     det_ctx->counter_alerts = SCPerfTVRegisterCounter("detect.alert", tv,
                                                       SC_PERF_TYPE_UINT64, "NULL");
+    det_ctx->counter_sgh_cache_hit = SCPerfTVRegisterCounter("detect.sgh_cache.hit", tv,
+                                                      SC_PERF_TYPE_UINT64, "NULL");
+    det_ctx->counter_sgh_cache_miss = SCPerfTVRegisterCounter("detect.sgh_cache.miss", tv,
+                                                      SC_PERF_TYPE_UINT64, "NULL");
     /* no counter creation here */
 
     /* pass thread data back to caller */
@@ -1447,6 +1502,8 @@ TmEcode DetectEngineThreadCtxDeinit(ThreadVars *tv, void *data)
 
     if (det_ctx->de_state_sig_array != NULL)
         SCFree(det_ctx->de_state_sig_array);
+    if (det_ctx->prefilter_sig_array != NULL)
+        SCFree(det_ctx->prefilter_sig_array);
     if (det_ctx->match_array != NULL)
         SCFree(det_ctx->match_array);
 
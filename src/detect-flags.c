@@ -57,6 +57,8 @@ static pcre *parse_regex;
 static pcre_extra *parse_regex_study;
 
 static int DetectFlagsMatch (ThreadVars *, DetectEngineThreadCtx *, Packet *, Signature *, SigMatch *);
+static int PrefilterFlagsGetValue(Packet *);
+static int PrefilterFlagsMatchValue(uint8_t, void *);
 static int DetectFlagsSetup (DetectEngineCtx *, Signature *, char *);
 static void DetectFlagsFree(void *);
 
@@ -71,6 +73,8 @@ void DetectFlagsRegister (void)
     sigmatch_table[DETECT_FLAGS].Setup = DetectFlagsSetup;
     sigmatch_table[DETECT_FLAGS].Free  = DetectFlagsFree;
     sigmatch_table[DETECT_FLAGS].RegisterTests = FlagsRegisterTests;
+    sigmatch_table[DETECT_FLAGS].PrefilterGetValue = PrefilterFlagsGetValue;
+    sigmatch_table[DETECT_FLAGS].PrefilterMatchValue = PrefilterFlagsMatchValue;
 
     const char *eb;
     int opts = 0;
@@ -97,30 +101,18 @@ error:
 
 /**
  * \internal
- * \brief This function is used to match flags on a packet with those passed via flags:
+ * \brief match the tcp flags of a packet against the flags: options
  *
- * \param t pointer to thread vars
- * \param det_ctx pointer to the pattern matcher thread
- * \param p pointer to the current packet
- * \param s pointer to the Signature
- * \param m pointer to the sigmatch
+ * \param flags tcp flags of the packet
+ * \param de flags options of the sig
  *
  * \retval 0 no match
  * \retval 1 match
  */
-static int DetectFlagsMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
+static inline int FlagsMatch(uint8_t flags, const DetectFlagsData *de)
 {
     SCEnter();
 
-    uint8_t flags = 0;
-    DetectFlagsData *de = (DetectFlagsData *)m->ctx;
-
-    if (!(PKT_IS_TCP(p)) || PKT_IS_PSEUDOPKT(p)) {
-        SCReturnInt(0);
-    }
-
-    flags = p->tcph->th_flags;
-
     if (!de->flags && flags) {
         if(de->modifier == MODIFIER_NOT) {
             SCReturnInt(1);
@@ -160,6 +152,46 @@ static int DetectFlagsMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Pack
     SCReturnInt(0);
 }
 
+/**
+ * \internal
+ * \brief This function is used to match flags on a packet with those passed via flags:
+ *
+ * \param t pointer to thread vars
+ * \param det_ctx pointer to the pattern matcher thread
+ * \param p pointer to the current packet
+ * \param s pointer to the Signature
+ * \param m pointer to the sigmatch
+ *
+ * \retval 0 no match
+ * \retval 1 match
+ */
+static int DetectFlagsMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
+{
+    SCEnter();
+
+    if (!(PKT_IS_TCP(p)) || PKT_IS_PSEUDOPKT(p)) {
+        SCReturnInt(0);
+    }
+
+    int ret = FlagsMatch(p->tcph->th_flags, (const DetectFlagsData *)m->ctx);
+    SCReturnInt(ret);
+}
+
+/** \internal
+ *  \brief get the tcp flags for the prefilter, -1 if the packet has none */
+static int PrefilterFlagsGetValue(Packet *p)
+{
+    if (!(PKT_IS_TCP(p)) || PKT_IS_PSEUDOPKT(p)) {
+        return -1;
+    }
+    return p->tcph->th_flags;
+}
+
+static int PrefilterFlagsMatchValue(uint8_t flags, void *ctx)
+{
+    return FlagsMatch(flags, (const DetectFlagsData *)ctx);
+}
+
 /**
  * \internal
  * \brief This function is used to parse flags options passed via flags: keyword
@@ -52,6 +52,8 @@ int DetectFlowMatch (ThreadVars *, DetectEngineThreadCtx *, Packet *, Signature
 static int DetectFlowSetup (DetectEngineCtx *, Signature *, char *);
 void DetectFlowRegisterTests(void);
 void DetectFlowFree(void *);
+static int PrefilterFlowGetValue(Packet *);
+static int PrefilterFlowMatchValue(uint8_t, void *);
 
 /**
  * \brief Registration function for flow: keyword
@@ -65,6 +67,8 @@ void DetectFlowRegister (void)
     sigmatch_table[DETECT_FLOW].Setup = DetectFlowSetup;
     sigmatch_table[DETECT_FLOW].Free  = DetectFlowFree;
     sigmatch_table[DETECT_FLOW].RegisterTests = DetectFlowRegisterTests;
+    sigmatch_table[DETECT_FLOW].PrefilterGetValue = PrefilterFlowGetValue;
+    sigmatch_table[DETECT_FLOW].PrefilterMatchValue = PrefilterFlowMatchValue;
 
     const char *eb;
     int eo;
@@ -90,6 +94,41 @@ error:
     return;
 }
 
+/** \internal
+ *  \brief the direction and state part of the flow flags for the prefilter */
+static int PrefilterFlowGetValue(Packet *p)
+{
+    return p->flowflags & (FLOW_PKT_TOSERVER|FLOW_PKT_TOCLIENT|
+                           FLOW_PKT_ESTABLISHED|FLOW_PKT_STATELESS);
+}
+
+/** \internal
+ *  \brief prefilter version of DetectFlowMatch. Whether the stream or the
+ *         packet is inspected is only known while the sig runs, so the
+ *         stream options are assumed to match. */
+static int PrefilterFlowMatchValue(uint8_t flowflags, void *ctx)
+{
+    const DetectFlowData *fd = (const DetectFlowData *)ctx;
+    uint8_t cnt = 0;
+
+    if ((fd->flags & FLOW_PKT_TOSERVER) && (flowflags & FLOW_PKT_TOSERVER)) {
+        cnt++;
+    } else if ((fd->flags & FLOW_PKT_TOCLIENT) && (flowflags & FLOW_PKT_TOCLIENT)) {
+        cnt++;
+    }
+
+    if ((fd->flags & FLOW_PKT_ESTABLISHED) && (flowflags & FLOW_PKT_ESTABLISHED)) {
+        cnt++;
+    } else if (fd->flags & FLOW_PKT_STATELESS) {
+        cnt++;
+    }
+
+    if (fd->flags & (FLOW_PKT_ONLYSTREAM|FLOW_PKT_NOSTREAM))
+        cnt++;
+
+    return (fd->match_cnt == cnt) ? 1 : 0;
+}
+
 /*
  * returns 0: no match
  *         1: match
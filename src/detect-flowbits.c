@@ -40,10 +40,12 @@
 #include "detect-engine.h"
 #include "detect-engine-mpm.h"
 #include "detect-engine-state.h"
+#include "detect-engine-alert.h"
 
 #include "flow-bit.h"
 #include "util-var-name.h"
 #include "util-unittest.h"
+#include "util-unittest-helper.h"
 #include "util-debug.h"
 
 #define PARSE_REGEX         "([a-z]+)(?:,(.*))?"
@@ -747,18 +749,15 @@ static int FlowBitsTestSig06(void)
     DetectEngineThreadCtx *det_ctx = NULL;
     DetectEngineCtx *de_ctx = NULL;
     Flow f;
-    GenericVar flowvar, *gv = NULL;
     int result = 0;
     int idx = 0;
 
     memset(p, 0, SIZE_OF_PACKET);
     memset(&th_v, 0, sizeof(th_v));
     memset(&f, 0, sizeof(Flow));
-    memset(&flowvar, 0, sizeof(GenericVar));
 
     FLOW_INITIALIZE(&f);
     p->flow = &f;
-    p->flow->flowvar = &flowvar;
 
     p->src.family = AF_INET;
     p->dst.family = AF_INET;
@@ -789,13 +788,8 @@ static int FlowBitsTestSig06(void)
 
     idx = VariableNameGetIdx(de_ctx, "myflow", DETECT_FLOWBITS);
 
-    gv = p->flow->flowvar;
-
-    for ( ; gv != NULL; gv = gv->next) {
-        if (gv->type == DETECT_FLOWBITS && gv->idx == idx) {
-                result = 1;
-        }
-    }
+    if (FlowBitIsset(p->flow, idx))
+        result = 1;
 
     SigGroupCleanup(de_ctx);
     SigCleanSignatures(de_ctx);
@@ -803,7 +797,6 @@ static int FlowBitsTestSig06(void)
     DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
     DetectEngineCtxFree(de_ctx);
 
-    if(gv) GenericVarFree(gv);
     FLOW_DESTROY(&f);
 
     SCFree(p);
@@ -823,7 +816,6 @@ end:
         DetectEngineCtxFree(de_ctx);
     }
 
-    if(gv) GenericVarFree(gv);
     FLOW_DESTROY(&f);
     SCFree(p);
     return result;
@@ -851,18 +843,15 @@ static int FlowBitsTestSig07(void)
     DetectEngineThreadCtx *det_ctx = NULL;
     DetectEngineCtx *de_ctx = NULL;
     Flow f;
-    GenericVar flowvar, *gv = NULL;
     int result = 0;
     int idx = 0;
 
     memset(p, 0, SIZE_OF_PACKET);
     memset(&th_v, 0, sizeof(th_v));
     memset(&f, 0, sizeof(Flow));
-    memset(&flowvar, 0, sizeof(GenericVar));
 
     FLOW_INITIALIZE(&f);
     p->flow = &f;
-    p->flow->flowvar = &flowvar;
 
     p->src.family = AF_INET;
     p->dst.family = AF_INET;
@@ -895,13 +884,8 @@ static int FlowBitsTestSig07(void)
 
     idx = VariableNameGetIdx(de_ctx, "myflow", DETECT_FLOWBITS);
 
-    gv = p->flow->flowvar;
-
-    for ( ; gv != NULL; gv = gv->next) {
-        if (gv->type == DETECT_FLOWBITS && gv->idx == idx) {
-                result = 1;
-        }
-    }
+    if (FlowBitIsset(p->flow, idx))
+        result = 1;
 
     SigGroupCleanup(de_ctx);
     SigCleanSignatures(de_ctx);
@@ -909,7 +893,6 @@ static int FlowBitsTestSig07(void)
     DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
     DetectEngineCtxFree(de_ctx);
 
-    if(gv) GenericVarFree(gv);
     FLOW_DESTROY(&f);
 
     SCFree(p);
@@ -929,7 +912,6 @@ end:
         DetectEngineCtxFree(de_ctx);
     }
 
-    if(gv) GenericVarFree(gv);
     FLOW_DESTROY(&f);
 
     SCFree(p);
@@ -958,18 +940,15 @@ static int FlowBitsTestSig08(void)
     DetectEngineThreadCtx *det_ctx = NULL;
     DetectEngineCtx *de_ctx = NULL;
     Flow f;
-    GenericVar flowvar, *gv = NULL;
     int result = 0;
     int idx = 0;
 
     memset(p, 0, SIZE_OF_PACKET);
     memset(&th_v, 0, sizeof(th_v));
     memset(&f, 0, sizeof(Flow));
-    memset(&flowvar, 0, sizeof(GenericVar));
 
     FLOW_INITIALIZE(&f);
     p->flow = &f;
-    p->flow->flowvar = &flowvar;
 
     p->src.family = AF_INET;
     p->dst.family = AF_INET;
@@ -1004,13 +983,8 @@ static int FlowBitsTestSig08(void)
 
     idx = VariableNameGetIdx(de_ctx, "myflow", DETECT_FLOWBITS);
 
-    gv = p->flow->flowvar;
-
-    for ( ; gv != NULL; gv = gv->next) {
-        if (gv->type == DETECT_FLOWBITS && gv->idx == idx) {
-                result = 1;
-        }
-    }
+    if (FlowBitIsset(p->flow, idx))
+        result = 1;
 
     SigGroupCleanup(de_ctx);
     SigCleanSignatures(de_ctx);
@@ -1018,7 +992,6 @@ static int FlowBitsTestSig08(void)
     DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
     DetectEngineCtxFree(de_ctx);
 
-    if(gv) GenericVarFree(gv);
     FLOW_DESTROY(&f);
 
     SCFree(p);
@@ -1038,12 +1011,117 @@ end:
         DetectEngineCtxFree(de_ctx);
     }
 
-    if(gv) GenericVarFree(gv);
     FLOW_DESTROY(&f);
 
     SCFree(p);
     return result;
 }
+
+/**
+ * \test FlowBitsTestSig09 tests that flowbits survive a rule swap to a
+ *       ctx that assigned different idx's to them
+ *
+ *  \retval 1 on succces
+ *  \retval 0 on failure
+ */
+
+static int FlowBitsTestSig09(void)
+{
+    Packet *p = NULL;
+    Flow f;
+    ThreadVars th_v;
+    DetectEngineThreadCtx *det_ctx1 = NULL, *det_ctx2 = NULL;
+    DetectEngineCtx *de_ctx1 = NULL, *de_ctx2 = NULL;
+    int result = 0;
+
+    memset(&th_v, 0, sizeof(th_v));
+    memset(&f, 0, sizeof(Flow));
+    FLOW_INITIALIZE(&f);
+    f.proto = IPPROTO_TCP;
+    f.flags |= FLOW_IPV4;
+
+    p = UTHBuildPacket((uint8_t *)"boo", 3, IPPROTO_TCP);
+    if (p == NULL)
+        goto end;
+    p->flow = &f;
+    p->flags |= PKT_HAS_FLOW;
+    p->flowflags |= FLOW_PKT_TOSERVER;
+
+    de_ctx1 = DetectEngineCtxInit();
+    if (de_ctx1 == NULL)
+        goto end;
+    de_ctx1->flags |= DE_QUIET;
+    de_ctx1->sig_list = SigInit(de_ctx1, "alert tcp any any -> any any "
+            "(flowbits:set,one; flowbits:set,two; sid:1;)");
+    if (de_ctx1->sig_list == NULL)
+        goto end;
+    SigGroupBuild(de_ctx1);
+    DetectEngineThreadCtxInit(&th_v, (void *)de_ctx1, (void *)&det_ctx1);
+
+    /* the new ctx knows 'two' as idx 1, 'one' is gone */
+    de_ctx2 = DetectEngineCtxInit();
+    if (de_ctx2 == NULL)
+        goto end;
+    de_ctx2->flags |= DE_QUIET;
+    de_ctx2->sig_list = SigInit(de_ctx2, "alert tcp any any -> any any "
+            "(flowbits:isset,two; sid:2;)");
+    if (de_ctx2->sig_list == NULL)
+        goto end;
+    de_ctx2->sig_list->next = SigInit(de_ctx2, "alert tcp any any -> any any "
+            "(flowbits:isset,three; sid:3;)");
+    if (de_ctx2->sig_list->next == NULL)
+        goto end;
+    SigGroupBuild(de_ctx2);
+    DetectEngineThreadCtxInit(&th_v, (void *)de_ctx2, (void *)&det_ctx2);
+
+    SigMatchSignatures(&th_v, de_ctx1, det_ctx1, p);
+    if (!PacketAlertCheck(p, 1)) {
+        printf("sid 1 didn't alert: ");
+        goto end;
+    }
+
+    /* free the old ctx first, the flow keeps its map alive */
+    DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx1);
+    det_ctx1 = NULL;
+    SigGroupCleanup(de_ctx1);
+    SigCleanSignatures(de_ctx1);
+    DetectEngineCtxFree(de_ctx1);
+    de_ctx1 = NULL;
+
+    SigMatchSignatures(&th_v, de_ctx2, det_ctx2, p);
+    if (!PacketAlertCheck(p, 2)) {
+        printf("sid 2 didn't alert, bit 'two' lost in the swap: ");
+        goto end;
+    }
+    if (PacketAlertCheck(p, 3)) {
+        printf("sid 3 alerted, bit 'one' was remapped to 'three': ");
+        goto end;
+    }
+    if (f.flowbits == NULL || f.flowbits->map != de_ctx2->flowbits_map) {
+        printf("flowbits not moved to the new map: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (det_ctx1 != NULL)
+        DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx1);
+    if (de_ctx1 != NULL) {
+        SigGroupCleanup(de_ctx1);
+        SigCleanSignatures(de_ctx1);
+        DetectEngineCtxFree(de_ctx1);
+    }
+    if (det_ctx2 != NULL)
+        DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx2);
+    if (de_ctx2 != NULL) {
+        SigGroupCleanup(de_ctx2);
+        SigCleanSignatures(de_ctx2);
+        DetectEngineCtxFree(de_ctx2);
+    }
+    FLOW_DESTROY(&f);
+    UTHFreePackets(&p, 1);
+    return result;
+}
 #endif /* UNITTESTS */
 
 /**
@@ -1060,5 +1138,6 @@ void FlowBitsRegisterTests(void)
     UtRegisterTest("FlowBitsTestSig06", FlowBitsTestSig06, 1);
     UtRegisterTest("FlowBitsTestSig07", FlowBitsTestSig07, 0);
     UtRegisterTest("FlowBitsTestSig08", FlowBitsTestSig08, 0);
+    UtRegisterTest("FlowBitsTestSig09", FlowBitsTestSig09, 1);
 #endif /* UNITTESTS */
 }
@@ -48,6 +48,8 @@ static pcre_extra *parse_regex_study;
 int DetectICodeMatch(ThreadVars *, DetectEngineThreadCtx *, Packet *, Signature *, SigMatch *);
 static int DetectICodeSetup(DetectEngineCtx *, Signature *, char *);
 void DetectICodeRegisterTests(void);
+static int PrefilterICodeGetValue(Packet *);
+static int PrefilterICodeMatchValue(uint8_t, void *);
 void DetectICodeFree(void *);
 
 
@@ -63,6 +65,8 @@ void DetectICodeRegister (void)
     sigmatch_table[DETECT_ICODE].Setup = DetectICodeSetup;
     sigmatch_table[DETECT_ICODE].Free = DetectICodeFree;
     sigmatch_table[DETECT_ICODE].RegisterTests = DetectICodeRegisterTests;
+    sigmatch_table[DETECT_ICODE].PrefilterGetValue = PrefilterICodeGetValue;
+    sigmatch_table[DETECT_ICODE].PrefilterMatchValue = PrefilterICodeMatchValue;
 
     const char *eb;
     int eo;
@@ -87,34 +91,9 @@ error:
     return;
 }
 
-/**
- * \brief This function is used to match icode rule option set on a packet with those passed via icode:
- *
- * \param t pointer to thread vars
- * \param det_ctx pointer to the pattern matcher thread
- * \param p pointer to the current packet
- * \param m pointer to the sigmatch that we will cast into DetectICodeData
- *
- * \retval 0 no match
- * \retval 1 match
- */
-int DetectICodeMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
+static inline int ICodeMatch(const uint8_t picode, const DetectICodeData *icd)
 {
     int ret = 0;
-    uint8_t picode;
-    DetectICodeData *icd = (DetectICodeData *)m->ctx;
-
-    if (PKT_IS_PSEUDOPKT(p))
-        return 0;
-
-    if (PKT_IS_ICMPV4(p)) {
-        picode = ICMPV4_GET_CODE(p);
-    } else if (PKT_IS_ICMPV6(p)) {
-        picode = ICMPV6_GET_CODE(p);
-    } else {
-        /* Packet not ICMPv4 nor ICMPv6 */
-        return ret;
-    }
 
     switch(icd->mode) {
         case DETECT_ICODE_EQ:
@@ -130,10 +109,50 @@ int DetectICodeMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p,
             ret = (picode >= icd->code1 && picode <= icd->code2) ? 1 : 0;
             break;
     }
-
     return ret;
 }
 
+/** \internal
+ *  \brief get the icmp code for the prefilter, -1 if the packet has none */
+static int PrefilterICodeGetValue(Packet *p)
+{
+    if (PKT_IS_PSEUDOPKT(p))
+        return -1;
+
+    if (PKT_IS_ICMPV4(p)) {
+        return ICMPV4_GET_CODE(p);
+    } else if (PKT_IS_ICMPV6(p)) {
+        return ICMPV6_GET_CODE(p);
+    }
+    /* Packet not ICMPv4 nor ICMPv6 */
+    return -1;
+}
+
+static int PrefilterICodeMatchValue(uint8_t picode, void *ctx)
+{
+    return ICodeMatch(picode, (const DetectICodeData *)ctx);
+}
+
+/**
+ * \brief This function is used to match icode rule option set on a packet with those passed via icode:
+ *
+ * \param t pointer to thread vars
+ * \param det_ctx pointer to the pattern matcher thread
+ * \param p pointer to the current packet
+ * \param m pointer to the sigmatch that we will cast into DetectICodeData
+ *
+ * \retval 0 no match
+ * \retval 1 match
+ */
+int DetectICodeMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
+{
+    int picode = PrefilterICodeGetValue(p);
+    if (picode < 0)
+        return 0;
+
+    return ICodeMatch((uint8_t)picode, (const DetectICodeData *)m->ctx);
+}
+
 /**
  * \brief This function is used to parse icode options passed via icode: keyword
  *
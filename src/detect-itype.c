@@ -48,6 +48,8 @@ static pcre_extra *parse_regex_study;
 int DetectITypeMatch(ThreadVars *, DetectEngineThreadCtx *, Packet *, Signature *, SigMatch *);
 static int DetectITypeSetup(DetectEngineCtx *, Signature *, char *);
 void DetectITypeRegisterTests(void);
+static int PrefilterITypeGetValue(Packet *);
+static int PrefilterITypeMatchValue(uint8_t, void *);
 void DetectITypeFree(void *);
 
 
@@ -63,6 +65,8 @@ void DetectITypeRegister (void)
     sigmatch_table[DETECT_ITYPE].Setup = DetectITypeSetup;
     sigmatch_table[DETECT_ITYPE].Free = DetectITypeFree;
     sigmatch_table[DETECT_ITYPE].RegisterTests = DetectITypeRegisterTests;
+    sigmatch_table[DETECT_ITYPE].PrefilterGetValue = PrefilterITypeGetValue;
+    sigmatch_table[DETECT_ITYPE].PrefilterMatchValue = PrefilterITypeMatchValue;
 
     const char *eb;
     int eo;
@@ -87,34 +91,9 @@ error:
     return;
 }
 
-/**
- * \brief This function is used to match itype rule option set on a packet with those passed via itype:
- *
- * \param t pointer to thread vars
- * \param det_ctx pointer to the pattern matcher thread
- * \param p pointer to the current packet
- * \param m pointer to the sigmatch that we will cast into DetectITypeData
- *
- * \retval 0 no match
- * \retval 1 match
- */
-int DetectITypeMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
+static inline int ITypeMatch(const uint8_t pitype, const DetectITypeData *itd)
 {
     int ret = 0;
-    uint8_t pitype;
-    DetectITypeData *itd = (DetectITypeData *)m->ctx;
-
-    if (PKT_IS_PSEUDOPKT(p))
-        return 0;
-
-    if (PKT_IS_ICMPV4(p)) {
-        pitype = ICMPV4_GET_TYPE(p);
-    } else if (PKT_IS_ICMPV6(p)) {
-        pitype = ICMPV6_GET_TYPE(p);
-    } else {
-        /* Packet not ICMPv4 nor ICMPv6 */
-        return ret;
-    }
 
     switch(itd->mode) {
         case DETECT_ITYPE_EQ:
@@ -130,10 +109,50 @@ int DetectITypeMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p,
             ret = (pitype > itd->type1 && pitype < itd->type2) ? 1 : 0;
             break;
     }
-
     return ret;
 }
 
+/** \internal
+ *  \brief get the icmp type for the prefilter, -1 if the packet has none */
+static int PrefilterITypeGetValue(Packet *p)
+{
+    if (PKT_IS_PSEUDOPKT(p))
+        return -1;
+
+    if (PKT_IS_ICMPV4(p)) {
+        return ICMPV4_GET_TYPE(p);
+    } else if (PKT_IS_ICMPV6(p)) {
+        return ICMPV6_GET_TYPE(p);
+    }
+    /* Packet not ICMPv4 nor ICMPv6 */
+    return -1;
+}
+
+static int PrefilterITypeMatchValue(uint8_t pitype, void *ctx)
+{
+    return ITypeMatch(pitype, (const DetectITypeData *)ctx);
+}
+
+/**
+ * \brief This function is used to match itype rule option set on a packet with those passed via itype:
+ *
+ * \param t pointer to thread vars
+ * \param det_ctx pointer to the pattern matcher thread
+ * \param p pointer to the current packet
+ * \param m pointer to the sigmatch that we will cast into DetectITypeData
+ *
+ * \retval 0 no match
+ * \retval 1 match
+ */
+int DetectITypeMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
+{
+    int pitype = PrefilterITypeGetValue(p);
+    if (pitype < 0)
+        return 0;
+
+    return ITypeMatch((uint8_t)pitype, (const DetectITypeData *)m->ctx);
+}
+
 /**
  * \brief This function is used to parse itype options passed via itype: keyword
  *
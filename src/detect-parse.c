@@ -28,6 +28,7 @@
 
 #include "detect.h"
 #include "detect-engine.h"
+#include "detect-engine-cache.h"
 #include "detect-engine-address.h"
 #include "detect-engine-port.h"
 #include "detect-engine-mpm.h"
@@ -1820,6 +1821,9 @@ end:
  */
 Signature *DetectEngineAppendSig(DetectEngineCtx *de_ctx, char *sigstr)
 {
+    /* the cache key covers all rules, including the ones that fail */
+    DetectEngineCacheKeyUpdateString(de_ctx, sigstr);
+
     Signature *sig = SigInit(de_ctx, sigstr);
     if (sig == NULL) {
         return NULL;
@@ -32,7 +32,77 @@
 
 /* Included into detect.c */
 
-#if defined(__SSE3__)
+#if defined(__AVX2__) && __WORDSIZE == 64
+
+/**
+ *  \brief AVX2 implementation of mask prefiltering.
+ *
+ *  Same approach as the SSE3 version below, but a 256 bit register holds
+ *  32 masks, so a batch of 64 sigs takes 2 loads instead of 4. The set bits
+ *  of the resulting bitmap are visited directly instead of testing each of
+ *  the 64 bits, so sparse bitmaps are cheap to walk.
+ */
+void SigMatchSignaturesBuildMatchArray(DetectEngineThreadCtx *det_ctx,
+                                       Packet *p, SignatureMask mask, AppProto alproto)
+{
+    uint32_t u;
+    register uint64_t bm; /* bit mask, 64 bits used */
+
+    /* keep local copies of variables that don't change during this function */
+    const uint32_t sig_cnt = det_ctx->sgh->sig_cnt;
+    SignatureMask *mask_array = det_ctx->sgh->mask_array;
+    SignatureHeader *head_array = det_ctx->sgh->head_array;
+
+    Vector256 pm, sm, r1, r2;
+    /* load the packet mask into each byte of the vector */
+    pm.v = _mm256_set1_epi8(mask);
+
+    /* reset previous run */
+    det_ctx->match_array_cnt = 0;
+
+    for (u = 0; u < sig_cnt; u += 64) {
+        /* load a batch of masks */
+        sm.v = _mm256_load_si256((const __m256i *)&mask_array[u]);
+        /* logical AND them with the packet's mask */
+        r1.v = _mm256_and_si256(pm.v, sm.v);
+        /* compare the result with the original mask */
+        r2.v = _mm256_cmpeq_epi8(sm.v, r1.v);
+        /* convert into a bitarray */
+        bm = (uint64_t)(uint32_t)_mm256_movemask_epi8(r2.v);
+
+        /* load a batch of masks */
+        sm.v = _mm256_load_si256((const __m256i *)&mask_array[u+32]);
+        /* logical AND them with the packet's mask */
+        r1.v = _mm256_and_si256(pm.v, sm.v);
+        /* compare the result with the original mask */
+        r2.v = _mm256_cmpeq_epi8(sm.v, r1.v);
+        /* convert into a bitarray */
+        bm |= ((uint64_t)(uint32_t)_mm256_movemask_epi8(r2.v)) << 32;
+
+        SCLogDebug("bm %016"PRIx64, bm);
+
+        /* the padding at the end of the mask array is 0, so it always
+         * matches. Strip those bits. */
+        if (sig_cnt - u < 64) {
+            bm &= ((uint64_t)1 << (sig_cnt - u)) - 1;
+        }
+
+        while (bm) {
+            uint32_t x = u + (uint32_t)__builtin_ctzll(bm);
+            /* clear the lowest bit set, so it is not found again */
+            bm &= bm - 1;
+
+            SignatureHeader *s = &head_array[x];
+            if (SigMatchSignaturesBuildMatchArrayAddSignature(det_ctx, p, s, alproto) == 1) {
+                /* okay, store it */
+                det_ctx->match_array[det_ctx->match_array_cnt] = s->full_sig;
+                det_ctx->match_array_cnt++;
+            }
+        }
+    }
+}
+ /* end defined(__AVX2__) */
+#elif defined(__SSE3__)
 
 /**
  *  \brief SIMD implementation of mask prefiltering.
@@ -562,6 +632,195 @@ static int SigTestSIMDMask04(void)
     return 1;
 #endif
 }
+
+/** \internal
+ *  \brief set up a sgh with cnt sigs with pseudo random masks. The sigs
+ *         have no flags, so every sig passing the mask check is added to
+ *         the match array. */
+static SigGroupHead *SigTestSIMDMaskSetupSgh(uint32_t cnt, Signature **sigs)
+{
+    uint32_t u, seed = 0x12345678;
+
+    SigGroupHead *sgh = SCMalloc(sizeof(SigGroupHead));
+    if (unlikely(sgh == NULL))
+        return NULL;
+    memset(sgh, 0, sizeof(SigGroupHead));
+
+    *sigs = SCMalloc(cnt * sizeof(Signature));
+    sgh->head_array = SCMalloc(cnt * sizeof(SignatureHeader));
+#if defined(__SSE3__) || defined(__tile__)
+    /* padded to 64 and aligned like SigGroupHeadBuildHeadArray does */
+    uint32_t padded = cnt + ((64 - (cnt % 64)) % 64);
+    sgh->mask_array = SCMallocAligned(padded, 32);
+    if (sgh->mask_array == NULL)
+        return NULL;
+    memset(sgh->mask_array, 0, padded);
+#endif
+    if (*sigs == NULL || sgh->head_array == NULL)
+        return NULL;
+    memset(*sigs, 0, cnt * sizeof(Signature));
+    memset(sgh->head_array, 0, cnt * sizeof(SignatureHeader));
+
+    for (u = 0; u < cnt; u++) {
+        seed = seed * 1103515245 + 12345;
+        /* sparse masks so that a fair part of the sigs pass */
+        SignatureMask m = (SignatureMask)((seed >> 16) & (seed >> 24));
+        (*sigs)[u].num = u;
+        sgh->head_array[u].mask = m;
+        sgh->head_array[u].num = u;
+        sgh->head_array[u].full_sig = &(*sigs)[u];
+#if defined(__SSE3__) || defined(__tile__)
+        sgh->mask_array[u] = m;
+#endif
+    }
+    sgh->sig_cnt = cnt;
+    return sgh;
+}
+
+static void SigTestSIMDMaskFreeSgh(SigGroupHead *sgh, Signature *sigs)
+{
+    if (sgh != NULL) {
+#if defined(__SSE3__) || defined(__tile__)
+        if (sgh->mask_array != NULL)
+            SCFreeAligned(sgh->mask_array);
+#endif
+        if (sgh->head_array != NULL)
+            SCFree(sgh->head_array);
+        SCFree(sgh);
+    }
+    if (sigs != NULL)
+        SCFree(sigs);
+}
+
+/** \internal
+ *  \brief scalar reference for the mask prefilter */
+static uint32_t SigTestSIMDMaskScalar(SigGroupHead *sgh, SignatureMask mask,
+                                      Signature **match_array)
+{
+    uint32_t u, cnt = 0;
+
+    for (u = 0; u < sgh->sig_cnt; u++) {
+        SignatureHeader *s = &sgh->head_array[u];
+        if ((mask & s->mask) == s->mask)
+            match_array[cnt++] = s->full_sig;
+    }
+    return cnt;
+}
+
+/**
+ *  \test the match array built by the (SIMD) prefilter must be the same
+ *         as the scalar one, including for a sig count that isn't a
+ *         multiple of the batch size.
+ */
+static int SigTestSIMDMask05(void)
+{
+    int result = 0;
+    uint32_t cnt = 1000, ref_cnt;
+    Signature *sigs = NULL;
+    Signature **ref = NULL;
+    DetectEngineThreadCtx det_ctx;
+    Packet *p = NULL;
+    int mask;
+
+    memset(&det_ctx, 0, sizeof(det_ctx));
+
+    SigGroupHead *sgh = SigTestSIMDMaskSetupSgh(cnt, &sigs);
+    ref = SCMalloc(cnt * sizeof(Signature *));
+    det_ctx.match_array = SCMalloc(cnt * sizeof(Signature *));
+    p = UTHBuildPacket(NULL, 0, IPPROTO_TCP);
+    if (sgh == NULL || ref == NULL || det_ctx.match_array == NULL || p == NULL)
+        goto end;
+    det_ctx.sgh = sgh;
+
+    for (mask = 0; mask < 256; mask++) {
+        ref_cnt = SigTestSIMDMaskScalar(sgh, (SignatureMask)mask, ref);
+        SigMatchSignaturesBuildMatchArray(&det_ctx, p, (SignatureMask)mask, ALPROTO_UNKNOWN);
+
+        if (det_ctx.match_array_cnt != ref_cnt ||
+            memcmp(det_ctx.match_array, ref, ref_cnt * sizeof(Signature *)) != 0) {
+            printf("mask %02x: %u sigs, expected %u: ", mask,
+                    det_ctx.match_array_cnt, ref_cnt);
+            goto end;
+        }
+    }
+
+    result = 1;
+end:
+    if (p != NULL)
+        UTHFreePacket(p);
+    if (det_ctx.match_array != NULL)
+        SCFree(det_ctx.match_array);
+    if (ref != NULL)
+        SCFree(ref);
+    SigTestSIMDMaskFreeSgh(sgh, sigs);
+    return result;
+}
+
+/*
+ * To print the mask prefilter speed of the compiled in implementation
+ * compared to a scalar loop, uncomment the following line:
+ *
+ *  #define ENABLE_SIMD_MASK_STATS 1
+ */
+
+#ifdef ENABLE_SIMD_MASK_STATS
+#define SIMD_MASK_STATS_SIGS    5000
+#define SIMD_MASK_STATS_RUNS    20000
+
+/** \test print the time spent prefiltering a 5k sig sgh */
+static int SigTestSIMDMaskStats01(void)
+{
+    int result = 0;
+    uint32_t i;
+    uint64_t total = 0;
+    Signature *sigs = NULL;
+    Signature **ref = NULL;
+    DetectEngineThreadCtx det_ctx;
+    Packet *p = NULL;
+    struct timeval start, end;
+
+    memset(&det_ctx, 0, sizeof(det_ctx));
+
+    SigGroupHead *sgh = SigTestSIMDMaskSetupSgh(SIMD_MASK_STATS_SIGS, &sigs);
+    ref = SCMalloc(SIMD_MASK_STATS_SIGS * sizeof(Signature *));
+    det_ctx.match_array = SCMalloc(SIMD_MASK_STATS_SIGS * sizeof(Signature *));
+    p = UTHBuildPacket(NULL, 0, IPPROTO_TCP);
+    if (sgh == NULL || ref == NULL || det_ctx.match_array == NULL || p == NULL)
+        goto end;
+    det_ctx.sgh = sgh;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < SIMD_MASK_STATS_RUNS; i++) {
+        total += SigTestSIMDMaskScalar(sgh, (SignatureMask)i, ref);
+    }
+    gettimeofday(&end, NULL);
+    printf("\nscalar: %u runs in %.3fs (%"PRIu64" sigs)\n", SIMD_MASK_STATS_RUNS,
+            (double)(end.tv_sec - start.tv_sec) +
+            (double)(end.tv_usec - start.tv_usec) / 1000000.0, total);
+
+    total = 0;
+    gettimeofday(&start, NULL);
+    for (i = 0; i < SIMD_MASK_STATS_RUNS; i++) {
+        SigMatchSignaturesBuildMatchArray(&det_ctx, p, (SignatureMask)i, ALPROTO_UNKNOWN);
+        total += det_ctx.match_array_cnt;
+    }
+    gettimeofday(&end, NULL);
+    printf("prefilter: %u runs in %.3fs (%"PRIu64" sigs)\n", SIMD_MASK_STATS_RUNS,
+            (double)(end.tv_sec - start.tv_sec) +
+            (double)(end.tv_usec - start.tv_usec) / 1000000.0, total);
+
+    result = 1;
+end:
+    if (p != NULL)
+        UTHFreePacket(p);
+    if (det_ctx.match_array != NULL)
+        SCFree(det_ctx.match_array);
+    if (ref != NULL)
+        SCFree(ref);
+    SigTestSIMDMaskFreeSgh(sgh, sigs);
+    return result;
+}
+#endif /* ENABLE_SIMD_MASK_STATS */
 #endif /* UNITTESTS */
 
 void DetectSimdRegisterTests(void)
@@ -571,5 +830,9 @@ void DetectSimdRegisterTests(void)
     UtRegisterTest("SigTestSIMDMask02", SigTestSIMDMask02, 1);
     UtRegisterTest("SigTestSIMDMask03", SigTestSIMDMask03, 1);
     UtRegisterTest("SigTestSIMDMask04", SigTestSIMDMask04, 1);
+    UtRegisterTest("SigTestSIMDMask05", SigTestSIMDMask05, 1);
+#ifdef ENABLE_SIMD_MASK_STATS
+    UtRegisterTest("SigTestSIMDMaskStats01", SigTestSIMDMaskStats01, 1);
+#endif
 #endif /* UNITTESTS */
 }
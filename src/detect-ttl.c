@@ -46,6 +46,8 @@ int DetectTtlMatch (ThreadVars *, DetectEngineThreadCtx *, Packet *, Signature *
 static int DetectTtlSetup (DetectEngineCtx *, Signature *, char *);
 void DetectTtlFree (void *);
 void DetectTtlRegisterTests (void);
+static int PrefilterTtlGetValue(Packet *);
+static int PrefilterTtlMatchValue(uint8_t, void *);
 
 /**
  * \brief Registration function for ttl: keyword
@@ -60,6 +62,8 @@ void DetectTtlRegister(void)
     sigmatch_table[DETECT_TTL].Setup = DetectTtlSetup;
     sigmatch_table[DETECT_TTL].Free = DetectTtlFree;
     sigmatch_table[DETECT_TTL].RegisterTests = DetectTtlRegisterTests;
+    sigmatch_table[DETECT_TTL].PrefilterGetValue = PrefilterTtlGetValue;
+    sigmatch_table[DETECT_TTL].PrefilterMatchValue = PrefilterTtlMatchValue;
 
     const char *eb;
     int eo;
@@ -84,6 +88,40 @@ error:
     return;
 }
 
+static inline int TtlMatch(const uint8_t pttl, const DetectTtlData *ttld)
+{
+    if (ttld->mode == DETECT_TTL_EQ && pttl == ttld->ttl1)
+        return 1;
+    else if (ttld->mode == DETECT_TTL_LT && pttl < ttld->ttl1)
+        return 1;
+    else if (ttld->mode == DETECT_TTL_GT && pttl > ttld->ttl1)
+        return 1;
+    else if (ttld->mode == DETECT_TTL_RA && (pttl > ttld->ttl1 && pttl < ttld->ttl2))
+        return 1;
+
+    return 0;
+}
+
+/** \internal
+ *  \brief get the ttl for the prefilter, -1 if the packet has none */
+static int PrefilterTtlGetValue(Packet *p)
+{
+    if (PKT_IS_PSEUDOPKT(p))
+        return -1;
+
+    if (PKT_IS_IPV4(p)) {
+        return IPV4_GET_IPTTL(p);
+    } else if (PKT_IS_IPV6(p)) {
+        return IPV6_GET_HLIM(p);
+    }
+    return -1;
+}
+
+static int PrefilterTtlMatchValue(uint8_t pttl, void *ctx)
+{
+    return TtlMatch(pttl, (const DetectTtlData *)ctx);
+}
+
 /**
  * \brief This function is used to match TTL rule option on a packet with those passed via ttl:
  *
@@ -97,33 +135,13 @@ error:
  */
 int DetectTtlMatch (ThreadVars *t, DetectEngineThreadCtx *det_ctx, Packet *p, Signature *s, SigMatch *m)
 {
-
-    int ret = 0;
-    uint8_t pttl;
-    DetectTtlData *ttld = (DetectTtlData *) m->ctx;
-
-    if (PKT_IS_PSEUDOPKT(p))
-        return 0;
-
-    if (PKT_IS_IPV4(p)) {
-        pttl = IPV4_GET_IPTTL(p);
-    } else if (PKT_IS_IPV6(p)) {
-        pttl = IPV6_GET_HLIM(p);
-    } else {
+    int pttl = PrefilterTtlGetValue(p);
+    if (pttl < 0) {
         SCLogDebug("Packet is of not IPv4 or IPv6");
-        return ret;
+        return 0;
     }
 
-    if (ttld->mode == DETECT_TTL_EQ && pttl == ttld->ttl1)
-        ret = 1;
-    else if (ttld->mode == DETECT_TTL_LT && pttl < ttld->ttl1)
-        ret = 1;
-    else if (ttld->mode == DETECT_TTL_GT && pttl > ttld->ttl1)
-        ret = 1;
-    else if (ttld->mode == DETECT_TTL_RA && (pttl > ttld->ttl1 && pttl < ttld->ttl2))
-        ret = 1;
-
-    return ret;
+    return TtlMatch((uint8_t)pttl, (const DetectTtlData *)m->ctx);
 }
 
 /**
@@ -39,6 +39,7 @@
 #include "detect-engine-address.h"
 #include "detect-engine-proto.h"
 #include "detect-engine-port.h"
+#include "detect-engine-prefilter.h"
 #include "detect-engine-mpm.h"
 #include "detect-engine-iponly.h"
 #include "detect-engine-threshold.h"
@@ -547,6 +548,15 @@ int SigMatchSignaturesBuildMatchArrayAddSignature(DetectEngineThreadCtx *det_ctx
         }
     }
 
+    /* filter out sigs that a prefilter engine didn't pass */
+    if (s->flags & SIG_FLAG_PREFILTER) {
+        if (likely(det_ctx->prefilter_sig_array != NULL) &&
+            det_ctx->prefilter_sig_array[s->num] != det_ctx->prefilter_id) {
+            SCLogDebug("sig %"PRIu32" kicked out by prefilter", s->num);
+            return 0;
+        }
+    }
+
     /* de_state check, filter out all signatures that already had a match before
      * or just partially match */
     if (s->flags & SIG_FLAG_STATE_MATCH) {
@@ -1034,65 +1044,36 @@ static void DebugInspectIds(Packet *p, Flow *f, StreamMsg *smsg)
 
 static void AlertDebugLogModeSyncFlowbitsNamesToPacketStruct(Packet *p, DetectEngineCtx *de_ctx)
 {
-#define MALLOC_JUMP 5
-
+    FlowBits *fb = p->flow->flowbits;
+    uint32_t idx;
     int i = 0;
 
-    GenericVar *gv = p->flow->flowvar;
+    if (fb == NULL)
+        return;
 
-    while (gv != NULL) {
-        i++;
-        gv = gv->next;
+    for (idx = 0; idx < (uint32_t)fb->size * 8; idx++) {
+        if (fb->bits[idx >> 3] & (1 << (idx & 7)))
+            i++;
     }
     if (i == 0)
         return;
 
-    p->debuglog_flowbits_names_len = i;
-
-    p->debuglog_flowbits_names = SCMalloc(sizeof(char *) *
-                                          p->debuglog_flowbits_names_len);
+    p->debuglog_flowbits_names = SCMalloc(sizeof(char *) * i);
     if (p->debuglog_flowbits_names == NULL) {
         return;
     }
-    memset(p->debuglog_flowbits_names, 0,
-           sizeof(char *) * p->debuglog_flowbits_names_len);
+    memset(p->debuglog_flowbits_names, 0, sizeof(char *) * i);
+    p->debuglog_flowbits_names_len = i;
 
     i = 0;
-    gv = p->flow->flowvar;
-    while (gv != NULL) {
-        if (gv->type != DETECT_FLOWBITS) {
-            gv = gv->next;
+    for (idx = 0; idx < (uint32_t)fb->size * 8; idx++) {
+        if (!(fb->bits[idx >> 3] & (1 << (idx & 7))))
             continue;
-        }
 
-        FlowBit *fb = (FlowBit *) gv;
-        char *name = VariableIdxGetName(de_ctx, fb->idx, fb->type);
+        char *name = VariableIdxGetName(de_ctx, idx, DETECT_FLOWBITS);
         if (name != NULL) {
-            p->debuglog_flowbits_names[i] = SCStrdup(name);
-            if (p->debuglog_flowbits_names[i] == NULL) {
-                return;
-            }
-            i++;
+            p->debuglog_flowbits_names[i++] = name;
         }
-
-        if (i == p->debuglog_flowbits_names_len) {
-            p->debuglog_flowbits_names_len += MALLOC_JUMP;
-            const char **names = SCRealloc(p->debuglog_flowbits_names,
-                                                   sizeof(char *) *
-                                                   p->debuglog_flowbits_names_len);
-            if (names == NULL) {
-                SCFree(p->debuglog_flowbits_names);
-                p->debuglog_flowbits_names = NULL;
-                p->debuglog_flowbits_names_len = 0;
-                return;
-            }
-            p->debuglog_flowbits_names = names;
-            memset(p->debuglog_flowbits_names +
-                   p->debuglog_flowbits_names_len - MALLOC_JUMP,
-                   0, sizeof(char *) * MALLOC_JUMP);
-        }
-
-        gv = gv->next;
     }
 
     return;
@@ -1154,6 +1135,7 @@ int SigMatchSignatures(ThreadVars *th_v, DetectEngineCtx *de_ctx, DetectEngineTh
             if (pflow->de_ctx_id == 0) {
                 /* first time this flow is inspected, set id */
                 pflow->de_ctx_id = de_ctx->id;
+                pflow->flowbits_map = de_ctx->flowbits_map;
             } else if (pflow->de_ctx_id != de_ctx->id) {
                 /* first time we inspect flow with this de_ctx, reset */
                 pflow->flags &= ~FLOW_SGH_TOSERVER;
@@ -1165,6 +1147,8 @@ int SigMatchSignatures(ThreadVars *th_v, DetectEngineCtx *de_ctx, DetectEngineTh
                 pflow->de_ctx_id = de_ctx->id;
                 GenericVarFree(pflow->flowvar);
                 pflow->flowvar = NULL;
+                /* flowbits survive the swap, move them to the new idx's */
+                FlowBitsRemap(pflow, de_ctx->flowbits_map);
             }
 
             /* set the iponly stuff */
@@ -1204,7 +1188,10 @@ int SigMatchSignatures(ThreadVars *th_v, DetectEngineCtx *de_ctx, DetectEngineTh
                 (p->proto == IPPROTO_UDP) ||
                 (p->proto == IPPROTO_SCTP && (p->flowflags & FLOW_PKT_ESTABLISHED)))
             {
-                has_state = (FlowGetAppState(pflow) != NULL);
+                /* a stream bypassed flow gets no more app layer data, so
+                 * its state has nothing new to inspect */
+                has_state = (FlowGetAppState(pflow) != NULL &&
+                             !(pflow->flags & FLOW_STREAM_BYPASS));
                 alproto = FlowGetAppProtocol(pflow);
                 alversion = AppLayerParserGetStateVersion(pflow->alparser);
                 SCLogDebug("alstate %s, alproto %u", has_state ? "true" : "false", alproto);
@@ -1268,6 +1255,9 @@ int SigMatchSignatures(ThreadVars *th_v, DetectEngineCtx *de_ctx, DetectEngineTh
             PACKET_PROFILING_DETECT_START(p, PROF_DETECT_GETSGH);
             det_ctx->sgh = SigMatchSignaturesGetSgh(de_ctx, det_ctx, p);
             PACKET_PROFILING_DETECT_END(p, PROF_DETECT_GETSGH);
+            SCPerfCounterIncr(det_ctx->counter_sgh_cache_miss, det_ctx->tv->sc_perf_pca);
+        } else {
+            SCPerfCounterIncr(det_ctx->counter_sgh_cache_hit, det_ctx->tv->sc_perf_pca);
         }
 
 #ifdef DEBUG
@@ -1324,6 +1314,10 @@ int SigMatchSignatures(ThreadVars *th_v, DetectEngineCtx *de_ctx, DetectEngineTh
     PACKET_PROFILING_DETECT_END(p, PROF_DETECT_MPM);
 
     PACKET_PROFILING_DETECT_START(p, PROF_DETECT_PREFILTER);
+    /* run the prefilter engines of the sigs without mpm */
+    if (det_ctx->sgh->prefilter_engines != NULL) {
+        DetectPrefilterRun(det_ctx, p);
+    }
     /* build the match array */
     SigMatchSignaturesBuildMatchArray(det_ctx, p, mask, alproto);
     PACKET_PROFILING_DETECT_END(p, PROF_DETECT_PREFILTER);
@@ -3990,12 +3984,21 @@ int SigAddressPrepareStage4(DetectEngineCtx *de_ctx)
 
     uint32_t idx = 0;
 
+    /* flag the sigs using a prefilter engine before the head arrays
+     * copy the sig flags */
+    Signature *s = de_ctx->sig_list;
+    for ( ; s != NULL; s = s->next) {
+        DetectPrefilterSetupSignature(s);
+    }
+
     for (idx = 0; idx < de_ctx->sgh_array_cnt; idx++) {
         SigGroupHead *sgh = de_ctx->sgh_array[idx];
         if (sgh == NULL)
             continue;
 
         SigGroupHeadBuildHeadArray(de_ctx, sgh);
+        if (DetectPrefilterBuildEngines(de_ctx, sgh) != 0)
+            SCReturnInt(-1);
         SigGroupHeadSetFilemagicFlag(de_ctx, sgh);
         SigGroupHeadSetFileMd5Flag(de_ctx, sgh);
         SigGroupHeadSetFilesizeFlag(de_ctx, sgh);
@@ -4005,6 +4008,8 @@ int SigAddressPrepareStage4(DetectEngineCtx *de_ctx)
 
     if (de_ctx->decoder_event_sgh != NULL) {
         SigGroupHeadBuildHeadArray(de_ctx, de_ctx->decoder_event_sgh);
+        if (DetectPrefilterBuildEngines(de_ctx, de_ctx->decoder_event_sgh) != 0)
+            SCReturnInt(-1);
         /* no need to set filestore count here as that would make a
          * signature not decode event only. */
     }
@@ -4016,6 +4021,78 @@ int SigAddressPrepareStage4(DetectEngineCtx *de_ctx)
     SCReturnInt(0);
 }
 
+/** \internal
+ *  \brief compile the port lists hanging off a destination address list */
+static int SigAddressCompileLookupsPorts(DetectAddress *list)
+{
+    DetectAddress *ag;
+    DetectPort *sp;
+
+    for (ag = list; ag != NULL; ag = ag->next) {
+        if (DetectPortCompileList(ag->port) != 0)
+            return -1;
+
+        for (sp = ag->port; sp != NULL; sp = sp->next) {
+            if (DetectPortCompileList(sp->dst_ph) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/** \internal
+ *  \brief compile the destination heads hanging off a source address list */
+static int SigAddressCompileLookupsDst(DetectAddress *list)
+{
+    DetectAddress *ag;
+
+    for (ag = list; ag != NULL; ag = ag->next) {
+        DetectAddressHead *dst_gh = ag->dst_gh;
+        if (dst_gh == NULL)
+            continue;
+
+        if (DetectAddressHeadCompile(dst_gh) != 0)
+            return -1;
+        if (SigAddressCompileLookupsPorts(dst_gh->any_head) != 0 ||
+            SigAddressCompileLookupsPorts(dst_gh->ipv4_head) != 0 ||
+            SigAddressCompileLookupsPorts(dst_gh->ipv6_head) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ *  \brief Compile the address and port lists used by
+ *         SigMatchSignaturesGetSgh() into sorted range arrays, so that
+ *         the per packet lookups are binary searches instead of list walks.
+ *
+ *  \param de_ctx detection engine ctx
+ *
+ *  \retval 0 ok
+ *  \retval -1 error
+ */
+int SigAddressCompileLookups(DetectEngineCtx *de_ctx)
+{
+    int f, proto;
+
+    for (f = 0; f < FLOW_STATES; f++) {
+        for (proto = 0; proto < 256; proto++) {
+            DetectAddressHead *src_gh = de_ctx->flow_gh[f].src_gh[proto];
+            if (src_gh == NULL)
+                continue;
+
+            if (DetectAddressHeadCompile(src_gh) != 0)
+                return -1;
+            if (SigAddressCompileLookupsDst(src_gh->any_head) != 0 ||
+                SigAddressCompileLookupsDst(src_gh->ipv4_head) != 0 ||
+                SigAddressCompileLookupsDst(src_gh->ipv6_head) != 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
 /* shortcut for debugging. If enabled Stage5 will
  * print sigid's for all groups */
 #define PRINTSIGS
@@ -4337,9 +4414,38 @@ int SigAddressPrepareStage5(DetectEngineCtx *de_ctx)
  * \retval  0 On Success.
  * \retval -1 On failure.
  */
+/** stages of SigGroupBuild, for the timing summary */
+enum {
+    SGB_STAGE_FP = 0,
+    SGB_STAGE_1,
+    SGB_STAGE_2,
+    SGB_STAGE_3,
+    SGB_STAGE_4,
+    SGB_STAGE_MPM,
+    SGB_STAGE_MAX,
+};
+
+/**
+ * \brief Store the msecs since *tv in *msec and reset *tv to now.
+ */
+static void SigGroupBuildStageTime(struct timeval *tv, uint64_t *msec)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    *msec = ((now.tv_sec - tv->tv_sec) * 1000) +
+        (((1000000 + now.tv_usec - tv->tv_usec) / 1000) - 1000);
+    *tv = now;
+}
+
 int SigGroupBuild(DetectEngineCtx *de_ctx)
 {
     Signature *s = de_ctx->sig_list;
+    uint64_t stage_msec[SGB_STAGE_MAX];
+    struct timeval tv;
+
+    memset(&stage_msec, 0, sizeof(stage_msec));
+    gettimeofday(&tv, NULL);
 
     /* Assign the unique order id of signatures after sorting,
      * so the IP Only engine process them in order too.  Also
@@ -4356,30 +4462,45 @@ int SigGroupBuild(DetectEngineCtx *de_ctx)
     if (DetectSetFastPatternAndItsId(de_ctx) < 0)
         return -1;
 
+    /* all flowbit idx's are assigned now, record them for the flows */
+    FlowBitsMapRelease(de_ctx->flowbits_map);
+    de_ctx->flowbits_map = FlowBitsMapBuild(de_ctx);
+    if (de_ctx->flowbits_map == NULL)
+        return -1;
+
     /* if we are using single sgh_mpm_context then let us init the standard mpm
      * contexts using the mpm_ctx factory */
     if (de_ctx->sgh_mpm_context == ENGINE_SGH_MPM_FACTORY_CONTEXT_SINGLE) {
         SigInitStandardMpmFactoryContexts(de_ctx);
     }
+    SigGroupBuildStageTime(&tv, &stage_msec[SGB_STAGE_FP]);
 
     if (SigAddressPrepareStage1(de_ctx) != 0) {
         SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
         exit(EXIT_FAILURE);
     }
+    SigGroupBuildStageTime(&tv, &stage_msec[SGB_STAGE_1]);
 //exit(0);
     if (SigAddressPrepareStage2(de_ctx) != 0) {
         SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
         exit(EXIT_FAILURE);
     }
+    SigGroupBuildStageTime(&tv, &stage_msec[SGB_STAGE_2]);
 
     if (SigAddressPrepareStage3(de_ctx) != 0) {
         SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
         exit(EXIT_FAILURE);
     }
+    SigGroupBuildStageTime(&tv, &stage_msec[SGB_STAGE_3]);
     if (SigAddressPrepareStage4(de_ctx) != 0) {
         SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
         exit(EXIT_FAILURE);
     }
+    if (SigAddressCompileLookups(de_ctx) != 0) {
+        SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
+        exit(EXIT_FAILURE);
+    }
+    SigGroupBuildStageTime(&tv, &stage_msec[SGB_STAGE_4]);
 
     if (de_ctx->sgh_mpm_context == ENGINE_SGH_MPM_FACTORY_CONTEXT_SINGLE) {
         MpmCtx *mpm_ctx = NULL;
@@ -4404,178 +4525,117 @@ int SigGroupBuild(DetectEngineCtx *de_ctx)
 #endif
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_proto_tcp_packet, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_proto_tcp_packet, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("packet- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_proto_udp_packet, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_proto_udp_packet, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("packet- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_proto_other_packet, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("packet- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_uri, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_uri, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("uri- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hcbd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hcbd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hcbd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hsbd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hsbd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hsbd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hhd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hhd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hhd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hrhd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hrhd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hrhd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hmd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hmd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hmd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hcd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hcd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hcd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hrud, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hrud, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hrud- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_stream, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_stream, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("stream- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hsmd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hsmd- %d\n", mpm_ctx->pattern_cnt);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hsmd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hsmd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hscd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hscd- %d\n", mpm_ctx->pattern_cnt);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hscd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hscd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_huad, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("huad- %d\n", mpm_ctx->pattern_cnt);
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_huad, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("huad- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hhhd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hhhd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hhhd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hhhd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hrhhd, 0);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hrhhd- %d\n", mpm_ctx->pattern_cnt);
 
         mpm_ctx = MpmFactoryGetMpmCtxForProfile(de_ctx, de_ctx->sgh_mpm_context_hrhhd, 1);
-        if (mpm_table[de_ctx->mpm_matcher].Prepare != NULL) {
-            mpm_table[de_ctx->mpm_matcher].Prepare(mpm_ctx);
-        }
+        MpmStoreQueueCtx(de_ctx, mpm_ctx);
         //printf("hrhhd- %d\n", mpm_ctx->pattern_cnt);
 
+        if (MpmStorePrepareQueued(de_ctx) != 0) {
+            SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
+            exit(EXIT_FAILURE);
+        }
+
 #ifdef __SC_CUDA_SUPPORT__
         if (PatternMatchDefaultMatcher() == MPM_AC_CUDA) {
             int r = SCCudaCtxPopCurrent(NULL);
@@ -4590,6 +4650,29 @@ int SigGroupBuild(DetectEngineCtx *de_ctx)
         DetermineCudaStateTableSize(de_ctx);
 #endif
 
+    } else if (de_ctx->sgh_mpm_context == ENGINE_SGH_MPM_FACTORY_CONTEXT_FULL) {
+        if (MpmStorePrepareQueued(de_ctx) != 0) {
+            SCLogError(SC_ERR_DETECT_PREPARE, "initializing the detection engine failed");
+            exit(EXIT_FAILURE);
+        }
+        MpmStoreReportStats(de_ctx);
+    }
+    SigGroupBuildStageTime(&tv, &stage_msec[SGB_STAGE_MPM]);
+
+    if (!(de_ctx->flags & DE_QUIET)) {
+        uint64_t total = 0;
+        int i;
+        for (i = 0; i < SGB_STAGE_MAX; i++)
+            total += stage_msec[i];
+
+        SCLogInfo("signature group build took %"PRIu64" ms: fast pattern "
+                "%"PRIu64" ms, stage 1 %"PRIu64" ms, stage 2 %"PRIu64" ms, "
+                "stage 3 %"PRIu64" ms, stage 4 %"PRIu64" ms, mpm prepare "
+                "%"PRIu64" ms (%"PRIu16" threads)", total,
+                stage_msec[SGB_STAGE_FP], stage_msec[SGB_STAGE_1],
+                stage_msec[SGB_STAGE_2], stage_msec[SGB_STAGE_3],
+                stage_msec[SGB_STAGE_4], stage_msec[SGB_STAGE_MPM],
+                de_ctx->prepare_threads);
     }
 
 //    SigAddressPrepareStage5(de_ctx);
@@ -10945,6 +11028,89 @@ end:
     return result;
 }
 
+/** \test per flow sgh cache: first packet per direction does the lookup,
+ *        later packets use the stored sgh until the de_ctx changes */
+static int SigTestDetectSghCacheCounter(void)
+{
+    Packet *p = NULL;
+    Flow f;
+    ThreadVars tv;
+    DetectEngineThreadCtx *det_ctx = NULL;
+    int result = 0;
+
+    memset(&tv, 0, sizeof(tv));
+    memset(&f, 0, sizeof(f));
+    FLOW_INITIALIZE(&f);
+    f.proto = IPPROTO_TCP;
+    f.flags |= FLOW_IPV4;
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    if (de_ctx == NULL) {
+        goto end;
+    }
+
+    de_ctx->mpm_matcher = MPM_B2G;
+    de_ctx->flags |= DE_QUIET;
+
+    de_ctx->sig_list = SigInit(de_ctx, "alert tcp any any -> any any (msg:\"Test sgh cache\"; "
+                               "content:\"boo\"; sid:1;)");
+    if (de_ctx->sig_list == NULL) {
+        goto end;
+    }
+
+    SigGroupBuild(de_ctx);
+    tv.name = "detect_test";
+    DetectEngineThreadCtxInit(&tv, de_ctx, (void *)&det_ctx);
+
+    /* init counters */
+    tv.sc_perf_pca = SCPerfGetAllCountersArray(&tv.sc_perf_pctx);
+    SCPerfAddToClubbedTMTable((tv.thread_group_name != NULL) ?
+            tv.thread_group_name : tv.name, &tv.sc_perf_pctx);
+
+    p = UTHBuildPacket((uint8_t *)"boo", strlen("boo"), IPPROTO_TCP);
+    p->flow = &f;
+    p->flags |= PKT_HAS_FLOW;
+    p->flowflags |= FLOW_PKT_TOSERVER;
+
+    Detect(&tv, p, det_ctx, NULL, NULL);
+    Detect(&tv, p, det_ctx, NULL, NULL);
+    if (SCPerfGetLocalCounterValue(det_ctx->counter_sgh_cache_miss, tv.sc_perf_pca) != 1 ||
+        SCPerfGetLocalCounterValue(det_ctx->counter_sgh_cache_hit, tv.sc_perf_pca) != 1) {
+        printf("toserver: expected 1 miss and 1 hit: ");
+        goto end;
+    }
+
+    p->flowflags &= ~FLOW_PKT_TOSERVER;
+    p->flowflags |= FLOW_PKT_TOCLIENT;
+    Detect(&tv, p, det_ctx, NULL, NULL);
+    if (SCPerfGetLocalCounterValue(det_ctx->counter_sgh_cache_miss, tv.sc_perf_pca) != 2) {
+        printf("toclient: expected 2 misses: ");
+        goto end;
+    }
+
+    /* a rule swap gives us a new de_ctx id, the stored sgh's are dropped */
+    f.de_ctx_id = de_ctx->id + 1;
+    Detect(&tv, p, det_ctx, NULL, NULL);
+    if (SCPerfGetLocalCounterValue(det_ctx->counter_sgh_cache_miss, tv.sc_perf_pca) != 3 ||
+        SCPerfGetLocalCounterValue(det_ctx->counter_sgh_cache_hit, tv.sc_perf_pca) != 1) {
+        printf("after de_ctx change: expected 3 misses and 1 hit: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    UTHFreePackets(&p, 1);
+    if (de_ctx != NULL) {
+        SigGroupCleanup(de_ctx);
+        SigCleanSignatures(de_ctx);
+        if (det_ctx != NULL)
+            DetectEngineThreadCtxDeinit(&tv, (void *)det_ctx);
+        DetectEngineCtxFree(de_ctx);
+    }
+    FLOW_DESTROY(&f);
+    return result;
+}
+
 /** \test test if the engine set flag to drop pkts of a flow that
  *        triggered a drop action on IPS mode */
 static int SigTestDropFlow01(void)
@@ -11954,6 +12120,7 @@ void SigRegisterTests(void)
     UtRegisterTest("SigTestDepthOffset01Wm", SigTestDepthOffset01Wm, 1);
 
     UtRegisterTest("SigTestDetectAlertCounter", SigTestDetectAlertCounter, 1);
+    UtRegisterTest("SigTestDetectSghCacheCounter", SigTestDetectSghCacheCounter, 1);
 
     UtRegisterTest("SigTestDropFlow01", SigTestDropFlow01, 1);
     UtRegisterTest("SigTestDropFlow02", SigTestDropFlow02, 1);
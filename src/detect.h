@@ -187,11 +187,33 @@ typedef struct DetectAddress_ {
     uint32_t cnt;
 } DetectAddress;
 
+/** compiled lookup entry for an ipv4 address group, range in host order */
+typedef struct DetectAddressLookupIPv4_ {
+    uint32_t ip;
+    uint32_t ip2;
+    DetectAddress *ag;
+} DetectAddressLookupIPv4;
+
+/** compiled lookup entry for an ipv6 address group, range in host order */
+typedef struct DetectAddressLookupIPv6_ {
+    uint32_t ip[4];
+    uint32_t ip2[4];
+    DetectAddress *ag;
+} DetectAddressLookupIPv6;
+
 /** Signature grouping head. Here 'any', ipv4 and ipv6 are split out */
 typedef struct DetectAddressHead_ {
     DetectAddress *any_head;
     DetectAddress *ipv4_head;
     DetectAddress *ipv6_head;
+
+    /** sorted range arrays compiled from the ipv4 and ipv6 lists once
+     *  the sgh build is done, so the per packet lookup can use a binary
+     *  search. NULL if the list wasn't compiled. */
+    DetectAddressLookupIPv4 *ipv4_lookup;
+    DetectAddressLookupIPv6 *ipv6_lookup;
+    uint32_t ipv4_lookup_cnt;
+    uint32_t ipv6_lookup_cnt;
 } DetectAddressHead;
 
 
@@ -228,6 +250,13 @@ enum {
 #define PORT_SIGGROUPHEAD_COPY  0x04 /**< sgh is a ptr copy */
 #define PORT_GROUP_PORTS_COPY   0x08 /**< dst_ph is a ptr copy */
 
+/** \brief compiled lookup entry for a port group, covering [port, port2] */
+typedef struct DetectPortLookupEntry_ {
+    uint16_t port;
+    uint16_t port2;
+    struct DetectPort_ *dp;
+} DetectPortLookupEntry;
+
 /** \brief Port structure for detection engine */
 typedef struct DetectPort_ {
     uint16_t port;
@@ -238,6 +267,11 @@ typedef struct DetectPort_ {
 
     struct DetectPort_ *dst_ph;
 
+    /** sorted range array compiled from the list this port heads, only
+     *  set on the first port of a list */
+    DetectPortLookupEntry *lookup;
+    uint32_t lookup_cnt;
+
     /* double linked list */
     union {
         struct DetectPort_ *prev;
@@ -281,6 +315,8 @@ typedef struct DetectPort_ {
 
 #define SIG_FLAG_TLSSTORE               (1<<21)
 
+#define SIG_FLAG_PREFILTER              (1<<22) /**< signature is narrowed down by a prefilter engine of its sgh */
+
 /* signature init flags */
 #define SIG_FLAG_INIT_DEONLY         1  /**< decode event only signature */
 #define SIG_FLAG_INIT_PACKET         (1<<1)  /**< signature has matches against a packet (as opposed to app layer) */
@@ -629,6 +665,10 @@ typedef struct DetectEngineCtx_ {
     HashListTable *variable_names;
     HashListTable *variable_idxs;
     uint16_t variable_names_idx;
+    /** flowbits get their own, dense, idx space */
+    uint16_t variable_flowbits_idx;
+    /** flowbits layout for the flows inspected by this ctx */
+    struct FlowBitsMap_ *flowbits_map;
 
     /* hash table used to cull out duplicate sigs */
     HashListTable *dup_sig_hash_table;
@@ -667,12 +707,23 @@ typedef struct DetectEngineCtx_ {
     /* specify the configuration for mpm context factory */
     uint8_t sgh_mpm_context;
 
+    /** threads used to prepare the queued mpm ctxs */
+    uint16_t prepare_threads;
+
+    /** detect-engine.cache-dir, NULL if the cache is disabled */
+    char *cache_dir;
+    /** hash of the rules, see DetectEngineCacheKeyUpdate() */
+    uint64_t cache_key;
+    struct DetectEngineCache_ *cache;
+
     /** hash table for looking up patterns for
      *  id sharing and id tracking. */
     MpmPatternIdStore *mpm_pattern_id_store;
     uint16_t max_fp_id;
 
     MpmCtxFactoryContainer *mpm_ctx_factory_container;
+    /** mpm ctxs shared between sgh's in "full" sgh mpm mode */
+    MpmStore *mpm_store;
 
     /* maximum recursion depth for content inspection */
     int inspection_recursion_limit;
@@ -804,6 +855,9 @@ typedef struct DetectionEngineThreadCtx_ {
 
     /** id for alert counter */
     uint16_t counter_alerts;
+    /** ids for the per flow sgh cache counters */
+    uint16_t counter_sgh_cache_hit;
+    uint16_t counter_sgh_cache_miss;
 
     /* used to discontinue any more matching */
     uint16_t discontinue_matching;
@@ -832,6 +886,11 @@ typedef struct DetectionEngineThreadCtx_ {
     SigIntId de_state_sig_array_len;
     uint8_t *de_state_sig_array;
 
+    /** prefilter engine results, indexed by sig num. A sig passed the
+     *  prefilter of the current packet if its entry is prefilter_id. */
+    uint32_t *prefilter_sig_array;
+    uint32_t prefilter_id;
+
     struct SigGroupHead_ *sgh;
     /** pointer to the current mpm ctx that is stored
      *  in a rule group head -- can be either a content
@@ -901,6 +960,12 @@ typedef struct SigTableElmt_ {
     void (*Free)(void *);
     void (*RegisterTests)(void);
 
+    /** prefilter support, see detect-engine-prefilter.c. Get the value
+     *  the keyword inspects from the packet, -1 if it can't match. */
+    int (*PrefilterGetValue)(Packet *);
+    /** prefilter support: does the keyword ctx match this value */
+    int (*PrefilterMatchValue)(uint8_t, void *);
+
     uint8_t flags;
     char *name;     /**< keyword name alias */
     char *alias;    /**< name alias */
@@ -975,6 +1040,9 @@ typedef struct SigGroupHead_ {
      *  signatures to be inspected in a cache efficient way. */
     SignatureHeader *head_array;
 
+    /** prefilter engines for the sigs in this group that have no mpm */
+    struct DetectPrefilterEngine_ *prefilter_engines;
+
     /* pattern matcher instances */
     MpmCtx *mpm_proto_other_ctx;
 
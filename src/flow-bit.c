@@ -20,11 +20,9 @@
  *
  * \author Victor Julien <victor@inliniac.net>
  *
- * Implements per flow bits. Actually, not a bit,
- * but called that way because of Snort's flowbits.
- * It's a binary storage.
+ * Implements per flow bits, named after Snort's flowbits. The bits
+ * are stored in a per flow bitmap indexed by the flowbit idx.
  *
- * \todo move away from a linked list implementation
  * \todo use different datatypes, such as string, int, etc.
  * \todo have more than one instance of the same var, and be able to match on a
  *       specific one, or one all at a time. So if a certain capture matches
@@ -39,78 +37,231 @@
 #include "flow-private.h"
 #include "detect.h"
 #include "util-var.h"
+#include "util-var-name.h"
 #include "util-debug.h"
 #include "util-unittest.h"
 
-/* get the flowbit with idx from the flow */
-static FlowBit *FlowBitGet(Flow *f, uint16_t idx)
+static int FlowBitsMapNameCompare(const void *a, const void *b)
 {
-    GenericVar *gv = f->flowvar;
-    for ( ; gv != NULL; gv = gv->next) {
-        if (gv->type == DETECT_FLOWBITS && gv->idx == idx) {
-            return (FlowBit *)gv;
-        }
+    const FlowBitsMapName *na = a;
+    const FlowBitsMapName *nb = b;
+    return strcmp(na->name, nb->name);
+}
+
+/**
+ *  \brief Build the flowbits map for a detection engine ctx
+ *
+ *  Called after all rules are loaded, so all flowbit idx's are assigned.
+ *
+ *  \retval map the map with a reference held for the caller
+ *  \retval NULL on error
+ */
+FlowBitsMap *FlowBitsMapBuild(DetectEngineCtx *de_ctx)
+{
+    FlowBitsMap *map = SCMalloc(sizeof(FlowBitsMap));
+    if (unlikely(map == NULL))
+        return NULL;
+    memset(map, 0, sizeof(FlowBitsMap));
+    SC_ATOMIC_INIT(map->refcnt);
+    (void) SC_ATOMIC_SET(map->refcnt, 1);
+
+    map->max_idx = de_ctx->variable_flowbits_idx;
+    if (map->max_idx == 0)
+        return map;
+
+    map->names = SCMalloc((map->max_idx + 1) * sizeof(char *));
+    map->sorted = SCMalloc(map->max_idx * sizeof(FlowBitsMapName));
+    if (map->names == NULL || map->sorted == NULL)
+        goto error;
+    memset(map->names, 0, (map->max_idx + 1) * sizeof(char *));
+
+    uint32_t idx;
+    for (idx = 1; idx <= map->max_idx; idx++) {
+        map->names[idx] = VariableIdxGetName(de_ctx, idx, DETECT_FLOWBITS);
+        if (map->names[idx] == NULL)
+            goto error;
+
+        map->sorted[idx - 1].name = map->names[idx];
+        map->sorted[idx - 1].idx = idx;
     }
+    qsort(map->sorted, map->max_idx, sizeof(FlowBitsMapName),
+            FlowBitsMapNameCompare);
 
+    return map;
+error:
+    FlowBitsMapRelease(map);
     return NULL;
 }
 
-/* add a flowbit to the flow */
+/** \brief release a reference to a map, freeing it if it was the last */
+void FlowBitsMapRelease(FlowBitsMap *map)
+{
+    if (map == NULL)
+        return;
+
+    if (SC_ATOMIC_SUB(map->refcnt, 1) != 0)
+        return;
+
+    if (map->names != NULL) {
+        uint32_t idx;
+        for (idx = 1; idx <= map->max_idx; idx++) {
+            if (map->names[idx] != NULL)
+                SCFree(map->names[idx]);
+        }
+        SCFree(map->names);
+    }
+    if (map->sorted != NULL)
+        SCFree(map->sorted);
+
+    SC_ATOMIC_DESTROY(map->refcnt);
+    SCFree(map);
+}
+
+/**
+ *  \brief get the idx of a flowbit in a map by name
+ *
+ *  \retval idx or 0 if the map has no flowbit with this name
+ */
+uint16_t FlowBitsMapLookup(FlowBitsMap *map, const char *name)
+{
+    if (map == NULL || map->max_idx == 0)
+        return 0;
+
+    FlowBitsMapName key = { (char *)name, 0 };
+    FlowBitsMapName *r = bsearch(&key, map->sorted, map->max_idx,
+            sizeof(FlowBitsMapName), FlowBitsMapNameCompare);
+    if (r == NULL)
+        return 0;
+
+    return r->idx;
+}
+
+void FlowBitsFree(FlowBits *fb)
+{
+    if (fb == NULL)
+        return;
+
+#ifdef FLOWBITS_STATS
+    SCMutexLock(&flowbits_mutex);
+    flowbits_removed++;
+    if (flowbits_memuse >= sizeof(FlowBits) + fb->size)
+        flowbits_memuse -= sizeof(FlowBits) + fb->size;
+    else {
+        printf("ERROR: flowbits memory usage going below 0!\n");
+        flowbits_memuse = 0;
+    }
+    SCMutexUnlock(&flowbits_mutex);
+#endif /* FLOWBITS_STATS */
+
+    FlowBitsMapRelease(fb->map);
+    SCFree(fb);
+}
+
+/* get the flowbit with idx from the flow */
+static int FlowBitGet(Flow *f, uint16_t idx)
+{
+    FlowBits *fb = f->flowbits;
+    if (fb == NULL || (idx >> 3) >= fb->size)
+        return 0;
+
+    return (fb->bits[idx >> 3] & (1 << (idx & 7))) != 0;
+}
+
+/* add a flowbit to the flow. The bitmap is sized for all flowbits of the
+ * flow's map on the first add, so it only needs to grow for idx's outside
+ * of the map. */
 static void FlowBitAdd(Flow *f, uint16_t idx)
 {
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb == NULL) {
-        fb = SCMalloc(sizeof(FlowBit));
-        if (unlikely(fb == NULL))
+    FlowBits *fb = f->flowbits;
+
+    if (fb == NULL || (idx >> 3) >= fb->size) {
+        FlowBitsMap *map = (fb != NULL) ? fb->map : f->flowbits_map;
+        uint16_t old_size = (fb != NULL) ? fb->size : 0;
+        uint16_t size = (idx >> 3) + 1;
+        if (map != NULL && (map->max_idx >> 3) + 1 > size)
+            size = (map->max_idx >> 3) + 1;
+
+        FlowBits *nfb = SCRealloc(fb, sizeof(FlowBits) + size);
+        if (unlikely(nfb == NULL))
             return;
+        memset(nfb->bits + old_size, 0, size - old_size);
+        nfb->size = size;
 
-        fb->type = DETECT_FLOWBITS;
-        fb->idx = idx;
-        fb->next = NULL;
-        GenericVarAppend(&f->flowvar, (GenericVar *)fb);
+        if (fb == NULL) {
+            nfb->map = map;
+            if (map != NULL)
+                (void) SC_ATOMIC_ADD(map->refcnt, 1);
+        }
+        f->flowbits = fb = nfb;
 
-        //printf("FlowBitAdd: adding flowbit with idx %" PRIu32 "\n", idx);
 #ifdef FLOWBITS_STATS
         SCMutexLock(&flowbits_mutex);
-        flowbits_added++;
-        flowbits_memuse += sizeof(FlowBit);
+        if (old_size == 0) {
+            flowbits_added++;
+            flowbits_memuse += sizeof(FlowBits);
+        }
+        flowbits_memuse += size - old_size;
         if (flowbits_memuse > flowbits_memuse_max)
             flowbits_memuse_max = flowbits_memuse;
         SCMutexUnlock(&flowbits_mutex);
 #endif /* FLOWBITS_STATS */
     }
+
+    fb->bits[idx >> 3] |= (1 << (idx & 7));
 }
 
 static void FlowBitRemove(Flow *f, uint16_t idx)
 {
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb == NULL)
+    FlowBits *fb = f->flowbits;
+    if (fb == NULL || (idx >> 3) >= fb->size)
         return;
 
-    GenericVarRemove(&f->flowvar, (GenericVar *)fb);
+    fb->bits[idx >> 3] &= ~(1 << (idx & 7));
+}
 
-    //printf("FlowBitRemove: remove flowbit with idx %" PRIu32 "\n", idx);
-#ifdef FLOWBITS_STATS
-    SCMutexLock(&flowbits_mutex);
-    flowbits_removed++;
-    if (flowbits_memuse >= sizeof(FlowBit))
-        flowbits_memuse -= sizeof(FlowBit);
-    else {
-        printf("ERROR: flowbits memory usage going below 0!\n");
-        flowbits_memuse = 0;
+/**
+ *  \brief move the flowbits of a flow to the layout of another map
+ *
+ *  Called with the flow locked when a flow is first inspected by a
+ *  detection engine ctx. Bits are carried over by name, bits without
+ *  a counterpart in the new map are dropped.
+ *
+ *  \param map flowbits map of the ctx that will inspect the flow
+ */
+void FlowBitsRemap(Flow *f, FlowBitsMap *map)
+{
+    FlowBits *ofb = f->flowbits;
+
+    f->flowbits_map = map;
+    if (ofb == NULL || ofb->map == map)
+        return;
+
+    f->flowbits = NULL;
+
+    if (ofb->map != NULL && map != NULL) {
+        uint32_t idx;
+        uint32_t max_idx = ofb->map->max_idx;
+        if (max_idx >= (uint32_t)ofb->size * 8)
+            max_idx = (uint32_t)ofb->size * 8 - 1;
+
+        for (idx = 1; idx <= max_idx; idx++) {
+            if (!(ofb->bits[idx >> 3] & (1 << (idx & 7))))
+                continue;
+
+            uint16_t nidx = FlowBitsMapLookup(map, ofb->map->names[idx]);
+            if (nidx != 0)
+                FlowBitAdd(f, nidx);
+        }
     }
-    SCMutexUnlock(&flowbits_mutex);
-#endif /* FLOWBITS_STATS */
+
+    FlowBitsFree(ofb);
 }
 
 void FlowBitSet(Flow *f, uint16_t idx)
 {
     FLOWLOCK_WRLOCK(f);
 
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb == NULL) {
-        FlowBitAdd(f, idx);
-    }
+    FlowBitAdd(f, idx);
 
     FLOWLOCK_UNLOCK(f);
 }
@@ -119,10 +270,7 @@ void FlowBitUnset(Flow *f, uint16_t idx)
 {
     FLOWLOCK_WRLOCK(f);
 
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb != NULL) {
-        FlowBitRemove(f, idx);
-    }
+    FlowBitRemove(f, idx);
 
     FLOWLOCK_UNLOCK(f);
 }
@@ -131,8 +279,7 @@ void FlowBitToggle(Flow *f, uint16_t idx)
 {
     FLOWLOCK_WRLOCK(f);
 
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb != NULL) {
+    if (FlowBitGet(f, idx)) {
         FlowBitRemove(f, idx);
     } else {
         FlowBitAdd(f, idx);
@@ -146,10 +293,7 @@ int FlowBitIsset(Flow *f, uint16_t idx)
     int r = 0;
     FLOWLOCK_RDLOCK(f);
 
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb != NULL) {
-        r = 1;
-    }
+    r = FlowBitGet(f, idx);
 
     FLOWLOCK_UNLOCK(f);
     return r;
@@ -160,35 +304,12 @@ int FlowBitIsnotset(Flow *f, uint16_t idx)
     int r = 0;
     FLOWLOCK_RDLOCK(f);
 
-    FlowBit *fb = FlowBitGet(f, idx);
-    if (fb == NULL) {
-        r = 1;
-    }
+    r = !FlowBitGet(f, idx);
 
     FLOWLOCK_UNLOCK(f);
     return r;
 }
 
-void FlowBitFree(FlowBit *fb)
-{
-    if (fb == NULL)
-        return;
-
-    SCFree(fb);
-
-#ifdef FLOWBITS_STATS
-    SCMutexLock(&flowbits_mutex);
-    flowbits_removed++;
-    if (flowbits_memuse >= sizeof(FlowBit))
-        flowbits_memuse -= sizeof(FlowBit);
-    else {
-        printf("ERROR: flowbits memory usage going below 0!\n");
-        flowbits_memuse = 0;
-    }
-    SCMutexUnlock(&flowbits_mutex);
-#endif /* FLOWBITS_STATS */
-}
-
 
 /* TESTS */
 #ifdef UNITTESTS
@@ -201,11 +322,11 @@ static int FlowBitTest01 (void)
 
     FlowBitAdd(&f, 0);
 
-    FlowBit *fb = FlowBitGet(&f,0);
-    if (fb != NULL)
+    int fb = FlowBitGet(&f,0);
+    if (fb)
         ret = 1;
 
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -216,11 +337,11 @@ static int FlowBitTest02 (void)
     Flow f;
     memset(&f, 0, sizeof(Flow));
 
-    FlowBit *fb = FlowBitGet(&f,0);
-    if (fb == NULL)
+    int fb = FlowBitGet(&f,0);
+    if (!fb)
         ret = 1;
 
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -233,23 +354,23 @@ static int FlowBitTest03 (void)
 
     FlowBitAdd(&f, 0);
 
-    FlowBit *fb = FlowBitGet(&f,0);
-    if (fb == NULL) {
-        printf("fb == NULL although it was just added: ");
+    int fb = FlowBitGet(&f,0);
+    if (!fb) {
+        printf("bit not set although it was just added: ");
         goto end;
     }
 
     FlowBitRemove(&f, 0);
 
     fb = FlowBitGet(&f,0);
-    if (fb != NULL) {
-        printf("fb != NULL although it was just removed: ");
+    if (fb) {
+        printf("bit set although it was just removed: ");
         goto end;
     } else {
         ret = 1;
     }
 end:
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -265,11 +386,11 @@ static int FlowBitTest04 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,0);
-    if (fb != NULL)
+    int fb = FlowBitGet(&f,0);
+    if (fb)
         ret = 1;
 
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -285,11 +406,11 @@ static int FlowBitTest05 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,1);
-    if (fb != NULL)
+    int fb = FlowBitGet(&f,1);
+    if (fb)
         ret = 1;
 
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -305,11 +426,11 @@ static int FlowBitTest06 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,2);
-    if (fb != NULL)
+    int fb = FlowBitGet(&f,2);
+    if (fb)
         ret = 1;
 
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -325,11 +446,11 @@ static int FlowBitTest07 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,3);
-    if (fb != NULL)
+    int fb = FlowBitGet(&f,3);
+    if (fb)
         ret = 1;
 
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -345,21 +466,21 @@ static int FlowBitTest08 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,0);
-    if (fb == NULL)
+    int fb = FlowBitGet(&f,0);
+    if (!fb)
         goto end;
 
     FlowBitRemove(&f,0);
 
     fb = FlowBitGet(&f,0);
-    if (fb != NULL) {
-        printf("fb != NULL even though it was removed: ");
+    if (fb) {
+        printf("bit set even though it was removed: ");
         goto end;
     }
 
     ret = 1;
 end:
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -375,21 +496,21 @@ static int FlowBitTest09 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,1);
-    if (fb == NULL)
+    int fb = FlowBitGet(&f,1);
+    if (!fb)
         goto end;
 
     FlowBitRemove(&f,1);
 
     fb = FlowBitGet(&f,1);
-    if (fb != NULL) {
-        printf("fb != NULL even though it was removed: ");
+    if (fb) {
+        printf("bit set even though it was removed: ");
         goto end;
     }
 
     ret = 1;
 end:
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -405,21 +526,21 @@ static int FlowBitTest10 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,2);
-    if (fb == NULL)
+    int fb = FlowBitGet(&f,2);
+    if (!fb)
         goto end;
 
     FlowBitRemove(&f,2);
 
     fb = FlowBitGet(&f,2);
-    if (fb != NULL) {
-        printf("fb != NULL even though it was removed: ");
+    if (fb) {
+        printf("bit set even though it was removed: ");
         goto end;
     }
 
     ret = 1;
 end:
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -435,21 +556,53 @@ static int FlowBitTest11 (void)
     FlowBitAdd(&f, 2);
     FlowBitAdd(&f, 3);
 
-    FlowBit *fb = FlowBitGet(&f,3);
-    if (fb == NULL)
+    int fb = FlowBitGet(&f,3);
+    if (!fb)
         goto end;
 
     FlowBitRemove(&f,3);
 
     fb = FlowBitGet(&f,3);
-    if (fb != NULL) {
-        printf("fb != NULL even though it was removed: ");
+    if (fb) {
+        printf("bit set even though it was removed: ");
+        goto end;
+    }
+
+    ret = 1;
+end:
+    FlowBitsFree(f.flowbits);
+    return ret;
+}
+
+/** \test bits outside of the flow's map grow the bitmap */
+static int FlowBitTest12 (void)
+{
+    int ret = 0;
+
+    Flow f;
+    memset(&f, 0, sizeof(Flow));
+
+    FlowBitAdd(&f, 3);
+    FlowBitAdd(&f, 300);
+
+    if (!FlowBitGet(&f,3) || !FlowBitGet(&f,300)) {
+        printf("bits not set after growing the bitmap: ");
+        goto end;
+    }
+    if (FlowBitGet(&f,299) || FlowBitGet(&f,1000)) {
+        printf("bit set that was never added: ");
+        goto end;
+    }
+
+    FlowBitRemove(&f,300);
+    if (FlowBitGet(&f,300) || !FlowBitGet(&f,3)) {
+        printf("remove touched the wrong bits: ");
         goto end;
     }
 
     ret = 1;
 end:
-    GenericVarFree(f.flowvar);
+    FlowBitsFree(f.flowbits);
     return ret;
 }
 
@@ -469,6 +622,7 @@ void FlowBitRegisterTests(void)
     UtRegisterTest("FlowBitTest09", FlowBitTest09, 1);
     UtRegisterTest("FlowBitTest10", FlowBitTest10, 1);
     UtRegisterTest("FlowBitTest11", FlowBitTest11, 1);
+    UtRegisterTest("FlowBitTest12", FlowBitTest12, 1);
 #endif /* UNITTESTS */
 }
 
@@ -27,15 +27,44 @@
 #include "flow.h"
 #include "util-var.h"
 
-typedef struct FlowBit_ {
-    uint8_t type; /* type, DETECT_FLOWBITS in this case */
-    uint16_t idx; /* name idx */
-    GenericVar *next; /* right now just implement this as a list,
-                       * in the long run we have think of something
-                       * faster. */
-} FlowBit;
-
-void FlowBitFree(FlowBit *);
+typedef struct FlowBitsMapName_ {
+    char *name;
+    uint16_t idx;
+} FlowBitsMapName;
+
+/** \brief flowbits layout of a detection engine ctx
+ *
+ *  Flowbit idx's are assigned per DetectEngineCtx while loading the rules.
+ *  The map records the names by idx so bits set under one ctx can be
+ *  remapped to the idx's of another ctx after a live rule swap. It's
+ *  refcounted as flows can outlive the ctx that set their bits. */
+typedef struct FlowBitsMap_ {
+    /** highest idx in use, idx 0 is never assigned */
+    uint16_t max_idx;
+    /** names indexed by idx */
+    char **names;
+    /** max_idx entries sorted by name for lookups by name */
+    FlowBitsMapName *sorted;
+    SC_ATOMIC_DECLARE(uint32_t, refcnt);
+} FlowBitsMap;
+
+/** \brief per flow flowbits bitmap, bit idx is set if flowbit idx is set */
+typedef struct FlowBits_ {
+    /** layout the bits are set in, NULL if not set by the detection engine */
+    FlowBitsMap *map;
+    /** size of bits in bytes */
+    uint16_t size;
+    uint8_t bits[];
+} FlowBits;
+
+struct DetectEngineCtx_;
+
+FlowBitsMap *FlowBitsMapBuild(struct DetectEngineCtx_ *);
+void FlowBitsMapRelease(FlowBitsMap *);
+uint16_t FlowBitsMapLookup(FlowBitsMap *, const char *);
+
+void FlowBitsFree(FlowBits *);
+void FlowBitsRemap(Flow *, FlowBitsMap *);
 void FlowBitRegisterTests(void);
 
 void FlowBitSet(Flow *, uint16_t);
@@ -34,6 +34,7 @@
 #include "flow-hash.h"
 #include "flow-util.h"
 #include "flow-private.h"
+#include "flow-queue.h"
 #include "flow-manager.h"
 #include "app-layer-parser.h"
 
@@ -48,10 +49,28 @@
 
 #define FLOW_DEFAULT_FLOW_PRUNE 5
 
+/** max number of flows we look at in a bucket without holding the bucket
+ *  lock. Longer rows are handled by the locked path. */
+#define FLOW_LOCKLESS_MAX_DEPTH 32
+
+#define FlowHashCounterIncr(tv, dtv, id) do { \
+        if ((tv) != NULL && (dtv) != NULL) \
+            SCPerfCounterIncr((dtv)->id, (tv)->sc_perf_pca); \
+    } while (0)
+
 SC_ATOMIC_EXTERN(unsigned int, flow_prune_idx);
 SC_ATOMIC_EXTERN(unsigned int, flow_flags);
 
 static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv);
+static Flow *FlowThreadTableGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv);
+
+/** thread flow tables, only used at init and shutdown */
+static FlowThreadTable *flow_thread_tables = NULL;
+static SCMutex flow_thread_tables_lock = SCMUTEX_INITIALIZER;
+
+/** threads doing lockless lookups, see FlowLocklessGraceStart() */
+static FlowLocklessReader *flow_lockless_readers = NULL;
+static SCMutex flow_lockless_readers_lock = SCMUTEX_INITIALIZER;
 
 #ifdef FLOW_DEBUG_STATS
 #define FLOW_DEBUG_STATS_PROTO_ALL      0
@@ -198,7 +217,7 @@ typedef struct FlowHashKey6_ {
     };
 } FlowHashKey6;
 
-/* calculate the hash key for this packet
+/* calculate the hash for this packet
  *
  * we're using:
  *  hash_rand -- set at init time
@@ -211,7 +230,7 @@ typedef struct FlowHashKey6_ {
  *
  *  For ICMP we only consider UNREACHABLE errors atm.
  */
-static inline uint32_t FlowGetKey(const Packet *p)
+static inline uint32_t FlowGetHash(const Packet *p)
 {
     uint32_t key;
 
@@ -238,7 +257,7 @@ static inline uint32_t FlowGetKey(const Packet *p)
             fhk.vlan_id[1] = p->vlan_id[1];
 
             uint32_t hash = hashword(fhk.u32, 5, flow_config.hash_rand);
-            key = hash % flow_config.hash_size;
+            key = hash;
 
         } else if (ICMPV4_DEST_UNREACH_IS_VALID(p)) {
             uint32_t psrc = IPV4_GET_RAW_IPSRC_U32(ICMPV4_GET_EMB_IPV4(p));
@@ -264,7 +283,7 @@ static inline uint32_t FlowGetKey(const Packet *p)
             fhk.vlan_id[1] = p->vlan_id[1];
 
             uint32_t hash = hashword(fhk.u32, 5, flow_config.hash_rand);
-            key = hash % flow_config.hash_size;
+            key = hash;
 
         } else {
             FlowHashKey4 fhk;
@@ -283,7 +302,7 @@ static inline uint32_t FlowGetKey(const Packet *p)
             fhk.vlan_id[1] = p->vlan_id[1];
 
             uint32_t hash = hashword(fhk.u32, 5, flow_config.hash_rand);
-            key = hash % flow_config.hash_size;
+            key = hash;
         }
     } else if (p->ip6h != NULL) {
         FlowHashKey6 fhk;
@@ -319,13 +338,19 @@ static inline uint32_t FlowGetKey(const Packet *p)
         fhk.vlan_id[1] = p->vlan_id[1];
 
         uint32_t hash = hashword(fhk.u32, 11, flow_config.hash_rand);
-        key = hash % flow_config.hash_size;
+        key = hash;
     } else
         key = 0;
 
     return key;
 }
 
+/* the bucket of this packet in the global flow hash */
+static inline uint32_t FlowGetKey(const Packet *p)
+{
+    return FlowGetHash(p) % flow_config.hash_size;
+}
+
 /* Since two or more flows can have the same hash key, we need to compare
  * the flow with the current flow key. */
 #define CMP_FLOW(f1,f2) \
@@ -420,6 +445,41 @@ static inline int FlowCreateCheck(const Packet *p)
     return 1;
 }
 
+/**
+ *  \internal
+ *  \brief Get a spare flow
+ *
+ *  If the thread has a spare flow cache, use it and refill it in batches
+ *  from the global spare queue. Otherwise get the flow from the spare
+ *  queue directly.
+ *
+ *  \retval f *unlocked* flow or NULL if no spare flows are available
+ */
+static inline Flow *FlowGetSpare(ThreadVars *tv, DecodeThreadVars *dtv)
+{
+    if (dtv == NULL || dtv->flow_spare_cache == NULL)
+        return FlowDequeue(&flow_spare_q);
+
+    FlowSpareCache *c = dtv->flow_spare_cache;
+    Flow *f = FlowSpareCacheGet(c);
+    if (f != NULL) {
+        FlowHashCounterIncr(tv, dtv, counter_flow_spare_cache_hit);
+        return f;
+    }
+
+    FlowHashCounterIncr(tv, dtv, counter_flow_spare_cache_miss);
+
+    /* refill half the cache, so we don't empty the spare queue for
+     * the other threads in one go */
+    uint32_t batch = c->size / 2;
+    if (batch == 0)
+        batch = 1;
+    if (FlowSpareCacheRefill(c, batch) == 0)
+        return NULL;
+
+    return FlowSpareCacheGet(c);
+}
+
 /**
  *  \brief Get a new flow
  *
@@ -440,7 +500,7 @@ static Flow *FlowGetNew(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
     }
 
     /* get a flow from the spare queue */
-    f = FlowDequeue(&flow_spare_q);
+    f = FlowGetSpare(tv, dtv);
     if (f == NULL) {
         /* If we reached the max memcap, we get a used flow */
         if (!(FLOW_CHECK_MEMCAP(sizeof(Flow)))) {
@@ -454,7 +514,10 @@ static Flow *FlowGetNew(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
                 FlowWakeupFlowManagerThread();
             }
 
-            f = FlowGetUsedFlow(tv, dtv);
+            if (dtv != NULL && dtv->flow_table != NULL)
+                f = FlowThreadTableGetUsedFlow(tv, dtv);
+            else
+                f = FlowGetUsedFlow(tv, dtv);
             if (f == NULL) {
                 /* very rare, but we can fail. Just giving up */
                 return NULL;
@@ -480,34 +543,71 @@ static Flow *FlowGetNew(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
     return f;
 }
 
-/** \brief Get Flow for packet
+/** \internal
+ *  \brief Look up the flow for a packet without locking the bucket
  *
- * Hash retrieval function for flows. Looks up the hash bucket containing the
- * flow pointer. Then compares the packet with the found flow to see if it is
- * the flow we need. If it isn't, walk the list until the right flow is found.
+ *  Walks the bucket's flow list without holding the bucket lock. Writers
+ *  (inserts, evictions and the flow manager) still modify the list under
+ *  the bucket lock, so a reader can see a list that is being changed. This
+ *  is safe because a flow that is removed from the hash goes through the
+ *  recycle and spare queues, and is only freed after a grace period in
+ *  which every reader that was walking a bucket has finished its walk. So
+ *  a stale hnext always points to a valid Flow, even if it is reused by now.
  *
- * If the flow is not found or the bucket was emtpy, a new flow is taken from
- * the queue. FlowDequeue() will alloc new flows as long as we stay within our
- * memcap limit.
+ *  A match found this way is revalidated under the flow lock: it must still
+ *  be part of this bucket and still match the packet.
  *
- * The p->flow pointer is updated to point to the flow.
+ *  \param fb hash bucket for the packet
+ *  \param p packet
+ *
+ *  \retval f *LOCKED* flow
+ *  \retval NULL not found, caller should use the locked path
+ */
+static Flow *FlowGetFlowFromHashLockless(FlowBucket *fb, const Packet *p)
+{
+    int depth = 0;
+    Flow *f = FLOW_HASH_READ_PTR(fb->head);
+
+    while (f != NULL && depth++ < FLOW_LOCKLESS_MAX_DEPTH) {
+        /* flow was removed from our bucket while we walked the list */
+        if (FLOW_HASH_READ_PTR(f->fb) != fb)
+            return NULL;
+
+        if (FlowCompare(f, p) != 0) {
+            FLOWLOCK_WRLOCK(f);
+            if (f->fb == fb && FlowCompare(f, p) != 0) {
+                return f;
+            }
+            FLOWLOCK_UNLOCK(f);
+            return NULL;
+        }
+
+        f = FLOW_HASH_READ_PTR(f->hnext);
+    }
+
+    return NULL;
+}
+
+/** \internal
+ *  \brief Get the flow for a packet from a hash bucket
+ *
+ *  Looks for the packet's flow in the bucket and adds a new flow to the
+ *  bucket if it isn't there. The caller must hold the bucket lock, or own
+ *  the bucket in case of a thread flow table.
  *
  *  \param tv thread vars
  *  \param dtv decode thread vars (for flow log api thread data)
+ *  \param fb hash bucket for the packet
+ *  \param p packet
  *
  *  \retval f *LOCKED* flow or NULL
  */
-Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
+static Flow *FlowGetFlowFromBucket(ThreadVars *tv, DecodeThreadVars *dtv,
+        FlowBucket *fb, const Packet *p)
 {
     Flow *f = NULL;
     FlowHashCountInit;
 
-    /* get the key to our bucket */
-    uint32_t key = FlowGetKey(p);
-    /* get our hash bucket and lock it */
-    FlowBucket *fb = &flow_hash[key];
-    FBLOCK_LOCK(fb);
-
     SCLogDebug("fb %p fb->head %p", fb, fb->head);
 
     FlowHashCountIncr;
@@ -516,20 +616,21 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
     if (fb->head == NULL) {
         f = FlowGetNew(tv, dtv, p);
         if (f == NULL) {
-            FBLOCK_UNLOCK(fb);
             FlowHashCountUpdate;
             return NULL;
         }
 
         /* flow is locked */
-        fb->head = f;
-        fb->tail = f;
 
-        /* got one, now lock, initialize and return */
+        /* got one, now initialize and add it to the bucket. In lockless
+         * mode readers may see the flow as soon as it is linked in. */
         FlowInit(f, p);
         f->fb = fb;
+        hw_barrier();
+
+        fb->head = f;
+        fb->tail = f;
 
-        FBLOCK_UNLOCK(fb);
         FlowHashCountUpdate;
         return f;
     }
@@ -548,23 +649,23 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
             f = f->hnext;
 
             if (f == NULL) {
-                f = pf->hnext = FlowGetNew(tv, dtv, p);
+                f = FlowGetNew(tv, dtv, p);
                 if (f == NULL) {
-                    FBLOCK_UNLOCK(fb);
                     FlowHashCountUpdate;
                     return NULL;
                 }
-                fb->tail = f;
 
                 /* flow is locked */
 
-                f->hprev = pf;
-
-                /* initialize and return */
+                /* initialize and add to the tail of the bucket */
                 FlowInit(f, p);
                 f->fb = fb;
+                f->hprev = pf;
+                hw_barrier();
+
+                pf->hnext = f;
+                fb->tail = f;
 
-                FBLOCK_UNLOCK(fb);
                 FlowHashCountUpdate;
                 return f;
             }
@@ -589,7 +690,6 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
 
                 /* found our flow, lock & return */
                 FLOWLOCK_WRLOCK(f);
-                FBLOCK_UNLOCK(fb);
                 FlowHashCountUpdate;
                 return f;
             }
@@ -598,36 +698,119 @@ Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p
 
     /* lock & return */
     FLOWLOCK_WRLOCK(f);
-    FBLOCK_UNLOCK(fb);
     FlowHashCountUpdate;
     return f;
 }
 
 /** \internal
- *  \brief Get a flow from the hash directly.
+ *  \brief Get Flow for packet from the thread's own flow table
+ *
+ *  Only the owning thread uses the table, so the bucket isn't locked.
+ *  The flow itself is still returned locked, as the rest of the engine
+ *  expects. Nobody else uses it, so that lock is never contended.
+ *
+ *  \retval f *LOCKED* flow or NULL
+ */
+static Flow *FlowGetFlowFromThreadTable(ThreadVars *tv, DecodeThreadVars *dtv,
+        const Packet *p)
+{
+    FlowThreadTable *ft = dtv->flow_table;
+    FlowBucket *fb = &ft->hash[FlowGetHash(p) % ft->size];
+
+    FlowHashCounterIncr(tv, dtv, counter_flow_hash_thread);
+    return FlowGetFlowFromBucket(tv, dtv, fb, p);
+}
+
+/** \brief Get Flow for packet
+ *
+ * Hash retrieval function for flows. Looks up the hash bucket containing the
+ * flow pointer. Then compares the packet with the found flow to see if it is
+ * the flow we need. If it isn't, walk the list until the right flow is found.
+ *
+ * If the flow is not found or the bucket was emtpy, a new flow is taken from
+ * the queue. FlowDequeue() will alloc new flows as long as we stay within our
+ * memcap limit.
+ *
+ * If the thread has its own flow table, the flow is looked up there.
+ *
+ * The p->flow pointer is updated to point to the flow.
+ *
+ *  \param tv thread vars
+ *  \param dtv decode thread vars (for flow log api thread data)
+ *
+ *  \retval f *LOCKED* flow or NULL
+ */
+Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *p)
+{
+    Flow *f = NULL;
+
+    if (dtv != NULL && dtv->flow_table != NULL)
+        return FlowGetFlowFromThreadTable(tv, dtv, p);
+    /* thread tables are used, but this thread has none */
+    if (unlikely(flow_hash == NULL))
+        return NULL;
+
+    /* get the key to our bucket */
+    uint32_t key = FlowGetKey(p);
+    FlowBucket *fb = &flow_hash[key];
+
+    /* try to find the flow without locking the bucket first. Only threads
+     * that registered as lockless reader can do this. */
+    if (flow_config.lockless_lookup && dtv != NULL && dtv->flow_reader != NULL) {
+        FlowLocklessReader *r = dtv->flow_reader;
+        (void) SC_ATOMIC_ADD(r->seq, 1);
+        /* the odd seq must be visible before we read the bucket */
+        hw_barrier();
+        f = FlowGetFlowFromHashLockless(fb, p);
+        (void) SC_ATOMIC_ADD(r->seq, 1);
+        if (f != NULL) {
+            FlowHashCounterIncr(tv, dtv, counter_flow_hash_lockless);
+            return f;
+        }
+    }
+
+    /* lock our hash bucket */
+    FlowHashCounterIncr(tv, dtv, counter_flow_hash_locked);
+    if (FBLOCK_TRYLOCK(fb) != 0) {
+        FlowHashCounterIncr(tv, dtv, counter_flow_hash_contention);
+        FBLOCK_LOCK(fb);
+    }
+
+    /* the flow is locked before the bucket is unlocked */
+    f = FlowGetFlowFromBucket(tv, dtv, fb, p);
+    if (f != NULL && f->wheel_slot == 0)
+        FlowWheelAdd(f, &p->ts);
+    FBLOCK_UNLOCK(fb);
+    return f;
+}
+
+/** \internal
+ *  \brief Get a flow from a hash directly.
  *
  *  Called in conditions where the spare queue is empty and memcap is reached.
  *
  *  Walks the hash until a flow can be freed. Timeouts are disregarded, use_cnt
- *  is adhered to. "flow_prune_idx" atomic int makes sure we don't start at the
- *  top each time since that would clear the top of the hash leading to longer
- *  and longer search times under high pressure (observed).
+ *  is adhered to.
  *
  *  \param tv thread vars
  *  \param dtv decode thread vars (for flow log api thread data)
+ *  \param hash hash to get the flow from
+ *  \param size number of buckets in the hash
+ *  \param idx bucket to start after
+ *  \param scanned set to the number of buckets looked at
  *
  *  \retval f flow or NULL
  */
-static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
+static Flow *FlowGetUsedFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv,
+        FlowBucket *hash, uint32_t size, uint32_t idx, uint32_t *scanned)
 {
-    uint32_t idx = SC_ATOMIC_GET(flow_prune_idx) % flow_config.hash_size;
-    uint32_t cnt = flow_config.hash_size;
+    uint32_t cnt = size;
 
     while (cnt--) {
-        if (++idx >= flow_config.hash_size)
+        if (++idx >= size)
             idx = 0;
 
-        FlowBucket *fb = &flow_hash[idx];
+        FlowBucket *fb = &hash[idx];
 
         if (FBLOCK_TRYLOCK(fb) != 0)
             continue;
@@ -651,6 +834,8 @@ static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
             continue;
         }
 
+        FlowWheelRemove(f);
+
         /* remove from the hash */
         if (f->hprev != NULL)
             f->hprev->hnext = f->hnext;
@@ -687,9 +872,878 @@ static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
 
         FLOWLOCK_UNLOCK(f);
 
-        (void) SC_ATOMIC_ADD(flow_prune_idx, (flow_config.hash_size - cnt));
+        *scanned = size - cnt;
         return f;
     }
 
     return NULL;
 }
+
+/** \internal
+ *  \brief Get a flow from the global hash directly.
+ *
+ *  "flow_prune_idx" atomic int makes sure we don't start at the
+ *  top each time since that would clear the top of the hash leading to longer
+ *  and longer search times under high pressure (observed).
+ *
+ *  \param tv thread vars
+ *  \param dtv decode thread vars (for flow log api thread data)
+ *
+ *  \retval f flow or NULL
+ */
+static Flow *FlowGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
+{
+    uint32_t idx = SC_ATOMIC_GET(flow_prune_idx) % flow_config.hash_size;
+    uint32_t scanned = 0;
+
+    if (unlikely(flow_hash == NULL))
+        return NULL;
+
+    Flow *f = FlowGetUsedFlowFromHash(tv, dtv, flow_hash, flow_config.hash_size,
+            idx, &scanned);
+    if (f != NULL)
+        (void) SC_ATOMIC_ADD(flow_prune_idx, scanned);
+    return f;
+}
+
+/** \internal
+ *  \brief Get a flow from the thread's own flow table directly.
+ *
+ *  \retval f flow or NULL
+ */
+static Flow *FlowThreadTableGetUsedFlow(ThreadVars *tv, DecodeThreadVars *dtv)
+{
+    FlowThreadTable *ft = dtv->flow_table;
+    uint32_t scanned = 0;
+
+    Flow *f = FlowGetUsedFlowFromHash(tv, dtv, ft->hash, ft->size,
+            ft->prune_idx, &scanned);
+    if (f != NULL)
+        ft->prune_idx = (ft->prune_idx + scanned) % ft->size;
+    return f;
+}
+
+/**
+ *  \brief Set up a thread owned flow table
+ *
+ *  The table has flow_config.thread_table_size buckets and counts against
+ *  the flow memcap. It's registered so that the flows can be force
+ *  reassembled and handed to the recycler at shutdown.
+ *
+ *  \retval ft table or NULL on error
+ */
+FlowThreadTable *FlowThreadTableNew(void)
+{
+    uint32_t size = flow_config.thread_table_size;
+    uint64_t hash_size = (uint64_t)size * sizeof(FlowBucket);
+    uint32_t u;
+
+    if (!(FLOW_CHECK_MEMCAP(hash_size))) {
+        SCLogError(SC_ERR_FLOW_INIT, "allocating thread flow table failed: "
+                "max flow memcap reached. Memcap: %"PRIu64", table size %"PRIu64,
+                flow_config.memcap, hash_size);
+        return NULL;
+    }
+
+    FlowThreadTable *ft = SCMalloc(sizeof(FlowThreadTable));
+    if (unlikely(ft == NULL))
+        return NULL;
+    memset(ft, 0x00, sizeof(FlowThreadTable));
+    ft->size = size;
+
+    ft->hash = SCMallocAligned(hash_size, CLS);
+    if (unlikely(ft->hash == NULL)) {
+        SCFree(ft);
+        return NULL;
+    }
+    memset(ft->hash, 0x00, hash_size);
+
+    ft->recycle_q = FlowQueueNew();
+
+    /* the owner doesn't lock the buckets, but timeout and shutdown
+     * handling share the locked hash walking code */
+    for (u = 0; u < ft->size; u++) {
+        FBLOCK_INIT(&ft->hash[u]);
+    }
+    (void) SC_ATOMIC_ADD(flow_memuse, hash_size);
+
+    SCMutexLock(&flow_thread_tables_lock);
+    ft->next = flow_thread_tables;
+    flow_thread_tables = ft;
+    SCMutexUnlock(&flow_thread_tables_lock);
+
+    return ft;
+}
+
+/**
+ *  \brief Free a thread owned flow table
+ *
+ *  The flows still in the table are handed to the flow recycler.
+ */
+void FlowThreadTableFree(FlowThreadTable *ft)
+{
+    uint32_t u;
+
+    if (ft == NULL)
+        return;
+
+    SCMutexLock(&flow_thread_tables_lock);
+    FlowThreadTable **pft = &flow_thread_tables;
+    while (*pft != NULL && *pft != ft)
+        pft = &(*pft)->next;
+    if (*pft != NULL)
+        *pft = ft->next;
+    SCMutexUnlock(&flow_thread_tables_lock);
+
+    FlowThreadTableCleanup(ft);
+
+    Flow *f;
+    while ((f = FlowDequeue(ft->recycle_q)) != NULL) {
+        FlowEnqueue(&flow_recycle_q, f);
+    }
+    FlowQueueDestroy(ft->recycle_q);
+    SCFree(ft->recycle_q);
+
+    for (u = 0; u < ft->size; u++) {
+        FBLOCK_DESTROY(&ft->hash[u]);
+    }
+    SCFreeAligned(ft->hash);
+    (void) SC_ATOMIC_SUB(flow_memuse, (uint64_t)ft->size * sizeof(FlowBucket));
+    SCFree(ft);
+}
+
+/**
+ *  \brief Call a function for the hash of each thread flow table
+ *
+ *  Only safe when the owning threads don't process packets anymore,
+ *  e.g. during shutdown.
+ */
+void FlowThreadTablesWalk(void (*Func)(FlowBucket *hash, uint32_t size))
+{
+    FlowThreadTable *ft;
+
+    SCMutexLock(&flow_thread_tables_lock);
+    for (ft = flow_thread_tables; ft != NULL; ft = ft->next) {
+        Func(ft->hash, ft->size);
+    }
+    SCMutexUnlock(&flow_thread_tables_lock);
+}
+
+/**
+ *  \brief Register the calling thread as lockless reader
+ *
+ *  \retval r reader to store in the thread's DecodeThreadVars
+ *  \retval NULL on error
+ */
+FlowLocklessReader *FlowLocklessReaderRegister(void)
+{
+    FlowLocklessReader *r = SCMalloc(sizeof(FlowLocklessReader));
+    if (unlikely(r == NULL))
+        return NULL;
+    memset(r, 0x00, sizeof(FlowLocklessReader));
+    SC_ATOMIC_INIT(r->seq);
+
+    SCMutexLock(&flow_lockless_readers_lock);
+    r->next = flow_lockless_readers;
+    flow_lockless_readers = r;
+    SCMutexUnlock(&flow_lockless_readers_lock);
+    return r;
+}
+
+/**
+ *  \brief Remove a reader from the list and free it
+ *
+ *  The thread must not be doing a lookup anymore.
+ */
+void FlowLocklessReaderDeregister(FlowLocklessReader *r)
+{
+    FlowLocklessReader **pr;
+
+    if (r == NULL)
+        return;
+
+    SCMutexLock(&flow_lockless_readers_lock);
+    for (pr = &flow_lockless_readers; *pr != NULL; pr = &(*pr)->next) {
+        if (*pr == r) {
+            *pr = r->next;
+            break;
+        }
+    }
+    SCMutexUnlock(&flow_lockless_readers_lock);
+
+    SC_ATOMIC_DESTROY(r->seq);
+    SCFree(r);
+}
+
+/**
+ *  \brief Start a grace period
+ *
+ *  Called after flows were taken out of the hash and the spare queue for
+ *  good. A reader can only still see them if it was walking a bucket at
+ *  this point, so remember where each reader is.
+ */
+void FlowLocklessGraceStart(void)
+{
+    FlowLocklessReader *r;
+
+    SCMutexLock(&flow_lockless_readers_lock);
+    for (r = flow_lockless_readers; r != NULL; r = r->next) {
+        r->grace_seq = SC_ATOMIC_GET(r->seq);
+    }
+    SCMutexUnlock(&flow_lockless_readers_lock);
+}
+
+/**
+ *  \brief Check if the grace period started by FlowLocklessGraceStart()
+ *         is over
+ *
+ *  It is over when no reader is still in the walk it was in at the start
+ *  of the grace period. Readers that started a walk later can't reach
+ *  flows that were no longer part of the hash.
+ *
+ *  \retval 1 over, flows set aside at the start can be freed
+ *  \retval 0 not over yet
+ */
+int FlowLocklessGraceDone(void)
+{
+    FlowLocklessReader *r;
+    int done = 1;
+
+    SCMutexLock(&flow_lockless_readers_lock);
+    for (r = flow_lockless_readers; r != NULL; r = r->next) {
+        if ((r->grace_seq & 1) && SC_ATOMIC_GET(r->seq) == r->grace_seq) {
+            done = 0;
+            break;
+        }
+    }
+    SCMutexUnlock(&flow_lockless_readers_lock);
+    return done;
+}
+
+#ifdef UNITTESTS
+#include "util-unittest.h"
+#include "util-unittest-helper.h"
+
+#define FLOW_HASH_STRESS_THREADS    8
+#define FLOW_HASH_STRESS_FLOWS      512
+#define FLOW_HASH_STRESS_LOOPS      200
+
+typedef struct FlowHashStressCtx_ {
+    Packet *pkts[FLOW_HASH_STRESS_FLOWS];
+    int stop;
+    SC_ATOMIC_DECLARE(unsigned int, errors);
+    SC_ATOMIC_DECLARE(unsigned int, evicted);
+} FlowHashStressCtx;
+
+typedef struct FlowHashStressThread_ {
+    FlowHashStressCtx *ctx;
+    int id;
+} FlowHashStressThread;
+
+/** \internal
+ *  \brief worker thread for the stress tests: look up all flows many times
+ *         in a thread specific order. */
+static void *FlowHashStressWorker(void *arg)
+{
+    FlowHashStressThread *t = (FlowHashStressThread *)arg;
+    FlowHashStressCtx *ctx = t->ctx;
+    DecodeThreadVars dtv;
+    int loop, i;
+
+    memset(&dtv, 0, sizeof(dtv));
+    if (flow_config.lockless_lookup) {
+        dtv.flow_reader = FlowLocklessReaderRegister();
+        if (dtv.flow_reader == NULL) {
+            (void) SC_ATOMIC_ADD(ctx->errors, 1);
+            return NULL;
+        }
+    }
+
+    for (loop = 0; loop < FLOW_HASH_STRESS_LOOPS; loop++) {
+        for (i = 0; i < FLOW_HASH_STRESS_FLOWS; i++) {
+            /* 7 is coprime with the number of flows, so every flow is used */
+            int idx = (i * 7 + t->id * 13 + loop) % FLOW_HASH_STRESS_FLOWS;
+            Packet *p = ctx->pkts[idx];
+
+            Flow *f = FlowGetFlowFromHash(NULL, &dtv, p);
+            if (f == NULL) {
+                (void) SC_ATOMIC_ADD(ctx->errors, 1);
+                continue;
+            }
+            if (FlowCompare(f, p) == 0 || f->fb != &flow_hash[FlowGetKey(p)]) {
+                (void) SC_ATOMIC_ADD(ctx->errors, 1);
+            }
+            FLOWLOCK_UNLOCK(f);
+        }
+    }
+    FlowLocklessReaderDeregister(dtv.flow_reader);
+    return NULL;
+}
+
+/** \internal
+ *  \brief evict flows from the hash while the workers are running, like
+ *         the flow manager and FlowGetUsedFlow would. Excess spare flows
+ *         are freed like the flow manager does. */
+static void *FlowHashStressEvictor(void *arg)
+{
+    FlowHashStressCtx *ctx = (FlowHashStressCtx *)arg;
+
+    while (!FLOW_HASH_READ_PTR(ctx->stop)) {
+        Flow *f = FlowGetUsedFlow(NULL, NULL);
+        if (f != NULL) {
+            (void) SC_ATOMIC_ADD(ctx->evicted, 1);
+            FlowEnqueue(&flow_spare_q, f);
+        }
+        FlowUpdateSpareFlows();
+        sched_yield();
+    }
+    return NULL;
+}
+
+/** \internal
+ *  \brief count the flows in the hash and check they are all unique
+ */
+static int FlowHashStressCheckHash(FlowHashStressCtx *ctx)
+{
+    uint32_t u;
+    int cnt = 0, i;
+
+    for (u = 0; u < flow_config.hash_size; u++) {
+        Flow *f;
+        for (f = flow_hash[u].head; f != NULL; f = f->hnext) {
+            if (f->fb != &flow_hash[u]) {
+                printf("flow %p in bucket %u has fb %p: ", f, u, f->fb);
+                return 0;
+            }
+            cnt++;
+        }
+    }
+
+    /* every packet must map to exactly one flow */
+    for (i = 0; i < FLOW_HASH_STRESS_FLOWS; i++) {
+        Packet *p = ctx->pkts[i];
+        FlowBucket *fb = &flow_hash[FlowGetKey(p)];
+        int matches = 0;
+        Flow *f;
+        for (f = fb->head; f != NULL; f = f->hnext) {
+            if (FlowCompare(f, p) != 0)
+                matches++;
+        }
+        if (matches != 1) {
+            printf("packet %d has %d flows in the hash: ", i, matches);
+            return 0;
+        }
+    }
+
+    if (cnt != FLOW_HASH_STRESS_FLOWS) {
+        printf("expected %d flows in the hash, got %d: ",
+                FLOW_HASH_STRESS_FLOWS, cnt);
+        return 0;
+    }
+    return 1;
+}
+
+/** \internal
+ *  \brief hammer the flow hash from many threads while a separate thread
+ *         evicts flows from it.
+ *
+ *  \param lockless "yes" or "no" for flow.lockless-lookup
+ */
+static int FlowHashStressRun(char *lockless)
+{
+    int result = 0;
+    int i;
+    FlowHashStressCtx ctx;
+    FlowHashStressThread threads[FLOW_HASH_STRESS_THREADS];
+    pthread_t workers[FLOW_HASH_STRESS_THREADS];
+    pthread_t evictor;
+
+    memset(&ctx, 0, sizeof(ctx));
+    SC_ATOMIC_INIT(ctx.errors);
+    SC_ATOMIC_INIT(ctx.evicted);
+
+    ConfCreateContextBackup();
+    ConfInit();
+    /* small hash so rows are long and threads collide on the buckets */
+    ConfSet("flow.hash-size", "16");
+    ConfSet("flow.prealloc", "64");
+    ConfSet("flow.lockless-lookup", lockless);
+    FlowInitConfig(FLOW_QUIET);
+
+    for (i = 0; i < FLOW_HASH_STRESS_FLOWS; i++) {
+        char src[16], dst[16];
+        snprintf(src, sizeof(src), "10.0.%d.%d", i / 256, i % 256);
+        snprintf(dst, sizeof(dst), "10.1.%d.%d", i % 7, i % 251);
+        ctx.pkts[i] = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, src, dst,
+                (uint16_t)(1024 + i), 80);
+        if (ctx.pkts[i] == NULL)
+            goto end;
+    }
+
+    if (pthread_create(&evictor, NULL, FlowHashStressEvictor, &ctx) != 0)
+        goto end;
+    for (i = 0; i < FLOW_HASH_STRESS_THREADS; i++) {
+        threads[i].ctx = &ctx;
+        threads[i].id = i;
+        if (pthread_create(&workers[i], NULL, FlowHashStressWorker, &threads[i]) != 0) {
+            printf("pthread_create failed: ");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < FLOW_HASH_STRESS_THREADS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    ctx.stop = 1;
+    pthread_join(evictor, NULL);
+
+    if (SC_ATOMIC_GET(ctx.errors) != 0) {
+        printf("%u lookup errors: ", SC_ATOMIC_GET(ctx.errors));
+        goto end;
+    }
+
+    /* evictions may have removed flows, so look everything up once more
+     * before checking the hash */
+    for (i = 0; i < FLOW_HASH_STRESS_FLOWS; i++) {
+        Flow *f = FlowGetFlowFromHash(NULL, NULL, ctx.pkts[i]);
+        if (f == NULL)
+            goto end;
+        FLOWLOCK_UNLOCK(f);
+    }
+    if (FlowHashStressCheckHash(&ctx) == 0)
+        goto end;
+
+    SCLogDebug("lockless %s: %u flows evicted during the run", lockless,
+            SC_ATOMIC_GET(ctx.evicted));
+    result = 1;
+end:
+    for (i = 0; i < FLOW_HASH_STRESS_FLOWS; i++) {
+        if (ctx.pkts[i] != NULL)
+            UTHFreePacket(ctx.pkts[i]);
+    }
+    FlowShutdown();
+    ConfDeInit();
+    ConfRestoreContextBackup();
+    SC_ATOMIC_DESTROY(ctx.errors);
+    SC_ATOMIC_DESTROY(ctx.evicted);
+    return result;
+}
+
+/** \test stress the flow hash using the bucket locks for lookups */
+static int FlowHashStressTest01(void)
+{
+    return FlowHashStressRun("no");
+}
+
+/** \test stress the flow hash using lockless lookups */
+static int FlowHashStressTest02(void)
+{
+    return FlowHashStressRun("yes");
+}
+
+/** \internal
+ *  \brief set up the flow engine with thread tables as in workers mode */
+static void FlowThreadTableTestInit(void)
+{
+    ConfCreateContextBackup();
+    ConfInit();
+    ConfSet("flow.hash-size", "4096");
+    ConfSet("flow.prealloc", "10");
+    ConfSet("flow.thread-tables", "yes");
+    FlowInitConfig(FLOW_QUIET);
+    FlowInitThreadTables("workers");
+}
+
+static void FlowThreadTableTestDeinit(void)
+{
+    FlowShutdown();
+    ConfDeInit();
+    ConfRestoreContextBackup();
+}
+
+/** \internal
+ *  \brief number of flows in a thread table */
+static uint32_t FlowThreadTableTestCount(FlowThreadTable *ft)
+{
+    uint32_t u, cnt = 0;
+    Flow *f;
+
+    for (u = 0; u < ft->size; u++) {
+        for (f = ft->hash[u].head; f != NULL; f = f->hnext)
+            cnt++;
+    }
+    return cnt;
+}
+
+/** \test lookups in a thread table: both directions map to the same flow,
+ *        the flow lives in the thread's table and the global hash isn't
+ *        set up. */
+static int FlowThreadTableTest01(void)
+{
+    int result = 0;
+    DecodeThreadVars dtv;
+    Packet *p1 = NULL, *p2 = NULL, *p3 = NULL;
+    Flow *f1 = NULL, *f2 = NULL, *f3 = NULL;
+
+    memset(&dtv, 0x00, sizeof(dtv));
+    FlowThreadTableTestInit();
+
+    if (flow_hash != NULL) {
+        printf("global flow hash set up: ");
+        goto end;
+    }
+    if (flow_config.thread_table_size == 0 ||
+        flow_config.thread_table_size > flow_config.hash_size) {
+        printf("bad thread table size %u: ", flow_config.thread_table_size);
+        goto end;
+    }
+
+    dtv.flow_table = FlowThreadTableNew();
+    if (dtv.flow_table == NULL || dtv.flow_table->size != flow_config.thread_table_size)
+        goto end;
+
+    p1 = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "10.0.0.1", "10.0.0.2", 1024, 80);
+    p2 = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "10.0.0.2", "10.0.0.1", 80, 1024);
+    p3 = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "10.0.0.1", "10.0.0.2", 1025, 80);
+    if (p1 == NULL || p2 == NULL || p3 == NULL)
+        goto end;
+
+    /* without a table of its own a thread gets nothing */
+    if (FlowGetFlowFromHash(NULL, NULL, p1) != NULL) {
+        printf("got a flow without a thread table: ");
+        goto end;
+    }
+
+    f1 = FlowGetFlowFromHash(NULL, &dtv, p1);
+    if (f1 == NULL)
+        goto end;
+    FLOWLOCK_UNLOCK(f1);
+    f2 = FlowGetFlowFromHash(NULL, &dtv, p2);
+    if (f2 == NULL)
+        goto end;
+    FLOWLOCK_UNLOCK(f2);
+    f3 = FlowGetFlowFromHash(NULL, &dtv, p3);
+    if (f3 == NULL)
+        goto end;
+    FLOWLOCK_UNLOCK(f3);
+
+    if (f1 != f2 || f1 == f3) {
+        printf("f1 %p f2 %p f3 %p: ", f1, f2, f3);
+        goto end;
+    }
+    if (f1->fb < dtv.flow_table->hash ||
+        f1->fb >= dtv.flow_table->hash + dtv.flow_table->size) {
+        printf("flow not in the thread table: ");
+        goto end;
+    }
+    if (FlowThreadTableTestCount(dtv.flow_table) != 2)
+        goto end;
+
+    /* the flows are handed to the recycler when the table is freed */
+    FlowThreadTableFree(dtv.flow_table);
+    dtv.flow_table = NULL;
+    if (flow_recycle_q.len != 2) {
+        printf("recycle queue len %u, expected 2: ", flow_recycle_q.len);
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (dtv.flow_table != NULL)
+        FlowThreadTableFree(dtv.flow_table);
+    if (p1 != NULL)
+        UTHFreePacket(p1);
+    if (p2 != NULL)
+        UTHFreePacket(p2);
+    if (p3 != NULL)
+        UTHFreePacket(p3);
+    FlowThreadTableTestDeinit();
+    return result;
+}
+
+/** \test the owner times out its flows, from packet time and when idle */
+static int FlowThreadTableTest02(void)
+{
+    int result = 0;
+    DecodeThreadVars dtv;
+    Packet *p1 = NULL, *p2 = NULL;
+    Flow *f;
+    struct timeval ts;
+
+    memset(&dtv, 0x00, sizeof(dtv));
+    TimeModeSetOffline();
+    FlowThreadTableTestInit();
+
+    dtv.flow_table = FlowThreadTableNew();
+    if (dtv.flow_table == NULL)
+        goto end;
+
+    p1 = UTHBuildPacketReal(NULL, 0, IPPROTO_UDP, "10.0.0.1", "10.0.0.2", 1024, 53);
+    p2 = UTHBuildPacketReal(NULL, 0, IPPROTO_UDP, "10.0.0.1", "10.0.0.2", 1025, 53);
+    if (p1 == NULL || p2 == NULL)
+        goto end;
+    p1->ts.tv_sec = p2->ts.tv_sec = 1000000;
+    p1->ts.tv_usec = p2->ts.tv_usec = 0;
+
+    f = FlowGetFlowFromHash(NULL, &dtv, p1);
+    if (f == NULL)
+        goto end;
+    f->lastts = p1->ts;
+    FLOWLOCK_UNLOCK(f);
+
+    /* the first call starts the time slices, then the flow is still
+     * well within its timeout */
+    ts = p1->ts;
+    if (FlowThreadTableTimeout(dtv.flow_table, &ts, &flow_recycle_q) != 0)
+        goto end;
+    ts.tv_sec += 2;
+    if (FlowThreadTableTimeout(dtv.flow_table, &ts, &flow_recycle_q) != 0) {
+        printf("flow timed out too early: ");
+        goto end;
+    }
+
+    /* an hour later a full scan times it out */
+    ts.tv_sec += 3600;
+    if (FlowThreadTableTimeout(dtv.flow_table, &ts, &flow_recycle_q) != 1) {
+        printf("flow not timed out: ");
+        goto end;
+    }
+    if (FlowThreadTableTestCount(dtv.flow_table) != 0 || flow_recycle_q.len != 1)
+        goto end;
+
+    /* traffic stops: the idle handler takes over using the engine time */
+    f = FlowGetFlowFromHash(NULL, &dtv, p2);
+    if (f == NULL)
+        goto end;
+    f->lastts = ts;
+    FLOWLOCK_UNLOCK(f);
+
+    ts.tv_sec += 3600;
+    TimeSet(&ts);
+    FlowHandleIdle(NULL, &dtv);
+    if (FlowThreadTableTestCount(dtv.flow_table) != 0 || flow_recycle_q.len != 2) {
+        printf("idle thread didn't time out its flow: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (dtv.flow_table != NULL)
+        FlowThreadTableFree(dtv.flow_table);
+    if (p1 != NULL)
+        UTHFreePacket(p1);
+    if (p2 != NULL)
+        UTHFreePacket(p2);
+    FlowThreadTableTestDeinit();
+    TimeModeSetLive();
+    return result;
+}
+
+/** \test emergency eviction takes flows from the thread's own table */
+static int FlowThreadTableTest03(void)
+{
+    int result = 0;
+    DecodeThreadVars dtv;
+    Packet *p = NULL;
+    Flow *f;
+    int i;
+
+    memset(&dtv, 0x00, sizeof(dtv));
+    FlowThreadTableTestInit();
+
+    dtv.flow_table = FlowThreadTableNew();
+    if (dtv.flow_table == NULL)
+        goto end;
+
+    p = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "10.0.0.1", "10.0.0.2", 1024, 80);
+    if (p == NULL)
+        goto end;
+
+    for (i = 0; i < 4; i++) {
+        p->sp = (uint16_t)(1024 + i);
+        f = FlowGetFlowFromHash(NULL, &dtv, p);
+        if (f == NULL)
+            goto end;
+        FLOWLOCK_UNLOCK(f);
+    }
+
+    /* a flow in use is never evicted */
+    p->sp = 1024;
+    f = FlowGetFlowFromHash(NULL, &dtv, p);
+    if (f == NULL)
+        goto end;
+    FlowIncrUsecnt(f);
+    FLOWLOCK_UNLOCK(f);
+
+    for (i = 0; i < 3; i++) {
+        Flow *used = FlowThreadTableGetUsedFlow(NULL, &dtv);
+        if (used == NULL || used == f) {
+            printf("eviction %d returned %p: ", i, used);
+            FlowDecrUsecnt(f);
+            goto end;
+        }
+        if (used->fb != NULL || FlowThreadTableTestCount(dtv.flow_table) != (uint32_t)(3 - i)) {
+            printf("evicted flow still in the table: ");
+            FlowDecrUsecnt(f);
+            goto end;
+        }
+        FlowEnqueue(&flow_spare_q, used);
+    }
+    if (FlowThreadTableGetUsedFlow(NULL, &dtv) != NULL) {
+        printf("evicted the flow in use: ");
+        FlowDecrUsecnt(f);
+        goto end;
+    }
+    FlowDecrUsecnt(f);
+
+    result = 1;
+end:
+    if (dtv.flow_table != NULL)
+        FlowThreadTableFree(dtv.flow_table);
+    if (p != NULL)
+        UTHFreePacket(p);
+    FlowThreadTableTestDeinit();
+    return result;
+}
+
+/** \test with a spare cache the owner recycles its timed out flows itself
+ *        instead of handing them to the flow recycler */
+static int FlowThreadTableTest04(void)
+{
+    int result = 0;
+    DecodeThreadVars dtv;
+    Packet *p = NULL;
+    Flow *f;
+    struct timeval ts;
+
+    memset(&dtv, 0x00, sizeof(dtv));
+    TimeModeSetOffline();
+    FlowThreadTableTestInit();
+
+    uint32_t spare = flow_spare_q.len;
+    dtv.flow_table = FlowThreadTableNew();
+    dtv.flow_spare_cache = FlowSpareCacheNew(8);
+    if (dtv.flow_table == NULL || dtv.flow_spare_cache == NULL)
+        goto end;
+
+    p = UTHBuildPacketReal(NULL, 0, IPPROTO_UDP, "10.0.0.1", "10.0.0.2", 1024, 53);
+    if (p == NULL)
+        goto end;
+    p->ts.tv_sec = 1000000;
+    p->ts.tv_usec = 0;
+
+    f = FlowGetFlowFromHash(NULL, &dtv, p);
+    if (f == NULL)
+        goto end;
+    f->lastts = p->ts;
+    FLOWLOCK_UNLOCK(f);
+
+    ts = p->ts;
+    TimeSet(&ts);
+    FlowHandleIdle(NULL, &dtv);
+
+    ts.tv_sec += 3600;
+    TimeSet(&ts);
+    FlowHandleIdle(NULL, &dtv);
+
+    if (FlowThreadTableTestCount(dtv.flow_table) != 0) {
+        printf("flow not timed out: ");
+        goto end;
+    }
+    if (flow_recycle_q.len != 0 || dtv.flow_table->recycle_q->len != 0) {
+        printf("flow handed to the recycler: ");
+        goto end;
+    }
+    /* recycled into the cache, which the idle thread gave back */
+    if (dtv.flow_spare_cache->len != 0 || flow_spare_q.len != spare) {
+        printf("cache len %u spare %u (%u): ", dtv.flow_spare_cache->len,
+                flow_spare_q.len, spare);
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (dtv.flow_table != NULL)
+        FlowThreadTableFree(dtv.flow_table);
+    if (dtv.flow_spare_cache != NULL)
+        FlowSpareCacheFree(dtv.flow_spare_cache);
+    if (p != NULL)
+        UTHFreePacket(p);
+    FlowThreadTableTestDeinit();
+    TimeModeSetLive();
+    return result;
+}
+
+#define FLOW_LOOKUP_STATS_FLOWS     (1 << 17)
+#define FLOW_LOOKUP_STATS_LOOKUPS   (1 << 22)
+
+/** \test print the number of flow lookups per second, e.g. to compare Flow
+ *        layouts. The hash has 8 flows per row on average and the flows
+ *        are looked up in a scattered order, so most lookups walk flows
+ *        that aren't in the cache. */
+static int FlowHashLookupStatsTest01(void)
+{
+    int result = 0;
+    uint32_t i;
+    struct timeval start, end;
+
+    ConfCreateContextBackup();
+    ConfInit();
+    ConfSet("flow.hash-size", "16384");
+    ConfSet("flow.prealloc", "0");
+    ConfSet("flow.memcap", "1gb");
+    FlowInitConfig(FLOW_QUIET);
+
+    Packet *p = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "10.0.0.1",
+            "192.168.0.1", 1024, 80);
+    if (p == NULL)
+        goto end;
+
+    for (i = 0; i < FLOW_LOOKUP_STATS_FLOWS; i++) {
+        p->src.addr_data32[0] = htonl(0x0a000000 + i);
+        Flow *f = FlowGetFlowFromHash(NULL, NULL, p);
+        if (f == NULL)
+            goto end;
+        FLOWLOCK_UNLOCK(f);
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < FLOW_LOOKUP_STATS_LOOKUPS; i++) {
+        /* odd multiplier: visits every flow, in a scattered order */
+        uint32_t n = (i * 2654435761U) & (FLOW_LOOKUP_STATS_FLOWS - 1);
+        p->src.addr_data32[0] = htonl(0x0a000000 + n);
+        Flow *f = FlowGetFlowFromHash(NULL, NULL, p);
+        if (f == NULL)
+            goto end;
+        FLOWLOCK_UNLOCK(f);
+    }
+    gettimeofday(&end, NULL);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+        (double)(end.tv_usec - start.tv_usec) / 1000000.0;
+    printf("\n%u lookups in %.3fs: %.0f lookups/s (sizeof(Flow) %"PRIuMAX")\n",
+            FLOW_LOOKUP_STATS_LOOKUPS, secs,
+            secs > 0 ? (double)FLOW_LOOKUP_STATS_LOOKUPS / secs : 0,
+            (uintmax_t)sizeof(Flow));
+    result = 1;
+end:
+    if (p != NULL)
+        UTHFreePacket(p);
+    FlowShutdown();
+    ConfDeInit();
+    ConfRestoreContextBackup();
+    return result;
+}
+#endif /* UNITTESTS */
+
+void FlowHashRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("FlowHashStressTest01", FlowHashStressTest01, 1);
+    UtRegisterTest("FlowHashStressTest02", FlowHashStressTest02, 1);
+    UtRegisterTest("FlowThreadTableTest01", FlowThreadTableTest01, 1);
+    UtRegisterTest("FlowThreadTableTest02", FlowThreadTableTest02, 1);
+    UtRegisterTest("FlowThreadTableTest03", FlowThreadTableTest03, 1);
+    UtRegisterTest("FlowThreadTableTest04", FlowThreadTableTest04, 1);
+    UtRegisterTest("FlowHashLookupStatsTest01", FlowHashLookupStatsTest01, 1);
+#endif /* UNITTESTS */
+}
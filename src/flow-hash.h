@@ -66,10 +66,52 @@ typedef struct FlowBucket_ {
     #error Enable FBLOCK_SPIN or FBLOCK_MUTEX
 #endif
 
+/** \brief flow table owned by a single thread
+ *
+ *  Used with flow.thread-tables in runmodes where a flow is always handled
+ *  by the same thread. The owner looks up flows without bucket locks and
+ *  times them out itself. */
+typedef struct FlowThreadTable_ {
+    FlowBucket *hash;       /**< size buckets */
+    uint32_t size;          /**< number of buckets */
+    uint32_t prune_idx;     /**< where to start looking for a flow to evict */
+    uint32_t scan_idx;      /**< next bucket for the timeout scan */
+    uint64_t scan_slice;    /**< time slice of the last timeout scan */
+    struct FlowQueue_ *recycle_q; /**< timed out flows the owner recycles */
+    struct FlowThreadTable_ *next;
+} FlowThreadTable;
+
+/** \brief thread doing lockless lookups in the global flow hash
+ *
+ *  The reader's seq is odd while it walks a bucket without holding the
+ *  bucket lock. Flows that were part of the hash are only freed once every
+ *  reader that was walking a bucket has moved on, see
+ *  FlowLocklessGraceStart() and FlowLocklessGraceDone(). */
+typedef struct FlowLocklessReader_ {
+    SC_ATOMIC_DECLARE(uint64_t, seq);
+    uint64_t grace_seq;     /**< seq at the start of the grace period */
+    struct FlowLocklessReader_ *next;
+} FlowLocklessReader;
+
+/** Read a hash list pointer that may be updated concurrently by a writer
+ *  holding the bucket lock. Used by the lockless lookup path. */
+#define FLOW_HASH_READ_PTR(ptr) (*(__typeof__(ptr) volatile *)&(ptr))
+
 /* prototypes */
 
 Flow *FlowGetFlowFromHash(ThreadVars *tv, DecodeThreadVars *dtv, const Packet *);
 
+FlowThreadTable *FlowThreadTableNew(void);
+void FlowThreadTableFree(FlowThreadTable *);
+void FlowThreadTablesWalk(void (*Func)(FlowBucket *, uint32_t));
+
+FlowLocklessReader *FlowLocklessReaderRegister(void);
+void FlowLocklessReaderDeregister(FlowLocklessReader *);
+void FlowLocklessGraceStart(void);
+int FlowLocklessGraceDone(void);
+
+void FlowHashRegisterTests(void);
+
 /** enable to print stats on hash lookups in flow-debug.log */
 //#define FLOW_DEBUG_STATS
 
@@ -89,12 +89,47 @@ SC_ATOMIC_EXTERN(unsigned int, flow_flags);
 #define FLOW_EMERG_MODE_UPDATE_DELAY_NSEC 100000
 #define NEW_FLOW_COUNT_COND 10
 
+/* capture methods that bypass flows register a check function so we
+ * can time out their flows */
+#define FLOW_BYPASS_CHECK_MAX 4
+
+/* thread flow tables are checked for timeouts in this many slices per second */
+#define FLOW_THREAD_TABLE_SLICES 16
+
+typedef struct FlowBypassCheck_ {
+    FlowBypassCheckFunc CheckFunc;
+    void *data;
+} FlowBypassCheck;
+
+static FlowBypassCheck flow_bypass_checks[FLOW_BYPASS_CHECK_MAX];
+static int flow_bypass_checks_cnt = 0;
+static SCMutex flow_bypass_checks_lock = SCMUTEX_INITIALIZER;
+
 typedef struct FlowTimeoutCounters_ {
     uint32_t new;
     uint32_t est;
     uint32_t clo;
+
+    uint32_t flows_checked;     /**< flows looked at */
+    uint32_t rows_checked;      /**< hash rows looked at */
 } FlowTimeoutCounters;
 
+/* timer wheel with one slot per second. Flows due further out than the
+ * wheel covers are put in the last slot and rescheduled from there. */
+#define FLOW_WHEEL_SIZE 4096
+#define FLOW_WHEEL_MASK (FLOW_WHEEL_SIZE - 1)
+
+typedef struct FlowWheelSlot_ {
+    SCMutex m;
+    Flow *head;
+} FlowWheelSlot;
+
+/** the wheel, NULL if disabled */
+static FlowWheelSlot *flow_wheel = NULL;
+/** first second not completely handled yet, 0 if the wheel didn't run yet.
+ *  Only moved forward while holding the lock of the slot it moves past. */
+SC_ATOMIC_DECLARE(uint32_t, flow_wheel_cur);
+
 /**
  * \brief Used to kill flow manager thread(s).
  *
@@ -255,6 +290,324 @@ static int FlowManagerFlowTimedOut(Flow *f, struct timeval *ts)
     return 1;
 }
 
+/** \internal
+ *  \brief remove a timed out flow from the hash and hand it to the recycler
+ *
+ *  Flow and bucket are locked and the flow isn't on the timer wheel
+ *  anymore. The flow is unlocked on return.
+ *
+ *  \param recycle_q queue to put the flow in, normally flow_recycle_q
+ */
+static void FlowManagerFlowRemove(Flow *f, int state, int emergency,
+        FlowTimeoutCounters *counters, FlowQueue *recycle_q)
+{
+    /* remove from the hash */
+    if (f->hprev != NULL)
+        f->hprev->hnext = f->hnext;
+    if (f->hnext != NULL)
+        f->hnext->hprev = f->hprev;
+    if (f->fb->head == f)
+        f->fb->head = f->hnext;
+    if (f->fb->tail == f)
+        f->fb->tail = f->hprev;
+
+    f->hnext = NULL;
+    f->hprev = NULL;
+    f->fb = NULL;
+
+    if (state == FLOW_STATE_NEW)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
+    else if (state == FLOW_STATE_ESTABLISHED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_ESTABLISHED;
+    else if (state == FLOW_STATE_CLOSED)
+        f->flow_end_flags |= FLOW_END_FLAG_STATE_CLOSED;
+
+    if (emergency)
+        f->flow_end_flags |= FLOW_END_FLAG_EMERGENCY;
+    f->flow_end_flags |= FLOW_END_FLAG_TIMEOUT;
+
+    /* no one is referring to this flow, use_cnt 0, removed from hash
+     * so we can unlock it and move it to the recycle queue. */
+    FLOWLOCK_UNLOCK(f);
+    FlowEnqueue(recycle_q, f);
+
+    switch (state) {
+        case FLOW_STATE_NEW:
+        default:
+            counters->new++;
+            break;
+        case FLOW_STATE_ESTABLISHED:
+            counters->est++;
+            break;
+        case FLOW_STATE_CLOSED:
+            counters->clo++;
+            break;
+    }
+}
+
+/** \brief set up the timer wheel if enabled in the config */
+void FlowWheelInit(void)
+{
+    uint32_t u;
+
+    SC_ATOMIC_INIT(flow_wheel_cur);
+
+    if (!flow_config.timer_wheel)
+        return;
+
+    flow_wheel = SCMallocAligned(FLOW_WHEEL_SIZE * sizeof(FlowWheelSlot), CLS);
+    if (unlikely(flow_wheel == NULL)) {
+        SCLogError(SC_ERR_FATAL, "allocating the flow timer wheel failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(flow_wheel, 0x00, FLOW_WHEEL_SIZE * sizeof(FlowWheelSlot));
+    for (u = 0; u < FLOW_WHEEL_SIZE; u++) {
+        SCMutexInit(&flow_wheel[u].m, NULL);
+    }
+}
+
+/** \brief free the timer wheel. The flows are freed with the hash. */
+void FlowWheelDestroy(void)
+{
+    uint32_t u;
+
+    if (flow_wheel != NULL) {
+        for (u = 0; u < FLOW_WHEEL_SIZE; u++) {
+            SCMutexDestroy(&flow_wheel[u].m);
+        }
+        SCFreeAligned(flow_wheel);
+        flow_wheel = NULL;
+    }
+    SC_ATOMIC_DESTROY(flow_wheel_cur);
+}
+
+/** \internal
+ *  \brief get the second a flow is due to be checked in its current state */
+static inline uint32_t FlowWheelDue(Flow *f, int state, uint32_t sec)
+{
+    return sec + FlowGetFlowTimeout(f, state, 0);
+}
+
+/** \internal
+ *  \brief unlink a flow from its slot, the slot lock is held */
+static inline void FlowWheelUnlink(FlowWheelSlot *s, Flow *f)
+{
+    if (f->wprev != NULL)
+        f->wprev->wnext = f->wnext;
+    if (f->wnext != NULL)
+        f->wnext->wprev = f->wprev;
+    if (s->head == f)
+        s->head = f->wnext;
+
+    f->wnext = NULL;
+    f->wprev = NULL;
+    f->wheel_slot = 0;
+}
+
+/** \internal
+ *  \brief link a locked flow into the slot of second 'due'
+ *
+ *  The due time is moved into the range the wheel covers. If the slot
+ *  was passed by the flow manager in the meantime, we try again.
+ *
+ *  \param locked slot already locked by the caller, or NULL
+ */
+static void FlowWheelLink(Flow *f, uint32_t due, FlowWheelSlot *locked)
+{
+    while (1) {
+        uint32_t cur = SC_ATOMIC_GET(flow_wheel_cur);
+        uint32_t sec = due;
+        if (cur != 0) {
+            if (sec < cur)
+                sec = cur;
+            else if (sec - cur >= FLOW_WHEEL_SIZE)
+                sec = cur + FLOW_WHEEL_SIZE - 1;
+        }
+
+        FlowWheelSlot *s = &flow_wheel[sec & FLOW_WHEEL_MASK];
+        if (s != locked) {
+            SCMutexLock(&s->m);
+            if (SC_ATOMIC_GET(flow_wheel_cur) > sec) {
+                SCMutexUnlock(&s->m);
+                continue;
+            }
+        }
+
+        f->wprev = NULL;
+        f->wnext = s->head;
+        if (s->head != NULL)
+            s->head->wprev = f;
+        s->head = f;
+        f->wheel_slot = (sec & FLOW_WHEEL_MASK) + 1;
+        f->wheel_ts = sec;
+
+        if (s != locked)
+            SCMutexUnlock(&s->m);
+        return;
+    }
+}
+
+/**
+ *  \brief put a new flow on the timer wheel
+ *
+ *  \param f new flow, locked, just added to the (locked) hash bucket
+ *  \param ts packet timestamp
+ */
+void FlowWheelAdd(Flow *f, const struct timeval *ts)
+{
+    if (flow_wheel == NULL)
+        return;
+
+    FlowWheelLink(f, FlowWheelDue(f, FLOW_STATE_NEW, (uint32_t)ts->tv_sec), NULL);
+}
+
+/**
+ *  \brief take a flow off the timer wheel
+ *
+ *  Called with the flow locked, before it's removed from the hash.
+ */
+void FlowWheelRemove(Flow *f)
+{
+    if (f->wheel_slot == 0)
+        return;
+
+    FlowWheelSlot *s = &flow_wheel[f->wheel_slot - 1];
+    SCMutexLock(&s->m);
+    FlowWheelUnlink(s, f);
+    SCMutexUnlock(&s->m);
+}
+
+/**
+ *  \brief reschedule a flow after its state changed
+ *
+ *  Flows are only rescheduled if the new state makes them time out
+ *  sooner, e.g. when a TCP session is closed. A later timeout is picked
+ *  up when the flow manager checks the flow.
+ *
+ *  \param f locked flow
+ *  \param ts packet timestamp
+ */
+void FlowWheelUpdate(Flow *f, const struct timeval *ts)
+{
+    if (f->wheel_slot == 0)
+        return;
+
+    int state = FlowGetFlowState(f);
+    uint32_t due = FlowWheelDue(f, state, (uint32_t)ts->tv_sec);
+    if (due >= f->wheel_ts)
+        return;
+
+    FlowWheelRemove(f);
+    FlowWheelLink(f, due, NULL);
+}
+
+/** \internal
+ *  \brief time out the due flows of a wheel slot
+ *
+ *  Slot, bucket and flow are taken in the reverse order of the packet
+ *  path, so the bucket and flow are only tried. Flows we can't lock
+ *  stay in the slot.
+ *
+ *  \retval 1 all due flows were handled
+ *  \retval 0 some flows are left
+ */
+static int FlowWheelSlotTimeout(FlowWheelSlot *s, struct timeval *ts,
+        FlowTimeoutCounters *counters, uint32_t *cnt)
+{
+    uint32_t now = (uint32_t)ts->tv_sec;
+    int done = 1;
+    Flow *f = s->head;
+
+    while (f != NULL) {
+        Flow *next_flow = f->wnext;
+
+        if (f->wheel_ts > now) {
+            f = next_flow;
+            continue;
+        }
+
+        /* a flow on the wheel is in the hash and can't be removed from it
+         * without taking the slot lock we hold */
+        FlowBucket *fb = f->fb;
+        if (FBLOCK_TRYLOCK(fb) != 0) {
+            done = 0;
+            f = next_flow;
+            continue;
+        }
+        if (FLOWLOCK_TRYWRLOCK(f) != 0) {
+            FBLOCK_UNLOCK(fb);
+            done = 0;
+            f = next_flow;
+            continue;
+        }
+
+        counters->flows_checked++;
+        FlowWheelUnlink(s, f);
+
+        int state = FlowGetFlowState(f);
+        if (FlowManagerFlowTimeout(f, state, ts, 0) == 0) {
+            uint32_t due = FlowWheelDue(f, state, (uint32_t)f->lastts.tv_sec);
+            FlowWheelLink(f, due > now ? due : now + 1, s);
+            FLOWLOCK_UNLOCK(f);
+        } else if (FlowManagerFlowTimedOut(f, ts) == 1) {
+            FlowManagerFlowRemove(f, state, 0, counters, &flow_recycle_q);
+            (*cnt)++;
+        } else {
+            /* still in use or being reassembled, try again next second */
+            FlowWheelLink(f, now + 1, s);
+            FLOWLOCK_UNLOCK(f);
+        }
+
+        FBLOCK_UNLOCK(fb);
+        f = next_flow;
+    }
+
+    return done;
+}
+
+/**
+ *  \brief time out flows using the timer wheel
+ *
+ *  Only the slots of the seconds that passed since the last run are
+ *  looked at. Slots that still have due flows we couldn't lock are
+ *  looked at again on the next run.
+ *
+ *  \param ts timestamp
+ *  \param counters ptr to FlowTimeoutCounters structure
+ *
+ *  \retval cnt number of timed out flows
+ */
+static uint32_t FlowTimeoutWheel(struct timeval *ts, FlowTimeoutCounters *counters)
+{
+    uint32_t now = (uint32_t)ts->tv_sec;
+    uint32_t cur = SC_ATOMIC_GET(flow_wheel_cur);
+    uint32_t cnt = 0;
+    uint32_t sec;
+    int done = 1;
+
+    if (cur > now)
+        return 0;
+
+    /* first run or after a time jump: look at every slot once */
+    if (cur == 0 || now - cur >= FLOW_WHEEL_SIZE) {
+        cur = (now >= FLOW_WHEEL_SIZE) ? now - FLOW_WHEEL_SIZE + 1 : 0;
+        SC_ATOMIC_SET(flow_wheel_cur, cur);
+    }
+
+    for (sec = cur; sec <= now; sec++) {
+        FlowWheelSlot *s = &flow_wheel[sec & FLOW_WHEEL_MASK];
+
+        SCMutexLock(&s->m);
+        if (FlowWheelSlotTimeout(s, ts, counters, &cnt) == 0)
+            done = 0;
+        if (done)
+            SC_ATOMIC_SET(flow_wheel_cur, sec + 1);
+        SCMutexUnlock(&s->m);
+    }
+
+    return cnt;
+}
+
 /**
  *  \internal
  *
@@ -268,7 +621,7 @@ static int FlowManagerFlowTimedOut(Flow *f, struct timeval *ts)
  *  \retval cnt timed out flows
  */
 static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
-        int emergency, FlowTimeoutCounters *counters)
+        int emergency, FlowTimeoutCounters *counters, FlowQueue *recycle_q)
 {
     uint32_t cnt = 0;
 
@@ -280,6 +633,7 @@ static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
 
         Flow *next_flow = f->hprev;
 
+        counters->flows_checked++;
         int state = FlowGetFlowState(f);
 
         /* timeout logic goes here */
@@ -292,53 +646,9 @@ static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
         /* check if the flow is fully timed out and
          * ready to be discarded. */
         if (FlowManagerFlowTimedOut(f, ts) == 1) {
-            /* remove from the hash */
-            if (f->hprev != NULL)
-                f->hprev->hnext = f->hnext;
-            if (f->hnext != NULL)
-                f->hnext->hprev = f->hprev;
-            if (f->fb->head == f)
-                f->fb->head = f->hnext;
-            if (f->fb->tail == f)
-                f->fb->tail = f->hprev;
-
-            f->hnext = NULL;
-            f->hprev = NULL;
-
-            if (state == FLOW_STATE_NEW)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
-            else if (state == FLOW_STATE_ESTABLISHED)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_ESTABLISHED;
-            else if (state == FLOW_STATE_CLOSED)
-                f->flow_end_flags |= FLOW_END_FLAG_STATE_CLOSED;
-
-            if (emergency)
-                f->flow_end_flags |= FLOW_END_FLAG_EMERGENCY;
-            f->flow_end_flags |= FLOW_END_FLAG_TIMEOUT;
-
-//            FlowClearMemory (f, f->protomap);
-
-            /* no one is referring to this flow, use_cnt 0, removed from hash
-             * so we can unlock it and move it back to the spare queue. */
-            FLOWLOCK_UNLOCK(f);
-            FlowEnqueue(&flow_recycle_q, f);
-            /* move to spare list */
-//            FlowMoveToSpare(f);
-
+            FlowWheelRemove(f);
+            FlowManagerFlowRemove(f, state, emergency, counters, recycle_q);
             cnt++;
-
-            switch (state) {
-                case FLOW_STATE_NEW:
-                default:
-                    counters->new++;
-                    break;
-                case FLOW_STATE_ESTABLISHED:
-                    counters->est++;
-                    break;
-                case FLOW_STATE_CLOSED:
-                    counters->clo++;
-                    break;
-            }
         } else {
             FLOWLOCK_UNLOCK(f);
         }
@@ -352,17 +662,19 @@ static uint32_t FlowManagerHashRowTimeout(Flow *f, struct timeval *ts,
 /**
  *  \brief time out flows from the hash
  *
+ *  \param hash flow hash, the global one or a thread flow table
  *  \param ts timestamp
  *  \param try_cnt number of flows to time out max (0 is unlimited)
  *  \param hash_min min hash index to consider
  *  \param hash_max max hash index to consider
  *  \param counters ptr to FlowTimeoutCounters structure
+ *  \param recycle_q queue for the timed out flows
  *
  *  \retval cnt number of timed out flow
  */
-static uint32_t FlowTimeoutHash(struct timeval *ts, uint32_t try_cnt,
-        uint32_t hash_min, uint32_t hash_max,
-        FlowTimeoutCounters *counters)
+static uint32_t FlowTimeoutHash(FlowBucket *hash, struct timeval *ts,
+        uint32_t try_cnt, uint32_t hash_min, uint32_t hash_max,
+        FlowTimeoutCounters *counters, FlowQueue *recycle_q)
 {
     uint32_t idx = 0;
     uint32_t cnt = 0;
@@ -372,18 +684,20 @@ static uint32_t FlowTimeoutHash(struct timeval *ts, uint32_t try_cnt,
         emergency = 1;
 
     for (idx = hash_min; idx < hash_max; idx++) {
-        FlowBucket *fb = &flow_hash[idx];
+        FlowBucket *fb = &hash[idx];
 
         if (FBLOCK_TRYLOCK(fb) != 0)
             continue;
 
         /* flow hash bucket is now locked */
+        counters->rows_checked++;
 
         if (fb->tail == NULL)
             goto next;
 
         /* we have a flow, or more than one */
-        cnt += FlowManagerHashRowTimeout(fb->tail, ts, emergency, counters);
+        cnt += FlowManagerHashRowTimeout(fb->tail, ts, emergency, counters,
+                recycle_q);
 
 next:
         FBLOCK_UNLOCK(fb);
@@ -415,6 +729,8 @@ static uint32_t FlowManagerHashRowCleanup(Flow *f)
 
         int state = FlowGetFlowState(f);
 
+        FlowWheelRemove(f);
+
         /* remove from the hash */
         if (f->hprev != NULL)
             f->hprev->hnext = f->hnext;
@@ -427,6 +743,7 @@ static uint32_t FlowManagerHashRowCleanup(Flow *f)
 
         f->hnext = NULL;
         f->hprev = NULL;
+        f->fb = NULL;
 
         if (state == FLOW_STATE_NEW)
             f->flow_end_flags |= FLOW_END_FLAG_STATE_NEW;
@@ -454,14 +771,17 @@ static uint32_t FlowManagerHashRowCleanup(Flow *f)
 /**
  *  \brief remove all flows from the hash
  *
+ *  \param hash the global flow hash or a thread flow table
+ *  \param size number of buckets in the hash
+ *
  *  \retval cnt number of removes out flows
  */
-static uint32_t FlowCleanupHash(void){
+static uint32_t FlowCleanupHash(FlowBucket *hash, uint32_t size){
     uint32_t idx = 0;
     uint32_t cnt = 0;
 
-    for (idx = 0; idx < flow_config.hash_size; idx++) {
-        FlowBucket *fb = &flow_hash[idx];
+    for (idx = 0; idx < size; idx++) {
+        FlowBucket *fb = &hash[idx];
 
         FBLOCK_LOCK(fb);
 
@@ -476,6 +796,123 @@ static uint32_t FlowCleanupHash(void){
     return cnt;
 }
 
+/** \internal
+ *  \brief FlowThreadTablesWalk callback handing all flows to the recycler */
+static void FlowCleanupThreadTable(FlowBucket *hash, uint32_t size)
+{
+    (void)FlowCleanupHash(hash, size);
+}
+
+/**
+ *  \brief time out flows in a thread owned flow table
+ *
+ *  Called by the owning thread for each packet and from its capture loop
+ *  when it's idle. Each time the time enters a new
+ *  1/FLOW_THREAD_TABLE_SLICES second, the next slice of the table is
+ *  checked, so the table is checked about once a second like the flow
+ *  manager does for the global hash. Timed out flows are put in
+ *  'recycle_q': flow_recycle_q to hand them to the flow recycler, or the
+ *  table's own queue if the owner recycles them itself.
+ *
+ *  \param ft the thread's flow table
+ *  \param ts packet timestamp or current time
+ *  \param recycle_q queue for the timed out flows
+ *
+ *  \retval cnt number of timed out flows
+ */
+uint32_t FlowThreadTableTimeout(FlowThreadTable *ft, struct timeval *ts,
+        FlowQueue *recycle_q)
+{
+    uint64_t slice = (uint64_t)ts->tv_sec * FLOW_THREAD_TABLE_SLICES +
+        ts->tv_usec / (1000000 / FLOW_THREAD_TABLE_SLICES);
+
+    if (likely(slice == ft->scan_slice))
+        return 0;
+
+    /* first packet or time went backwards: just start counting */
+    if (ft->scan_slice == 0 || slice < ft->scan_slice) {
+        ft->scan_slice = slice;
+        return 0;
+    }
+
+    uint64_t slices = slice - ft->scan_slice;
+    ft->scan_slice = slice;
+
+    uint32_t todo = ft->size;
+    if (slices < FLOW_THREAD_TABLE_SLICES) {
+        uint32_t per_slice = ft->size / FLOW_THREAD_TABLE_SLICES;
+        todo = (uint32_t)slices * (per_slice ? per_slice : 1);
+    }
+
+    FlowTimeoutCounters counters = { 0, 0, 0, };
+    uint32_t cnt = 0;
+    while (todo > 0) {
+        uint32_t max = ft->scan_idx + todo;
+        if (max > ft->size)
+            max = ft->size;
+
+        cnt += FlowTimeoutHash(ft->hash, ts, 0, ft->scan_idx, max, &counters,
+                recycle_q);
+
+        todo -= (max - ft->scan_idx);
+        ft->scan_idx = (max == ft->size) ? 0 : max;
+    }
+
+    return cnt;
+}
+
+/**
+ *  \brief hand all flows of a thread owned flow table to the recycler
+ *
+ *  \retval cnt number of flows
+ */
+uint32_t FlowThreadTableCleanup(FlowThreadTable *ft)
+{
+    return FlowCleanupHash(ft->hash, ft->size);
+}
+
+/**
+ *  \brief Register a function checking the flows bypassed by a capture
+ *         method. It's called by the flow manager about once a second.
+ *
+ *  \param CheckFunc the check function
+ *  \param data data passed to the check function
+ *
+ *  \retval 0 ok
+ *  \retval -1 too many check functions
+ */
+int FlowManagerRegisterBypassCheck(FlowBypassCheckFunc CheckFunc, void *data)
+{
+    int r = -1;
+
+    SCMutexLock(&flow_bypass_checks_lock);
+    if (flow_bypass_checks_cnt < FLOW_BYPASS_CHECK_MAX) {
+        flow_bypass_checks[flow_bypass_checks_cnt].CheckFunc = CheckFunc;
+        flow_bypass_checks[flow_bypass_checks_cnt].data = data;
+        flow_bypass_checks_cnt++;
+        r = 0;
+    }
+    SCMutexUnlock(&flow_bypass_checks_lock);
+    return r;
+}
+
+/** \internal
+ *  \brief run the registered bypass check functions
+ *
+ *  \param ts timestamp
+ *  \param stats stats to update
+ */
+static void FlowBypassCheckRun(struct timeval *ts, FlowBypassStats *stats)
+{
+    int i;
+
+    SCMutexLock(&flow_bypass_checks_lock);
+    for (i = 0; i < flow_bypass_checks_cnt; i++) {
+        flow_bypass_checks[i].CheckFunc(ts, stats, flow_bypass_checks[i].data);
+    }
+    SCMutexUnlock(&flow_bypass_checks_lock);
+}
+
 extern int g_detect_disabled;
 
 typedef struct FlowManagerThreadData_ {
@@ -486,10 +923,16 @@ typedef struct FlowManagerThreadData_ {
     uint16_t flow_mgr_cnt_clo;
     uint16_t flow_mgr_cnt_new;
     uint16_t flow_mgr_cnt_est;
+    uint16_t flow_mgr_timeouts_per_sec;
+    uint16_t flow_mgr_flows_checked;
+    uint16_t flow_mgr_rows_checked;
     uint16_t flow_mgr_memuse;
     uint16_t flow_mgr_spare;
     uint16_t flow_emerg_mode_enter;
     uint16_t flow_emerg_mode_over;
+    uint16_t flow_bypassed_pkts;
+    uint16_t flow_bypassed_bytes;
+    uint16_t flow_bypassed_active;
 } FlowManagerThreadData;
 
 static TmEcode FlowManagerThreadInit(ThreadVars *t, void *initdata, void **data)
@@ -526,6 +969,12 @@ static TmEcode FlowManagerThreadInit(ThreadVars *t, void *initdata, void **data)
             SC_PERF_TYPE_UINT64, "NULL");
     ftd->flow_mgr_cnt_est = SCPerfTVRegisterCounter("flow_mgr.est_pruned", t,
             SC_PERF_TYPE_UINT64, "NULL");
+    ftd->flow_mgr_timeouts_per_sec = SCPerfTVRegisterCounter("flow_mgr.timeouts_per_sec", t,
+            SC_PERF_TYPE_UINT64, "NULL");
+    ftd->flow_mgr_flows_checked = SCPerfTVRegisterCounter("flow_mgr.flows_checked", t,
+            SC_PERF_TYPE_UINT64, "NULL");
+    ftd->flow_mgr_rows_checked = SCPerfTVRegisterCounter("flow_mgr.rows_checked", t,
+            SC_PERF_TYPE_UINT64, "NULL");
     ftd->flow_mgr_memuse = SCPerfTVRegisterCounter("flow.memuse", t,
             SC_PERF_TYPE_UINT64, "NULL");
     ftd->flow_mgr_spare = SCPerfTVRegisterCounter("flow.spare", t,
@@ -534,6 +983,14 @@ static TmEcode FlowManagerThreadInit(ThreadVars *t, void *initdata, void **data)
             SC_PERF_TYPE_UINT64, "NULL");
     ftd->flow_emerg_mode_over = SCPerfTVRegisterCounter("flow.emerg_mode_over", t,
             SC_PERF_TYPE_UINT64, "NULL");
+    if (ftd->instance == 1) {
+        ftd->flow_bypassed_pkts = SCPerfTVRegisterCounter("flow_bypassed.pkts", t,
+                SC_PERF_TYPE_UINT64, "NULL");
+        ftd->flow_bypassed_bytes = SCPerfTVRegisterCounter("flow_bypassed.bytes", t,
+                SC_PERF_TYPE_UINT64, "NULL");
+        ftd->flow_bypassed_active = SCPerfTVRegisterCounter("flow_bypassed.active", t,
+                SC_PERF_TYPE_UINT64, "NULL");
+    }
 
     PacketPoolInit();
     return TM_ECODE_OK;
@@ -564,6 +1021,9 @@ static TmEcode FlowManager(ThreadVars *th_v, void *thread_data)
     int emerg = FALSE;
     int prev_emerg = FALSE;
     uint32_t last_sec = 0;
+    uint32_t last_bypass_sec = 0;
+    uint32_t last_rate_sec = 0;
+    uint32_t rate_timeouts = 0;
     struct timespec cond_time;
     int flow_update_delay_sec = FLOW_NORMAL_MODE_UPDATE_DELAY_SEC;
     int flow_update_delay_nsec = FLOW_NORMAL_MODE_UPDATE_DELAY_NSEC;
@@ -617,15 +1077,52 @@ static TmEcode FlowManager(ThreadVars *th_v, void *thread_data)
         if (ftd->instance == 1)
             FlowUpdateSpareFlows();
 
-        /* try to time out flows */
+        /* try to time out flows. The timer wheel only knows the normal
+         * timeouts, so in emergency mode we walk the hash. */
         FlowTimeoutCounters counters = { 0, 0, 0, };
-        FlowTimeoutHash(&ts, 0 /* check all */, ftd->min, ftd->max, &counters);
+        uint32_t timeouts = 0;
+        if (flow_hash == NULL) {
+            /* thread flow tables: the owners time out their flows */
+        } else if (flow_wheel == NULL || emerg == TRUE) {
+            timeouts = FlowTimeoutHash(flow_hash, &ts, 0 /* check all */,
+                    ftd->min, ftd->max, &counters, &flow_recycle_q);
+        } else if (ftd->instance == 1) {
+            timeouts = FlowTimeoutWheel(&ts, &counters);
+        }
+
+        rate_timeouts += timeouts;
+        if ((uint32_t)ts.tv_sec != last_rate_sec) {
+            if (last_rate_sec != 0 && (uint32_t)ts.tv_sec > last_rate_sec) {
+                SCPerfCounterSetUI64(ftd->flow_mgr_timeouts_per_sec, th_v->sc_perf_pca,
+                        (uint64_t)(rate_timeouts / ((uint32_t)ts.tv_sec - last_rate_sec)));
+            }
+            rate_timeouts = 0;
+            last_rate_sec = (uint32_t)ts.tv_sec;
+        }
+        SCPerfCounterAddUI64(ftd->flow_mgr_flows_checked, th_v->sc_perf_pca,
+                (uint64_t)counters.flows_checked);
+        SCPerfCounterAddUI64(ftd->flow_mgr_rows_checked, th_v->sc_perf_pca,
+                (uint64_t)counters.rows_checked);
 
 
         if (ftd->instance == 1) {
             DefragTimeoutHash(&ts);
             //uint32_t hosts_pruned =
             HostTimeoutHash(&ts);
+
+            /* flows bypassed at the capture level don't update their
+             * flow, so the capture method checks their timeouts */
+            if ((uint32_t)ts.tv_sec != last_bypass_sec) {
+                FlowBypassStats bypass_stats = { 0, 0, 0 };
+                FlowBypassCheckRun(&ts, &bypass_stats);
+                SCPerfCounterAddUI64(ftd->flow_bypassed_pkts, th_v->sc_perf_pca,
+                        bypass_stats.pkts);
+                SCPerfCounterAddUI64(ftd->flow_bypassed_bytes, th_v->sc_perf_pca,
+                        bypass_stats.bytes);
+                SCPerfCounterSetUI64(ftd->flow_bypassed_active, th_v->sc_perf_pca,
+                        (uint64_t)bypass_stats.active);
+                last_bypass_sec = (uint32_t)ts.tv_sec;
+            }
         }
 /*
         SCPerfCounterAddUI64(flow_mgr_host_prune, th_v->sc_perf_pca, (uint64_t)hosts_pruned);
@@ -743,6 +1240,9 @@ void FlowManagerThreadSpawn()
     return;
 }
 
+/** number of recycled flows moved to the spare queue per queue lock */
+#define FLOW_RECYCLER_BATCH_SIZE 64
+
 typedef struct FlowRecyclerThreadData_ {
     void *output_thread_data;
 } FlowRecyclerThreadData;
@@ -814,6 +1314,8 @@ static TmEcode FlowRecycler(ThreadVars *th_v, void *thread_data)
         /* Loop through the queue and clean up all flows in it */
         if (len) {
             Flow *f;
+            FlowSpareCache batch;
+            memset(&batch, 0, sizeof(batch));
 
             while ((f = FlowDequeue(&flow_recycle_q)) != NULL) {
                 FLOWLOCK_WRLOCK(f);
@@ -822,9 +1324,14 @@ static TmEcode FlowRecycler(ThreadVars *th_v, void *thread_data)
 
                 FlowClearMemory (f, f->protomap);
                 FLOWLOCK_UNLOCK(f);
-                FlowMoveToSpare(f);
+
+                /* move the flows to the spare queue in batches */
+                FlowSpareCachePut(&batch, f);
+                if (batch.len >= FLOW_RECYCLER_BATCH_SIZE)
+                    (void)FlowSpareCacheDrain(&batch, 0);
                 recycled_cnt++;
             }
+            (void)FlowSpareCacheDrain(&batch, 0);
         }
 
         SCLogDebug("%u flows to recycle", len);
@@ -918,8 +1425,12 @@ void FlowKillFlowRecyclerThread(void)
     ThreadVars *tv = NULL;
     int cnt = 0;
 
-    /* move all flows still in the hash to the recycler queue */
-    FlowCleanupHash();
+    /* move all flows still in the hash to the recycler queue. The packet
+     * threads are done by now, so the flows in their tables are handed
+     * over as well, while the recycler can still log and clean them. */
+    if (flow_hash != NULL)
+        FlowCleanupHash(flow_hash, flow_config.hash_size);
+    FlowThreadTablesWalk(FlowCleanupThreadTable);
 
     /* make sure all flows are processed */
     do {
@@ -1073,7 +1584,7 @@ static int FlowMgrTest02 (void)
     memset(&fb, 0, sizeof(FlowBucket));
     memset(&ts, 0, sizeof(ts));
     memset(&seg, 0, sizeof(TcpSegment));
-    memset(&client, 0, sizeof(TcpSegment));
+    memset(&client, 0, sizeof(TcpStream));
 
     FBLOCK_INIT(&fb);
     FLOW_INITIALIZE(&f);
@@ -1179,7 +1690,7 @@ static int FlowMgrTest04 (void)
     memset(&fb, 0, sizeof(FlowBucket));
     memset(&ts, 0, sizeof(ts));
     memset(&seg, 0, sizeof(TcpSegment));
-    memset(&client, 0, sizeof(TcpSegment));
+    memset(&client, 0, sizeof(TcpStream));
 
     FBLOCK_INIT(&fb);
     FLOW_INITIALIZE(&f);
@@ -1254,7 +1765,8 @@ static int FlowMgrTest05 (void)
     TimeGet(&ts);
     /* try to time out flows */
     FlowTimeoutCounters counters = { 0, 0, 0, };
-    FlowTimeoutHash(&ts, 0 /* check all */, 0, flow_config.hash_size, &counters);
+    FlowTimeoutHash(flow_hash, &ts, 0 /* check all */, 0, flow_config.hash_size,
+            &counters, &flow_recycle_q);
 
     if (flow_recycle_q.len > 0) {
         result = 1;
@@ -1265,6 +1777,49 @@ static int FlowMgrTest05 (void)
 
     return result;
 }
+
+/**
+ *  \test  Test that the timer wheel only times out flows once they
+ *         are due.
+ *
+ *  \retval On success it returns 1 and on failure 0.
+ */
+
+static int FlowMgrTest06 (void)
+{
+    int result = 0;
+    struct timeval ts;
+
+    FlowInitConfig(FLOW_QUIET);
+    if (flow_wheel == NULL)
+        goto end;
+
+    UTHBuildPacketOfFlows(0, 10, 0);
+
+    /* nothing is due yet */
+    TimeGet(&ts);
+    FlowTimeoutCounters counters = { 0, 0, 0, };
+    if (FlowTimeoutWheel(&ts, &counters) != 0 || counters.flows_checked != 0 ||
+            flow_recycle_q.len != 0) {
+        goto end;
+    }
+
+    TimeSetIncrementTime(2000);
+    TimeGet(&ts);
+    if (FlowTimeoutWheel(&ts, &counters) != 10 || counters.flows_checked != 10 ||
+            flow_recycle_q.len != 10) {
+        goto end;
+    }
+
+    /* the wheel is empty now */
+    if (FlowTimeoutWheel(&ts, &counters) != 0 || counters.flows_checked != 10)
+        goto end;
+
+    result = 1;
+end:
+    FlowShutdown();
+    return result;
+}
 #endif /* UNITTESTS */
 
 /**
@@ -1278,5 +1833,6 @@ void FlowMgrRegisterTests (void)
     UtRegisterTest("FlowMgrTest03 -- Timeout a flow in emergency having fresh TcpSession", FlowMgrTest03, 1);
     UtRegisterTest("FlowMgrTest04 -- Timeout a flow in emergency having TcpSession with segments", FlowMgrTest04, 1);
     UtRegisterTest("FlowMgrTest05 -- Test flow Allocations when it reach memcap", FlowMgrTest05, 1);
+    UtRegisterTest("FlowMgrTest06 -- Timeout flows using the timer wheel", FlowMgrTest06, 1);
 #endif /* UNITTESTS */
 }
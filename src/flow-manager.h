@@ -29,6 +29,33 @@ SCCtrlCondT flow_manager_ctrl_cond;
 SCCtrlMutex flow_manager_ctrl_mutex;
 #define FlowWakeupFlowManagerThread() SCCtrlCondSignal(&flow_manager_ctrl_cond)
 
+/** \brief stats of the flows that are bypassed at the capture level */
+typedef struct FlowBypassStats_ {
+    uint64_t pkts;      /**< packets bypassed since the last check */
+    uint64_t bytes;     /**< bytes bypassed since the last check */
+    uint32_t active;    /**< number of bypassed flows still present */
+} FlowBypassStats;
+
+/** \brief function checking the bypassed flows of a capture method. It
+ *         removes the flows that were idle for longer than their timeout
+ *         and adds its stats to the FlowBypassStats. */
+typedef void (*FlowBypassCheckFunc)(struct timeval *ts,
+        FlowBypassStats *stats, void *data);
+
+int FlowManagerRegisterBypassCheck(FlowBypassCheckFunc CheckFunc, void *data);
+
+struct FlowThreadTable_;
+struct FlowQueue_;
+uint32_t FlowThreadTableTimeout(struct FlowThreadTable_ *ft, struct timeval *ts,
+        struct FlowQueue_ *recycle_q);
+uint32_t FlowThreadTableCleanup(struct FlowThreadTable_ *ft);
+
+void FlowWheelInit(void);
+void FlowWheelDestroy(void);
+void FlowWheelAdd(Flow *f, const struct timeval *ts);
+void FlowWheelUpdate(Flow *f, const struct timeval *ts);
+void FlowWheelRemove(Flow *f);
+
 void FlowManagerThreadSpawn(void);
 void FlowKillFlowManagerThread(void);
 void FlowMgrRegisterTests (void);
@@ -166,3 +166,104 @@ void FlowMoveToSpare(Flow *f)
     FQLOCK_UNLOCK(&flow_spare_q);
 }
 
+
+/**
+ *  \brief Create a thread local spare flow cache
+ *
+ *  \param size max number of flows the cache holds
+ *
+ *  \retval c cache or NULL on error
+ */
+FlowSpareCache *FlowSpareCacheNew(uint32_t size)
+{
+    FlowSpareCache *c = SCMalloc(sizeof(FlowSpareCache));
+    if (unlikely(c == NULL))
+        return NULL;
+    memset(c, 0, sizeof(FlowSpareCache));
+    c->size = size;
+    return c;
+}
+
+/**
+ *  \brief Return all cached flows to the spare queue and free the cache
+ */
+void FlowSpareCacheFree(FlowSpareCache *c)
+{
+    if (c == NULL)
+        return;
+
+    (void)FlowSpareCacheDrain(c, 0);
+    SCFree(c);
+}
+
+/**
+ *  \brief Move up to 'cnt' flows from the global spare queue into a
+ *         thread local cache, taking the queue lock only once.
+ *
+ *  \param c cache
+ *  \param cnt max number of flows to move
+ *
+ *  \retval moved number of flows moved into the cache
+ */
+uint32_t FlowSpareCacheRefill(FlowSpareCache *c, uint32_t cnt)
+{
+    uint32_t moved = 0;
+
+    FQLOCK_LOCK(&flow_spare_q);
+    while (moved < cnt && flow_spare_q.bot != NULL) {
+        Flow *f = flow_spare_q.bot;
+
+        flow_spare_q.bot = f->lprev;
+        if (flow_spare_q.bot != NULL)
+            flow_spare_q.bot->lnext = NULL;
+        else
+            flow_spare_q.top = NULL;
+        flow_spare_q.len--;
+
+        FlowSpareCachePut(c, f);
+        moved++;
+    }
+    FQLOCK_UNLOCK(&flow_spare_q);
+
+    return moved;
+}
+
+/**
+ *  \brief Move flows from a thread local cache back to the global spare
+ *         queue, taking the queue lock only once.
+ *
+ *  \param c cache
+ *  \param keep number of flows to keep in the cache
+ *
+ *  \retval moved number of flows moved to the spare queue
+ */
+uint32_t FlowSpareCacheDrain(FlowSpareCache *c, uint32_t keep)
+{
+    uint32_t moved = 0;
+
+    if (c->len <= keep)
+        return 0;
+
+    FQLOCK_LOCK(&flow_spare_q);
+    while (c->len > keep) {
+        Flow *f = FlowSpareCacheGet(c);
+
+        /* append, like FlowMoveToSpare */
+        f->lprev = flow_spare_q.bot;
+        if (f->lprev != NULL)
+            f->lprev->lnext = f;
+        f->lnext = NULL;
+        flow_spare_q.bot = f;
+        if (flow_spare_q.top == NULL)
+            flow_spare_q.top = f;
+        flow_spare_q.len++;
+        moved++;
+    }
+#ifdef DBG_PERF
+    if (flow_spare_q.len > flow_spare_q.dbg_maxlen)
+        flow_spare_q.dbg_maxlen = flow_spare_q.len;
+#endif /* DBG_PERF */
+    FQLOCK_UNLOCK(&flow_spare_q);
+
+    return moved;
+}
@@ -55,6 +55,17 @@ typedef struct FlowQueue_
 #endif
 } FlowQueue;
 
+/** Thread local cache of spare flows. Only used by its owning thread, so
+ *  it has no lock. Flows are linked through their lnext pointers. The
+ *  cache is refilled from and drained to the global spare queue in batches
+ *  so the queue lock is taken once per batch instead of once per flow. It
+ *  is drained when it goes over its size and when the thread is idle. */
+typedef struct FlowSpareCache_ {
+    Flow *top;
+    uint32_t len;
+    uint32_t size;      /**< max flows to keep in the cache */
+} FlowSpareCache;
+
 #ifdef FQLOCK_SPIN
     #define FQLOCK_INIT(q) SCSpinInit(&(q)->s, 0)
     #define FQLOCK_DESTROY(q) SCSpinDestroy(&(q)->s)
@@ -81,5 +92,51 @@ Flow *FlowDequeue (FlowQueue *);
 
 void FlowMoveToSpare(Flow *);
 
+FlowSpareCache *FlowSpareCacheNew(uint32_t);
+void FlowSpareCacheFree(FlowSpareCache *);
+uint32_t FlowSpareCacheRefill(FlowSpareCache *, uint32_t);
+uint32_t FlowSpareCacheDrain(FlowSpareCache *, uint32_t);
+
+/**
+ *  \brief get a flow from a thread local spare cache
+ *
+ *  \retval f flow or NULL if the cache is empty
+ */
+static inline Flow *FlowSpareCacheGet(FlowSpareCache *c)
+{
+    Flow *f = c->top;
+    if (f != NULL) {
+        c->top = f->lnext;
+        c->len--;
+        f->lnext = NULL;
+    }
+    return f;
+}
+
+/**
+ *  \brief add a recycled flow to a thread local spare cache
+ */
+static inline void FlowSpareCachePut(FlowSpareCache *c, Flow *f)
+{
+    f->lprev = NULL;
+    f->lnext = c->top;
+    c->top = f;
+    c->len++;
+}
+
+/**
+ *  \brief give a flow the owning thread is done with back to its cache
+ *
+ *  Once the cache goes over its size, half of it is moved back to the
+ *  global spare queue in one batch, so a thread that releases more flows
+ *  than it creates doesn't keep them from the other threads.
+ */
+static inline void FlowSpareCacheReturn(FlowSpareCache *c, Flow *f)
+{
+    FlowSpareCachePut(c, f);
+    if (unlikely(c->len > c->size))
+        (void)FlowSpareCacheDrain(c, c->size / 2);
+}
+
 #endif /* __FLOW_QUEUE_H__ */
 
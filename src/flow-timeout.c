@@ -486,9 +486,10 @@ done:
  * - be robust in case of future changes
  * - locking overhead if neglectable when no other thread fights us
  *
- * \param q The queue to process flows from.
+ * \param hash the global flow hash or a thread flow table
+ * \param size number of buckets in the hash
  */
-static inline void FlowForceReassemblyForHash(void)
+static void FlowForceReassemblyForHash(FlowBucket *hash, uint32_t size)
 {
     Flow *f;
     TcpSession *ssn;
@@ -496,8 +497,8 @@ static inline void FlowForceReassemblyForHash(void)
     int server_ok = 0;
     uint32_t idx = 0;
 
-    for (idx = 0; idx < flow_config.hash_size; idx++) {
-        FlowBucket *fb = &flow_hash[idx];
+    for (idx = 0; idx < size; idx++) {
+        FlowBucket *fb = &hash[idx];
 
         FBLOCK_LOCK(fb);
 
@@ -540,7 +541,10 @@ void FlowForceReassembly(void)
     /* called by 'main()' which has no packet pool */
     PacketPoolInit();
     /* Carry out flow reassembly for unattended flows */
-    FlowForceReassemblyForHash();
+    if (flow_hash != NULL)
+        FlowForceReassemblyForHash(flow_hash, flow_config.hash_size);
+    /* the threads owning a flow table don't process packets anymore */
+    FlowThreadTablesWalk(FlowForceReassemblyForHash);
     PacketPoolDestroy();
     return;
 }
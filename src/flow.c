@@ -33,6 +33,7 @@
 
 #include "util-random.h"
 #include "util-time.h"
+#include "util-cpu.h"
 
 #include "flow.h"
 #include "flow-queue.h"
@@ -61,6 +62,7 @@
 #include "stream.h"
 
 #include "app-layer-parser.h"
+#include "output-flow.h"
 
 #define FLOW_DEFAULT_EMERGENCY_RECOVERY 30
 
@@ -71,6 +73,18 @@
 
 #define FLOW_DEFAULT_PREALLOC    10000
 
+/* smallest thread flow table, unless flow.hash-size is smaller */
+#define FLOW_THREAD_TABLE_MIN_SIZE  1024
+
+/* compile time checks of the Flow layout described in flow.h: the hash
+ * lookup must only touch the first cache line of a flow */
+#define FLOW_LAYOUT_CHECK(name, cond) \
+    typedef char flow_layout_check_##name[(cond) ? 1 : -1] __attribute__((unused))
+FLOW_LAYOUT_CHECK(vlan_id, offsetof(Flow, vlan_id) + sizeof(((Flow *)0)->vlan_id) <= CLS);
+FLOW_LAYOUT_CHECK(hnext, offsetof(Flow, hnext) + sizeof(((Flow *)0)->hnext) <= CLS);
+FLOW_LAYOUT_CHECK(fb, offsetof(Flow, fb) + sizeof(((Flow *)0)->fb) <= CLS);
+FLOW_LAYOUT_CHECK(size, (sizeof(Flow) % CLS) == 0);
+
 /** atomic int that is used when freeing a flow from the hash. In this
  *  case we walk the hash to find a flow to free. This var records where
  *  we left off in the hash. Without this only the top rows of the hash
@@ -82,6 +96,10 @@ SC_ATOMIC_DECLARE(unsigned int, flow_prune_idx);
 /** atomic flags */
 SC_ATOMIC_DECLARE(unsigned int, flow_flags);
 
+/** excess spare flows waiting for the end of a grace period before they
+ *  are freed, only used with flow.lockless-lookup */
+static FlowQueue flow_grace_q;
+
 void FlowRegisterTests(void);
 void FlowInitFlowProto();
 int FlowSetProtoTimeout(uint8_t , uint32_t ,uint32_t ,uint32_t);
@@ -108,6 +126,12 @@ void FlowCleanupAppLayer(Flow *f)
  *  Enforce the prealloc parameter, so keep at least prealloc flows in the
  *  spare queue and free flows going over the limit.
  *
+ *  With lockless lookups a packet thread may still be looking at a flow
+ *  that was in the hash before it went to the spare queue. So there the
+ *  excess flows are first set aside, and only freed on a later call once
+ *  every packet thread has finished the lookup it was doing at that point.
+ *  Until then they still count against the memcap.
+ *
  *  \retval 1 if the queue was properly updated (or if it already was in good shape)
  *  \retval 0 otherwise.
  */
@@ -115,6 +139,15 @@ int FlowUpdateSpareFlows(void)
 {
     SCEnter();
     uint32_t toalloc = 0, tofree = 0, len;
+    Flow *f;
+
+    if (flow_config.lockless_lookup && flow_grace_q.len > 0 &&
+            FlowLocklessGraceDone())
+    {
+        while ((f = FlowDequeue(&flow_grace_q)) != NULL) {
+            FlowFree(f);
+        }
+    }
 
     FQLOCK_LOCK(&flow_spare_q);
     len = flow_spare_q.len;
@@ -125,24 +158,34 @@ int FlowUpdateSpareFlows(void)
 
         uint32_t i;
         for (i = 0; i < toalloc; i++) {
-            Flow *f = FlowAlloc();
+            f = FlowAlloc();
             if (f == NULL)
                 return 0;
 
             FlowEnqueue(&flow_spare_q,f);
         }
     } else if (len > flow_config.prealloc) {
+        /* only one grace period at a time */
+        if (flow_config.lockless_lookup && flow_grace_q.len > 0)
+            return 1;
+
         tofree = len - flow_config.prealloc;
 
         uint32_t i;
         for (i = 0; i < tofree; i++) {
             /* FlowDequeue locks the queue */
-            Flow *f = FlowDequeue(&flow_spare_q);
+            f = FlowDequeue(&flow_spare_q);
             if (f == NULL)
-                return 1;
+                break;
 
-            FlowFree(f);
+            if (flow_config.lockless_lookup)
+                FlowEnqueue(&flow_grace_q, f);
+            else
+                FlowFree(f);
         }
+
+        if (flow_config.lockless_lookup && flow_grace_q.len > 0)
+            FlowLocklessGraceStart();
     }
 
     return 1;
@@ -227,6 +270,70 @@ static inline int FlowUpdateSeenFlag(const Packet *p)
     return 1;
 }
 
+/** \internal
+ *  \brief time out the flows of the thread's own flow table, if any */
+static inline void FlowThreadTableHandleTimeout(ThreadVars *tv,
+        DecodeThreadVars *dtv, struct timeval *ts)
+{
+    if (dtv == NULL || dtv->flow_table == NULL)
+        return;
+
+    FlowThreadTable *ft = dtv->flow_table;
+
+    /* with a spare cache the thread recycles its timed out flows itself,
+     * so they're reused without going through the global queues */
+    FlowQueue *recycle_q = dtv->flow_spare_cache ? ft->recycle_q : &flow_recycle_q;
+
+    uint32_t cnt = FlowThreadTableTimeout(ft, ts, recycle_q);
+    if (cnt == 0)
+        return;
+
+    if (tv != NULL) {
+        SCPerfCounterAddUI64(dtv->counter_flow_thread_table_timeouts,
+                tv->sc_perf_pca, (uint64_t)cnt);
+    }
+
+    if (recycle_q == ft->recycle_q) {
+        Flow *f;
+        while ((f = FlowDequeue(recycle_q)) != NULL) {
+            FLOWLOCK_WRLOCK(f);
+            if (dtv->output_flow_thread_data != NULL)
+                (void)OutputFlowLog(tv, dtv->output_flow_thread_data, f);
+            FlowClearMemory(f, f->protomap);
+            FLOWLOCK_UNLOCK(f);
+
+            FlowSpareCacheReturn(dtv->flow_spare_cache, f);
+        }
+    }
+}
+
+/** \brief Flow handling for a packet thread that doesn't get packets
+ *
+ * Called by capture methods when they time out waiting for packets, so
+ * that a thread owning a flow table keeps timing out its flows when its
+ * traffic stops. An idle thread also returns its cached spare flows to
+ * the global spare queue.
+ *
+ *  \param tv threadvars
+ *  \param dtv decode thread vars of the thread
+ */
+void FlowHandleIdle(ThreadVars *tv, DecodeThreadVars *dtv)
+{
+    struct timeval ts;
+
+    if (dtv == NULL)
+        return;
+
+    if (dtv->flow_table != NULL) {
+        memset(&ts, 0x00, sizeof(ts));
+        TimeGet(&ts);
+        FlowThreadTableHandleTimeout(tv, dtv, &ts);
+    }
+
+    if (dtv->flow_spare_cache != NULL && dtv->flow_spare_cache->len > 0)
+        (void)FlowSpareCacheDrain(dtv->flow_spare_cache, 0);
+}
+
 /** \brief Entry point for packet flow handling
  *
  * This is called for every packet.
@@ -237,6 +344,9 @@ static inline int FlowUpdateSeenFlag(const Packet *p)
  */
 void FlowHandlePacket(ThreadVars *tv, DecodeThreadVars *dtv, Packet *p)
 {
+    /* a thread owning its flow table times out its own flows */
+    FlowThreadTableHandleTimeout(tv, dtv, &p->ts);
+
     /* Get this packet's flow from the hash. FlowHandlePacket() will setup
      * a new flow if nescesary. If we get NULL, we're out of flow memory.
      * The returned flow is locked. */
@@ -289,6 +399,77 @@ void FlowHandlePacket(ThreadVars *tv, DecodeThreadVars *dtv, Packet *p)
     return;
 }
 
+/** \internal
+ *  \brief allocate the global flow hash */
+static void FlowInitHash(char quiet)
+{
+    uint64_t hash_size = flow_config.hash_size * sizeof(FlowBucket);
+    if (!(FLOW_CHECK_MEMCAP(hash_size))) {
+        SCLogError(SC_ERR_FLOW_INIT, "allocating flow hash failed: "
+                "max flow memcap is smaller than projected hash size. "
+                "Memcap: %"PRIu64", Hash table size %"PRIu64". Calculate "
+                "total hash size by multiplying \"flow.hash-size\" with %"PRIuMAX", "
+                "which is the hash bucket size.", flow_config.memcap, hash_size,
+                (uintmax_t)sizeof(FlowBucket));
+        exit(EXIT_FAILURE);
+    }
+    flow_hash = SCCalloc(flow_config.hash_size, sizeof(FlowBucket));
+    if (unlikely(flow_hash == NULL)) {
+        SCLogError(SC_ERR_FATAL, "Fatal error encountered in FlowInitHash. Exiting...");
+        exit(EXIT_FAILURE);
+    }
+    memset(flow_hash, 0, flow_config.hash_size * sizeof(FlowBucket));
+
+    uint32_t i = 0;
+    for (i = 0; i < flow_config.hash_size; i++) {
+        FBLOCK_INIT(&flow_hash[i]);
+    }
+    (void) SC_ATOMIC_ADD(flow_memuse, (flow_config.hash_size * sizeof(FlowBucket)));
+
+    if (quiet == FALSE) {
+        SCLogInfo("allocated %llu bytes of memory for the flow hash... "
+                  "%" PRIu32 " buckets of size %" PRIuMAX "",
+                  SC_ATOMIC_GET(flow_memuse), flow_config.hash_size,
+                  (uintmax_t)sizeof(FlowBucket));
+    }
+}
+
+/** \brief set up flow handling for the runmode
+ *
+ *  Thread flow tables can only be used if a flow is always handled by the
+ *  same thread, which is the case in the workers and single runmodes.
+ *  There each packet thread gets a table of flow.hash-size / number of
+ *  cpus buckets and the global flow hash isn't used. In other runmodes
+ *  we fall back to the global hash.
+ *
+ *  \param runmode the custom mode, e.g. "workers"
+ */
+void FlowInitThreadTables(const char *runmode)
+{
+    if (!flow_config.thread_tables)
+        return;
+
+    if (runmode != NULL &&
+        (strcmp(runmode, "workers") == 0 || strcmp(runmode, "single") == 0))
+    {
+        uint16_t ncpus = UtilCpuGetNumProcessorsOnline();
+        uint32_t size = flow_config.hash_size / (ncpus ? ncpus : 1);
+        if (size < FLOW_THREAD_TABLE_MIN_SIZE)
+            size = MIN(FLOW_THREAD_TABLE_MIN_SIZE, flow_config.hash_size);
+        flow_config.thread_table_size = size;
+
+        SCLogInfo("packet threads use their own flow tables of %"PRIu32" "
+                "buckets", flow_config.thread_table_size);
+        return;
+    }
+
+    SCLogWarning(SC_ERR_INVALID_ARGUMENT, "flow.thread-tables is only "
+            "supported by the workers and single runmodes, "
+            "using the global flow hash");
+    flow_config.thread_tables = 0;
+    FlowInitHash(FALSE);
+}
+
 /** \brief initialize the configuration
  *  \warning Not thread safe */
 void FlowInitConfig(char quiet)
@@ -301,6 +482,7 @@ void FlowInitConfig(char quiet)
     SC_ATOMIC_INIT(flow_prune_idx);
     FlowQueueInit(&flow_spare_q);
     FlowQueueInit(&flow_recycle_q);
+    FlowQueueInit(&flow_grace_q);
 
     unsigned int seed = RandomTimePreseed();
     /* set defaults */
@@ -353,42 +535,48 @@ void FlowInitConfig(char quiet)
             flow_config.prealloc = configval;
         }
     }
+    if ((ConfGet("flow.spare-cache-size", &conf_val)) == 1)
+    {
+        if (ByteExtractStringUint32(&configval, 10, strlen(conf_val),
+                                    conf_val) > 0) {
+            flow_config.spare_cache_size = configval;
+        }
+    }
+    int lockless = 0;
+    if (ConfGetBool("flow.lockless-lookup", &lockless) == 1) {
+        flow_config.lockless_lookup = lockless;
+    }
     SCLogDebug("Flow config from suricata.yaml: memcap: %"PRIu64", hash-size: "
                "%"PRIu32", prealloc: %"PRIu32, flow_config.memcap,
                flow_config.hash_size, flow_config.prealloc);
-
-    /* alloc hash memory */
-    uint64_t hash_size = flow_config.hash_size * sizeof(FlowBucket);
-    if (!(FLOW_CHECK_MEMCAP(hash_size))) {
-        SCLogError(SC_ERR_FLOW_INIT, "allocating flow hash failed: "
-                "max flow memcap is smaller than projected hash size. "
-                "Memcap: %"PRIu64", Hash table size %"PRIu64". Calculate "
-                "total hash size by multiplying \"flow.hash-size\" with %"PRIuMAX", "
-                "which is the hash bucket size.", flow_config.memcap, hash_size,
-                (uintmax_t)sizeof(FlowBucket));
-        exit(EXIT_FAILURE);
+    if (flow_config.lockless_lookup && quiet == FALSE) {
+        SCLogInfo("flow hash lookups are lockless");
     }
-    flow_hash = SCCalloc(flow_config.hash_size, sizeof(FlowBucket));
-    if (unlikely(flow_hash == NULL)) {
-        SCLogError(SC_ERR_FATAL, "Fatal error encountered in FlowInitConfig. Exiting...");
-        exit(EXIT_FAILURE);
+    int thread_tables = 0;
+    if (ConfGetBool("flow.thread-tables", &thread_tables) == 1) {
+        flow_config.thread_tables = thread_tables;
     }
-    memset(flow_hash, 0, flow_config.hash_size * sizeof(FlowBucket));
-
-    uint32_t i = 0;
-    for (i = 0; i < flow_config.hash_size; i++) {
-        FBLOCK_INIT(&flow_hash[i]);
+    if (flow_config.thread_tables && RunmodeGetCurrent() == RUNMODE_UNIX_SOCKET) {
+        SCLogWarning(SC_ERR_INVALID_ARGUMENT, "flow.thread-tables is not "
+                "supported in unix socket mode, using the global flow hash");
+        flow_config.thread_tables = 0;
     }
-    (void) SC_ATOMIC_ADD(flow_memuse, (flow_config.hash_size * sizeof(FlowBucket)));
-
-    if (quiet == FALSE) {
-        SCLogInfo("allocated %llu bytes of memory for the flow hash... "
-                  "%" PRIu32 " buckets of size %" PRIuMAX "",
-                  SC_ATOMIC_GET(flow_memuse), flow_config.hash_size,
-                  (uintmax_t)sizeof(FlowBucket));
+    int timer_wheel = 1;
+    (void)ConfGetBool("flow.timer-wheel", &timer_wheel);
+    flow_config.timer_wheel = timer_wheel;
+
+    /* with thread tables the global hash is set up once the runmode is
+     * known, see FlowInitThreadTables() */
+    if (!flow_config.thread_tables)
+        FlowInitHash(quiet);
+
+    FlowWheelInit();
+    if (flow_config.timer_wheel && quiet == FALSE) {
+        SCLogInfo("flows are timed out using a timer wheel");
     }
 
     /* pre allocate flows */
+    uint32_t i = 0;
     for (i = 0; i < flow_config.prealloc; i++) {
         if (!(FLOW_CHECK_MEMCAP(sizeof(Flow)))) {
             SCLogError(SC_ERR_FLOW_INIT, "preallocating flows failed: "
@@ -443,7 +631,13 @@ void FlowShutdown(void)
     while((f = FlowDequeue(&flow_spare_q))) {
         FlowFree(f);
     }
+    while((f = FlowDequeue(&flow_grace_q))) {
+        FlowFree(f);
+    }
     while((f = FlowDequeue(&flow_recycle_q))) {
+        /* not handled by the recycler, so not cleaned up yet */
+        uint8_t proto_map = FlowGetProtoMapping(f->proto);
+        FlowClearMemory(f, proto_map);
         FlowFree(f);
     }
 
@@ -467,10 +661,12 @@ void FlowShutdown(void)
         }
         SCFree(flow_hash);
         flow_hash = NULL;
+        (void) SC_ATOMIC_SUB(flow_memuse, flow_config.hash_size * sizeof(FlowBucket));
     }
-    (void) SC_ATOMIC_SUB(flow_memuse, flow_config.hash_size * sizeof(FlowBucket));
+    FlowWheelDestroy();
     FlowQueueDestroy(&flow_spare_q);
     FlowQueueDestroy(&flow_recycle_q);
+    FlowQueueDestroy(&flow_grace_q);
 
     SC_ATOMIC_DESTROY(flow_prune_idx);
     SC_ATOMIC_DESTROY(flow_memuse);
@@ -1063,6 +1259,244 @@ static int FlowTest09 (void)
     return result;
 }
 
+/**
+ *  \test   Test moving flows between the spare queue and a thread local
+ *          spare cache.
+ *
+ *  \retval On success it returns 1 and on failure 0.
+ */
+
+static int FlowTest10 (void)
+{
+    int result = 0;
+
+    FlowInitConfig(FLOW_QUIET);
+
+    uint32_t spare = flow_spare_q.len;
+    unsigned long long int memuse = SC_ATOMIC_GET(flow_memuse);
+
+    FlowSpareCache *c = FlowSpareCacheNew(16);
+    if (c == NULL)
+        goto end;
+
+    if (FlowSpareCacheRefill(c, 8) != 8 || c->len != 8 ||
+            flow_spare_q.len != spare - 8) {
+        printf("refill failed: ");
+        goto end;
+    }
+
+    Flow *f = FlowSpareCacheGet(c);
+    if (f == NULL || c->len != 7) {
+        printf("get failed: ");
+        goto end;
+    }
+    FlowSpareCachePut(c, f);
+
+    if (FlowSpareCacheDrain(c, 2) != 6 || c->len != 2 ||
+            flow_spare_q.len != spare - 2) {
+        printf("drain failed: ");
+        goto end;
+    }
+
+    FlowSpareCacheFree(c);
+    c = NULL;
+
+    if (flow_spare_q.len != spare) {
+        printf("expected %u spare flows, got %u: ", spare, flow_spare_q.len);
+        goto end;
+    }
+    if (SC_ATOMIC_GET(flow_memuse) != memuse) {
+        printf("memuse changed: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (c != NULL)
+        FlowSpareCacheFree(c);
+    FlowShutdown();
+    return result;
+}
+
+/**
+ *  \test   Test that new flows are taken from the thread local spare cache
+ *
+ *  \retval On success it returns 1 and on failure 0.
+ */
+
+static int FlowTest11 (void)
+{
+    int result = 0;
+    DecodeThreadVars dtv;
+    memset(&dtv, 0, sizeof(dtv));
+
+    FlowInitConfig(FLOW_QUIET);
+
+    uint32_t spare = flow_spare_q.len;
+    dtv.flow_spare_cache = FlowSpareCacheNew(8);
+    if (dtv.flow_spare_cache == NULL)
+        goto end;
+
+    Packet *p = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "1.2.3.4", "5.6.7.8",
+            1024, 80);
+    if (p == NULL)
+        goto end;
+
+    /* empty cache: refill half of it, use one flow */
+    FlowHandlePacket(NULL, &dtv, p);
+    if (p->flow == NULL) {
+        UTHFreePacket(p);
+        goto end;
+    }
+    FlowDeReference(&p->flow);
+    UTHFreePacket(p);
+
+    if (dtv.flow_spare_cache->len != 3 || flow_spare_q.len != spare - 4) {
+        printf("cache len %u spare %u: ", dtv.flow_spare_cache->len,
+                flow_spare_q.len);
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (dtv.flow_spare_cache != NULL)
+        FlowSpareCacheFree(dtv.flow_spare_cache);
+    FlowShutdown();
+    return result;
+}
+
+/**
+ *  \test   Test that a thread spare cache going over its size and an idle
+ *          thread return their flows to the spare queue
+ *
+ *  \retval On success it returns 1 and on failure 0.
+ */
+
+static int FlowTest12 (void)
+{
+    int result = 0;
+    DecodeThreadVars dtv;
+    memset(&dtv, 0, sizeof(dtv));
+
+    FlowInitConfig(FLOW_QUIET);
+
+    uint32_t spare = flow_spare_q.len;
+    FlowSpareCache *tmp = FlowSpareCacheNew(8);
+    dtv.flow_spare_cache = FlowSpareCacheNew(4);
+    if (tmp == NULL || dtv.flow_spare_cache == NULL)
+        goto end;
+
+    /* flows the thread is done with */
+    if (FlowSpareCacheRefill(tmp, 5) != 5)
+        goto end;
+
+    int i;
+    for (i = 0; i < 4; i++)
+        FlowSpareCacheReturn(dtv.flow_spare_cache, FlowSpareCacheGet(tmp));
+    if (dtv.flow_spare_cache->len != 4 || flow_spare_q.len != spare - 5) {
+        printf("cache len %u spare %u: ", dtv.flow_spare_cache->len,
+                flow_spare_q.len);
+        goto end;
+    }
+
+    /* over the size: half of the cache goes back in one batch */
+    FlowSpareCacheReturn(dtv.flow_spare_cache, FlowSpareCacheGet(tmp));
+    if (dtv.flow_spare_cache->len != 2 || flow_spare_q.len != spare - 2) {
+        printf("after drain cache len %u spare %u: ", dtv.flow_spare_cache->len,
+                flow_spare_q.len);
+        goto end;
+    }
+
+    /* an idle thread gives back the rest */
+    FlowHandleIdle(NULL, &dtv);
+    if (dtv.flow_spare_cache->len != 0 || flow_spare_q.len != spare) {
+        printf("after idle cache len %u spare %u: ", dtv.flow_spare_cache->len,
+                flow_spare_q.len);
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (tmp != NULL)
+        FlowSpareCacheFree(tmp);
+    if (dtv.flow_spare_cache != NULL)
+        FlowSpareCacheFree(dtv.flow_spare_cache);
+    FlowShutdown();
+    return result;
+}
+
+/**
+ *  \test   Test that with lockless lookups excess spare flows are only
+ *          freed once a reader that was walking a bucket has moved on.
+ *
+ *  \retval On success it returns 1 and on failure 0.
+ */
+static int FlowTest13 (void)
+{
+    int result = 0;
+    FlowLocklessReader *r = NULL;
+
+    ConfCreateContextBackup();
+    ConfInit();
+    ConfSet("flow.prealloc", "10");
+    ConfSet("flow.lockless-lookup", "yes");
+    FlowInitConfig(FLOW_QUIET);
+
+    r = FlowLocklessReaderRegister();
+    if (r == NULL)
+        goto end;
+
+    unsigned long long int memuse = SC_ATOMIC_GET(flow_memuse);
+
+    /* a burst left more spare flows than we want to keep */
+    int i;
+    for (i = 0; i < 5; i++) {
+        Flow *f = FlowAlloc();
+        if (f == NULL)
+            goto end;
+        FlowEnqueue(&flow_spare_q, f);
+    }
+
+    /* the reader is walking a bucket */
+    (void) SC_ATOMIC_ADD(r->seq, 1);
+
+    FlowUpdateSpareFlows();
+    if (flow_spare_q.len != 10 || flow_grace_q.len != 5) {
+        printf("spare %u grace %u: ", flow_spare_q.len, flow_grace_q.len);
+        goto end;
+    }
+
+    /* still walking, nothing can be freed */
+    FlowUpdateSpareFlows();
+    if (flow_grace_q.len != 5 || SC_ATOMIC_GET(flow_memuse) == memuse) {
+        printf("grace %u freed too early: ", flow_grace_q.len);
+        goto end;
+    }
+
+    /* walk done, the grace period is over */
+    (void) SC_ATOMIC_ADD(r->seq, 1);
+
+    FlowUpdateSpareFlows();
+    if (flow_spare_q.len != 10 || flow_grace_q.len != 0) {
+        printf("after grace spare %u grace %u: ", flow_spare_q.len,
+                flow_grace_q.len);
+        goto end;
+    }
+    if (SC_ATOMIC_GET(flow_memuse) != memuse) {
+        printf("memuse %llu, expected %llu: ",
+                (unsigned long long int)SC_ATOMIC_GET(flow_memuse), memuse);
+        goto end;
+    }
+
+    result = 1;
+end:
+    FlowLocklessReaderDeregister(r);
+    FlowShutdown();
+    ConfDeInit();
+    ConfRestoreContextBackup();
+    return result;
+}
+
 #endif /* UNITTESTS */
 
 /**
@@ -1076,8 +1510,13 @@ void FlowRegisterTests (void)
     UtRegisterTest("FlowTest07 -- Test flow Allocations when it reach memcap", FlowTest07, 1);
     UtRegisterTest("FlowTest08 -- Test flow Allocations when it reach memcap", FlowTest08, 1);
     UtRegisterTest("FlowTest09 -- Test flow Allocations when it reach memcap", FlowTest09, 1);
+    UtRegisterTest("FlowTest10 -- Test thread local spare flow cache", FlowTest10, 1);
+    UtRegisterTest("FlowTest11 -- Test new flows using the spare flow cache", FlowTest11, 1);
+    UtRegisterTest("FlowTest12 -- Test spare cache high watermark and idle drain", FlowTest12, 1);
+    UtRegisterTest("FlowTest13 -- Test lockless lookup grace period", FlowTest13, 1);
 
     FlowMgrRegisterTests();
+    FlowHashRegisterTests();
     RegisterFlowStorageTests();
 #endif /* UNITTESTS */
 }
@@ -66,6 +66,9 @@ typedef struct AppLayerParserState_ AppLayerParserState;
 /** All packets in this flow should be dropped */
 #define FLOW_ACTION_DROP                  0x00000200
 
+/** Stream engine is done with this flow, its packets bypass reassembly */
+#define FLOW_STREAM_BYPASS                0x00000400
+
 /** Sgh for toserver direction set (even if it's NULL) */
 #define FLOW_SGH_TOSERVER                 0x00000800
 /** Sgh for toclient direction set (even if it's NULL) */
@@ -241,6 +244,20 @@ typedef struct FlowCnf_
     uint32_t emerg_timeout_est;
     uint32_t emergency_recovery;
 
+    /** walk hash buckets without taking the bucket lock on lookup */
+    int lockless_lookup;
+
+    /** size of the per thread spare flow cache, 0 to disable */
+    uint32_t spare_cache_size;
+
+    /** give each worker thread its own flow table */
+    int thread_tables;
+    /** number of buckets of a thread flow table */
+    uint32_t thread_table_size;
+
+    /** time out flows using the timer wheel instead of hash walks */
+    int timer_wheel;
+
 } FlowConfig;
 
 /* Hash key for the flow hash */
@@ -291,10 +308,20 @@ typedef uint16_t FlowThreadId;
  *  The flow "header" (addresses, ports, proto, recursion level) are static
  *  after the initialization and remain read-only throughout the entire live
  *  of a flow. This is why we can access those without protection of the lock.
+ *
+ *  Layout
+ *
+ *  The flow is cache line aligned. The fields the hash lookup compares and
+ *  follows are kept in the first cache line, so walking a hash row touches
+ *  one line per flow. The fields each packet updates follow, the fields
+ *  only used by detection and housekeeping come last. Checked at compile
+ *  time in flow.c, "make flow-layout" shows the full layout.
  */
 
 typedef struct Flow_
 {
+    /* 1st cache line: all the hash lookup looks at */
+
     /* flow "header", used for hashing and flow lookup. Static after init,
      * so safe to look at without lock */
     FlowAddress src, dst;
@@ -312,21 +339,17 @@ typedef struct Flow_
 
     /* end of flow "header" */
 
-    /** how many pkts and stream msgs are using the flow *right now*. This
-     *  variable is atomic so not protected by the Flow mutex "m".
-     *
-     *  On receiving a packet the counter is incremented while the flow
-     *  bucked is locked, which is also the case on timeout pruning.
-     */
-    SC_ATOMIC_DECLARE(FlowRefCount, use_cnt);
+    uint32_t flags;
 
-    /** flow queue id, used with autofp */
-    SC_ATOMIC_DECLARE(int, autofp_tmqh_flow_qid);
+    /** hash list pointers, protected by fb->s. In lockless lookup mode
+     *  readers may follow these without the bucket lock, so fb is reset
+     *  to NULL whenever a flow is removed from the hash. */
+    struct Flow_ *hnext; /* hash list */
+    struct FlowBucket_ *fb;
 
-    uint32_t probing_parser_toserver_alproto_masks;
-    uint32_t probing_parser_toclient_alproto_masks;
+    /* 2nd cache line: updated by each packet */
 
-    uint32_t flags;
+    struct Flow_ *hprev;
 
     /* time stamp of last update (last packet) */
     struct timeval lastts;
@@ -339,9 +362,30 @@ typedef struct Flow_
     #error Enable FLOWLOCK_RWLOCK or FLOWLOCK_MUTEX
 #endif
 
+    /* 3rd cache line: used by the packet pipeline */
+
+    /** how many pkts and stream msgs are using the flow *right now*. This
+     *  variable is atomic so not protected by the Flow mutex "m".
+     *
+     *  On receiving a packet the counter is incremented while the flow
+     *  bucked is locked, which is also the case on timeout pruning.
+     */
+    SC_ATOMIC_DECLARE(FlowRefCount, use_cnt);
+
+    /** Thread ID for the stream/detect portion of this flow */
+    FlowThreadId thread_id;
+
+    /** flow queue id, used with autofp */
+    SC_ATOMIC_DECLARE(int, autofp_tmqh_flow_qid);
+
     /** protocol specific data pointer, e.g. for TcpSession */
     void *protoctx;
 
+    uint32_t todstpktcnt;
+    uint32_t tosrcpktcnt;
+    uint64_t todstbytecnt;
+    uint64_t tosrcbytecnt;
+
     /** mapping to Flow's protocol specific protocols for timeouts
         and state and free functions. */
     uint8_t protomap;
@@ -353,21 +397,23 @@ typedef struct Flow_
     AppProto alproto_ts;
     AppProto alproto_tc;
 
-    uint32_t data_al_so_far[2];
+    /** application level storage ptrs.
+     *
+     */
+    AppLayerParserState *alparser;     /**< parser internal state */
+    void *alstate;      /**< application layer state */
+
+    /* rest: detection, protocol detection and housekeeping */
 
     /** detection engine ctx id used to inspect this flow. Set at initial
      *  inspection. If it doesn't match the currently in use de_ctx, the
      *  de_state and stored sgh ptrs are reset. */
     uint32_t de_ctx_id;
 
-    /** Thread ID for the stream/detect portion of this flow */
-    FlowThreadId thread_id;
+    uint32_t probing_parser_toserver_alproto_masks;
+    uint32_t probing_parser_toclient_alproto_masks;
 
-    /** application level storage ptrs.
-     *
-     */
-    AppLayerParserState *alparser;     /**< parser internal state */
-    void *alstate;      /**< application layer state */
+    uint32_t data_al_so_far[2];
 
     /** detection engine state */
     struct DetectEngineState_ *de_state;
@@ -382,23 +428,28 @@ typedef struct Flow_
     /* pointer to the var list */
     GenericVar *flowvar;
 
+    /** flowbits bitmap */
+    struct FlowBits_ *flowbits;
+    /** flowbits map of the detection engine ctx inspecting this flow, set
+     *  together with de_ctx_id. Only dereferenced during detection. */
+    struct FlowBitsMap_ *flowbits_map;
+
     SCMutex de_state_m;          /**< mutex lock for the de_state object */
 
-    /** hash list pointers, protected by fb->s */
-    struct Flow_ *hnext; /* hash list */
-    struct Flow_ *hprev;
-    struct FlowBucket_ *fb;
+    /** timer wheel list pointers, protected by the wheel slot lock. Only
+     *  changed while the flow is locked as well. */
+    struct Flow_ *wnext;
+    struct Flow_ *wprev;
+    /** wheel slot + 1, 0 if the flow isn't on the timer wheel */
+    uint32_t wheel_slot;
+    /** second at which the flow is checked for timeout */
+    uint32_t wheel_ts;
 
     /** queue list pointers, protected by queue mutex */
     struct Flow_ *lnext; /* list */
     struct Flow_ *lprev;
     struct timeval startts;
-
-    uint32_t todstpktcnt;
-    uint32_t tosrcpktcnt;
-    uint64_t todstbytecnt;
-    uint64_t tosrcbytecnt;
-} Flow;
+} __attribute__((aligned(CLS))) Flow;
 
 enum {
     FLOW_STATE_NEW = 0,
@@ -419,6 +470,8 @@ typedef struct FlowProto_ {
 
 void FlowHandlePacket (ThreadVars *, DecodeThreadVars *, Packet *);
 void FlowInitConfig (char);
+void FlowInitThreadTables(const char *);
+void FlowHandleIdle(ThreadVars *, DecodeThreadVars *);
 void FlowPrintQueueInfo (void);
 void FlowShutdown(void);
 void FlowSetIPOnlyFlag(Flow *, char);
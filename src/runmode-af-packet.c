@@ -215,6 +215,30 @@ void *ParseAFPConfig(const char *iface)
                 aconf->iface);
         aconf->flags |= AFP_RING_MODE;
     }
+    (void)ConfGetChildValueBoolWithDefault(if_root, if_default, "tpacket-v3", (int *)&boolval);
+    if (boolval) {
+        if (aconf->flags & AFP_RING_MODE) {
+            SCLogInfo("Enabling tpacket v3 capture on iface %s",
+                    aconf->iface);
+            aconf->flags |= AFP_TPACKET_V3;
+        } else {
+            SCLogWarning(SC_ERR_INVALID_VALUE, "tpacket-v3 requires use-mmap, "
+                    "disabling it on iface %s", aconf->iface);
+        }
+    }
+    aconf->block_size = getpagesize() << AFP_BLOCK_SIZE_DEFAULT_ORDER;
+    if ((ConfGetChildValueIntWithDefault(if_root, if_default, "block-size", &value)) == 1) {
+        if (value % getpagesize()) {
+            SCLogWarning(SC_ERR_INVALID_VALUE, "block-size %"PRIdMAX" must be "
+                    "a multiple of the page size, using default", value);
+        } else {
+            aconf->block_size = value;
+        }
+    }
+    aconf->block_timeout = AFP_BLOCK_TIMEOUT_DEFAULT;
+    if ((ConfGetChildValueIntWithDefault(if_root, if_default, "block-timeout", &value)) == 1) {
+        aconf->block_timeout = value;
+    }
     (void)ConfGetChildValueBoolWithDefault(if_root, if_default, "use-emergency-flush", (int *)&boolval);
     if (boolval) {
         SCLogInfo("Enabling ring emergency flush on iface %s",
@@ -327,6 +351,26 @@ void *ParseAFPConfig(const char *iface)
         aconf->promisc = 0;
     }
 
+    boolval = 0;
+    (void)ConfGetChildValueBoolWithDefault(if_root, if_default, "bypass", (int *)&boolval);
+    if (boolval) {
+#ifdef HAVE_PACKET_EBPF
+        if (aconf->copy_mode != AFP_COPY_MODE_NONE) {
+            SCLogWarning(SC_ERR_INVALID_VALUE, "bypass can't be used with "
+                    "copy-mode, disabling it on iface %s", aconf->iface);
+        } else if (aconf->bpf_filter != NULL) {
+            SCLogWarning(SC_ERR_INVALID_VALUE, "bypass replaces the bpf "
+                    "filter, disabling it on iface %s", aconf->iface);
+        } else {
+            SCLogInfo("Enabling flow bypass on iface %s", aconf->iface);
+            aconf->flags |= AFP_BYPASS;
+        }
+#else
+        SCLogWarning(SC_ERR_UNIMPLEMENTED, "bypass is not supported by this "
+                "build, disabling it on iface %s", aconf->iface);
+#endif
+    }
+
     if (ConfGetChildValueWithDefault(if_root, if_default, "checksum-checks", &tmpctype) == 1) {
         if (strcmp(tmpctype, "auto") == 0) {
             aconf->checksum_mode = CHECKSUM_VALIDATION_AUTO;
@@ -32,6 +32,8 @@
 #include "detect-engine-proto.h"
 #include "detect-engine-port.h"
 #include "detect-engine-mpm.h"
+#include "detect-engine-cache.h"
+#include "detect-engine-prefilter.h"
 #include "detect-engine-sigorder.h"
 #include "detect-engine-payload.h"
 #include "detect-engine-dcepayload.h"
@@ -237,6 +239,8 @@ void RunUnittests(int list_unittests, char *regex_arg)
     SCProfilingRegisterTests();
 #endif
     DeStateRegisterTests();
+    DetectEngineCacheRegisterTests();
+    DetectPrefilterRegisterTests();
     DetectRingBufferRegisterTests();
     MemcmpRegisterTests();
     DetectEngineHttpClientBodyRegisterTests();
@@ -35,6 +35,7 @@
 #include "conf.h"
 #include "queue.h"
 #include "runmodes.h"
+#include "flow.h"
 #include "util-unittest.h"
 #include "util-misc.h"
 
@@ -355,6 +356,9 @@ void RunModeDispatch(int runmode, const char *custom_mode, DetectEngineCtx *de_c
         exit(EXIT_FAILURE);
     }
 
+    /* before the packet threads set up their flow handling */
+    FlowInitThreadTables(active_runmode);
+
     mode->RunModeFunc(de_ctx);
 
     if (local_custom_mode != NULL)
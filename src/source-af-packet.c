@@ -94,6 +94,17 @@
 #include <sys/mman.h>
 #endif
 
+#ifdef HAVE_PACKET_EBPF
+/* pcap/bpf.h already defines a struct bpf_insn for classic BPF */
+#define bpf_insn ebpf_insn
+#include <linux/bpf.h>
+#undef bpf_insn
+#include <sys/syscall.h>
+#include "flow-private.h"
+#include "flow-util.h"
+#include "flow-manager.h"
+#endif
+
 #endif /* HAVE_AF_PACKET */
 
 extern int max_pending_packets;
@@ -162,6 +173,11 @@ TmEcode NoAFPSupportExit(ThreadVars *tv, void *initdata, void **data)
 #define TP_STATUS_VLAN_VALID (1 << 4)
 #endif
 
+/* TPACKET_V3 is available if the kernel headers know its header */
+#ifdef TPACKET3_HDRLEN
+#define HAVE_TPACKET_V3 1
+#endif
+
 /** protect pfring_set_bpf_filter, as it is not thread safe */
 static SCMutex afpacket_bpf_set_filter_lock = SCMUTEX_INITIALIZER;
 
@@ -179,9 +195,28 @@ enum {
 
 union thdr {
     struct tpacket2_hdr *h2;
+#ifdef HAVE_TPACKET_V3
+    struct tpacket3_hdr *h3;
+#endif
     void *raw;
 };
 
+/**
+ * \brief TPACKET_V3 block state
+ *
+ * A block is given back to the kernel when the reader is done with it
+ * and all packets pointing into it have been released.
+ */
+typedef struct AFPBlock_ {
+    /** block descriptor in the ring */
+    void *desc;
+    /** reader + number of packets still using the block */
+    SC_ATOMIC_DECLARE(uint32_t, refcnt);
+    /** kernel sequence number of the block content we walked last. Only
+     *  used by the reader thread. */
+    uint64_t seq;
+} AFPBlock;
+
 /**
  * \brief Structure to hold thread specific variables.
  */
@@ -236,13 +271,28 @@ typedef struct AFPThreadVars_
     int copy_mode;
 
     struct tpacket_req req;
+#ifdef HAVE_TPACKET_V3
+    struct tpacket_req3 req3;
+#endif
     unsigned int tp_hdrlen;
     unsigned int ring_buflen;
     char *ring_buf;
     char *frame_buf;
+    /** current frame, or current block in TPACKET_V3 mode */
     unsigned int frame_offset;
     int ring_size;
 
+    /* TPACKET_V3 */
+    int block_size;
+    int block_timeout;
+    AFPBlock *blocks;
+    unsigned int blocks_nr;
+    uint16_t capture_zero_copy;
+    uint16_t capture_copied;
+    uint16_t capture_kernel_freeze_q;
+    uint16_t capture_blocks;
+    uint16_t capture_block_busy;
+
 } AFPThreadVars;
 
 TmEcode ReceiveAFP(ThreadVars *, Packet *, void *, PacketQueue *, PacketQueue *);
@@ -256,6 +306,10 @@ TmEcode DecodeAFPThreadDeinit(ThreadVars *tv, void *data);
 TmEcode DecodeAFP(ThreadVars *, Packet *, void *, PacketQueue *, PacketQueue *);
 
 TmEcode AFPSetBPFFilter(AFPThreadVars *ptv);
+#ifdef HAVE_PACKET_EBPF
+static int AFPSetBypassFilter(AFPThreadVars *ptv);
+static int AFPBypassCallback(Packet *p);
+#endif
 static int AFPGetIfnumByDev(int fd, const char *ifname, int verbose);
 static int AFPGetDevFlags(int fd, const char *ifname);
 static int AFPDerefSocket(AFPPeer* peer);
@@ -504,6 +558,24 @@ static int AFPCreateSocket(AFPThreadVars *ptv, char *devname, int verbose);
 static inline void AFPDumpCounters(AFPThreadVars *ptv)
 {
 #ifdef PACKET_STATISTICS
+#ifdef HAVE_TPACKET_V3
+    if (ptv->flags & AFP_TPACKET_V3) {
+        struct tpacket_stats_v3 kstats;
+        socklen_t len = sizeof (struct tpacket_stats_v3);
+        if (getsockopt(ptv->socket, SOL_PACKET, PACKET_STATISTICS,
+                    &kstats, &len) > -1) {
+            SCLogDebug("(%s) Kernel: Packets %" PRIu32 ", dropped %" PRIu32
+                    ", queue freezes %" PRIu32 "", ptv->tv->name,
+                    kstats.tp_packets, kstats.tp_drops, kstats.tp_freeze_q_cnt);
+            SCPerfCounterAddUI64(ptv->capture_kernel_packets, ptv->tv->sc_perf_pca, kstats.tp_packets);
+            SCPerfCounterAddUI64(ptv->capture_kernel_drops, ptv->tv->sc_perf_pca, kstats.tp_drops);
+            SCPerfCounterAddUI64(ptv->capture_kernel_freeze_q, ptv->tv->sc_perf_pca, kstats.tp_freeze_q_cnt);
+            (void) SC_ATOMIC_ADD(ptv->livedev->drop, (uint64_t) kstats.tp_drops);
+            (void) SC_ATOMIC_ADD(ptv->livedev->pkts, (uint64_t) kstats.tp_packets);
+        }
+        return;
+    }
+#endif
     struct tpacket_stats kstats;
     socklen_t len = sizeof (struct tpacket_stats);
     if (getsockopt(ptv->socket, SOL_PACKET, PACKET_STATISTICS,
@@ -531,11 +603,11 @@ static inline void AFPDumpCounters(AFPThreadVars *ptv)
 int AFPRead(AFPThreadVars *ptv)
 {
     Packet *p = NULL;
-    /* XXX should try to use read that get directly to packet */
     int offset = 0;
     int caplen;
+    int direct_len;
     struct sockaddr_ll from;
-    struct iovec iov;
+    struct iovec iov[2];
     struct msghdr msg;
     struct cmsghdr *cmsg;
     union {
@@ -544,10 +616,16 @@ int AFPRead(AFPThreadVars *ptv)
     } cmsg_buf;
     unsigned char aux_checksum = 0;
 
+    p = PacketGetFromQueueOrAlloc();
+    if (p == NULL) {
+        SCReturnInt(AFP_FAILURE);
+    }
+    PKT_SET_SRC(p, PKT_SRC_WIRE);
+
     msg.msg_name = &from;
     msg.msg_namelen = sizeof(from);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
     msg.msg_control = &cmsg_buf;
     msg.msg_controllen = sizeof(cmsg_buf);
     msg.msg_flags = 0;
@@ -556,22 +634,27 @@ int AFPRead(AFPThreadVars *ptv)
         offset = SLL_HEADER_LEN;
     else
         offset = 0;
-    iov.iov_len = ptv->datalen - offset;
-    iov.iov_base = ptv->data + offset;
+
+    /* receive straight into the packet. Only the part of an oversized
+     * packet that doesn't fit lands in ptv->data and gets copied. */
+    direct_len = GET_PKT_DIRECT_MAX_SIZE(p);
+    iov[0].iov_len = direct_len - offset;
+    iov[0].iov_base = GET_PKT_DIRECT_DATA(p) + offset;
+    iov[1].iov_len = ptv->datalen;
+    iov[1].iov_base = ptv->data;
 
     caplen = recvmsg(ptv->socket, &msg, MSG_TRUNC);
 
     if (caplen < 0) {
         SCLogWarning(SC_ERR_AFP_READ, "recvmsg failed with error code %" PRId32,
                 errno);
+        TmqhOutputPacketpool(ptv->tv, p);
         SCReturnInt(AFP_READ_FAILURE);
     }
-
-    p = PacketGetFromQueueOrAlloc();
-    if (p == NULL) {
-        SCReturnInt(AFP_FAILURE);
+    /* MSG_TRUNC returns the real length, we only have the buffers */
+    if (caplen > (int)(iov[0].iov_len + iov[1].iov_len)) {
+        caplen = iov[0].iov_len + iov[1].iov_len;
     }
-    PKT_SET_SRC(p, PKT_SRC_WIRE);
 
     /* get timestamp of packet via ioctl */
     if (ioctl(ptv->socket, SIOCGSTAMP, &p->ts) == -1) {
@@ -584,19 +667,30 @@ int AFPRead(AFPThreadVars *ptv)
     ptv->pkts++;
     ptv->bytes += caplen + offset;
     p->livedev = ptv->livedev;
+#ifdef HAVE_PACKET_EBPF
+    if (ptv->flags & AFP_BYPASS)
+        p->BypassPacketsFlow = AFPBypassCallback;
+#endif
 
     /* add forged header */
     if (ptv->cooked) {
-        SllHdr * hdrp = (SllHdr *)ptv->data;
+        SllHdr * hdrp = (SllHdr *)GET_PKT_DIRECT_DATA(p);
+        memset(hdrp, 0, SLL_HEADER_LEN);
         /* XXX this is minimalist, but this seems enough */
         hdrp->sll_protocol = from.sll_protocol;
     }
 
     p->datalink = ptv->datalink;
     SET_PKT_LEN(p, caplen + offset);
-    if (PacketCopyData(p, ptv->data, GET_PKT_LEN(p)) == -1) {
-        TmqhOutputPacketpool(ptv->tv, p);
-        SCReturnInt(AFP_FAILURE);
+    if (GET_PKT_LEN(p) > (uint32_t)direct_len) {
+        if (PacketCopyDataOffset(p, direct_len, ptv->data,
+                    GET_PKT_LEN(p) - direct_len) == -1) {
+            TmqhOutputPacketpool(ptv->tv, p);
+            SCReturnInt(AFP_FAILURE);
+        }
+        SCPerfCounterIncr(ptv->capture_copied, ptv->tv->sc_perf_pca);
+    } else {
+        SCPerfCounterIncr(ptv->capture_zero_copy, ptv->tv->sc_perf_pca);
     }
     SCLogDebug("pktlen: %" PRIu32 " (pkt %p, pkt data %p)",
                GET_PKT_LEN(p), p, GET_PKT_DATA(p));
@@ -686,6 +780,21 @@ TmEcode AFPWritePacket(Packet *p)
     return TM_ECODE_OK;
 }
 
+#ifdef HAVE_TPACKET_V3
+/**
+ * \brief Drop a reference to a TPACKET_V3 block
+ *
+ * The last reference gives the block back to the kernel.
+ */
+static inline void AFPBlockRelease(AFPBlock *blk)
+{
+    if (SC_ATOMIC_SUB(blk->refcnt, 1) == 0) {
+        struct tpacket_block_desc *pbd = blk->desc;
+        pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    }
+}
+#endif
+
 void AFPReleaseDataFromRing(Packet *p)
 {
     /* Need to be in copy mode and need to detect early release
@@ -702,6 +811,11 @@ void AFPReleaseDataFromRing(Packet *p)
         h.raw = p->afp_v.relptr;
         h.h2->tp_status = TP_STATUS_KERNEL;
     }
+#ifdef HAVE_TPACKET_V3
+    else if (p->afp_v.block) {
+        AFPBlockRelease(p->afp_v.block);
+    }
+#endif
 
 cleanup:
     AFPV_CLEANUP(&p->afp_v);
@@ -793,6 +907,10 @@ int AFPReadFromRing(AFPThreadVars *ptv)
         ptv->pkts++;
         ptv->bytes += h.h2->tp_len;
         p->livedev = ptv->livedev;
+#ifdef HAVE_PACKET_EBPF
+        if (ptv->flags & AFP_BYPASS)
+            p->BypassPacketsFlow = AFPBypassCallback;
+#endif
 
         /* add forged header */
         if (ptv->cooked) {
@@ -832,11 +950,13 @@ int AFPReadFromRing(AFPThreadVars *ptv)
                     p->afp_v.peer = NULL;
                 }
             }
+            SCPerfCounterIncr(ptv->capture_zero_copy, ptv->tv->sc_perf_pca);
         } else {
             if (PacketCopyData(p, (unsigned char*)h.raw + h.h2->tp_mac, h.h2->tp_snaplen) == -1) {
                 TmqhOutputPacketpool(ptv->tv, p);
                 SCReturnInt(AFP_FAILURE);
             }
+            SCPerfCounterIncr(ptv->capture_copied, ptv->tv->sc_perf_pca);
         }
         /* Timestamp */
         p->ts.tv_sec = h.h2->tp_sec;
@@ -891,6 +1011,195 @@ next_frame:
     SCReturnInt(AFP_READ_OK);
 }
 
+#ifdef HAVE_TPACKET_V3
+/**
+ * \brief Turn all packets of a TPACKET_V3 block into Packets
+ *
+ * In zero copy mode each packet holds a reference on the block, the
+ * block is given back to the kernel by the last AFPBlockRelease() call.
+ *
+ * \retval AFP_READ_OK or AFP_FAILURE
+ */
+static int AFPWalkBlock(AFPThreadVars *ptv, AFPBlock *blk)
+{
+    struct tpacket_block_desc *pbd = blk->desc;
+    uint32_t num_pkts = pbd->hdr.bh1.num_pkts;
+    union thdr h;
+    struct sockaddr_ll *from;
+    uint32_t i;
+    int r = AFP_READ_OK;
+
+    /* reader reference, dropped when we're done with the block */
+    (void)SC_ATOMIC_SET(blk->refcnt, 1);
+    blk->seq = pbd->hdr.bh1.seq_num;
+
+    SCPerfCounterIncr(ptv->capture_blocks, ptv->tv->sc_perf_pca);
+
+    h.raw = (uint8_t *)pbd + pbd->hdr.bh1.offset_to_first_pkt;
+    for (i = 0; i < num_pkts; i++, h.raw = (uint8_t *)h.raw + h.h3->tp_next_offset) {
+        Packet *p = PacketGetFromQueueOrAlloc();
+        if (p == NULL) {
+            r = AFP_FAILURE;
+            break;
+        }
+        PKT_SET_SRC(p, PKT_SRC_WIRE);
+
+        from = (void *)h.raw + TPACKET_ALIGN(ptv->tp_hdrlen);
+
+        ptv->pkts++;
+        ptv->bytes += h.h3->tp_len;
+        p->livedev = ptv->livedev;
+#ifdef HAVE_PACKET_EBPF
+        if (ptv->flags & AFP_BYPASS)
+            p->BypassPacketsFlow = AFPBypassCallback;
+#endif
+        p->datalink = ptv->datalink;
+
+        /* add forged header */
+        if (ptv->cooked) {
+            SllHdr * hdrp = (SllHdr *)ptv->data;
+            /* XXX this is minimalist, but this seems enough */
+            hdrp->sll_protocol = from->sll_protocol;
+        }
+
+        /* get vlan id from header */
+        if ((!ptv->vlan_disabled) &&
+            (h.h3->tp_status & TP_STATUS_VLAN_VALID || h.h3->hv1.tp_vlan_tci)) {
+            p->vlan_id[0] = h.h3->hv1.tp_vlan_tci;
+            p->vlan_idx = 1;
+            p->vlanh[0] = NULL;
+        }
+
+        if (ptv->flags & AFP_ZERO_COPY) {
+            if (PacketSetData(p, (unsigned char *)h.raw + h.h3->tp_mac, h.h3->tp_snaplen) == -1) {
+                TmqhOutputPacketpool(ptv->tv, p);
+                r = AFP_FAILURE;
+                break;
+            }
+            (void)SC_ATOMIC_ADD(blk->refcnt, 1);
+            p->afp_v.relptr = NULL;
+            p->afp_v.block = blk;
+            p->ReleasePacket = AFPReleasePacket;
+            p->afp_v.mpeer = ptv->mpeer;
+            AFPRefSocket(ptv->mpeer);
+
+            p->afp_v.copy_mode = ptv->copy_mode;
+            if (p->afp_v.copy_mode != AFP_COPY_MODE_NONE) {
+                p->afp_v.peer = ptv->mpeer->peer;
+            } else {
+                p->afp_v.peer = NULL;
+            }
+            SCPerfCounterIncr(ptv->capture_zero_copy, ptv->tv->sc_perf_pca);
+        } else {
+            if (PacketCopyData(p, (unsigned char *)h.raw + h.h3->tp_mac, h.h3->tp_snaplen) == -1) {
+                TmqhOutputPacketpool(ptv->tv, p);
+                r = AFP_FAILURE;
+                break;
+            }
+            SCPerfCounterIncr(ptv->capture_copied, ptv->tv->sc_perf_pca);
+        }
+
+        /* Timestamp */
+        p->ts.tv_sec = h.h3->tp_sec;
+        p->ts.tv_usec = h.h3->tp_nsec/1000;
+        SCLogDebug("pktlen: %" PRIu32 " (pkt %p, pkt data %p)",
+                GET_PKT_LEN(p), p, GET_PKT_DATA(p));
+
+        /* We only check for checksum disable */
+        if (ptv->checksum_mode == CHECKSUM_VALIDATION_DISABLE) {
+            p->flags |= PKT_IGNORE_CHECKSUM;
+        } else if (ptv->checksum_mode == CHECKSUM_VALIDATION_AUTO) {
+            if (ptv->livedev->ignore_checksum) {
+                p->flags |= PKT_IGNORE_CHECKSUM;
+            } else if (ChecksumAutoModeCheck(ptv->pkts,
+                        SC_ATOMIC_GET(ptv->livedev->pkts),
+                        SC_ATOMIC_GET(ptv->livedev->invalid_checksums))) {
+                ptv->livedev->ignore_checksum = 1;
+                p->flags |= PKT_IGNORE_CHECKSUM;
+            }
+        } else {
+            if (h.h3->tp_status & TP_STATUS_CSUMNOTREADY) {
+                p->flags |= PKT_IGNORE_CHECKSUM;
+            }
+        }
+
+        /* on failure the packet, and with it its block reference,
+         * has been returned to the pool already */
+        if (TmThreadsSlotProcessPkt(ptv->tv, ptv->slot, p) != TM_ECODE_OK) {
+            r = AFP_FAILURE;
+            break;
+        }
+    }
+
+    AFPBlockRelease(blk);
+    return r;
+}
+
+/**
+ * \brief AF packet read function for TPACKET_V3 ring
+ *
+ * Walks the blocks the kernel handed over to us. A block we walked
+ * before that still has packets in the engine is not touched again.
+ *
+ * \param ptv pointer to AFPThreadVars
+ * \retval AFP_READ_OK, AFP_KERNEL_DROP or AFP_FAILURE
+ */
+static int AFPReadFromRingV3(AFPThreadVars *ptv)
+{
+    uint8_t emergency_flush = 0;
+
+    while (1) {
+        if (unlikely(suricata_ctl_flags != 0)) {
+            break;
+        }
+
+        AFPBlock *blk = &ptv->blocks[ptv->frame_offset];
+        struct tpacket_block_desc *pbd = blk->desc;
+
+        if (!(pbd->hdr.bh1.block_status & TP_STATUS_USER)) {
+            break;
+        }
+
+        /* same content as the last time: packets from this block are
+         * still in the engine, the kernel can't fill it. */
+        if (pbd->hdr.bh1.seq_num == blk->seq) {
+            SCPerfCounterIncr(ptv->capture_block_busy, ptv->tv->sc_perf_pca);
+            break;
+        }
+
+        /* the block may be back in the kernel once it's walked */
+        uint32_t status = pbd->hdr.bh1.block_status;
+
+        if ((ptv->flags & AFP_EMERGENCY_MODE) && emergency_flush) {
+            /* hand the block back without looking at it */
+            blk->seq = pbd->hdr.bh1.seq_num;
+            pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        } else if (AFPWalkBlock(ptv, blk) != AFP_READ_OK) {
+            if (++ptv->frame_offset >= ptv->blocks_nr) {
+                ptv->frame_offset = 0;
+            }
+            SCReturnInt(AFP_FAILURE);
+        }
+
+        if (status & TP_STATUS_LOSING) {
+            emergency_flush = 1;
+            AFPDumpCounters(ptv);
+        }
+
+        if (++ptv->frame_offset >= ptv->blocks_nr) {
+            ptv->frame_offset = 0;
+            /* Get out of loop to be sure we will reach maintenance tasks */
+            break;
+        }
+    }
+
+    if ((ptv->flags & AFP_EMERGENCY_MODE) && emergency_flush) {
+        SCReturnInt(AFP_KERNEL_DROP);
+    }
+    SCReturnInt(AFP_READ_OK);
+}
+#endif /* HAVE_TPACKET_V3 */
+
 /**
  * \brief Reference socket
  *
@@ -996,6 +1305,34 @@ static int AFPReadAndDiscard(AFPThreadVars *ptv, struct timeval *synctv)
     return 0;
 }
 
+#ifdef HAVE_TPACKET_V3
+static int AFPReadAndDiscardFromRingV3(AFPThreadVars *ptv, struct timeval *synctv)
+{
+    struct tpacket_block_desc *pbd = ptv->blocks[ptv->frame_offset].desc;
+    union thdr h;
+
+    if (!(pbd->hdr.bh1.block_status & TP_STATUS_USER)) {
+        return 0;
+    }
+
+    /* look at the timestamp of the first packet of the block */
+    h.raw = (uint8_t *)pbd + pbd->hdr.bh1.offset_to_first_pkt;
+    if (pbd->hdr.bh1.num_pkts > 0 &&
+        (((time_t)h.h3->tp_sec > synctv->tv_sec) ||
+        ((time_t)h.h3->tp_sec == synctv->tv_sec &&
+        (suseconds_t) (h.h3->tp_nsec / 1000) > synctv->tv_usec))) {
+        return 1;
+    }
+
+    pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    if (++ptv->frame_offset >= ptv->blocks_nr) {
+        ptv->frame_offset = 0;
+    }
+
+    return 0;
+}
+#endif
+
 static int AFPReadAndDiscardFromRing(AFPThreadVars *ptv, struct timeval *synctv)
 {
     union thdr h;
@@ -1004,6 +1341,12 @@ static int AFPReadAndDiscardFromRing(AFPThreadVars *ptv, struct timeval *synctv)
         return 1;
     }
 
+#ifdef HAVE_TPACKET_V3
+    if (ptv->flags & AFP_TPACKET_V3) {
+        return AFPReadAndDiscardFromRingV3(ptv, synctv);
+    }
+#endif
+
     /* Read packet from ring */
     h.raw = (((union thdr **)ptv->frame_buf)[ptv->frame_offset]);
     if (h.raw == NULL) {
@@ -1210,6 +1553,11 @@ TmEcode ReceiveAFPLoop(ThreadVars *tv, void *data, void *slot)
                 continue;
             }
         } else if (r > 0) {
+#ifdef HAVE_TPACKET_V3
+            if (ptv->flags & AFP_TPACKET_V3) {
+                r = AFPReadFromRingV3(ptv);
+            } else
+#endif
             if (ptv->flags & AFP_RING_MODE) {
                 r = AFPReadFromRing(ptv);
             } else {
@@ -1240,6 +1588,10 @@ TmEcode ReceiveAFPLoop(ThreadVars *tv, void *data, void *slot)
                     AFPDumpCounters(ptv);
                     break;
             }
+        } else if (r == 0) {
+            /* no packets: a thread owning its flow table still has to
+             * time out its flows */
+            FlowHandleIdle(tv, (DecodeThreadVars *)SC_ATOMIC_GET(ptv->slot->slot_data));
         } else if ((r < 0) && (errno != EINTR)) {
             SCLogError(SC_ERR_AFP_READ, "Error reading data from iface '%s': (%d" PRIu32 ") %s",
                        ptv->iface,
@@ -1357,6 +1709,106 @@ frame size: TPACKET_ALIGN(snaplen + TPACKET_ALIGN(TPACKET_ALIGN(tp_hdrlen) + siz
     return 1;
 }
 
+#ifdef HAVE_TPACKET_V3
+static int AFPComputeRingParamsV3(AFPThreadVars *ptv)
+{
+    int tp_hdrlen = sizeof(struct tpacket3_hdr);
+    int snaplen = default_packet_size;
+
+    ptv->req3.tp_block_size = ptv->block_size;
+    ptv->req3.tp_frame_size = TPACKET_ALIGN(snaplen + TPACKET_ALIGN(TPACKET_ALIGN(tp_hdrlen) + sizeof(struct sockaddr_ll) + ETH_HLEN) - ETH_HLEN);
+    int frames_per_block = ptv->req3.tp_block_size / ptv->req3.tp_frame_size;
+    if (frames_per_block == 0) {
+        SCLogError(SC_ERR_INVALID_VALUE, "block-size %d is smaller than the "
+                "frame size %d", ptv->block_size, ptv->req3.tp_frame_size);
+        return -1;
+    }
+    /* frames are of variable size in V3, so this is the worst case */
+    ptv->req3.tp_block_nr = ptv->ring_size / frames_per_block + 1;
+    ptv->req3.tp_frame_nr = ptv->req3.tp_block_nr * frames_per_block;
+    ptv->req3.tp_retire_blk_tov = ptv->block_timeout;
+    ptv->req3.tp_sizeof_priv = 0;
+    ptv->req3.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    SCLogInfo("AF_PACKET V3 RX Ring params: block_size=%d block_nr=%d frame_size=%d frame_nr=%d",
+              ptv->req3.tp_block_size, ptv->req3.tp_block_nr,
+              ptv->req3.tp_frame_size, ptv->req3.tp_frame_nr);
+    return 1;
+}
+
+/**
+ * \brief Setup a TPACKET_V3 RX ring on the socket
+ *
+ * \retval 0 on success, -1 on error
+ */
+static int AFPSetupRingV3(AFPThreadVars *ptv, char *devname)
+{
+    int val = TPACKET_V3;
+    unsigned int len = sizeof(val);
+    unsigned int i;
+
+    if (getsockopt(ptv->socket, SOL_PACKET, PACKET_HDRLEN, &val, &len) < 0) {
+        if (errno == ENOPROTOOPT) {
+            SCLogError(SC_ERR_AFP_CREATE,
+                       "Too old kernel giving up (need 3.2 at least for TPACKET_V3)");
+        }
+        SCLogError(SC_ERR_AFP_CREATE, "Error when retrieving packet header len");
+        return -1;
+    }
+    ptv->tp_hdrlen = val;
+
+    val = TPACKET_V3;
+    if (setsockopt(ptv->socket, SOL_PACKET, PACKET_VERSION, &val,
+                sizeof(val)) < 0) {
+        SCLogError(SC_ERR_AFP_CREATE,
+                   "Can't activate TPACKET_V3 on packet socket: %s",
+                   strerror(errno));
+        return -1;
+    }
+
+    if (AFPComputeRingParamsV3(ptv) != 1) {
+        return -1;
+    }
+
+    if (setsockopt(ptv->socket, SOL_PACKET, PACKET_RX_RING,
+                (void *) &ptv->req3, sizeof(ptv->req3)) < 0) {
+        SCLogError(SC_ERR_MEM_ALLOC,
+                "Unable to allocate RX Ring for iface %s: (%d) %s",
+                devname,
+                errno,
+                strerror(errno));
+        return -1;
+    }
+
+    ptv->ring_buflen = ptv->req3.tp_block_nr * ptv->req3.tp_block_size;
+    ptv->ring_buf = mmap(0, ptv->ring_buflen, PROT_READ|PROT_WRITE,
+            MAP_SHARED, ptv->socket, 0);
+    if (ptv->ring_buf == MAP_FAILED) {
+        SCLogError(SC_ERR_MEM_ALLOC, "Unable to mmap");
+        return -1;
+    }
+
+    /* packets of the previous socket are all released, see AFPTryReopen */
+    if (ptv->blocks != NULL) {
+        SCFree(ptv->blocks);
+        ptv->blocks = NULL;
+    }
+    ptv->blocks = SCMalloc(ptv->req3.tp_block_nr * sizeof(AFPBlock));
+    if (ptv->blocks == NULL) {
+        SCLogError(SC_ERR_MEM_ALLOC, "Unable to allocate block state");
+        return -1;
+    }
+    memset(ptv->blocks, 0, ptv->req3.tp_block_nr * sizeof(AFPBlock));
+    for (i = 0; i < ptv->req3.tp_block_nr; i++) {
+        ptv->blocks[i].desc = &ptv->ring_buf[i * ptv->req3.tp_block_size];
+        SC_ATOMIC_INIT(ptv->blocks[i].refcnt);
+    }
+    ptv->blocks_nr = ptv->req3.tp_block_nr;
+    ptv->frame_offset = 0;
+
+    return 0;
+}
+#endif /* HAVE_TPACKET_V3 */
+
 static int AFPCreateSocket(AFPThreadVars *ptv, char *devname, int verbose)
 {
     int r;
@@ -1480,6 +1932,12 @@ static int AFPCreateSocket(AFPThreadVars *ptv, char *devname, int verbose)
         goto frame_err;
     }
 
+#ifdef HAVE_TPACKET_V3
+    if (ptv->flags & AFP_TPACKET_V3) {
+        if (AFPSetupRingV3(ptv, devname) != 0)
+            goto socket_err;
+    } else
+#endif
     if (ptv->flags & AFP_RING_MODE) {
         int val = TPACKET_V2;
         unsigned int len = sizeof(val);
@@ -1579,6 +2037,14 @@ static int AFPCreateSocket(AFPThreadVars *ptv, char *devname, int verbose)
         goto frame_err;
     }
 
+#ifdef HAVE_PACKET_EBPF
+    if (ptv->flags & AFP_BYPASS) {
+        if (AFPSetBypassFilter(ptv) < 0) {
+            ptv->flags &= ~AFP_BYPASS;
+        }
+    }
+#endif
+
     /* Init is ok */
     AFPSwitchState(ptv, AFP_STATE_UP);
     return 0;
@@ -1641,6 +2107,592 @@ TmEcode AFPSetBPFFilter(AFPThreadVars *ptv)
     return TM_ECODE_OK;
 }
 
+#ifdef HAVE_PACKET_EBPF
+
+/**
+ * \defgroup afpbypass AF_PACKET flow bypass
+ *
+ * Flows that don't need inspection anymore can be dropped in the kernel
+ * by an eBPF socket filter attached to the capture sockets. The filter
+ * looks up the 5-tuple of IPv4 and IPv6 TCP and UDP packets in a hash
+ * map and drops the packet if it's found, counting it in the map entry.
+ * The map is shared by all interfaces. The flow manager periodically
+ * collects the counters and removes the entries of the flows that were
+ * idle for longer than their established timeout.
+ *
+ * @{
+ */
+
+/** max number of map entries, a flow uses one per direction */
+#define AFP_BYPASS_MAP_SIZE 65536
+/** max number of entries removed per check */
+#define AFP_BYPASS_EXPIRE_MAX 1024
+/** max number of eBPF instructions of the filter */
+#define AFP_BYPASS_PROG_MAX 160
+
+/** \brief key of the bypass map, in the layout the filter builds it.
+ *         The address words and the ports are in host byte order. */
+typedef struct AFPBypassKey_ {
+    uint32_t src[4];
+    uint32_t dst[4];
+    uint16_t sp;
+    uint16_t dp;
+    uint8_t proto;
+    uint8_t pad[3];
+} AFPBypassKey;
+
+/** \brief value of the bypass map. pkts and bytes are updated by the
+ *         filter, lastts by the flow manager. */
+typedef struct AFPBypassValue_ {
+    uint64_t pkts;
+    uint64_t bytes;
+    uint64_t lastts;
+} AFPBypassValue;
+
+static int afp_bypass_map_fd = -1;
+static int afp_bypass_prog_fd = -1;
+static SCMutex afp_bypass_lock = SCMUTEX_INITIALIZER;
+
+/* eBPF instruction helpers */
+#define AFP_BPF_INSN(c, d, s, o, i) \
+    ((struct ebpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define AFP_BPF_MOV64_REG(d, s)     AFP_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define AFP_BPF_MOV64_IMM(d, i)     AFP_BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define AFP_BPF_ALU64_IMM(op, d, i) AFP_BPF_INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define AFP_BPF_LDX_MEM(sz, d, s, o) AFP_BPF_INSN(BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define AFP_BPF_STX_MEM(sz, d, s, o) AFP_BPF_INSN(BPF_STX | BPF_MEM | (sz), d, s, o, 0)
+#define AFP_BPF_XADD(sz, d, s, o)   AFP_BPF_INSN(BPF_STX | BPF_XADD | (sz), d, s, o, 0)
+#define AFP_BPF_LD_ABS(sz, i)       AFP_BPF_INSN(BPF_LD | (sz) | BPF_ABS, 0, 0, 0, i)
+#define AFP_BPF_LD_IND(sz, s, i)    AFP_BPF_INSN(BPF_LD | (sz) | BPF_IND, 0, s, 0, i)
+#define AFP_BPF_JMP_IMM(op, d, i)   AFP_BPF_INSN(BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+#define AFP_BPF_JMP_REG(op, d, s)   AFP_BPF_INSN(BPF_JMP | (op) | BPF_X, d, s, 0, 0)
+#define AFP_BPF_JA()                AFP_BPF_INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+#define AFP_BPF_CALL(f)             AFP_BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define AFP_BPF_EXIT()              AFP_BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* key offsets relative to the frame pointer */
+#define AFP_BPF_KEY_OFF     (-(int)sizeof(AFPBypassKey))
+#define AFP_BPF_KEY(field)  (AFP_BPF_KEY_OFF + (int)offsetof(AFPBypassKey, field))
+
+static int AFPBypassSyscall(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * \internal
+ * \brief build the bypass filter program
+ *
+ * The filter accepts the packet unless it's a non fragmented, untagged
+ * IPv4 or IPv6 TCP or UDP packet whose 5-tuple is in the bypass map.
+ * Tagged means either an in-band vlan header or a tag stripped by the
+ * NIC or the kernel, which only shows up in skb->vlan_present. Lengths
+ * are checked before the loads as an out of bounds load drops the
+ * packet.
+ *
+ * TCP packets with SYN, FIN or RST set change the session state, so
+ * they are always accepted. On FIN or RST the entries of both
+ * directions are removed from the map, so the rest of the teardown and
+ * a new session on the same tuple are seen by the stream engine.
+ *
+ * \param prog array of AFP_BYPASS_PROG_MAX instructions to fill
+ * \param map_fd bypass map
+ *
+ * \retval number of instructions
+ */
+static int AFPBypassBuildProg(struct ebpf_insn *prog, int map_fd)
+{
+    /* jumps to the accept and lookup blocks, fixed up at the end */
+    int accept_jumps[24], accept_cnt = 0;
+    int lookup_jump;
+    int ipv6_jump;
+    int udp_jump;
+    int count_jump;
+    int n = 0;
+    int i;
+
+#define EMIT(insn) prog[n++] = (insn)
+#define EMIT_ACCEPT_JMP(insn) do {              \
+        accept_jumps[accept_cnt++] = n;         \
+        EMIT(insn);                             \
+    } while (0)
+/* if (len < min) accept */
+#define EMIT_LEN_CHECK(min) do {                                        \
+        EMIT(AFP_BPF_MOV64_IMM(BPF_REG_1, (min)));                      \
+        EMIT_ACCEPT_JMP(AFP_BPF_JMP_REG(BPF_JGT, BPF_REG_1, BPF_REG_7)); \
+    } while (0)
+/* r0 has the ip proto: only TCP and UDP */
+#define EMIT_PROTO_CHECK() do {                                         \
+        EMIT(AFP_BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 1, IPPROTO_TCP)); \
+        EMIT_ACCEPT_JMP(AFP_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, IPPROTO_UDP)); \
+        EMIT(AFP_BPF_STX_MEM(BPF_B, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(proto))); \
+    } while (0)
+/* delete the key at the frame pointer from the map */
+#define EMIT_MAP_DELETE() do {                                          \
+        EMIT(AFP_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd)); \
+        EMIT(AFP_BPF_INSN(0, 0, 0, 0, 0));                              \
+        EMIT(AFP_BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));                 \
+        EMIT(AFP_BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, AFP_BPF_KEY_OFF));    \
+        EMIT(AFP_BPF_CALL(BPF_FUNC_map_delete_elem));                   \
+    } while (0)
+
+    /* r6 = skb, r7 = skb->len, r9 = tcp state flags */
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_6, BPF_REG_1));
+    EMIT(AFP_BPF_LDX_MEM(BPF_W, BPF_REG_7, BPF_REG_6,
+                offsetof(struct __sk_buff, len)));
+    EMIT(AFP_BPF_MOV64_IMM(BPF_REG_9, 0));
+    /* stripped vlan tag */
+    EMIT(AFP_BPF_LDX_MEM(BPF_W, BPF_REG_1, BPF_REG_6,
+                offsetof(struct __sk_buff, vlan_present)));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_IMM(BPF_JNE, BPF_REG_1, 0));
+    /* zero the key */
+    EMIT(AFP_BPF_MOV64_IMM(BPF_REG_1, 0));
+    for (i = AFP_BPF_KEY_OFF; i < 0; i += 8)
+        EMIT(AFP_BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, i));
+
+    EMIT_LEN_CHECK(ETHERNET_HEADER_LEN);
+    EMIT(AFP_BPF_LD_ABS(BPF_H, 12));
+    ipv6_jump = n;
+    EMIT(AFP_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, ETHERNET_TYPE_IPV6));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, ETHERNET_TYPE_IP));
+
+    /* IPv4 */
+    EMIT_LEN_CHECK(ETHERNET_HEADER_LEN + IPV4_HEADER_LEN);
+    /* fragments */
+    EMIT(AFP_BPF_LD_ABS(BPF_H, ETHERNET_HEADER_LEN + 6));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_AND, BPF_REG_0, 0x3fff));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0));
+    EMIT(AFP_BPF_LD_ABS(BPF_B, ETHERNET_HEADER_LEN + 9));
+    EMIT_PROTO_CHECK();
+    EMIT(AFP_BPF_LD_ABS(BPF_W, ETHERNET_HEADER_LEN + 12));
+    EMIT(AFP_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(src)));
+    EMIT(AFP_BPF_LD_ABS(BPF_W, ETHERNET_HEADER_LEN + 16));
+    EMIT(AFP_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(dst)));
+    /* r8 = ip header len, the ports follow the ip header */
+    EMIT(AFP_BPF_LD_ABS(BPF_B, ETHERNET_HEADER_LEN));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_AND, BPF_REG_0, 0x0f));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_LSH, BPF_REG_0, 2));
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_8, BPF_REG_0));
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_1, BPF_REG_8));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, ETHERNET_HEADER_LEN + 4));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_REG(BPF_JGT, BPF_REG_1, BPF_REG_7));
+    EMIT(AFP_BPF_LD_IND(BPF_H, BPF_REG_8, ETHERNET_HEADER_LEN));
+    EMIT(AFP_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(sp)));
+    EMIT(AFP_BPF_LD_IND(BPF_H, BPF_REG_8, ETHERNET_HEADER_LEN + 2));
+    EMIT(AFP_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(dp)));
+    /* tcp flags */
+    EMIT(AFP_BPF_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, AFP_BPF_KEY(proto)));
+    udp_jump = n;
+    EMIT(AFP_BPF_JMP_IMM(BPF_JNE, BPF_REG_1, IPPROTO_TCP));
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_1, BPF_REG_8));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_ADD, BPF_REG_1, ETHERNET_HEADER_LEN + 14));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_REG(BPF_JGT, BPF_REG_1, BPF_REG_7));
+    EMIT(AFP_BPF_LD_IND(BPF_B, BPF_REG_8, ETHERNET_HEADER_LEN + 13));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_AND, BPF_REG_0, TH_SYN|TH_FIN|TH_RST));
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_9, BPF_REG_0));
+    prog[udp_jump].off = n - udp_jump - 1;
+    lookup_jump = n;
+    EMIT(AFP_BPF_JA());
+
+    /* IPv6, packets with extension headers are not bypassed */
+    prog[ipv6_jump].off = n - ipv6_jump - 1;
+    EMIT_LEN_CHECK(ETHERNET_HEADER_LEN + IPV6_HEADER_LEN + 4);
+    EMIT(AFP_BPF_LD_ABS(BPF_B, ETHERNET_HEADER_LEN + 6));
+    EMIT_PROTO_CHECK();
+    for (i = 0; i < 4; i++) {
+        EMIT(AFP_BPF_LD_ABS(BPF_W, ETHERNET_HEADER_LEN + 8 + i * 4));
+        EMIT(AFP_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(src) + i * 4));
+    }
+    for (i = 0; i < 4; i++) {
+        EMIT(AFP_BPF_LD_ABS(BPF_W, ETHERNET_HEADER_LEN + 24 + i * 4));
+        EMIT(AFP_BPF_STX_MEM(BPF_W, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(dst) + i * 4));
+    }
+    EMIT(AFP_BPF_LD_ABS(BPF_H, ETHERNET_HEADER_LEN + IPV6_HEADER_LEN));
+    EMIT(AFP_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(sp)));
+    EMIT(AFP_BPF_LD_ABS(BPF_H, ETHERNET_HEADER_LEN + IPV6_HEADER_LEN + 2));
+    EMIT(AFP_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_0, AFP_BPF_KEY(dp)));
+    /* tcp flags */
+    EMIT(AFP_BPF_LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_10, AFP_BPF_KEY(proto)));
+    udp_jump = n;
+    EMIT(AFP_BPF_JMP_IMM(BPF_JNE, BPF_REG_1, IPPROTO_TCP));
+    EMIT_LEN_CHECK(ETHERNET_HEADER_LEN + IPV6_HEADER_LEN + 14);
+    EMIT(AFP_BPF_LD_ABS(BPF_B, ETHERNET_HEADER_LEN + IPV6_HEADER_LEN + 13));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_AND, BPF_REG_0, TH_SYN|TH_FIN|TH_RST));
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_9, BPF_REG_0));
+    prog[udp_jump].off = n - udp_jump - 1;
+
+    /* lookup */
+    prog[lookup_jump].off = n - lookup_jump - 1;
+    EMIT(AFP_BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd));
+    EMIT(AFP_BPF_INSN(0, 0, 0, 0, 0));
+    EMIT(AFP_BPF_MOV64_REG(BPF_REG_2, BPF_REG_10));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, AFP_BPF_KEY_OFF));
+    EMIT(AFP_BPF_CALL(BPF_FUNC_map_lookup_elem));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0));
+
+    /* bypassed tcp session changing state: SYN is accepted, FIN and
+     * RST also remove both directions from the map */
+    count_jump = n;
+    EMIT(AFP_BPF_JMP_IMM(BPF_JEQ, BPF_REG_9, 0));
+    EMIT(AFP_BPF_ALU64_IMM(BPF_AND, BPF_REG_9, TH_FIN|TH_RST));
+    EMIT_ACCEPT_JMP(AFP_BPF_JMP_IMM(BPF_JEQ, BPF_REG_9, 0));
+    EMIT_MAP_DELETE();
+    /* turn the key around: addresses are two dwords each, the ports
+     * are swapped as halfwords */
+    for (i = 0; i < 16; i += 8) {
+        EMIT(AFP_BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_10, AFP_BPF_KEY(src) + i));
+        EMIT(AFP_BPF_LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_10, AFP_BPF_KEY(dst) + i));
+        EMIT(AFP_BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_2, AFP_BPF_KEY(src) + i));
+        EMIT(AFP_BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_1, AFP_BPF_KEY(dst) + i));
+    }
+    EMIT(AFP_BPF_LDX_MEM(BPF_H, BPF_REG_1, BPF_REG_10, AFP_BPF_KEY(sp)));
+    EMIT(AFP_BPF_LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_10, AFP_BPF_KEY(dp)));
+    EMIT(AFP_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_2, AFP_BPF_KEY(sp)));
+    EMIT(AFP_BPF_STX_MEM(BPF_H, BPF_REG_10, BPF_REG_1, AFP_BPF_KEY(dp)));
+    EMIT_MAP_DELETE();
+    EMIT_ACCEPT_JMP(AFP_BPF_JA());
+
+    /* count and drop */
+    prog[count_jump].off = n - count_jump - 1;
+    EMIT(AFP_BPF_MOV64_IMM(BPF_REG_1, 1));
+    EMIT(AFP_BPF_XADD(BPF_DW, BPF_REG_0, BPF_REG_1, offsetof(AFPBypassValue, pkts)));
+    EMIT(AFP_BPF_XADD(BPF_DW, BPF_REG_0, BPF_REG_7, offsetof(AFPBypassValue, bytes)));
+    EMIT(AFP_BPF_MOV64_IMM(BPF_REG_0, 0));
+    EMIT(AFP_BPF_EXIT());
+
+    /* accept the whole packet */
+    for (i = 0; i < accept_cnt; i++)
+        prog[accept_jumps[i]].off = n - accept_jumps[i] - 1;
+    EMIT(AFP_BPF_MOV64_IMM(BPF_REG_0, -1));
+    EMIT(AFP_BPF_EXIT());
+
+#undef EMIT_MAP_DELETE
+#undef EMIT_PROTO_CHECK
+#undef EMIT_LEN_CHECK
+#undef EMIT_ACCEPT_JMP
+#undef EMIT
+    BUG_ON(n > AFP_BYPASS_PROG_MAX);
+    return n;
+}
+
+/**
+ * \internal
+ * \brief fill the bypass map key for a packet
+ *
+ * \param reverse set to build the key of the other direction
+ *
+ * \retval 0 ok
+ * \retval -1 packet can't be bypassed
+ */
+static int AFPBypassKeyFromPacket(Packet *p, AFPBypassKey *key, int reverse)
+{
+    Address *src = reverse ? &p->dst : &p->src;
+    Address *dst = reverse ? &p->src : &p->dst;
+    int i;
+
+    memset(key, 0, sizeof(*key));
+
+    if (p->proto != IPPROTO_TCP && p->proto != IPPROTO_UDP)
+        return -1;
+    /* the key has no vlan id and the filter accepts all tagged traffic,
+     * whether the tag is in the packet or was stripped into the skb
+     * meta data, so don't fill the map with entries that never match */
+    if (p->vlan_idx != 0)
+        return -1;
+
+    if (PKT_IS_IPV4(p)) {
+        key->src[0] = ntohl(src->addr_data32[0]);
+        key->dst[0] = ntohl(dst->addr_data32[0]);
+    } else if (PKT_IS_IPV6(p)) {
+        for (i = 0; i < 4; i++) {
+            key->src[i] = ntohl(src->addr_data32[i]);
+            key->dst[i] = ntohl(dst->addr_data32[i]);
+        }
+    } else {
+        return -1;
+    }
+
+    key->sp = reverse ? p->dp : p->sp;
+    key->dp = reverse ? p->sp : p->dp;
+    key->proto = p->proto;
+    return 0;
+}
+
+/**
+ * \internal
+ * \brief add the flow of the packet to the bypass map
+ *
+ * Called from the stream engine when the flow doesn't need any more
+ * inspection.
+ *
+ * \retval 1 flow is bypassed
+ * \retval 0 not bypassed
+ */
+static int AFPBypassCallback(Packet *p)
+{
+    AFPBypassKey key[2];
+    AFPBypassValue value;
+    union bpf_attr attr;
+    int i;
+
+    if (AFPBypassKeyFromPacket(p, &key[0], 0) < 0 ||
+            AFPBypassKeyFromPacket(p, &key[1], 1) < 0)
+        return 0;
+
+    memset(&value, 0, sizeof(value));
+    value.lastts = (uint64_t)p->ts.tv_sec;
+
+    for (i = 0; i < 2; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = afp_bypass_map_fd;
+        attr.key = (uint64_t)(uintptr_t)&key[i];
+        attr.value = (uint64_t)(uintptr_t)&value;
+        attr.flags = BPF_ANY;
+        if (AFPBypassSyscall(BPF_MAP_UPDATE_ELEM, &attr) != 0) {
+            SCLogDebug("bypass map update failed: %s", strerror(errno));
+            if (i == 1) {
+                /* don't leave half a flow in the map */
+                attr.key = (uint64_t)(uintptr_t)&key[0];
+                (void)AFPBypassSyscall(BPF_MAP_DELETE_ELEM, &attr);
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int AFPBypassMapLookup(AFPBypassKey *key, AFPBypassValue *value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = afp_bypass_map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    return AFPBypassSyscall(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static void AFPBypassMapUpdate(AFPBypassKey *key, AFPBypassValue *value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = afp_bypass_map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_EXIST;
+    (void)AFPBypassSyscall(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void AFPBypassMapDelete(AFPBypassKey *key)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = afp_bypass_map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    (void)AFPBypassSyscall(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static void AFPBypassKeyReverse(AFPBypassKey *key, AFPBypassKey *rkey)
+{
+    memset(rkey, 0, sizeof(*rkey));
+    memcpy(rkey->src, key->dst, sizeof(rkey->src));
+    memcpy(rkey->dst, key->src, sizeof(rkey->dst));
+    rkey->sp = key->dp;
+    rkey->dp = key->sp;
+    rkey->proto = key->proto;
+}
+
+/** \internal
+ *  \brief the two entries of a flow are handled together, from the key
+ *          with the lowest source */
+static int AFPBypassKeyIsFirst(AFPBypassKey *key)
+{
+    int r = memcmp(key->src, key->dst, sizeof(key->src));
+    if (r != 0)
+        return (r < 0);
+    return (key->sp <= key->dp);
+}
+
+/**
+ * \internal
+ * \brief flow manager check of the bypassed flows
+ *
+ * Collects the packet and byte counts of the map entries and removes
+ * the flows that saw no packets for longer than the established timeout
+ * of their protocol. The counts are reset in place, so a few packets
+ * counted by the filter during the update can be lost.
+ */
+static void AFPBypassCheck(struct timeval *ts, FlowBypassStats *stats, void *data)
+{
+    AFPBypassKey key, next_key, rkey;
+    AFPBypassValue value, rvalue;
+    AFPBypassKey *expired;
+    union bpf_attr attr;
+    int expired_cnt = 0;
+    int i;
+
+    if (afp_bypass_map_fd < 0)
+        return;
+
+    expired = SCMalloc(AFP_BYPASS_EXPIRE_MAX * sizeof(AFPBypassKey));
+    if (unlikely(expired == NULL))
+        return;
+
+    /* proto 0 is never in the map, so we start with the first key */
+    memset(&key, 0, sizeof(key));
+    while (1) {
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = afp_bypass_map_fd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        attr.next_key = (uint64_t)(uintptr_t)&next_key;
+        if (AFPBypassSyscall(BPF_MAP_GET_NEXT_KEY, &attr) != 0)
+            break;
+        key = next_key;
+
+        if (AFPBypassMapLookup(&key, &value) != 0)
+            continue;
+
+        AFPBypassKeyReverse(&key, &rkey);
+        int has_reverse = (AFPBypassMapLookup(&rkey, &rvalue) == 0);
+        if (has_reverse && !AFPBypassKeyIsFirst(&key))
+            continue;
+
+        uint64_t pkts = value.pkts;
+        uint64_t lastts = value.lastts;
+        if (has_reverse) {
+            pkts += rvalue.pkts;
+            if (rvalue.lastts > lastts)
+                lastts = rvalue.lastts;
+        }
+
+        if (pkts > 0) {
+            stats->pkts += pkts;
+            stats->bytes += value.bytes + (has_reverse ? rvalue.bytes : 0);
+
+            memset(&value, 0, sizeof(value));
+            value.lastts = (uint64_t)ts->tv_sec;
+            AFPBypassMapUpdate(&key, &value);
+            if (has_reverse)
+                AFPBypassMapUpdate(&rkey, &value);
+        } else {
+            uint32_t timeout = flow_proto[FlowGetProtoMapping(key.proto)].est_timeout;
+            if (lastts + timeout < (uint64_t)ts->tv_sec &&
+                    expired_cnt + 2 <= AFP_BYPASS_EXPIRE_MAX) {
+                expired[expired_cnt++] = key;
+                if (has_reverse)
+                    expired[expired_cnt++] = rkey;
+                continue;
+            }
+        }
+        stats->active++;
+    }
+
+    /* delete after the walk so we don't disturb the iteration */
+    for (i = 0; i < expired_cnt; i++) {
+        AFPBypassMapDelete(&expired[i]);
+    }
+    SCFree(expired);
+}
+
+/**
+ * \internal
+ * \brief create the bypass map and filter, once for all interfaces
+ *
+ * \retval 0 ok
+ * \retval -1 error
+ */
+static int AFPBypassSetup(void)
+{
+    union bpf_attr attr;
+    struct ebpf_insn prog[AFP_BYPASS_PROG_MAX];
+    char log[4096];
+    int r = 0;
+
+    SCMutexLock(&afp_bypass_lock);
+    if (afp_bypass_prog_fd >= 0)
+        goto end;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_HASH;
+    attr.key_size = sizeof(AFPBypassKey);
+    attr.value_size = sizeof(AFPBypassValue);
+    attr.max_entries = AFP_BYPASS_MAP_SIZE;
+    afp_bypass_map_fd = AFPBypassSyscall(BPF_MAP_CREATE, &attr);
+    if (afp_bypass_map_fd < 0) {
+        SCLogError(SC_ERR_AFP_CREATE, "Unable to create the bypass map: %s",
+                strerror(errno));
+        r = -1;
+        goto end;
+    }
+
+    memset(prog, 0, sizeof(prog));
+    memset(&attr, 0, sizeof(attr));
+    log[0] = '\0';
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insn_cnt = AFPBypassBuildProg(prog, afp_bypass_map_fd);
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    afp_bypass_prog_fd = AFPBypassSyscall(BPF_PROG_LOAD, &attr);
+    if (afp_bypass_prog_fd < 0) {
+        SCLogError(SC_ERR_AFP_CREATE, "Unable to load the bypass filter: %s",
+                strerror(errno));
+        SCLogDebug("verifier log: %s", log);
+        close(afp_bypass_map_fd);
+        afp_bypass_map_fd = -1;
+        r = -1;
+        goto end;
+    }
+
+    if (FlowManagerRegisterBypassCheck(AFPBypassCheck, NULL) != 0) {
+        SCLogWarning(SC_ERR_AFP_CREATE, "Unable to register the bypass check, "
+                "bypassed flows will not time out");
+    }
+
+end:
+    SCMutexUnlock(&afp_bypass_lock);
+    return r;
+}
+
+/**
+ * \internal
+ * \brief attach the bypass filter to the capture socket
+ *
+ * \retval 0 ok
+ * \retval -1 error, bypass can't be used on this socket
+ */
+static int AFPSetBypassFilter(AFPThreadVars *ptv)
+{
+    if (ptv->datalink != LINKTYPE_ETHERNET) {
+        SCLogWarning(SC_ERR_AFP_CREATE, "Bypass is only supported on "
+                "ethernet interfaces, disabling it on iface %s", ptv->iface);
+        return -1;
+    }
+
+    if (AFPBypassSetup() < 0)
+        return -1;
+
+    if (setsockopt(ptv->socket, SOL_SOCKET, SO_ATTACH_BPF,
+                &afp_bypass_prog_fd, sizeof(afp_bypass_prog_fd)) == -1) {
+        SCLogError(SC_ERR_AFP_CREATE, "Failed to attach the bypass filter "
+                "on iface %s: %s", ptv->iface, strerror(errno));
+        return -1;
+    }
+
+    SCLogInfo("Using the bypass filter on iface %s", ptv->iface);
+    return 0;
+}
+
+/**
+ * @}
+ */
+
+#endif /* HAVE_PACKET_EBPF */
+
 
 /**
  * \brief Init function for ReceiveAFP.
@@ -1683,6 +2735,8 @@ TmEcode ReceiveAFPThreadInit(ThreadVars *tv, void *initdata, void **data)
 
     ptv->buffer_size = afpconfig->buffer_size;
     ptv->ring_size = afpconfig->ring_size;
+    ptv->block_size = afpconfig->block_size;
+    ptv->block_timeout = afpconfig->block_timeout;
 
     ptv->promisc = afpconfig->promisc;
     ptv->checksum_mode = afpconfig->checksum_mode;
@@ -1701,6 +2755,14 @@ TmEcode ReceiveAFPThreadInit(ThreadVars *tv, void *initdata, void **data)
 #endif
     ptv->flags = afpconfig->flags;
 
+#ifndef HAVE_TPACKET_V3
+    if (ptv->flags & AFP_TPACKET_V3) {
+        SCLogWarning(SC_ERR_INVALID_VALUE, "TPACKET_V3 is not supported by "
+                "this build, using TPACKET_V2 on iface %s", ptv->iface);
+        ptv->flags &= ~AFP_TPACKET_V3;
+    }
+#endif
+
     if (afpconfig->bpf_filter) {
         ptv->bpf_filter = afpconfig->bpf_filter;
     }
@@ -1714,7 +2776,31 @@ TmEcode ReceiveAFPThreadInit(ThreadVars *tv, void *initdata, void **data)
             ptv->tv,
             SC_PERF_TYPE_UINT64,
             "NULL");
+    if (ptv->flags & AFP_TPACKET_V3) {
+        ptv->capture_kernel_freeze_q = SCPerfTVRegisterCounter("capture.kernel_freeze_q",
+                ptv->tv,
+                SC_PERF_TYPE_UINT64,
+                "NULL");
+    }
 #endif
+    ptv->capture_zero_copy = SCPerfTVRegisterCounter("capture.zero_copy",
+            ptv->tv,
+            SC_PERF_TYPE_UINT64,
+            "NULL");
+    ptv->capture_copied = SCPerfTVRegisterCounter("capture.copied",
+            ptv->tv,
+            SC_PERF_TYPE_UINT64,
+            "NULL");
+    if (ptv->flags & AFP_TPACKET_V3) {
+        ptv->capture_blocks = SCPerfTVRegisterCounter("capture.blocks",
+                ptv->tv,
+                SC_PERF_TYPE_UINT64,
+                "NULL");
+        ptv->capture_block_busy = SCPerfTVRegisterCounter("capture.block_busy",
+                ptv->tv,
+                SC_PERF_TYPE_UINT64,
+                "NULL");
+    }
 
     char *active_runmode = RunmodeGetActive();
 
@@ -1799,9 +2885,21 @@ void ReceiveAFPThreadExitStats(ThreadVars *tv, void *data)
             tv->name,
             (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_kernel_packets, tv->sc_perf_pca),
             (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_kernel_drops, tv->sc_perf_pca));
+    if (ptv->flags & AFP_TPACKET_V3) {
+        SCLogInfo("(%s) Kernel: queue freezes %" PRIu64 "", tv->name,
+                (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_kernel_freeze_q, tv->sc_perf_pca));
+    }
 #endif
+    if (ptv->flags & AFP_TPACKET_V3) {
+        SCLogInfo("(%s) Blocks %" PRIu64 ", busy %" PRIu64 "", tv->name,
+                (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_blocks, tv->sc_perf_pca),
+                (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_block_busy, tv->sc_perf_pca));
+    }
 
     SCLogInfo("(%s) Packets %" PRIu64 ", bytes %" PRIu64 "", tv->name, ptv->pkts, ptv->bytes);
+    SCLogInfo("(%s) Zero copy packets %" PRIu64 ", copied %" PRIu64 "", tv->name,
+            (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_zero_copy, tv->sc_perf_pca),
+            (uint64_t) SCPerfGetLocalCounterValue(ptv->capture_copied, tv->sc_perf_pca));
 }
 
 /**
@@ -1821,6 +2919,11 @@ TmEcode ReceiveAFPThreadDeinit(ThreadVars *tv, void *data)
     }
     ptv->datalen = 0;
 
+    if (ptv->blocks != NULL) {
+        SCFree(ptv->blocks);
+        ptv->blocks = NULL;
+    }
+
     ptv->bpf_filter = NULL;
 
     SCReturnInt(TM_ECODE_OK);
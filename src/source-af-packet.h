@@ -43,6 +43,8 @@
 #define AFP_ZERO_COPY (1<<1)
 #define AFP_SOCK_PROTECT (1<<2)
 #define AFP_EMERGENCY_MODE (1<<3)
+#define AFP_TPACKET_V3 (1<<4)
+#define AFP_BYPASS (1<<5)
 
 #define AFP_COPY_MODE_NONE  0
 #define AFP_COPY_MODE_TAP   1
@@ -51,6 +53,11 @@
 #define AFP_FILE_MAX_PKTS 256
 #define AFP_IFACE_NAME_LENGTH 48
 
+/* default TPACKET_V3 block size is getpagesize() << order */
+#define AFP_BLOCK_SIZE_DEFAULT_ORDER 3
+/* default TPACKET_V3 block retire timeout in ms */
+#define AFP_BLOCK_TIMEOUT_DEFAULT 10
+
 typedef struct AFPIfaceConfig_
 {
     char iface[AFP_IFACE_NAME_LENGTH];
@@ -60,6 +67,9 @@ typedef struct AFPIfaceConfig_
     int buffer_size;
     /* ring size in number of packets */
     int ring_size;
+    /* TPACKET_V3 block size and retire timeout (ms) */
+    int block_size;
+    int block_timeout;
     /* cluster param */
     int cluster_id;
     int cluster_type;
@@ -108,10 +118,14 @@ typedef struct AFPPacketVars_
      * to do reference counting.
      */
     AFPPeer *mpeer;
+    /** TPACKET_V3 block holding the packet data, the block is given
+     *  back to the kernel when all its packets are released */
+    struct AFPBlock_ *block;
 } AFPPacketVars;
 
 #define AFPV_CLEANUP(afpv) do {           \
     (afpv)->relptr = NULL;                \
+    (afpv)->block = NULL;                 \
     (afpv)->copy_mode = 0;                \
     (afpv)->peer = NULL;                  \
     (afpv)->mpeer = NULL;                 \
@@ -51,6 +51,7 @@ typedef struct StreamTcpSackRecord_ {
 } StreamTcpSackRecord;
 
 typedef struct TcpSegment_ {
+    PoolThreadReserved res;
     uint8_t *payload;
     uint16_t payload_len;       /**< actual size of the payload */
     uint16_t pool_size;         /**< size of the memory */
@@ -59,6 +60,11 @@ typedef struct TcpSegment_ {
     struct TcpSegment_ *prev;
     /* coccinelle: TcpSegment:flags:SEGMENTTCP_FLAG */
     uint8_t flags;
+    uint8_t rb_color;           /**< red or black, for the segment tree */
+    /* node in the seq ordered segment tree of the stream */
+    struct TcpSegment_ *rb_parent;
+    struct TcpSegment_ *rb_left;
+    struct TcpSegment_ *rb_right;
 } TcpSegment;
 
 typedef struct TcpStream_ {
@@ -84,6 +90,7 @@ typedef struct TcpStream_ {
 
     TcpSegment *seg_list;           /**< list of TCP segments that are not yet (fully) used in reassembly */
     TcpSegment *seg_list_tail;      /**< Last segment in the reassembled stream seg list*/
+    TcpSegment *seg_tree;           /**< root of the seq ordered tree of the seg_list segments */
 
     StreamTcpSackRecord *sack_head; /**< head of list of SACK records */
     StreamTcpSackRecord *sack_tail; /**< tail of list of SACK records */
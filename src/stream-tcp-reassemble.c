@@ -66,24 +66,32 @@
 #define PSEUDO_PACKET_PAYLOAD_SIZE  65416 /* 64 Kb minus max IP and TCP header */
 
 #ifdef DEBUG
-static SCMutex segment_pool_memuse_mutex;
-static uint64_t segment_pool_memuse = 0;
-static uint64_t segment_pool_memcnt = 0;
+SC_ATOMIC_DECLARE(uint64_t, segment_pool_memuse);
+SC_ATOMIC_DECLARE(uint64_t, segment_pool_memcnt);
+SC_ATOMIC_DECLARE(uint64_t, segment_pool_cnt);
 #endif
 
 /* We define several pools with prealloced segments with fixed size
  * payloads. We do this to prevent having to do an SCMalloc call for every
  * data segment we receive, which would be a large performance penalty.
  * The cost is in memory of course. The number of pools and the properties
- * of the pools are determined by the yaml. */
+ * of the pools are determined by the yaml.
+ *
+ * Each size class is a PoolThread with an element per reassembly thread,
+ * so getting a segment only takes the (uncontended) lock of our own
+ * element. A segment remembers the element it came from, so it can be
+ * returned from any thread, e.g. when the flow manager frees the flow. */
 static int segment_pool_num = 0;
-static Pool **segment_pool = NULL;
-static SCMutex *segment_pool_mutex = NULL;
+/** the pools of the threads after the first start with 1/x of the
+ *  configured prealloc and grow on demand */
+#define SEGMENT_THREAD_PREALLOC_DIV 8
+static PoolThread **segment_thread_pool = NULL;
+/* protects initializing and growing the pools, not used at runtime */
+static SCMutex segment_thread_pool_mutex = SCMUTEX_INITIALIZER;
+/* number of thread ids handed out to reassembly thread ctxs */
+static int segment_thread_pool_users = 0;
 static uint16_t *segment_pool_pktsizes = NULL;
-#ifdef DEBUG
-static SCMutex segment_pool_cnt_mutex;
-static uint64_t segment_pool_cnt = 0;
-#endif
+static uint32_t *segment_pool_poolsizes = NULL;
 /* index to the right pool for all packet sizes. */
 static uint16_t segment_pool_idx[65536]; /* O(1) lookups of the pool */
 static int check_overlap_different_data = 0;
@@ -183,7 +191,11 @@ int TcpSegmentPoolInit(void *data, void *payload_len)
      * won't have uninitialized memory to consider. */
     memset(seg, 0, sizeof (TcpSegment));
 
-    if (StreamTcpReassembleCheckMemcap((uint32_t)size + (uint32_t)sizeof(TcpSegment)) == 0) {
+    /* reserve the memory up front so that threads filling their pools
+     * concurrently can't take us over the memcap together */
+    uint64_t memuse = SC_ATOMIC_ADD(ra_memuse, (uint64_t)size + sizeof(TcpSegment));
+    if (stream_config.reassembly_memcap != 0 && memuse > stream_config.reassembly_memcap) {
+        StreamTcpReassembleDecrMemuse((uint64_t)size + sizeof(TcpSegment));
         return 0;
     }
 
@@ -192,18 +204,14 @@ int TcpSegmentPoolInit(void *data, void *payload_len)
 
     seg->payload = SCMalloc(seg->payload_len);
     if (seg->payload == NULL) {
+        StreamTcpReassembleDecrMemuse((uint64_t)size + sizeof(TcpSegment));
         return 0;
     }
 
 #ifdef DEBUG
-    SCMutexLock(&segment_pool_memuse_mutex);
-    segment_pool_memuse += seg->payload_len;
-    segment_pool_memcnt++;
-    SCLogDebug("segment_pool_memcnt %"PRIu64"", segment_pool_memcnt);
-    SCMutexUnlock(&segment_pool_memuse_mutex);
+    (void) SC_ATOMIC_ADD(segment_pool_memuse, seg->payload_len);
+    (void) SC_ATOMIC_ADD(segment_pool_memcnt, 1);
 #endif
-
-    StreamTcpReassembleIncrMemuse((uint32_t)seg->pool_size + sizeof(TcpSegment));
     return 1;
 }
 
@@ -215,14 +223,15 @@ void TcpSegmentPoolCleanup(void *ptr)
 
     TcpSegment *seg = (TcpSegment *) ptr;
 
+    /* Init failed, its memory reservation is already undone */
+    if (seg->payload == NULL)
+        return;
+
     StreamTcpReassembleDecrMemuse((uint32_t)seg->pool_size + sizeof(TcpSegment));
 
 #ifdef DEBUG
-    SCMutexLock(&segment_pool_memuse_mutex);
-    segment_pool_memuse -= seg->pool_size;
-    segment_pool_memcnt--;
-    SCLogDebug("segment_pool_memcnt %"PRIu64"", segment_pool_memcnt);
-    SCMutexUnlock(&segment_pool_memuse_mutex);
+    (void) SC_ATOMIC_SUB(segment_pool_memuse, seg->pool_size);
+    (void) SC_ATOMIC_SUB(segment_pool_memcnt, 1);
 #endif
 
     SCFree(seg->payload);
@@ -242,17 +251,15 @@ void StreamTcpSegmentReturntoPool(TcpSegment *seg)
     seg->next = NULL;
     seg->prev = NULL;
 
+    /* the segment goes back to the pool of the thread it came from,
+     * which is not necessarily ours */
     uint16_t idx = segment_pool_idx[seg->pool_size];
-    SCMutexLock(&segment_pool_mutex[idx]);
-    PoolReturn(segment_pool[idx], (void *) seg);
-    SCLogDebug("segment_pool[%"PRIu16"]->empty_stack_size %"PRIu32"",
-               idx,segment_pool[idx]->empty_stack_size);
-    SCMutexUnlock(&segment_pool_mutex[idx]);
+    SCLogDebug("returning segment to segment_thread_pool[%"PRIu16"], id %"PRIu16,
+               idx, seg->res);
+    PoolThreadReturn(segment_thread_pool[idx], (void *) seg);
 
 #ifdef DEBUG
-    SCMutexLock(&segment_pool_cnt_mutex);
-    segment_pool_cnt--;
-    SCMutexUnlock(&segment_pool_cnt_mutex);
+    (void) SC_ATOMIC_SUB(segment_pool_cnt, 1);
 #endif
 }
 
@@ -277,6 +284,7 @@ void StreamTcpReturnStreamSegments (TcpStream *stream)
 
     stream->seg_list = NULL;
     stream->seg_list_tail = NULL;
+    stream->seg_tree = NULL;
 }
 
 typedef struct SegmentSizes_
@@ -295,9 +303,9 @@ static int SortByPktsize(const void *a, const void *b)
 
 int StreamTcpReassemblyConfig(char quiet)
 {
-    Pool **my_segment_pool = NULL;
-    SCMutex *my_segment_lock = NULL;
+    PoolThread **my_segment_pool = NULL;
     uint16_t *my_segment_pktsizes = NULL;
+    uint32_t *my_segment_poolsizes = NULL;
     SegmentSizes sizes[256];
     memset(&sizes, 0x00, sizeof(sizes));
 
@@ -383,40 +391,39 @@ int StreamTcpReassemblyConfig(char quiet)
         SCLogDebug("pktsize %u, prealloc %u", sizes[i].pktsize, sizes[i].prealloc);
     }
 
-    my_segment_pool = SCMalloc(npools * sizeof(Pool *));
+    my_segment_pool = SCMalloc(npools * sizeof(PoolThread *));
     if (my_segment_pool == NULL) {
         SCLogError(SC_ERR_MEM_ALLOC, "malloc failed");
         return -1;
     }
-    my_segment_lock = SCMalloc(npools * sizeof(SCMutex));
-    if (my_segment_lock == NULL) {
+    my_segment_pktsizes = SCMalloc(npools * sizeof(uint16_t));
+    if (my_segment_pktsizes == NULL) {
         SCLogError(SC_ERR_MEM_ALLOC, "malloc failed");
 
         SCFree(my_segment_pool);
         return -1;
     }
-    my_segment_pktsizes = SCMalloc(npools * sizeof(uint16_t));
-    if (my_segment_pktsizes == NULL) {
+    my_segment_poolsizes = SCMalloc(npools * sizeof(uint32_t));
+    if (my_segment_poolsizes == NULL) {
         SCLogError(SC_ERR_MEM_ALLOC, "malloc failed");
 
-        SCFree(my_segment_lock);
+        SCFree(my_segment_pktsizes);
         SCFree(my_segment_pool);
         return -1;
     }
-    uint32_t my_segment_poolsizes[npools];
 
     for (i = 0; i < npools; i++) {
         my_segment_pktsizes[i] = sizes[i].pktsize;
         my_segment_poolsizes[i] = sizes[i].prealloc;
-        SCMutexInit(&my_segment_lock[i], NULL);
 
-        /* setup the pool */
-        SCMutexLock(&my_segment_lock[i]);
-        my_segment_pool[i] = PoolInit(0, my_segment_poolsizes[i], 0,
+        /* setup the pool with the element of the first thread, the
+         * others are added in StreamTcpReassembleInitThreadCtx */
+        my_segment_pool[i] = PoolThreadInit(1, /* thread */
+                0, /* unlimited */
+                my_segment_poolsizes[i], 0,
                 TcpSegmentPoolAlloc, TcpSegmentPoolInit,
                 (void *) &my_segment_pktsizes[i],
                 TcpSegmentPoolCleanup, NULL);
-        SCMutexUnlock(&my_segment_lock[i]);
 
         if (my_segment_pool[i] == NULL) {
             SCLogError(SC_ERR_INITIALIZATION, "couldn't set up segment pool "
@@ -427,8 +434,9 @@ int StreamTcpReassemblyConfig(char quiet)
         SCLogDebug("my_segment_pktsizes[i] %u, my_segment_poolsizes[i] %u",
                 my_segment_pktsizes[i], my_segment_poolsizes[i]);
         if (!quiet)
-            SCLogInfo("segment pool: pktsize %u, prealloc %u",
-                    my_segment_pktsizes[i], my_segment_poolsizes[i]);
+            SCLogInfo("segment pool: pktsize %u, prealloc %u (first thread, "
+                    "others %u)", my_segment_pktsizes[i], my_segment_poolsizes[i],
+                    my_segment_poolsizes[i] / SEGMENT_THREAD_PREALLOC_DIV);
     }
 
     uint16_t idx = 0;
@@ -446,10 +454,13 @@ int StreamTcpReassemblyConfig(char quiet)
         idx++;
     }
     /* set the globals */
-    segment_pool = my_segment_pool;
-    segment_pool_mutex = my_segment_lock;
+    SCMutexLock(&segment_thread_pool_mutex);
+    segment_thread_pool = my_segment_pool;
+    segment_thread_pool_users = 0;
     segment_pool_pktsizes = my_segment_pktsizes;
+    segment_pool_poolsizes = my_segment_poolsizes;
     segment_pool_num = npools;
+    SCMutexUnlock(&segment_thread_pool_mutex);
 
     uint32_t stream_chunk_prealloc = 250;
     ConfNode *chunk = ConfGetNode("stream.reassembly.chunk-prealloc");
@@ -473,13 +484,14 @@ int StreamTcpReassembleInit(char quiet)
 {
     /* init the memcap/use tracker */
     SC_ATOMIC_INIT(ra_memuse);
+#ifdef DEBUG
+    SC_ATOMIC_INIT(segment_pool_memuse);
+    SC_ATOMIC_INIT(segment_pool_memcnt);
+    SC_ATOMIC_INIT(segment_pool_cnt);
+#endif
 
     if (StreamTcpReassemblyConfig(quiet) < 0)
         return -1;
-#ifdef DEBUG
-    SCMutexInit(&segment_pool_memuse_mutex, NULL);
-    SCMutexInit(&segment_pool_cnt_mutex, NULL);
-#endif
     return 0;
 }
 
@@ -491,48 +503,119 @@ static uint32_t dbg_app_layer_gap_candidate;
 void StreamTcpReassembleFree(char quiet)
 {
     uint16_t u16 = 0;
+
+    SCMutexLock(&segment_thread_pool_mutex);
     for (u16 = 0; u16 < segment_pool_num; u16++) {
-        SCMutexLock(&segment_pool_mutex[u16]);
+        PoolThread *pt = segment_thread_pool[u16];
+        if (pt == NULL)
+            continue;
 
         if (quiet == FALSE) {
-            PoolPrintSaturation(segment_pool[u16]);
-            SCLogDebug("segment_pool[u16]->empty_stack_size %"PRIu32", "
-                       "segment_pool[u16]->alloc_stack_size %"PRIu32", alloced "
-                       "%"PRIu32"", segment_pool[u16]->empty_stack_size,
-                       segment_pool[u16]->alloc_stack_size,
-                       segment_pool[u16]->allocated);
-
-            if (segment_pool[u16]->max_outstanding > segment_pool[u16]->allocated) {
+            uint32_t max_outstanding = 0;
+            uint32_t allocated = 0;
+            int i;
+            for (i = 0; i < PoolThreadSize(pt); i++) {
+                PoolThreadElement *e = &pt->array[i];
+                SCMutexLock(&e->lock);
+                PoolPrintSaturation(e->pool);
+                SCLogDebug("segment_thread_pool[%u] id %d: empty_stack_size %"PRIu32", "
+                           "alloc_stack_size %"PRIu32", alloced %"PRIu32"", u16, i,
+                           e->pool->empty_stack_size, e->pool->alloc_stack_size,
+                           e->pool->allocated);
+                max_outstanding += e->pool->max_outstanding;
+                allocated += e->pool->allocated;
+                SCMutexUnlock(&e->lock);
+            }
+
+            if (max_outstanding > allocated) {
                 SCLogInfo("TCP segment pool of size %u had a peak use of %u segments, "
                         "more than the prealloc setting of %u", segment_pool_pktsizes[u16],
-                        segment_pool[u16]->max_outstanding, segment_pool[u16]->allocated);
+                        max_outstanding, allocated);
             }
         }
-        PoolFree(segment_pool[u16]);
-
-        SCMutexUnlock(&segment_pool_mutex[u16]);
-        SCMutexDestroy(&segment_pool_mutex[u16]);
+        PoolThreadFree(pt);
     }
-    SCFree(segment_pool);
-    SCFree(segment_pool_mutex);
+    SCFree(segment_thread_pool);
     SCFree(segment_pool_pktsizes);
-    segment_pool = NULL;
-    segment_pool_mutex = NULL;
+    SCFree(segment_pool_poolsizes);
+    segment_thread_pool = NULL;
+    segment_thread_pool_users = 0;
     segment_pool_pktsizes = NULL;
+    segment_pool_poolsizes = NULL;
+    segment_pool_num = 0;
+    SCMutexUnlock(&segment_thread_pool_mutex);
 
     StreamMsgQueuesDeinit(quiet);
 
 #ifdef DEBUG
-    SCLogDebug("segment_pool_cnt %"PRIu64"", segment_pool_cnt);
-    SCLogDebug("segment_pool_memuse %"PRIu64"", segment_pool_memuse);
-    SCLogDebug("segment_pool_memcnt %"PRIu64"", segment_pool_memcnt);
-    SCMutexDestroy(&segment_pool_memuse_mutex);
-    SCMutexDestroy(&segment_pool_cnt_mutex);
+    SCLogDebug("segment_pool_cnt %"PRIu64"", SC_ATOMIC_GET(segment_pool_cnt));
+    SCLogDebug("segment_pool_memuse %"PRIu64"", SC_ATOMIC_GET(segment_pool_memuse));
+    SCLogDebug("segment_pool_memcnt %"PRIu64"", SC_ATOMIC_GET(segment_pool_memcnt));
     SCLogInfo("dbg_app_layer_gap %u", dbg_app_layer_gap);
     SCLogInfo("dbg_app_layer_gap_candidate %u", dbg_app_layer_gap_candidate);
 #endif
 }
 
+/**
+ *  \internal
+ *  \brief grow all segment pools by one element for a new thread
+ *
+ *  Only the first thread gets the configured prealloc, the others start
+ *  with a fraction of it. The prealloc is further scaled down so it never
+ *  takes the memuse over half of the memcap: the pools are unlimited, so
+ *  a thread that needs more segments gets them at runtime, while lots of
+ *  threads won't exhaust the memcap at init.
+ *
+ *  Needs segment_thread_pool_mutex to be held.
+ *
+ *  \retval id pool element id of the thread, the same in each pool
+ *  \retval -1 error
+ */
+static int StreamTcpReassembleThreadPoolGrow(void)
+{
+    uint64_t cost = 0;
+    uint64_t avail = 0;
+    uint16_t u16;
+    int id = -1;
+
+    for (u16 = 0; u16 < segment_pool_num; u16++) {
+        cost += (uint64_t)(segment_pool_poolsizes[u16] / SEGMENT_THREAD_PREALLOC_DIV) *
+            (segment_pool_pktsizes[u16] + sizeof(TcpSegment));
+    }
+    if (stream_config.reassembly_memcap != 0) {
+        uint64_t memuse = SC_ATOMIC_GET(ra_memuse);
+        if (memuse < stream_config.reassembly_memcap / 2)
+            avail = stream_config.reassembly_memcap / 2 - memuse;
+    } else {
+        avail = cost;
+    }
+
+    /* as all pools grow in lock step the new id is the same for each */
+    for (u16 = 0; u16 < segment_pool_num; u16++) {
+        uint32_t prealloc = segment_pool_poolsizes[u16] / SEGMENT_THREAD_PREALLOC_DIV;
+        if (cost > avail)
+            prealloc = (uint32_t)(((uint64_t)prealloc * avail) / cost);
+
+        int r = PoolThreadGrow(segment_thread_pool[u16],
+                0, /* unlimited */
+                prealloc, 0,
+                TcpSegmentPoolAlloc, TcpSegmentPoolInit,
+                (void *) &segment_pool_pktsizes[u16],
+                TcpSegmentPoolCleanup, NULL);
+        if (r < 0) {
+            SCLogError(SC_ERR_INITIALIZATION, "couldn't grow segment pool "
+                    "for packet size %u. Memcap too low?",
+                    segment_pool_pktsizes[u16]);
+            return -1;
+        }
+        BUG_ON(u16 > 0 && r != id);
+        id = r;
+        SCLogDebug("segment pool pktsize %u: thread %d prealloc %u",
+                segment_pool_pktsizes[u16], id, prealloc);
+    }
+    return id;
+}
+
 TcpReassemblyThreadCtx *StreamTcpReassembleInitThreadCtx(ThreadVars *tv)
 {
     SCEnter();
@@ -544,6 +627,25 @@ TcpReassemblyThreadCtx *StreamTcpReassembleInitThreadCtx(ThreadVars *tv)
 
     ra_ctx->app_tctx = AppLayerGetCtxThread(tv);
 
+    SCMutexLock(&segment_thread_pool_mutex);
+    if (segment_thread_pool_users == 0 || RunmodeIsUnittests()) {
+        /* the first thread uses the element created at config time.
+         * Unittests create lots of short lived ctxs, they all share it. */
+        ra_ctx->segment_thread_pool_id = 0;
+    } else {
+        int id = StreamTcpReassembleThreadPoolGrow();
+        if (id < 0) {
+            SCMutexUnlock(&segment_thread_pool_mutex);
+            AppLayerDestroyCtxThread(ra_ctx->app_tctx);
+            SCFree(ra_ctx);
+            SCReturnPtr(NULL, "TcpReassemblyThreadCtx");
+        }
+        ra_ctx->segment_thread_pool_id = id;
+    }
+    segment_thread_pool_users++;
+    SCLogDebug("thread segment_thread_pool_id %d", ra_ctx->segment_thread_pool_id);
+    SCMutexUnlock(&segment_thread_pool_mutex);
+
     SCReturnPtr(ra_ctx, "TcpReassemblyThreadCtx");
 }
 
@@ -673,6 +775,263 @@ static inline uint32_t StreamTcpReassembleGetRaBaseSeq(TcpStream *stream)
     }
 }
 
+/* Segment tree: a red-black tree of the segments in the list of a stream,
+ * ordered by seq. It is used to find where an out of order segment goes
+ * without walking the list, the list itself stays the authority on the
+ * order of the data. */
+
+#define SEG_TREE_BLACK  0
+#define SEG_TREE_RED    1
+
+/** \internal
+ *  \brief point the parent of 'old' (or the tree root) at 'new' */
+static inline void StreamTcpSegmentTreeLink(TcpStream *stream, TcpSegment *parent,
+        TcpSegment *old, TcpSegment *new)
+{
+    if (parent == NULL)
+        stream->seg_tree = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+}
+
+static void StreamTcpSegmentTreeRotateLeft(TcpStream *stream, TcpSegment *node)
+{
+    TcpSegment *right = node->rb_right;
+
+    node->rb_right = right->rb_left;
+    if (right->rb_left != NULL)
+        right->rb_left->rb_parent = node;
+    right->rb_parent = node->rb_parent;
+    StreamTcpSegmentTreeLink(stream, node->rb_parent, node, right);
+    right->rb_left = node;
+    node->rb_parent = right;
+}
+
+static void StreamTcpSegmentTreeRotateRight(TcpStream *stream, TcpSegment *node)
+{
+    TcpSegment *left = node->rb_left;
+
+    node->rb_left = left->rb_right;
+    if (left->rb_right != NULL)
+        left->rb_right->rb_parent = node;
+    left->rb_parent = node->rb_parent;
+    StreamTcpSegmentTreeLink(stream, node->rb_parent, node, left);
+    left->rb_right = node;
+    node->rb_parent = left;
+}
+
+#define SEG_TREE_IS_BLACK(seg) ((seg) == NULL || (seg)->rb_color == SEG_TREE_BLACK)
+
+/** \internal
+ *  \brief add a segment to the seq ordered segment tree of the stream */
+static void StreamTcpSegmentTreeInsert(TcpStream *stream, TcpSegment *seg)
+{
+    TcpSegment *parent = NULL;
+    TcpSegment **link = &stream->seg_tree;
+
+    while (*link != NULL) {
+        parent = *link;
+        if (SEQ_LT(seg->seq, parent->seq))
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    seg->rb_parent = parent;
+    seg->rb_left = seg->rb_right = NULL;
+    seg->rb_color = SEG_TREE_RED;
+    *link = seg;
+
+    /* restore the red-black properties */
+    while ((parent = seg->rb_parent) != NULL && parent->rb_color == SEG_TREE_RED) {
+        TcpSegment *gparent = parent->rb_parent;
+
+        if (parent == gparent->rb_left) {
+            TcpSegment *uncle = gparent->rb_right;
+            if (!SEG_TREE_IS_BLACK(uncle)) {
+                parent->rb_color = uncle->rb_color = SEG_TREE_BLACK;
+                gparent->rb_color = SEG_TREE_RED;
+                seg = gparent;
+                continue;
+            }
+            if (seg == parent->rb_right) {
+                StreamTcpSegmentTreeRotateLeft(stream, parent);
+                seg = parent;
+                parent = seg->rb_parent;
+            }
+            parent->rb_color = SEG_TREE_BLACK;
+            gparent->rb_color = SEG_TREE_RED;
+            StreamTcpSegmentTreeRotateRight(stream, gparent);
+        } else {
+            TcpSegment *uncle = gparent->rb_left;
+            if (!SEG_TREE_IS_BLACK(uncle)) {
+                parent->rb_color = uncle->rb_color = SEG_TREE_BLACK;
+                gparent->rb_color = SEG_TREE_RED;
+                seg = gparent;
+                continue;
+            }
+            if (seg == parent->rb_left) {
+                StreamTcpSegmentTreeRotateRight(stream, parent);
+                seg = parent;
+                parent = seg->rb_parent;
+            }
+            parent->rb_color = SEG_TREE_BLACK;
+            gparent->rb_color = SEG_TREE_RED;
+            StreamTcpSegmentTreeRotateLeft(stream, gparent);
+        }
+    }
+    stream->seg_tree->rb_color = SEG_TREE_BLACK;
+}
+
+/** \internal
+ *  \brief remove a segment from the segment tree of the stream */
+static void StreamTcpSegmentTreeRemove(TcpStream *stream, TcpSegment *seg)
+{
+    TcpSegment *child, *parent;
+    uint8_t color;
+
+    if (seg->rb_left != NULL && seg->rb_right != NULL) {
+        /* put the successor, which has no left child, in seg's place */
+        TcpSegment *succ = seg->rb_right;
+        while (succ->rb_left != NULL)
+            succ = succ->rb_left;
+
+        child = succ->rb_right;
+        parent = succ->rb_parent;
+        color = succ->rb_color;
+
+        if (parent == seg) {
+            parent = succ;
+        } else {
+            if (child != NULL)
+                child->rb_parent = parent;
+            parent->rb_left = child;
+            succ->rb_right = seg->rb_right;
+            seg->rb_right->rb_parent = succ;
+        }
+        StreamTcpSegmentTreeLink(stream, seg->rb_parent, seg, succ);
+        succ->rb_parent = seg->rb_parent;
+        succ->rb_color = seg->rb_color;
+        succ->rb_left = seg->rb_left;
+        seg->rb_left->rb_parent = succ;
+    } else {
+        child = (seg->rb_left != NULL) ? seg->rb_left : seg->rb_right;
+        parent = seg->rb_parent;
+        color = seg->rb_color;
+
+        if (child != NULL)
+            child->rb_parent = parent;
+        StreamTcpSegmentTreeLink(stream, parent, seg, child);
+    }
+    seg->rb_parent = seg->rb_left = seg->rb_right = NULL;
+
+    if (color == SEG_TREE_RED)
+        return;
+
+    /* a black node is gone, restore the red-black properties */
+    while (child != stream->seg_tree && SEG_TREE_IS_BLACK(child)) {
+        if (child == parent->rb_left) {
+            TcpSegment *sibling = parent->rb_right;
+            if (sibling->rb_color == SEG_TREE_RED) {
+                sibling->rb_color = SEG_TREE_BLACK;
+                parent->rb_color = SEG_TREE_RED;
+                StreamTcpSegmentTreeRotateLeft(stream, parent);
+                sibling = parent->rb_right;
+            }
+            if (SEG_TREE_IS_BLACK(sibling->rb_left) &&
+                    SEG_TREE_IS_BLACK(sibling->rb_right)) {
+                sibling->rb_color = SEG_TREE_RED;
+                child = parent;
+                parent = child->rb_parent;
+                continue;
+            }
+            if (SEG_TREE_IS_BLACK(sibling->rb_right)) {
+                sibling->rb_left->rb_color = SEG_TREE_BLACK;
+                sibling->rb_color = SEG_TREE_RED;
+                StreamTcpSegmentTreeRotateRight(stream, sibling);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = SEG_TREE_BLACK;
+            sibling->rb_right->rb_color = SEG_TREE_BLACK;
+            StreamTcpSegmentTreeRotateLeft(stream, parent);
+        } else {
+            TcpSegment *sibling = parent->rb_left;
+            if (sibling->rb_color == SEG_TREE_RED) {
+                sibling->rb_color = SEG_TREE_BLACK;
+                parent->rb_color = SEG_TREE_RED;
+                StreamTcpSegmentTreeRotateRight(stream, parent);
+                sibling = parent->rb_left;
+            }
+            if (SEG_TREE_IS_BLACK(sibling->rb_left) &&
+                    SEG_TREE_IS_BLACK(sibling->rb_right)) {
+                sibling->rb_color = SEG_TREE_RED;
+                child = parent;
+                parent = child->rb_parent;
+                continue;
+            }
+            if (SEG_TREE_IS_BLACK(sibling->rb_left)) {
+                sibling->rb_right->rb_color = SEG_TREE_BLACK;
+                sibling->rb_color = SEG_TREE_RED;
+                StreamTcpSegmentTreeRotateLeft(stream, sibling);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = SEG_TREE_BLACK;
+            sibling->rb_left->rb_color = SEG_TREE_BLACK;
+            StreamTcpSegmentTreeRotateRight(stream, parent);
+        }
+        child = stream->seg_tree;
+        break;
+    }
+    if (child != NULL)
+        child->rb_color = SEG_TREE_BLACK;
+}
+
+/** \internal
+ *  \brief put 'new_seg' in the tree position of 'old_seg'
+ *
+ *  Only valid if 'new_seg' takes the place of 'old_seg' in the list as
+ *  well, so the order of the tree is kept. */
+static void StreamTcpSegmentTreeReplace(TcpStream *stream, TcpSegment *old_seg,
+        TcpSegment *new_seg)
+{
+    new_seg->rb_parent = old_seg->rb_parent;
+    new_seg->rb_left = old_seg->rb_left;
+    new_seg->rb_right = old_seg->rb_right;
+    new_seg->rb_color = old_seg->rb_color;
+
+    StreamTcpSegmentTreeLink(stream, old_seg->rb_parent, old_seg, new_seg);
+    if (new_seg->rb_left != NULL)
+        new_seg->rb_left->rb_parent = new_seg;
+    if (new_seg->rb_right != NULL)
+        new_seg->rb_right->rb_parent = new_seg;
+
+    old_seg->rb_parent = old_seg->rb_left = old_seg->rb_right = NULL;
+}
+
+/** \internal
+ *  \brief find the last segment that starts at or before 'seq'
+ *
+ *  \retval seg the segment or NULL if all segments start after 'seq'
+ */
+static TcpSegment *StreamTcpSegmentTreeFindLEQ(TcpStream *stream, uint32_t seq)
+{
+    TcpSegment *node = stream->seg_tree;
+    TcpSegment *found = NULL;
+
+    while (node != NULL) {
+        if (SEQ_LEQ(node->seq, seq)) {
+            found = node;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return found;
+}
+
 /**
  *  \internal
  *  \brief  Function to handle the insertion newly arrived segment,
@@ -730,6 +1089,7 @@ int StreamTcpReassembleInsertSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_
         stream->seg_list = seg;
         seg->prev = NULL;
         stream->seg_list_tail = seg;
+        StreamTcpSegmentTreeInsert(stream, seg);
         goto end;
     }
 
@@ -741,6 +1101,7 @@ int StreamTcpReassembleInsertSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_
         stream->seg_list_tail->next = seg;
         seg->prev = stream->seg_list_tail;
         stream->seg_list_tail = seg;
+        StreamTcpSegmentTreeInsert(stream, seg);
 
         goto end;
     }
@@ -750,6 +1111,12 @@ int StreamTcpReassembleInsertSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_
         StreamTcpSetOSPolicy(stream, p);
     }
 
+    /* the segments before the last one starting at or before seg don't
+     * overlap with it, so start the walk there */
+    TcpSegment *start_seg = StreamTcpSegmentTreeFindLEQ(stream, seg->seq);
+    if (start_seg != NULL)
+        list_seg = start_seg;
+
     for (; list_seg != NULL; list_seg = next_list_seg) {
         next_list_seg = list_seg->next;
 
@@ -776,6 +1143,7 @@ int StreamTcpReassembleInsertSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_
                     seg->prev = list_seg->prev;
                 }
                 list_seg->prev = seg;
+                StreamTcpSegmentTreeInsert(stream, seg);
 
                 goto end;
 
@@ -824,6 +1192,7 @@ int StreamTcpReassembleInsertSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_
                     list_seg->next = seg;
                     seg->prev = list_seg;
                     stream->seg_list_tail = seg;
+                    StreamTcpSegmentTreeInsert(stream, seg);
                     goto end;
                 }
             } else {
@@ -968,6 +1337,7 @@ static int HandleSegmentStartsBeforeListSegment(ThreadVars *tv, TcpReassemblyThr
             new_seg->prev = list_seg->prev;
             list_seg->prev->next = new_seg;
             list_seg->prev = new_seg;
+            StreamTcpSegmentTreeInsert(stream, new_seg);
 
             /* create a new seg, copy the list_seg data over */
             StreamTcpSegmentDataCopy(new_seg, seg);
@@ -1028,6 +1398,7 @@ static int HandleSegmentStartsBeforeListSegment(ThreadVars *tv, TcpReassemblyThr
             if (stream->seg_list_tail == list_seg)
                 stream->seg_list_tail = new_seg;
 
+            StreamTcpSegmentTreeReplace(stream, list_seg, new_seg);
             StreamTcpSegmentReturntoPool(list_seg);
             list_seg = new_seg;
             if (new_seg->prev != NULL) {
@@ -1091,6 +1462,7 @@ static int HandleSegmentStartsBeforeListSegment(ThreadVars *tv, TcpReassemblyThr
                 if (stream->seg_list_tail == list_seg)
                     stream->seg_list_tail = new_seg;
 
+                StreamTcpSegmentTreeReplace(stream, list_seg, new_seg);
                 StreamTcpSegmentReturntoPool(list_seg);
                 list_seg = new_seg;
                 if (new_seg->prev != NULL) {
@@ -1163,6 +1535,7 @@ static int HandleSegmentStartsBeforeListSegment(ThreadVars *tv, TcpReassemblyThr
                     if (stream->seg_list_tail == list_seg)
                         stream->seg_list_tail = new_seg;
 
+                    StreamTcpSegmentTreeReplace(stream, list_seg, new_seg);
                     StreamTcpSegmentReturntoPool(list_seg);
                     list_seg = new_seg;
                     return_after = TRUE;
@@ -1231,6 +1604,7 @@ static int HandleSegmentStartsBeforeListSegment(ThreadVars *tv, TcpReassemblyThr
                 if (stream->seg_list_tail == list_seg)
                     stream->seg_list_tail = new_seg;
 
+                StreamTcpSegmentTreeReplace(stream, list_seg, new_seg);
                 StreamTcpSegmentReturntoPool(list_seg);
                 list_seg = new_seg;
                 return_after = TRUE;
@@ -1423,6 +1797,7 @@ static int HandleSegmentStartsAtSameListSegment(ThreadVars *tv, TcpReassemblyThr
                     new_seg->next->prev = new_seg;
                 new_seg->prev = list_seg;
                 list_seg->next = new_seg;
+                StreamTcpSegmentTreeInsert(stream, new_seg);
                 SCLogDebug("new_seg %p, new_seg->next %p, new_seg->prev %p, "
                            "list_seg->next %p", new_seg, new_seg->next,
                            new_seg->prev, list_seg->next);
@@ -1627,6 +2002,7 @@ static int HandleSegmentStartsAfterListSegment(ThreadVars *tv, TcpReassemblyThre
                     new_seg->next->prev = new_seg;
                 new_seg->prev = list_seg;
                 list_seg->next = new_seg;
+                StreamTcpSegmentTreeInsert(stream, new_seg);
 
                 SCLogDebug("new_seg %p, new_seg->next %p, new_seg->prev %p, "
                            "list_seg->next %p new_seg->seq %"PRIu32"", new_seg,
@@ -2087,6 +2463,8 @@ static inline int StreamTcpReturnSegmentCheck(const Flow *f, TcpSession *ssn, Tc
 
 static void StreamTcpRemoveSegmentFromStream(TcpStream *stream, TcpSegment *seg)
 {
+    StreamTcpSegmentTreeRemove(stream, seg);
+
     if (seg->prev == NULL) {
         stream->seg_list = seg->next;
         if (stream->seg_list != NULL)
@@ -3742,20 +4120,13 @@ TcpSegment* StreamTcpGetSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_ctx,
     SCLogDebug("segment_pool_idx %" PRIu32 " for payload_len %" PRIu32 "",
                 idx, len);
 
-    SCMutexLock(&segment_pool_mutex[idx]);
-    TcpSegment *seg = (TcpSegment *) PoolGet(segment_pool[idx]);
-
-    SCLogDebug("segment_pool[%u]->empty_stack_size %u, segment_pool[%u]->alloc_"
-               "list_size %u, alloc %u", idx, segment_pool[idx]->empty_stack_size,
-               idx, segment_pool[idx]->alloc_stack_size,
-               segment_pool[idx]->allocated);
-    SCMutexUnlock(&segment_pool_mutex[idx]);
+    TcpSegment *seg = (TcpSegment *) PoolThreadGetById(segment_thread_pool[idx],
+            (uint16_t)ra_ctx->segment_thread_pool_id);
 
     SCLogDebug("seg we return is %p", seg);
     if (seg == NULL) {
-        SCLogDebug("segment_pool[%u]->empty_stack_size %u, "
-                   "alloc %u", idx, segment_pool[idx]->empty_stack_size,
-                   segment_pool[idx]->allocated);
+        SCLogDebug("segment_thread_pool[%u] id %d is empty", idx,
+                ra_ctx->segment_thread_pool_id);
         /* Increment the counter to show that we are not able to serve the
            segment request due to memcap limit */
         SCPerfCounterIncr(ra_ctx->counter_tcp_segment_memcap, tv->sc_perf_pca);
@@ -3766,9 +4137,7 @@ TcpSegment* StreamTcpGetSegment(ThreadVars *tv, TcpReassemblyThreadCtx *ra_ctx,
     }
 
 #ifdef DEBUG
-    SCMutexLock(&segment_pool_cnt_mutex);
-    segment_pool_cnt++;
-    SCMutexUnlock(&segment_pool_cnt_mutex);
+    (void) SC_ATOMIC_ADD(segment_pool_cnt, 1);
 #endif
 
     return seg;
@@ -8982,6 +9351,606 @@ end:
     return ret;
 }
 
+/** \internal
+ *  \brief check that an in order walk of the segment tree gives the list */
+static int StreamTcpSegmentTreeCheck(TcpStream *stream)
+{
+    TcpSegment *list_seg = stream->seg_list;
+    TcpSegment *node = stream->seg_tree;
+
+    if (node != NULL && node->rb_parent != NULL)
+        return 0;
+
+    while (node != NULL && node->rb_left != NULL)
+        node = node->rb_left;
+
+    while (node != NULL) {
+        if (node != list_seg)
+            return 0;
+        list_seg = list_seg->next;
+
+        if (node->rb_right != NULL) {
+            node = node->rb_right;
+            while (node->rb_left != NULL)
+                node = node->rb_left;
+        } else {
+            while (node->rb_parent != NULL && node == node->rb_parent->rb_right)
+                node = node->rb_parent;
+            node = node->rb_parent;
+        }
+    }
+    return (list_seg == NULL);
+}
+
+/** \test insert many segments out of order, remove some and put them back */
+static int StreamTcpReassembleInsertTest04(void)
+{
+    int ret = 0;
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    ThreadVars tv;
+    TcpSession ssn;
+    uint8_t stream_contents[1000];
+    int i;
+
+    memset(&tv, 0x00, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+    StreamTcpUTSetupStream(&ssn.client, 1);
+    StreamTcpUTSetupStream(&ssn.server, 1);
+
+    for (i = 0; i < 100; i++)
+        memset(stream_contents + i * 10, 'A' + (i % 26), 10);
+
+    /* client: last segment first */
+    for (i = 99; i >= 0; i--) {
+        if (StreamTcpUTAddSegmentWithByte(&tv, ra_ctx, &ssn.client,
+                    2 + i * 10, 'A' + (i % 26), 10) == -1) {
+            printf("failed to add client segment %d: ", i);
+            goto end;
+        }
+    }
+    /* server: scattered */
+    for (i = 0; i < 100; i++) {
+        int n = (i * 37) % 100;
+        if (StreamTcpUTAddSegmentWithByte(&tv, ra_ctx, &ssn.server,
+                    2 + n * 10, 'A' + (n % 26), 10) == -1) {
+            printf("failed to add server segment %d: ", n);
+            goto end;
+        }
+    }
+
+    if (StreamTcpCheckStreamContents(stream_contents, sizeof(stream_contents), &ssn.client) == 0 ||
+        StreamTcpCheckStreamContents(stream_contents, sizeof(stream_contents), &ssn.server) == 0) {
+        printf("failed in stream matching: ");
+        goto end;
+    }
+    if (ssn.client.seg_list_tail->seq != 992 || ssn.server.seg_list_tail->seq != 992) {
+        printf("unexpected last segment: ");
+        goto end;
+    }
+    if (!StreamTcpSegmentTreeCheck(&ssn.client) ||
+        !StreamTcpSegmentTreeCheck(&ssn.server)) {
+        printf("segment tree doesn't match the list: ");
+        goto end;
+    }
+
+    /* take out every third segment */
+    TcpSegment *seg = ssn.server.seg_list;
+    for (i = 0; seg != NULL; i++) {
+        TcpSegment *next_seg = seg->next;
+        if (i % 3 == 0) {
+            StreamTcpRemoveSegmentFromStream(&ssn.server, seg);
+            StreamTcpSegmentReturntoPool(seg);
+        }
+        seg = next_seg;
+    }
+    if (!StreamTcpSegmentTreeCheck(&ssn.server)) {
+        printf("segment tree doesn't match the list after removal: ");
+        goto end;
+    }
+
+    /* and put them back */
+    for (i = 99; i >= 0; i--) {
+        if (i % 3 != 0)
+            continue;
+        if (StreamTcpUTAddSegmentWithByte(&tv, ra_ctx, &ssn.server,
+                    2 + i * 10, 'A' + (i % 26), 10) == -1) {
+            printf("failed to re-add server segment %d: ", i);
+            goto end;
+        }
+    }
+    if (StreamTcpCheckStreamContents(stream_contents, sizeof(stream_contents), &ssn.server) == 0 ||
+        !StreamTcpSegmentTreeCheck(&ssn.server)) {
+        printf("failed in stream matching after re-adding: ");
+        goto end;
+    }
+
+    ret = 1;
+end:
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    return ret;
+}
+
+/** \test out of order segments overlapping the gaps between the segments
+ *        in the list, for the first and last overlap policies */
+static int StreamTcpReassembleInsertTest05(void)
+{
+    int ret = 0;
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    ThreadVars tv;
+    TcpSession ssn;
+    uint8_t policies[2] = { OS_POLICY_FIRST, OS_POLICY_LAST };
+    uint8_t stream_contents[1010];
+    int i, p;
+
+    memset(&tv, 0x00, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+
+    for (p = 0; p < 2; p++) {
+        StreamTcpUTSetupStream(&ssn.client, 1);
+        ssn.client.os_policy = policies[p];
+
+        /* 'A' in the even slots, last one first */
+        for (i = 100; i >= 0; i -= 2) {
+            memset(stream_contents + i * 10, 'A', 10);
+            if (StreamTcpUTAddSegmentWithByte(&tv, ra_ctx, &ssn.client,
+                        2 + i * 10, 'A', 10) == -1) {
+                printf("failed to add segment %d: ", i);
+                goto end;
+            }
+        }
+        /* 'B' filling the odd slots, overlapping the segments on both
+         * sides by 2 bytes */
+        for (i = 99; i >= 1; i -= 2) {
+            if (policies[p] == OS_POLICY_FIRST)
+                memset(stream_contents + i * 10, 'B', 10);
+            else
+                memset(stream_contents + i * 10 - 2, 'B', 14);
+
+            if (StreamTcpUTAddSegmentWithByte(&tv, ra_ctx, &ssn.client,
+                        i * 10, 'B', 14) == -1) {
+                printf("failed to add segment %d: ", i);
+                goto end;
+            }
+        }
+
+        if (StreamTcpCheckStreamContents(stream_contents, sizeof(stream_contents), &ssn.client) == 0) {
+            printf("failed in stream matching for policy %u: ", policies[p]);
+            goto end;
+        }
+        if (ssn.client.seg_list_tail->seq + ssn.client.seg_list_tail->payload_len != 1012 ||
+            !StreamTcpSegmentTreeCheck(&ssn.client)) {
+            printf("bad segment list for policy %u: ", policies[p]);
+            goto end;
+        }
+        StreamTcpUTClearStream(&ssn.client);
+    }
+
+    ret = 1;
+end:
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    return ret;
+}
+
+/** \internal
+ *  \brief set up a flow and an ACK packet from the server for the app layer
+ *         reassembly tests, so the client stream is reassembled */
+static Packet *StreamTcpReassembleAppLayerTestPacket(TcpSession *ssn, Flow **f)
+{
+    Packet *p;
+
+    *f = UTHBuildFlow(AF_INET, "1.1.1.1", "2.2.2.2", 1024, 80);
+    if (*f == NULL)
+        return NULL;
+    (*f)->protoctx = ssn;
+    (*f)->proto = IPPROTO_TCP;
+
+    p = UTHBuildPacketReal(NULL, 0, IPPROTO_TCP, "2.2.2.2", "1.1.1.1", 80, 1024);
+    if (p == NULL)
+        return NULL;
+    p->flow = *f;
+    p->flowflags |= FLOW_PKT_TOCLIENT;
+    return p;
+}
+
+/** \test in order app layer reassembly. Before protocol detection is done
+ *        no segment may be returned to the pool, even if it was passed to
+ *        the app layer already. */
+static int StreamTcpReassembleAppLayerTest01(void)
+{
+    int ret = 0;
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    ThreadVars tv;
+    TcpSession ssn;
+    Flow *f = NULL;
+    Packet *p = NULL;
+
+    memset(&tv, 0x00, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+    StreamTcpUTSetupStream(&ssn.client, 1);
+    ssn.state = TCP_ESTABLISHED;
+
+    uint8_t stream_payload1[] = "GE";
+    uint8_t stream_payload2[] = "T /";
+    uint8_t stream_payload3[] = "HTTP/1.0\r\n\r\n";
+
+    p = StreamTcpReassembleAppLayerTestPacket(&ssn, &f);
+    if (p == NULL) {
+        printf("couldn't get a packet: ");
+        goto end;
+    }
+
+    SCMutexLock(&f->m);
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  2, stream_payload1, 2) == -1) {
+        printf("failed to add segment 1: ");
+        goto end;
+    }
+    ssn.client.last_ack = 4;
+
+    if (StreamTcpReassembleAppLayer(&tv, ra_ctx, &ssn, &ssn.client, p) < 0) {
+        printf("StreamTcpReassembleAppLayer failed: ");
+        goto end;
+    }
+
+    /* not enough data for protocol detection */
+    if (ssn.client.ra_app_base_seq != 1) {
+        printf("expected ra_app_base_seq 1, got %u: ", ssn.client.ra_app_base_seq);
+        goto end;
+    }
+    TcpSegment *seg = ssn.client.seg_list;
+    if (seg == NULL || (seg->flags & SEGMENTTCP_FLAG_APPLAYER_PROCESSED)) {
+        printf("segment flagged as app layer processed before detection: ");
+        goto end;
+    }
+    seg->flags |= SEGMENTTCP_FLAG_APPLAYER_PROCESSED|SEGMENTTCP_FLAG_RAW_PROCESSED;
+    if (StreamTcpReturnSegmentCheck(f, &ssn, &ssn.client, seg) != 0) {
+        printf("segment can be returned before detection: ");
+        goto end;
+    }
+    seg->flags &= ~(SEGMENTTCP_FLAG_APPLAYER_PROCESSED|SEGMENTTCP_FLAG_RAW_PROCESSED);
+
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  4, stream_payload2, 3) == -1) {
+        printf("failed to add segment 2: ");
+        goto end;
+    }
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  7, stream_payload3, 12) == -1) {
+        printf("failed to add segment 3: ");
+        goto end;
+    }
+    ssn.client.last_ack = 19;
+
+    if (StreamTcpReassembleAppLayer(&tv, ra_ctx, &ssn, &ssn.client, p) < 0) {
+        printf("StreamTcpReassembleAppLayer failed: ");
+        goto end;
+    }
+
+    if (!StreamTcpIsSetStreamFlagAppProtoDetectionCompleted(&ssn.client)) {
+        printf("protocol detection not completed: ");
+        goto end;
+    }
+    if (ssn.client.ra_app_base_seq != 18) {
+        printf("expected ra_app_base_seq 18, got %u: ", ssn.client.ra_app_base_seq);
+        goto end;
+    }
+
+    /* all app layer data is processed, only raw reassembly holds the
+     * segments now */
+    for (seg = ssn.client.seg_list; seg != NULL; seg = seg->next) {
+        if (!(seg->flags & SEGMENTTCP_FLAG_APPLAYER_PROCESSED)) {
+            printf("segment %u not app layer processed: ", seg->seq);
+            goto end;
+        }
+        if (StreamTcpReturnSegmentCheck(f, &ssn, &ssn.client, seg) != 0) {
+            printf("segment %u can be returned before raw reassembly: ", seg->seq);
+            goto end;
+        }
+        seg->flags |= SEGMENTTCP_FLAG_RAW_PROCESSED;
+        if (StreamTcpReturnSegmentCheck(f, &ssn, &ssn.client, seg) != 1) {
+            printf("segment %u can't be returned: ", seg->seq);
+            goto end;
+        }
+    }
+
+    ret = 1;
+end:
+    UTHFreePacket(p);
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    if (f != NULL) {
+        SCMutexUnlock(&f->m);
+        UTHFreeFlow(f);
+    }
+    return ret;
+}
+
+/** \test app layer reassembly with acked data missing: the data before
+ *        the gap is passed on and the stream is flagged */
+static int StreamTcpReassembleAppLayerTest02(void)
+{
+    int ret = 0;
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    ThreadVars tv;
+    TcpSession ssn;
+    Flow *f = NULL;
+    Packet *p = NULL;
+
+    memset(&tv, 0x00, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+    StreamTcpUTSetupStream(&ssn.client, 1);
+    ssn.state = TCP_ESTABLISHED;
+
+    uint8_t stream_payload1[] = "GE";
+    uint8_t stream_payload3[] = "HTTP/1.0\r\n\r\n";
+
+    p = StreamTcpReassembleAppLayerTestPacket(&ssn, &f);
+    if (p == NULL) {
+        printf("couldn't get a packet: ");
+        goto end;
+    }
+
+    SCMutexLock(&f->m);
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  2, stream_payload1, 2) == -1) {
+        printf("failed to add segment 1: ");
+        goto end;
+    }
+    /* "T /" at seq 4 is missing */
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  7, stream_payload3, 12) == -1) {
+        printf("failed to add segment 3: ");
+        goto end;
+    }
+    ssn.client.last_ack = 19;
+
+    if (StreamTcpReassembleAppLayer(&tv, ra_ctx, &ssn, &ssn.client, p) < 0) {
+        printf("StreamTcpReassembleAppLayer failed: ");
+        goto end;
+    }
+
+    if (!(ssn.client.flags & STREAMTCP_STREAM_FLAG_GAP)) {
+        printf("gap not flagged: ");
+        goto end;
+    }
+    if (!(ENGINE_ISSET_EVENT(p, STREAM_REASSEMBLY_SEQ_GAP))) {
+        printf("no gap event: ");
+        goto end;
+    }
+    /* the data before the gap was passed on, the app layer gave up */
+    if (!(ssn.client.seg_list->flags & SEGMENTTCP_FLAG_APPLAYER_PROCESSED)) {
+        printf("data before the gap not processed: ");
+        goto end;
+    }
+    if (!(ssn.client.flags & STREAMTCP_STREAM_FLAG_NOREASSEMBLY)) {
+        printf("stream still reassembled after the gap: ");
+        goto end;
+    }
+    if (ssn.client.ra_app_base_seq != 6) {
+        printf("expected ra_app_base_seq 6, got %u: ", ssn.client.ra_app_base_seq);
+        goto end;
+    }
+
+    /* nothing more is passed on for this stream */
+    if (StreamTcpReassembleAppLayer(&tv, ra_ctx, &ssn, &ssn.client, p) < 0 ||
+        ssn.client.ra_app_base_seq != 6 ||
+        (ssn.client.seg_list_tail->flags & SEGMENTTCP_FLAG_APPLAYER_PROCESSED)) {
+        printf("stream with a gap was reassembled: ");
+        goto end;
+    }
+
+    ret = 1;
+end:
+    UTHFreePacket(p);
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    if (f != NULL) {
+        SCMutexUnlock(&f->m);
+        UTHFreeFlow(f);
+    }
+    return ret;
+}
+
+/** \test app layer reassembly of overlapping segments: the app layer
+ *        sees each byte once */
+static int StreamTcpReassembleAppLayerTest03(void)
+{
+    int ret = 0;
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    ThreadVars tv;
+    TcpSession ssn;
+    Flow *f = NULL;
+    Packet *p = NULL;
+
+    memset(&tv, 0x00, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+    StreamTcpUTSetupStream(&ssn.client, 1);
+    ssn.state = TCP_ESTABLISHED;
+
+    uint8_t stream_contents[] = "GET / HTTP/1.0\r\n\r\n";
+    uint8_t stream_payload1[] = "GET / HT";
+    uint8_t stream_payload2[] = "T / HTTP/1.0\r\n\r\n";
+
+    p = StreamTcpReassembleAppLayerTestPacket(&ssn, &f);
+    if (p == NULL) {
+        printf("couldn't get a packet: ");
+        goto end;
+    }
+
+    SCMutexLock(&f->m);
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  2, stream_payload1, 8) == -1) {
+        printf("failed to add segment 1: ");
+        goto end;
+    }
+    /* overlaps the last 6 bytes of the first segment */
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  4, stream_payload2, 15) == -1) {
+        printf("failed to add segment 2: ");
+        goto end;
+    }
+    ssn.client.last_ack = 19;
+
+    if (StreamTcpCheckStreamContents(stream_contents, 17, &ssn.client) == 0) {
+        printf("failed in stream matching: ");
+        goto end;
+    }
+
+    if (StreamTcpReassembleAppLayer(&tv, ra_ctx, &ssn, &ssn.client, p) < 0) {
+        printf("StreamTcpReassembleAppLayer failed: ");
+        goto end;
+    }
+
+    if (ssn.client.flags & STREAMTCP_STREAM_FLAG_GAP) {
+        printf("overlap taken for a gap: ");
+        goto end;
+    }
+    if (ssn.client.ra_app_base_seq != 18) {
+        printf("expected ra_app_base_seq 18, got %u: ", ssn.client.ra_app_base_seq);
+        goto end;
+    }
+
+    ret = 1;
+end:
+    UTHFreePacket(p);
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    if (f != NULL) {
+        SCMutexUnlock(&f->m);
+        UTHFreeFlow(f);
+    }
+    return ret;
+}
+
+/** \test the app layer reassembly doesn't need memory of its own, so it
+ *        still works when the reassembly memcap is reached */
+static int StreamTcpReassembleAppLayerTest04(void)
+{
+    int ret = 0;
+    TcpReassemblyThreadCtx *ra_ctx = NULL;
+    ThreadVars tv;
+    TcpSession ssn;
+    Flow *f = NULL;
+    Packet *p = NULL;
+    uint64_t memcap = 0;
+
+    memset(&tv, 0x00, sizeof(tv));
+
+    StreamTcpUTInit(&ra_ctx);
+    StreamTcpUTSetupSession(&ssn);
+    StreamTcpUTSetupStream(&ssn.client, 1);
+    ssn.state = TCP_ESTABLISHED;
+    memcap = stream_config.reassembly_memcap;
+
+    uint8_t stream_payload[] = "GET / HTTP/1.0\r\n\r\n";
+
+    p = StreamTcpReassembleAppLayerTestPacket(&ssn, &f);
+    if (p == NULL) {
+        printf("couldn't get a packet: ");
+        goto end;
+    }
+
+    SCMutexLock(&f->m);
+    if (StreamTcpUTAddSegmentWithPayload(&tv, ra_ctx, &ssn.client,  2, stream_payload, 17) == -1) {
+        printf("failed to add segment 1: ");
+        goto end;
+    }
+    ssn.client.last_ack = 19;
+
+    /* no room for anything else */
+    stream_config.reassembly_memcap = SC_ATOMIC_GET(ra_memuse);
+    if (StreamTcpReassembleCheckMemcap((uint32_t)sizeof(TcpSegment)) != 0) {
+        printf("memcap not reached: ");
+        goto end;
+    }
+
+    if (StreamTcpReassembleAppLayer(&tv, ra_ctx, &ssn, &ssn.client, p) < 0) {
+        printf("StreamTcpReassembleAppLayer failed: ");
+        goto end;
+    }
+    if (ssn.client.ra_app_base_seq != 18) {
+        printf("expected ra_app_base_seq 18, got %u: ", ssn.client.ra_app_base_seq);
+        goto end;
+    }
+    if (SC_ATOMIC_GET(ra_memuse) > stream_config.reassembly_memcap) {
+        printf("memuse went over the memcap: ");
+        goto end;
+    }
+
+    ret = 1;
+end:
+    stream_config.reassembly_memcap = memcap;
+    UTHFreePacket(p);
+    StreamTcpUTClearSession(&ssn);
+    StreamTcpUTDeinit(ra_ctx);
+    if (f != NULL) {
+        SCMutexUnlock(&f->m);
+        UTHFreeFlow(f);
+    }
+    return ret;
+}
+
+/**
+ *  \test  Set up the segment pools for lots of threads under the default
+ *         yaml memcap of 128mb. Thread init must not fail and all threads
+ *         must still be able to get segments.
+ */
+static int StreamTcpReassembleThreadPoolTest01(void)
+{
+    TcpReassemblyThreadCtx ra_ctx;
+    ThreadVars tv;
+    TcpSegment *seg = NULL;
+    int ret = 0;
+    int i;
+
+    StreamTcpInitConfig(TRUE);
+    stream_config.reassembly_memcap = 128 * 1024 * 1024;
+
+    /* the first thread uses the element created at config time, the
+     * others grow the pools */
+    SCMutexLock(&segment_thread_pool_mutex);
+    for (i = 1; i < 64; i++) {
+        int id = StreamTcpReassembleThreadPoolGrow();
+        if (id != i) {
+            printf("thread %d: got id %d: ", i, id);
+            SCMutexUnlock(&segment_thread_pool_mutex);
+            goto end;
+        }
+    }
+    SCMutexUnlock(&segment_thread_pool_mutex);
+
+    if (SC_ATOMIC_GET(ra_memuse) > stream_config.reassembly_memcap / 2) {
+        printf("prealloc uses %"PRIu64" of the memcap: ", SC_ATOMIC_GET(ra_memuse));
+        goto end;
+    }
+
+    memset(&tv, 0x00, sizeof(tv));
+    memset(&ra_ctx, 0x00, sizeof(ra_ctx));
+    for (i = 0; i < 64; i += 63) {
+        ra_ctx.segment_thread_pool_id = i;
+        seg = StreamTcpGetSegment(&tv, &ra_ctx, 1448);
+        if (seg == NULL) {
+            printf("thread %d: no segment: ", i);
+            goto end;
+        }
+        StreamTcpSegmentReturntoPool(seg);
+    }
+
+    ret = 1;
+end:
+    StreamTcpFreeConfig(TRUE);
+    if (SC_ATOMIC_GET(ra_memuse) != 0) {
+        printf("memuse %"PRIu64" after free: ", SC_ATOMIC_GET(ra_memuse));
+        ret = 0;
+    }
+    return ret;
+}
+
 #endif /* UNITTESTS */
 
 /** \brief  The Function Register the Unit tests to test the reassembly engine
@@ -9052,6 +10021,13 @@ void StreamTcpReassembleRegisterTests(void)
     UtRegisterTest("StreamTcpReassembleInsertTest01 -- insert with overlap", StreamTcpReassembleInsertTest01, 1);
     UtRegisterTest("StreamTcpReassembleInsertTest02 -- insert with overlap", StreamTcpReassembleInsertTest02, 1);
     UtRegisterTest("StreamTcpReassembleInsertTest03 -- insert with overlap", StreamTcpReassembleInsertTest03, 1);
+    UtRegisterTest("StreamTcpReassembleInsertTest04 -- insert out of order", StreamTcpReassembleInsertTest04, 1);
+    UtRegisterTest("StreamTcpReassembleInsertTest05 -- insert out of order with overlap", StreamTcpReassembleInsertTest05, 1);
+    UtRegisterTest("StreamTcpReassembleAppLayerTest01 -- app layer in order", StreamTcpReassembleAppLayerTest01, 1);
+    UtRegisterTest("StreamTcpReassembleAppLayerTest02 -- app layer gap", StreamTcpReassembleAppLayerTest02, 1);
+    UtRegisterTest("StreamTcpReassembleAppLayerTest03 -- app layer overlap", StreamTcpReassembleAppLayerTest03, 1);
+    UtRegisterTest("StreamTcpReassembleAppLayerTest04 -- app layer at memcap", StreamTcpReassembleAppLayerTest04, 1);
+    UtRegisterTest("StreamTcpReassembleThreadPoolTest01 -- pools for 64 threads under memcap", StreamTcpReassembleThreadPoolTest01, 1);
 
     StreamTcpInlineRegisterTests();
     StreamTcpUtilRegisterTests();
@@ -53,6 +53,8 @@ enum
 
 typedef struct TcpReassemblyThreadCtx_ {
     void *app_tctx;
+    /** id of this thread in the segment thread pools */
+    int segment_thread_pool_id;
     /** TCP segments which are not being reassembled due to memcap was reached */
     uint16_t counter_tcp_segment_memcap;
     /** number of streams that stop reassembly because their depth is reached */
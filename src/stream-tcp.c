@@ -35,6 +35,7 @@
 
 #include "flow.h"
 #include "flow-util.h"
+#include "flow-manager.h"
 
 #include "conf.h"
 #include "conf-yaml-loader.h"
@@ -442,6 +443,21 @@ void StreamTcpInitConfig(char quiet)
         SCLogInfo("stream.\"inline\": %s", stream_inline ? "enabled" : "disabled");
     }
 
+    int bypass = 0;
+    if (ConfGetBool("stream.bypass", &bypass) == 1 && bypass == 1) {
+        /* inline mode needs to see every packet to normalize the stream */
+        if (stream_inline) {
+            SCLogWarning(SC_ERR_INVALID_ARGUMENT, "stream.bypass is not "
+                    "supported in inline mode, disabling");
+            bypass = 0;
+        } else {
+            stream_config.flags |= STREAMTCP_INIT_FLAG_BYPASS;
+        }
+    }
+    if (!quiet) {
+        SCLogInfo("stream \"bypass\": %s", bypass ? "enabled" : "disabled");
+    }
+
     if ((ConfGetInt("stream.max-synack-queued", &value)) == 1) {
         if (value >= 0 && value <= 255) {
             stream_config.max_synack_queued = (uint8_t)value;
@@ -679,6 +695,10 @@ static void StreamTcpPacketSetState(Packet *p, TcpSession *ssn,
         return;
 
     ssn->state = state;
+
+    /* closing the session shortens the flow timeout */
+    if (p->flow != NULL)
+        FlowWheelUpdate(p->flow, &p->ts);
 }
 
 /**
@@ -4373,6 +4393,93 @@ static int StreamTcpPacketIsBadWindowUpdate(TcpSession *ssn, Packet *p)
 
 
 /* flow is and stays locked */
+/**
+ *  \internal
+ *  \brief check if a session can bypass the stream engine
+ *
+ *  That is the case once both directions are done reassembling, because
+ *  the depth was reached or the app layer disabled reassembly, and all
+ *  reassembled data has been consumed by the app layer, raw stream
+ *  inspection and the loggers.
+ *
+ *  \retval 1 yes
+ *  \retval 0 no
+ */
+static int StreamTcpBypassCheck(const TcpSession *ssn)
+{
+    if (ssn->state != TCP_ESTABLISHED)
+        return 0;
+
+    if (!(ssn->client.flags & STREAMTCP_STREAM_FLAG_NOREASSEMBLY) ||
+        !(ssn->server.flags & STREAMTCP_STREAM_FLAG_NOREASSEMBLY))
+        return 0;
+
+    /* segments are only returned once everyone is done with them */
+    if (ssn->client.seg_list != NULL || ssn->server.seg_list != NULL)
+        return 0;
+
+    if (ssn->toserver_smsg_head != NULL || ssn->toclient_smsg_head != NULL)
+        return 0;
+
+    return 1;
+}
+
+/**
+ *  \internal
+ *  \brief minimal tracking of a packet of a bypassed session
+ *
+ *  Updates the sequence numbers and window the way the established state
+ *  handling would, so a later FIN or RST is still accepted. Packets with
+ *  an invalid ACK or outside of the window are rejected without touching
+ *  the session, like in the established state.
+ *
+ *  \retval 0 ok
+ *  \retval -1 packet rejected
+ */
+static int StreamTcpBypassPacket(TcpSession *ssn, Packet *p)
+{
+    TcpStream *stream, *ostream;
+
+    if (PKT_IS_TOSERVER(p)) {
+        stream = &ssn->client;
+        ostream = &ssn->server;
+    } else {
+        stream = &ssn->server;
+        ostream = &ssn->client;
+    }
+
+    if (StreamTcpValidateAck(ssn, ostream, p) == -1) {
+        SCLogDebug("ssn %p: rejecting because of invalid ack value", ssn);
+        StreamTcpSetEvent(p, STREAM_EST_INVALID_ACK);
+        return -1;
+    }
+
+    if (!(SEQ_LEQ(TCP_GET_SEQ(p) + p->payload_len, stream->next_win) ||
+          (ssn->flags & STREAMTCP_FLAG_MIDSTREAM) ||
+          (ssn->flags & STREAMTCP_FLAG_ASYNC)))
+    {
+        SCLogDebug("ssn %p: SEQ out of window, packet SEQ %" PRIu32 ", "
+                "payload size %" PRIu32 ", next_win %" PRIu32, ssn,
+                TCP_GET_SEQ(p), p->payload_len, stream->next_win);
+        StreamTcpSetEvent(p, STREAM_EST_PACKET_OUT_OF_WINDOW);
+        return -1;
+    }
+
+    if (SEQ_GT((TCP_GET_SEQ(p) + p->payload_len), stream->next_seq))
+        stream->next_seq = TCP_GET_SEQ(p) + p->payload_len;
+
+    if (p->tcph->th_flags & TH_ACK) {
+        ostream->window = TCP_GET_WINDOW(p) << ostream->wscale;
+        StreamTcpUpdateLastAck(ssn, ostream, TCP_GET_ACK(p));
+        StreamTcpUpdateNextWin(ssn, ostream, (ostream->last_ack + ostream->window));
+    }
+
+    if (ssn->flags & STREAMTCP_FLAG_TIMESTAMP) {
+        StreamTcpHandleTimestamp(ssn, p);
+    }
+    return 0;
+}
+
 int StreamTcpPacket (ThreadVars *tv, Packet *p, StreamTcpThread *stt,
                      PacketQueue *pq)
 {
@@ -4382,13 +4489,11 @@ int StreamTcpPacket (ThreadVars *tv, Packet *p, StreamTcpThread *stt,
 
     SCLogDebug("p->pcap_cnt %"PRIu64, p->pcap_cnt);
 
-    /* assign the thread id to the flow */
-    if (unlikely(p->flow->thread_id == 0)) {
+    /* assign the thread id to the flow. It changes if the autofp
+     * rebalance scheduler moved the flow to another thread. */
+    if (unlikely((FlowThreadId)tv->id != p->flow->thread_id)) {
+        SCLogDebug("flow has thread %u, we are %d", p->flow->thread_id, tv->id);
         p->flow->thread_id = (FlowThreadId)tv->id;
-#ifdef DEBUG
-    } else if (unlikely((FlowThreadId)tv->id != p->flow->thread_id)) {
-        SCLogDebug("wrong thread: flow has %u, we are %d", p->flow->thread_id, tv->id);
-#endif
     }
 
     TcpSession *ssn = (TcpSession *)p->flow->protoctx;
@@ -4432,6 +4537,23 @@ int StreamTcpPacket (ThreadVars *tv, Packet *p, StreamTcpThread *stt,
         SCReturnInt(0);
     }
 
+    /* bypassed session: only keep track of the sequence numbers, so the
+     * session can still be closed normally. Packets that change the
+     * state take the full path. */
+    if ((p->flow->flags & FLOW_STREAM_BYPASS) && ssn != NULL &&
+            ssn->state == TCP_ESTABLISHED &&
+            !(p->tcph->th_flags & (TH_SYN|TH_FIN|TH_RST)))
+    {
+        if (StreamTcpBypassPacket(ssn, p) == -1)
+            goto error;
+
+        SCPerfCounterIncr(stt->counter_tcp_bypassed_pkts, tv->sc_perf_pca);
+        SCPerfCounterAddUI64(stt->counter_tcp_bypassed_bytes, tv->sc_perf_pca,
+                GET_PKT_LEN(p));
+        p->flags |= (PKT_STREAM_EST|PKT_STREAM_NOPCAPLOG);
+        SCReturnInt(0);
+    }
+
     if (ssn == NULL || ssn->state == TCP_NONE) {
         if (StreamTcpPacketStateNone(tv, p, stt, ssn, &stt->pseudo_queue) == -1) {
             goto error;
@@ -4565,6 +4687,7 @@ int StreamTcpPacket (ThreadVars *tv, Packet *p, StreamTcpThread *stt,
                                        ~FLOW_TC_PM_ALPROTO_DETECT_DONE &
                                        ~FLOW_TC_PP_ALPROTO_DETECT_DONE);
                     p->flow->flags &= ~ FLOW_NO_APPLAYER_INSPECTION;
+                    p->flow->flags &= ~FLOW_STREAM_BYPASS;
                     if (p->flow->de_state != NULL) {
                         SCMutexLock(&p->flow->de_state_m);
                         DetectEngineStateReset(p->flow->de_state, (STREAM_TOSERVER | STREAM_TOCLIENT));
@@ -4631,6 +4754,22 @@ int StreamTcpPacket (ThreadVars *tv, Packet *p, StreamTcpThread *stt,
             ReCalculateChecksum(p);
         }
 
+        /* no more stream data is needed in either direction, so the rest
+         * of the session can bypass the stream engine */
+        if ((stream_config.flags & STREAMTCP_INIT_FLAG_BYPASS) &&
+                !(p->flow->flags & FLOW_STREAM_BYPASS) &&
+                StreamTcpBypassCheck(ssn) == 1)
+        {
+            SCLogDebug("ssn %p: bypassing the stream engine", ssn);
+            p->flow->flags |= FLOW_STREAM_BYPASS;
+
+            /* see if the capture method can drop the rest of the flow
+             * before it reaches us */
+            if (PacketBypassCallback(p) == 1) {
+                SCLogDebug("ssn %p: flow bypassed by the capture method", ssn);
+            }
+        }
+
         /* check for conditions that may make us not want to log this packet */
 
         /* streams that hit depth */
@@ -4792,6 +4931,12 @@ TmEcode StreamTcpThreadInit(ThreadVars *tv, void *initdata, void **data)
     stt->counter_tcp_rst = SCPerfTVRegisterCounter("tcp.rst", tv,
                                                         SC_PERF_TYPE_UINT64,
                                                         "NULL");
+    stt->counter_tcp_bypassed_pkts = SCPerfTVRegisterCounter("tcp.bypassed_pkts", tv,
+                                                        SC_PERF_TYPE_UINT64,
+                                                        "NULL");
+    stt->counter_tcp_bypassed_bytes = SCPerfTVRegisterCounter("tcp.bypassed_bytes", tv,
+                                                        SC_PERF_TYPE_UINT64,
+                                                        "NULL");
 
     /* init reassembly ctx */
     stt->ra_ctx = StreamTcpReassembleInitThreadCtx(tv);
@@ -10338,6 +10483,248 @@ end:
     return ret;
 }
 
+/**
+ *  \test   Test that a session that is done reassembling bypasses the
+ *          stream engine, but can still be closed.
+ *
+ *  \retval On success it returns 1 and on failure 0.
+ */
+static int StreamTcpTest46 (void)
+{
+    Flow f;
+    ThreadVars tv;
+    StreamTcpThread stt;
+    uint8_t payload[4];
+    TCPHdr tcph;
+    TcpReassemblyThreadCtx ra_ctx;
+    PacketQueue pq;
+    TcpSession *ssn = NULL;
+
+    memset(&ra_ctx, 0, sizeof(TcpReassemblyThreadCtx));
+    memset (&f, 0, sizeof(Flow));
+    memset(&tv, 0, sizeof (ThreadVars));
+    memset(&stt, 0, sizeof (StreamTcpThread));
+    memset(&tcph, 0, sizeof (TCPHdr));
+    memset(&pq,0,sizeof(PacketQueue));
+
+    Packet *p = SCMalloc(SIZE_OF_PACKET);
+    if (unlikely(p == NULL))
+        return 0;
+    memset(p, 0, SIZE_OF_PACKET);
+
+    p->flow = &f;
+    tcph.th_win = htons(5480);
+    tcph.th_flags = TH_SYN;
+    p->tcph = &tcph;
+    p->flowflags = FLOW_PKT_TOSERVER;
+    int ret = 0;
+    stt.ra_ctx = &ra_ctx;
+
+    StreamTcpInitConfig(TRUE);
+    stream_config.flags |= STREAMTCP_INIT_FLAG_BYPASS;
+
+    SCMutexLock(&f.m);
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+
+    p->tcph->th_ack = htonl(1);
+    p->tcph->th_flags = TH_SYN | TH_ACK;
+    p->flowflags = FLOW_PKT_TOCLIENT;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+
+    p->tcph->th_ack = htonl(1);
+    p->tcph->th_seq = htonl(1);
+    p->tcph->th_flags = TH_ACK;
+    p->flowflags = FLOW_PKT_TOSERVER;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+
+    ssn = (TcpSession *)p->flow->protoctx;
+    if (f.flags & FLOW_STREAM_BYPASS) {
+        printf("bypassed while reassembly is still needed: ");
+        goto end;
+    }
+
+    /* both directions are done, like after reaching the depth */
+    ssn->client.flags |= STREAMTCP_STREAM_FLAG_NOREASSEMBLY;
+    ssn->server.flags |= STREAMTCP_STREAM_FLAG_NOREASSEMBLY;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+    if (!(f.flags & FLOW_STREAM_BYPASS)) {
+        printf("session not bypassed: ");
+        goto end;
+    }
+
+    p->tcph->th_flags = TH_PUSH | TH_ACK;
+    StreamTcpCreateTestPacket(payload, 0x41, 3, 4); /*AAA*/
+    p->payload = payload;
+    p->payload_len = 3;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+    if (ssn->client.next_seq != 4 || ssn->client.seg_list != NULL) {
+        printf("client.next_seq %"PRIu32", seg_list %p: ",
+                ssn->client.next_seq, ssn->client.seg_list);
+        goto end;
+    }
+
+    /* the FIN takes the normal path again */
+    p->tcph->th_seq = htonl(4);
+    p->tcph->th_flags = TH_FIN | TH_ACK;
+    p->payload = NULL;
+    p->payload_len = 0;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+    if (ssn->state != TCP_CLOSE_WAIT) {
+        printf("state %u, expected TCP_CLOSE_WAIT: ", ssn->state);
+        goto end;
+    }
+
+    ret = 1;
+
+end:
+    StreamTcpSessionClear(p->flow->protoctx);
+    StreamTcpFreeConfig(TRUE);
+    SCMutexUnlock(&f.m);
+    SCFree(p);
+    return ret;
+}
+
+/**
+ *  \test packets of a bypassed session that are out of the window don't
+ *        move the tracked sequence numbers.
+ */
+static int StreamTcpTest47 (void)
+{
+    Flow f;
+    ThreadVars tv;
+    StreamTcpThread stt;
+    uint8_t payload[4];
+    TCPHdr tcph;
+    TcpReassemblyThreadCtx ra_ctx;
+    PacketQueue pq;
+    TcpSession *ssn = NULL;
+
+    memset(&ra_ctx, 0, sizeof(TcpReassemblyThreadCtx));
+    memset (&f, 0, sizeof(Flow));
+    memset(&tv, 0, sizeof (ThreadVars));
+    memset(&stt, 0, sizeof (StreamTcpThread));
+    memset(&tcph, 0, sizeof (TCPHdr));
+    memset(&pq,0,sizeof(PacketQueue));
+
+    Packet *p = SCMalloc(SIZE_OF_PACKET);
+    if (unlikely(p == NULL))
+        return 0;
+    memset(p, 0, SIZE_OF_PACKET);
+
+    p->flow = &f;
+    tcph.th_win = htons(5480);
+    tcph.th_flags = TH_SYN;
+    p->tcph = &tcph;
+    p->flowflags = FLOW_PKT_TOSERVER;
+    int ret = 0;
+    stt.ra_ctx = &ra_ctx;
+
+    StreamTcpInitConfig(TRUE);
+    stream_config.flags |= STREAMTCP_INIT_FLAG_BYPASS;
+
+    SCMutexLock(&f.m);
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+
+    p->tcph->th_ack = htonl(1);
+    p->tcph->th_flags = TH_SYN | TH_ACK;
+    p->flowflags = FLOW_PKT_TOCLIENT;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+
+    p->tcph->th_ack = htonl(1);
+    p->tcph->th_seq = htonl(1);
+    p->tcph->th_flags = TH_ACK;
+    p->flowflags = FLOW_PKT_TOSERVER;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+
+    ssn = (TcpSession *)p->flow->protoctx;
+    ssn->client.flags |= STREAMTCP_STREAM_FLAG_NOREASSEMBLY;
+    ssn->server.flags |= STREAMTCP_STREAM_FLAG_NOREASSEMBLY;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+    if (!(f.flags & FLOW_STREAM_BYPASS)) {
+        printf("session not bypassed: ");
+        goto end;
+    }
+
+    uint32_t next_seq = ssn->client.next_seq;
+    uint32_t last_ack = ssn->server.last_ack;
+
+    /* far beyond the window */
+    p->tcph->th_seq = htonl(1 + 1000000);
+    p->tcph->th_flags = TH_PUSH | TH_ACK;
+    StreamTcpCreateTestPacket(payload, 0x41, 3, 4); /*AAA*/
+    p->payload = payload;
+    p->payload_len = 3;
+
+    if (StreamTcpPacket(&tv, p, &stt, &pq) != -1) {
+        printf("out of window packet accepted: ");
+        goto end;
+    }
+    if (ssn->client.next_seq != next_seq || ssn->server.last_ack != last_ack) {
+        printf("client.next_seq %"PRIu32" (%"PRIu32"), server.last_ack "
+                "%"PRIu32" (%"PRIu32"): ", ssn->client.next_seq, next_seq,
+                ssn->server.last_ack, last_ack);
+        goto end;
+    }
+
+    /* an in window packet is still tracked */
+    p->tcph->th_seq = htonl(1);
+    if (StreamTcpPacket(&tv, p, &stt, &pq) == -1) {
+        printf("failed in processing packet in StreamTcpPacket\n");
+        goto end;
+    }
+    if (ssn->client.next_seq != 4) {
+        printf("client.next_seq %"PRIu32", expected 4: ", ssn->client.next_seq);
+        goto end;
+    }
+
+    ret = 1;
+
+end:
+    StreamTcpSessionClear(p->flow->protoctx);
+    StreamTcpFreeConfig(TRUE);
+    SCMutexUnlock(&f.m);
+    SCFree(p);
+    return ret;
+}
+
 #endif /* UNITTESTS */
 
 void StreamTcpRegisterTests (void)
@@ -10415,6 +10802,8 @@ void StreamTcpRegisterTests (void)
     UtRegisterTest("StreamTcpTest43 -- SYN/ACK queue", StreamTcpTest43, 1);
     UtRegisterTest("StreamTcpTest44 -- SYN/ACK queue", StreamTcpTest44, 1);
     UtRegisterTest("StreamTcpTest45 -- SYN/ACK queue", StreamTcpTest45, 1);
+    UtRegisterTest("StreamTcpTest46 -- stream bypass", StreamTcpTest46, 1);
+    UtRegisterTest("StreamTcpTest47 -- stream bypass out of window", StreamTcpTest47, 1);
 
     /* set up the reassembly tests as well */
     StreamTcpReassembleRegisterTests();
@@ -38,6 +38,9 @@
 /* Flag to indicate that the checksum validation for the stream engine
    has been enabled */
 #define STREAMTCP_INIT_FLAG_CHECKSUM_VALIDATION    0x01
+/* Flag to indicate that sessions that need no more reassembly bypass the
+   stream engine */
+#define STREAMTCP_INIT_FLAG_BYPASS                 0x02
 
 /*global flow data*/
 typedef struct TcpStreamCnf_ {
@@ -101,6 +104,9 @@ typedef struct StreamTcpThread_ {
     uint16_t counter_tcp_synack;
     /** rst pkts */
     uint16_t counter_tcp_rst;
+    /** pkts and bytes of sessions bypassing the stream engine */
+    uint16_t counter_tcp_bypassed_pkts;
+    uint16_t counter_tcp_bypassed_bytes;
 
     /** tcp reassembly thread data */
     TcpReassemblyThreadCtx *ra_ctx;
@@ -726,6 +726,9 @@ void SCPrintBuildInfo(void)
 
     /* SIMD stuff */
     memset(features, 0x00, sizeof(features));
+#if defined(__AVX2__)
+    strlcat(features, "AVX2 ", sizeof(features));
+#endif
 #if defined(__SSE4_2__)
     strlcat(features, "SSE_4_2 ", sizeof(features));
 #endif
@@ -51,6 +51,7 @@ void TmqhSetup (void)
 void TmqhCleanup(void)
 {
     TmqhRingBufferDestroy();
+    TmqhFlowRingCleanup();
 }
 
 Tmqh* TmqhGetQueueHandlerByName(char *name)
@@ -34,6 +34,7 @@
 #include "tm-queuehandlers.h"
 #include "tm-threads.h"
 #include "tmqh-packetpool.h"
+#include "tmqh-flow.h"
 #include "threads.h"
 #include "util-debug.h"
 #include "util-privs.h"
@@ -1167,6 +1168,10 @@ ThreadVars *TmThreadCreate(char *name, char *inq_name, char *inqh_name,
 
         tv->tmqh_in = tmqh->InHandler;
         tv->InShutdownHandler = tmqh->InShutdownHandler;
+        if (tmqh->InHandlerThreadInit != NULL) {
+            if (tmqh->InHandlerThreadInit(tv) != 0)
+                goto error;
+        }
         SCLogDebug("tv->tmqh_in %p", tv->tmqh_in);
     }
 
@@ -1438,7 +1443,7 @@ void TmThreadKillThread(ThreadVars *tv)
         if (!(strlen(tv->inq->name) == strlen("packetpool") &&
               strcasecmp(tv->inq->name, "packetpool") == 0)) {
             PacketQueue *q = &trans_q[tv->inq->id];
-            while (q->len != 0) {
+            while (q->len != 0 || TmqhFlowRingPending(tv->inq->id) != 0) {
                 usleep(1000);
             }
         }
@@ -1547,7 +1552,7 @@ void TmThreadDisableReceiveThreads(void)
                 if (!(strlen(tv->inq->name) == strlen("packetpool") &&
                       strcasecmp(tv->inq->name, "packetpool") == 0)) {
                     PacketQueue *q = &trans_q[tv->inq->id];
-                    while (q->len != 0) {
+                    while (q->len != 0 || TmqhFlowRingPending(tv->inq->id) != 0) {
                         usleep(1000);
                     }
                 }
@@ -1619,7 +1624,7 @@ void TmThreadDisablePacketThreads(void)
             if (!(strlen(tv->inq->name) == strlen("packetpool") &&
                         strcasecmp(tv->inq->name, "packetpool") == 0)) {
                 PacketQueue *q = &trans_q[tv->inq->id];
-                while (q->len != 0) {
+                while (q->len != 0 || TmqhFlowRingPending(tv->inq->id) != 0) {
                     usleep(1000);
                 }
             }
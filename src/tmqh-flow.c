@@ -25,6 +25,10 @@
  * are sent to the same queue. We support different kind of q handlers.  Have
  * a look at "autofp-scheduler" conf to further undertsand the various q
  * handlers we provide.
+ *
+ * The "flow-ring" variant uses the same schedulers, but instead of the
+ * mutex and condition protected queues it connects each writer thread to
+ * each reader queue with a lock free single producer, single consumer ring.
  */
 
 #include "suricata.h"
@@ -33,28 +37,80 @@
 #include "threads.h"
 #include "threadvars.h"
 #include "tmqh-flow.h"
+#include "tmqh-packetpool.h"
 
 #include "tm-queuehandlers.h"
+#include "tm-threads.h"
+
+#include "flow-util.h"
 
 #include "conf.h"
 #include "util-unittest.h"
 
+/** number of packets a reader takes from a ring before it moves on to
+ *  the next one and hands the slots back to the writer */
+#define FLOW_RING_BATCH         32
+/** loops a reader busy polls the rings before it starts yielding */
+#define FLOW_RING_SPIN_LOOPS    2000
+/** yields before the reader goes to sleep on the queue condition */
+#define FLOW_RING_YIELD_LOOPS   16
+/** default for autofp-rebalance-threshold */
+#define FLOW_REBALANCE_THRESHOLD_DEFAULT 64
+
+/** upper limit for autofp-ring-size */
+#define FLOW_RING_MAX_SIZE      (1 << 20)
+
+/** \brief reader side of the flow rings, one per queue id */
+typedef struct TmqhFlowRingReader_ {
+    TmqhFlowRing *rings;    /**< list of rings feeding this queue */
+    TmqhFlowRing *cur;      /**< ring we're currently reading from */
+    uint16_t nrings;
+
+    /** set while the reader waits on the queue condition */
+    SC_ATOMIC_DECLARE(int, sleeping);
+
+    ThreadVars *tv;         /**< the single reader thread */
+    uint16_t depth_id;      /**< autofp.ring_depth counter */
+    uint16_t drops_id;      /**< autofp.ring_drops counter */
+} TmqhFlowRingReader;
+
+static TmqhFlowRingReader flow_ring_readers[256];
+/** protect adding rings to the readers, init/shutdown only */
+static SCMutex flow_ring_lock = SCMUTEX_INITIALIZER;
+
 Packet *TmqhInputFlow(ThreadVars *t);
+Packet *TmqhInputFlowRing(ThreadVars *t);
+int TmqhInputFlowRingThreadInit(ThreadVars *t);
 void TmqhOutputFlowHash(ThreadVars *t, Packet *p);
 void TmqhOutputFlowActivePackets(ThreadVars *t, Packet *p);
+void TmqhOutputFlowRebalance(ThreadVars *t, Packet *p);
 void TmqhOutputFlowRoundRobin(ThreadVars *t, Packet *p);
 void *TmqhOutputFlowSetupCtx(char *queue_str);
+void *TmqhOutputFlowRingSetupCtx(char *queue_str);
 void TmqhOutputFlowFreeCtx(void *ctx);
 void TmqhFlowRegisterTests(void);
 
 void TmqhFlowRegister(void)
 {
+    int i;
+
     tmqh_table[TMQH_FLOW].name = "flow";
     tmqh_table[TMQH_FLOW].InHandler = TmqhInputFlow;
     tmqh_table[TMQH_FLOW].OutHandlerCtxSetup = TmqhOutputFlowSetupCtx;
     tmqh_table[TMQH_FLOW].OutHandlerCtxFree = TmqhOutputFlowFreeCtx;
     tmqh_table[TMQH_FLOW].RegisterTests = TmqhFlowRegisterTests;
 
+    tmqh_table[TMQH_FLOW_RING].name = "flow-ring";
+    tmqh_table[TMQH_FLOW_RING].InHandler = TmqhInputFlowRing;
+    tmqh_table[TMQH_FLOW_RING].InHandlerThreadInit = TmqhInputFlowRingThreadInit;
+    tmqh_table[TMQH_FLOW_RING].OutHandlerCtxSetup = TmqhOutputFlowRingSetupCtx;
+    tmqh_table[TMQH_FLOW_RING].OutHandlerCtxFree = TmqhOutputFlowFreeCtx;
+
+    memset(&flow_ring_readers, 0x00, sizeof(flow_ring_readers));
+    for (i = 0; i < 256; i++) {
+        SC_ATOMIC_INIT(flow_ring_readers[i].sleeping);
+    }
+
     char *scheduler = NULL;
     if (ConfGet("autofp-scheduler", &scheduler) == 1) {
         if (strcasecmp(scheduler, "round-robin") == 0) {
@@ -66,6 +122,9 @@ void TmqhFlowRegister(void)
         } else if (strcasecmp(scheduler, "hash") == 0) {
             SCLogInfo("AutoFP mode using \"Hash\" flow load balancer");
             tmqh_table[TMQH_FLOW].OutHandler = TmqhOutputFlowHash;
+        } else if (strcasecmp(scheduler, "rebalance") == 0) {
+            SCLogInfo("AutoFP mode using \"Rebalance\" flow load balancer");
+            tmqh_table[TMQH_FLOW].OutHandler = TmqhOutputFlowRebalance;
         } else {
             SCLogError(SC_ERR_INVALID_YAML_CONF_ENTRY, "Invalid entry \"%s\" "
                        "for autofp-scheduler in conf.  Killing engine.",
@@ -77,6 +136,9 @@ void TmqhFlowRegister(void)
         tmqh_table[TMQH_FLOW].OutHandler = TmqhOutputFlowActivePackets;
     }
 
+    /* the ring handler only differs in how packets are passed on */
+    tmqh_table[TMQH_FLOW_RING].OutHandler = tmqh_table[TMQH_FLOW].OutHandler;
+
     return;
 }
 
@@ -104,6 +166,339 @@ Packet *TmqhInputFlow(ThreadVars *tv)
     }
 }
 
+/**
+ * \brief allocate a ring of 'size' slots feeding queue 'qid'
+ *
+ * \param size number of slots, must be a power of 2
+ */
+static TmqhFlowRing *FlowRingAlloc(uint32_t size, uint16_t qid)
+{
+    TmqhFlowRing *r = SCMallocAligned(sizeof(TmqhFlowRing), CLS);
+    if (unlikely(r == NULL))
+        return NULL;
+    memset(r, 0x00, sizeof(TmqhFlowRing));
+
+    r->slots = SCMalloc(size * sizeof(Packet *));
+    if (unlikely(r->slots == NULL)) {
+        SCFreeAligned(r);
+        return NULL;
+    }
+    memset(r->slots, 0x00, size * sizeof(Packet *));
+
+    SC_ATOMIC_INIT(r->prod.write);
+    SC_ATOMIC_INIT(r->cons.read);
+    SC_ATOMIC_INIT(r->drops);
+    r->size = size;
+    r->mask = size - 1;
+    r->qid = qid;
+    return r;
+}
+
+static void FlowRingFree(TmqhFlowRing *r)
+{
+    SC_ATOMIC_DESTROY(r->prod.write);
+    SC_ATOMIC_DESTROY(r->cons.read);
+    SC_ATOMIC_DESTROY(r->drops);
+    SCFree(r->slots);
+    SCFreeAligned(r);
+}
+
+/** \brief add a ring to the list of rings read by its queue's reader */
+static void FlowRingAttach(TmqhFlowRing *r)
+{
+    TmqhFlowRingReader *rd = &flow_ring_readers[r->qid];
+
+    SCMutexLock(&flow_ring_lock);
+    TmqhFlowRing *tail = rd->rings;
+    while (tail != NULL && tail->next != NULL)
+        tail = tail->next;
+    if (tail == NULL)
+        rd->rings = r;
+    else
+        tail->next = r;
+    rd->nrings++;
+    SCMutexUnlock(&flow_ring_lock);
+}
+
+/** \internal
+ *  \brief writer side: put a packet in the ring
+ *
+ *  \retval 0 ok
+ *  \retval -1 ring full
+ */
+static inline int FlowRingPut(TmqhFlowRing *r, Packet *p)
+{
+    uint32_t w = SC_ATOMIC_GET(r->prod.write);
+
+    if (w - r->prod.read_cache == r->size) {
+        r->prod.read_cache = SC_ATOMIC_GET(r->cons.read);
+        if (w - r->prod.read_cache == r->size)
+            return -1;
+    }
+
+    r->slots[w & r->mask] = p;
+    /* publish: full barrier, so the slot is visible before the index */
+    (void) SC_ATOMIC_ADD(r->prod.write, 1);
+    return 0;
+}
+
+/** \internal
+ *  \brief reader side: get the next packet from the ring
+ *
+ *  Slots are handed back to the writer by FlowRingRelease, so that
+ *  the shared read index is only written once per batch.
+ *
+ *  \retval p packet or NULL if the ring is empty
+ */
+static inline Packet *FlowRingGet(TmqhFlowRing *r)
+{
+    uint32_t rd = SC_ATOMIC_GET(r->cons.read) + r->cons.taken;
+
+    if (rd == r->cons.write_cache) {
+        r->cons.write_cache = SC_ATOMIC_GET(r->prod.write);
+        if (rd == r->cons.write_cache)
+            return NULL;
+    }
+
+    Packet *p = r->slots[rd & r->mask];
+    r->cons.taken++;
+    return p;
+}
+
+/** \internal
+ *  \brief reader side: give the slots taken so far back to the writer */
+static inline void FlowRingRelease(TmqhFlowRing *r)
+{
+    if (r->cons.taken > 0) {
+        (void) SC_ATOMIC_ADD(r->cons.read, r->cons.taken);
+        r->cons.taken = 0;
+    }
+}
+
+static inline uint32_t FlowRingPendingCount(TmqhFlowRing *r)
+{
+    return SC_ATOMIC_GET(r->prod.write) - SC_ATOMIC_GET(r->cons.read);
+}
+
+/**
+ * \brief get the number of packets in the rings feeding a queue
+ *
+ * Used to wait for the rings to be drained at shutdown. Packets the
+ * reader took but didn't release yet are counted as well.
+ *
+ * \param qid queue id
+ *
+ * \retval pending number of packets
+ */
+uint32_t TmqhFlowRingPending(uint16_t qid)
+{
+    uint32_t pending = 0;
+    TmqhFlowRing *r;
+
+    for (r = flow_ring_readers[qid].rings; r != NULL; r = r->next) {
+        pending += FlowRingPendingCount(r);
+    }
+    return pending;
+}
+
+/** \internal
+ *  \brief update the reader's ring depth and drop counters */
+static void FlowRingReaderUpdateCounters(TmqhFlowRingReader *rd)
+{
+    uint64_t depth = 0, drops = 0;
+    TmqhFlowRing *r;
+
+    if (rd->tv == NULL || rd->tv->sc_perf_pca == NULL)
+        return;
+
+    for (r = rd->rings; r != NULL; r = r->next) {
+        depth += FlowRingPendingCount(r);
+        drops += SC_ATOMIC_GET(r->drops);
+    }
+    SCPerfCounterSetUI64(rd->depth_id, rd->tv->sc_perf_pca, depth);
+    SCPerfCounterSetUI64(rd->drops_id, rd->tv->sc_perf_pca, drops);
+}
+
+/** \internal
+ *  \brief get the next packet from the rings of a reader
+ *
+ *  Rings are served round robin, up to FLOW_RING_BATCH packets at a time.
+ */
+static Packet *FlowRingReaderGet(TmqhFlowRingReader *rd)
+{
+    TmqhFlowRing *r = rd->cur ? rd->cur : rd->rings;
+    int i;
+
+    if (r == NULL)
+        return NULL;
+
+    /* one extra round so a single ring is retried after a full batch */
+    for (i = 0; i <= rd->nrings; i++) {
+        if (r->cons.taken < FLOW_RING_BATCH) {
+            Packet *p = FlowRingGet(r);
+            if (p != NULL) {
+                rd->cur = r;
+                return p;
+            }
+        }
+        FlowRingRelease(r);
+
+        r = r->next;
+        if (r == NULL) {
+            r = rd->rings;
+            FlowRingReaderUpdateCounters(rd);
+        }
+    }
+
+    rd->cur = r;
+    return NULL;
+}
+
+/** \internal
+ *  \brief wake up the reader of queue 'qid' if it went to sleep */
+static inline void FlowRingWakeReader(uint16_t qid)
+{
+    if (SC_ATOMIC_GET(flow_ring_readers[qid].sleeping) != 0) {
+        PacketQueue *q = &trans_q[qid];
+
+        SCMutexLock(&q->mutex_q);
+        SCCondSignal(&q->cond_q);
+        SCMutexUnlock(&q->mutex_q);
+    }
+}
+
+/** \internal
+ *  \brief pass a packet on to a reader through its ring
+ *
+ *  If the ring is full we drop the packet in IDS mode. In IPS mode
+ *  we wait for the reader to make room, as the packet would otherwise
+ *  never get a verdict.
+ */
+static void FlowRingEnqueue(ThreadVars *tv, TmqhFlowRing *r, Packet *p)
+{
+    while (FlowRingPut(r, p) != 0) {
+        if (!EngineModeIsIPS() || TmThreadsCheckFlag(tv, THV_KILL)) {
+            (void) SC_ATOMIC_ADD(r->drops, 1);
+            TmqhOutputPacketpool(tv, p);
+            return;
+        }
+        FlowRingWakeReader(r->qid);
+        sched_yield();
+    }
+
+    FlowRingWakeReader(r->qid);
+}
+
+/**
+ * \brief in handler for the flow ring queues
+ *
+ * Pseudo packets are still passed on through the regular queue, so
+ * that is checked first. Then the rings are polled. If they stay empty
+ * we spin, then yield and finally sleep on the queue condition.
+ */
+Packet *TmqhInputFlowRing(ThreadVars *tv)
+{
+    PacketQueue *q = &trans_q[tv->inq->id];
+    TmqhFlowRingReader *rd = &flow_ring_readers[tv->inq->id];
+    Packet *p = NULL;
+    uint32_t loops = 0;
+
+    SCPerfSyncCountersIfSignalled(tv);
+
+    while (1) {
+        if (q->len > 0) {
+            SCMutexLock(&q->mutex_q);
+            if (q->len > 0)
+                p = PacketDequeue(q);
+            SCMutexUnlock(&q->mutex_q);
+            if (p != NULL)
+                return p;
+        }
+
+        p = FlowRingReaderGet(rd);
+        if (p != NULL)
+            return p;
+
+        loops++;
+        if (loops < FLOW_RING_SPIN_LOOPS) {
+            cc_barrier();
+        } else if (loops < FLOW_RING_SPIN_LOOPS + FLOW_RING_YIELD_LOOPS) {
+            sched_yield();
+        } else {
+            break;
+        }
+    }
+
+    SCMutexLock(&q->mutex_q);
+    (void) SC_ATOMIC_SET(rd->sleeping, 1);
+    /* the writer checks 'sleeping' after publishing, so either it sees
+     * the flag or we see its packet here */
+    if (q->len == 0 && TmqhFlowRingPending(tv->inq->id) == 0) {
+        SCCondWait(&q->cond_q, &q->mutex_q);
+    }
+    (void) SC_ATOMIC_SET(rd->sleeping, 0);
+    SCMutexUnlock(&q->mutex_q);
+
+    /* return NULL so the caller gets to check the thread flags */
+    return NULL;
+}
+
+/**
+ * \brief register the reader thread of a flow ring queue
+ *
+ * Rings are single consumer, so only one reader per queue is allowed.
+ *
+ * \retval 0 ok
+ * \retval -1 error
+ */
+int TmqhInputFlowRingThreadInit(ThreadVars *tv)
+{
+    if (tv->inq == NULL)
+        return -1;
+
+    TmqhFlowRingReader *rd = &flow_ring_readers[tv->inq->id];
+    if (rd->tv != NULL) {
+        SCLogError(SC_ERR_THREAD_QUEUE, "queue \"%s\" already has a reader, "
+                "the \"flow-ring\" handler supports only one", tv->inq->name);
+        return -1;
+    }
+    rd->tv = tv;
+
+    rd->depth_id = SCPerfTVRegisterCounter("autofp.ring_depth", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    rd->drops_id = SCPerfTVRegisterCounter("autofp.ring_drops", tv,
+            SC_PERF_TYPE_UINT64, "NULL");
+    return 0;
+}
+
+/**
+ * \brief free all flow rings
+ *
+ * Rings are shared between a writer and a reader thread, so they can only
+ * be freed once both are gone.
+ */
+void TmqhFlowRingCleanup(void)
+{
+    int i;
+
+    SCMutexLock(&flow_ring_lock);
+    for (i = 0; i < 256; i++) {
+        TmqhFlowRingReader *rd = &flow_ring_readers[i];
+        TmqhFlowRing *r = rd->rings;
+        while (r != NULL) {
+            TmqhFlowRing *next = r->next;
+            FlowRingFree(r);
+            r = next;
+        }
+        rd->rings = NULL;
+        rd->cur = NULL;
+        rd->nrings = 0;
+        rd->tv = NULL;
+        SC_ATOMIC_RESET(rd->sleeping);
+    }
+    SCMutexUnlock(&flow_ring_lock);
+}
+
 static int StoreQueueId(TmqhFlowCtx *ctx, char *name)
 {
     void *ptmp;
@@ -139,6 +534,7 @@ static int StoreQueueId(TmqhFlowCtx *ctx, char *name)
     ctx->queues[ctx->size - 1].q = &trans_q[id];
     SC_ATOMIC_INIT(ctx->queues[ctx->size - 1].total_packets);
     SC_ATOMIC_INIT(ctx->queues[ctx->size - 1].total_flows);
+    SC_ATOMIC_INIT(ctx->queues[ctx->size - 1].total_moved);
 
     return 0;
 }
@@ -191,6 +587,12 @@ void *TmqhOutputFlowSetupCtx(char *queue_str)
 
     SC_ATOMIC_INIT(ctx->round_robin_idx);
 
+    intmax_t threshold = 0;
+    if (ConfGetInt("autofp-rebalance-threshold", &threshold) != 1 ||
+        threshold <= 0 || threshold > UINT32_MAX)
+        threshold = FLOW_REBALANCE_THRESHOLD_DEFAULT;
+    ctx->rebalance_threshold = (uint32_t)threshold;
+
     SCFree(str);
     return (void *)ctx;
 
@@ -201,6 +603,67 @@ error:
     return NULL;
 }
 
+/** \internal
+ *  \brief get the ring size from the autofp-ring-size setting
+ *
+ *  Defaults to max-pending-packets, which is what a writer thread can
+ *  have in flight, so that the ring never fills up.
+ */
+static uint32_t FlowRingGetSize(void)
+{
+    extern intmax_t max_pending_packets;
+    intmax_t value = 0;
+    uint32_t size = 1;
+
+    if (ConfGetInt("autofp-ring-size", &value) != 1 || value <= 0)
+        value = max_pending_packets;
+    if (value > FLOW_RING_MAX_SIZE) {
+        SCLogWarning(SC_ERR_INVALID_VALUE, "autofp-ring-size %"PRIdMAX" too "
+                "big, using %u", value, FLOW_RING_MAX_SIZE);
+        value = FLOW_RING_MAX_SIZE;
+    }
+
+    while (size < value)
+        size <<= 1;
+    return size;
+}
+
+/**
+ * \brief setup the flow ring queue handlers ctx
+ *
+ * Same as TmqhOutputFlowSetupCtx, but also creates a ring for each
+ * output queue.
+ *
+ * \param queue_str comma separated string with output queue names
+ *
+ * \retval ctx queues handlers ctx or NULL in error
+ */
+void *TmqhOutputFlowRingSetupCtx(char *queue_str)
+{
+    int i;
+    uint32_t size = FlowRingGetSize();
+
+    TmqhFlowCtx *ctx = TmqhOutputFlowSetupCtx(queue_str);
+    if (ctx == NULL)
+        return NULL;
+
+    for (i = 0; i < ctx->size; i++) {
+        uint16_t qid = (uint16_t)(ctx->queues[i].q - trans_q);
+
+        TmqhFlowRing *r = FlowRingAlloc(size, qid);
+        if (r == NULL) {
+            SCFree(ctx->queues);
+            SCFree(ctx);
+            return NULL;
+        }
+        FlowRingAttach(r);
+        ctx->queues[i].ring = r;
+    }
+
+    SCLogDebug("%u rings of %u packets", ctx->size, size);
+    return (void *)ctx;
+}
+
 void TmqhOutputFlowFreeCtx(void *ctx)
 {
     int i;
@@ -209,11 +672,25 @@ void TmqhOutputFlowFreeCtx(void *ctx)
     SCLogInfo("AutoFP - Total flow handler queues - %" PRIu16,
               fctx->size);
     for (i = 0; i < fctx->size; i++) {
-        SCLogInfo("AutoFP - Queue %-2"PRIu32 " - pkts: %-12"PRIu64" flows: %-12"PRIu64, i,
-                SC_ATOMIC_GET(fctx->queues[i].total_packets),
-                SC_ATOMIC_GET(fctx->queues[i].total_flows));
+        if (fctx->queues[i].ring != NULL) {
+            /* the ring itself is freed by TmqhFlowRingCleanup, as the
+             * reader may still be polling it */
+            SCLogInfo("AutoFP - Queue %-2"PRIu32 " - pkts: %-12"PRIu64" flows: %-12"PRIu64
+                    " moved: %-12"PRIu64" ring drops: %-12"PRIu64, i,
+                    SC_ATOMIC_GET(fctx->queues[i].total_packets),
+                    SC_ATOMIC_GET(fctx->queues[i].total_flows),
+                    SC_ATOMIC_GET(fctx->queues[i].total_moved),
+                    SC_ATOMIC_GET(fctx->queues[i].ring->drops));
+        } else {
+            SCLogInfo("AutoFP - Queue %-2"PRIu32 " - pkts: %-12"PRIu64" flows: %-12"PRIu64
+                    " moved: %-12"PRIu64, i,
+                    SC_ATOMIC_GET(fctx->queues[i].total_packets),
+                    SC_ATOMIC_GET(fctx->queues[i].total_flows),
+                    SC_ATOMIC_GET(fctx->queues[i].total_moved));
+        }
         SC_ATOMIC_DESTROY(fctx->queues[i].total_packets);
         SC_ATOMIC_DESTROY(fctx->queues[i].total_flows);
+        SC_ATOMIC_DESTROY(fctx->queues[i].total_moved);
     }
 
     SCFree(fctx->queues);
@@ -221,6 +698,31 @@ void TmqhOutputFlowFreeCtx(void *ctx)
     return;
 }
 
+/** \internal
+ *  \brief pass the packet on to the selected queue */
+static inline void TmqhFlowEnqueue(ThreadVars *tv, TmqhFlowMode *fm, Packet *p)
+{
+    if (fm->ring != NULL) {
+        FlowRingEnqueue(tv, fm->ring, p);
+        return;
+    }
+
+    PacketQueue *q = fm->q;
+    SCMutexLock(&q->mutex_q);
+    PacketEnqueue(q, p);
+    SCCondSignal(&q->cond_q);
+    SCMutexUnlock(&q->mutex_q);
+}
+
+/** \internal
+ *  \brief number of packets waiting for the reader of a queue */
+static inline uint32_t TmqhFlowQueueLen(TmqhFlowMode *fm)
+{
+    if (fm->ring != NULL)
+        return FlowRingPendingCount(fm->ring);
+    return fm->q->len;
+}
+
 /**
  * \brief select the queue to output in a round robin fashion.
  *
@@ -254,15 +756,34 @@ void TmqhOutputFlowRoundRobin(ThreadVars *tv, Packet *p)
     }
     (void) SC_ATOMIC_ADD(ctx->queues[qid].total_packets, 1);
 
-    PacketQueue *q = ctx->queues[qid].q;
-    SCMutexLock(&q->mutex_q);
-    PacketEnqueue(q, p);
-    SCCondSignal(&q->cond_q);
-    SCMutexUnlock(&q->mutex_q);
-
+    TmqhFlowEnqueue(tv, &ctx->queues[qid], p);
     return;
 }
 
+/** \internal
+ *  \brief get the queue with the least packets waiting
+ *
+ *  \param lowest_len if not NULL, set to the length of that queue
+ */
+static int TmqhFlowLowestQueue(TmqhFlowCtx *ctx, uint32_t *lowest_len)
+{
+    uint16_t i = 0;
+    int lowest_id = 0;
+    uint32_t lowest = TmqhFlowQueueLen(&ctx->queues[i]);
+
+    for (i = 1; i < ctx->size; i++) {
+        uint32_t len = TmqhFlowQueueLen(&ctx->queues[i]);
+        if (len < lowest) {
+            lowest = len;
+            lowest_id = i;
+        }
+    }
+
+    if (lowest_len != NULL)
+        *lowest_len = lowest;
+    return lowest_id;
+}
+
 /**
  * \brief select the queue to output to based on queue lengths.
  *
@@ -280,18 +801,8 @@ void TmqhOutputFlowActivePackets(ThreadVars *tv, Packet *p)
     if (p->flow != NULL) {
         qid = SC_ATOMIC_GET(p->flow->autofp_tmqh_flow_qid);
         if (qid == -1) {
-            uint16_t i = 0;
-            int lowest_id = 0;
-            TmqhFlowMode *queues = ctx->queues;
-            uint32_t lowest = queues[i].q->len;
-            for (i = 1; i < ctx->size; i++) {
-                if (queues[i].q->len < lowest) {
-                    lowest = queues[i].q->len;
-                    lowest_id = i;
-                }
-            }
-            qid = lowest_id;
-            (void) SC_ATOMIC_SET(p->flow->autofp_tmqh_flow_qid, lowest_id);
+            qid = TmqhFlowLowestQueue(ctx, NULL);
+            (void) SC_ATOMIC_SET(p->flow->autofp_tmqh_flow_qid, qid);
             (void) SC_ATOMIC_ADD(ctx->queues[qid].total_flows, 1);
         }
     } else {
@@ -302,12 +813,82 @@ void TmqhOutputFlowActivePackets(ThreadVars *tv, Packet *p)
     }
     (void) SC_ATOMIC_ADD(ctx->queues[qid].total_packets, 1);
 
-    PacketQueue *q = ctx->queues[qid].q;
-    SCMutexLock(&q->mutex_q);
-    PacketEnqueue(q, p);
-    SCCondSignal(&q->cond_q);
-    SCMutexUnlock(&q->mutex_q);
+    TmqhFlowEnqueue(tv, &ctx->queues[qid], p);
+    return;
+}
+
+/** \internal
+ *  \brief see if a flow should move away from its queue
+ *
+ *  A flow is moved if its queue has at least rebalance_threshold packets
+ *  more waiting than the least busy queue. The caller must hold the flow
+ *  lock and make sure the flow has no packets in flight, so moving it
+ *  can't reorder packets.
+ *
+ *  \retval qid queue the flow should use from now on
+ */
+static int TmqhFlowRebalanceQueue(TmqhFlowCtx *ctx, Flow *f, int qid)
+{
+    uint32_t len = TmqhFlowQueueLen(&ctx->queues[qid]);
+    if (len < ctx->rebalance_threshold)
+        return qid;
+
+    uint32_t lowest = 0;
+    int lowest_id = TmqhFlowLowestQueue(ctx, &lowest);
+    if (len - lowest < ctx->rebalance_threshold)
+        return qid;
+
+    (void) SC_ATOMIC_SET(f->autofp_tmqh_flow_qid, lowest_id);
+    (void) SC_ATOMIC_ADD(ctx->queues[qid].total_moved, 1);
+    (void) SC_ATOMIC_ADD(ctx->queues[lowest_id].total_flows, 1);
+    return lowest_id;
+}
+
+/**
+ * \brief select the queue to output to based on queue lengths, moving
+ *        flows away from busy queues.
+ *
+ * New flows are assigned like with active packets. A flow that is already
+ * assigned can move to another queue when its queue is busy, but only at
+ * a point where none of its packets are in flight: the packet we're handling
+ * holds the only reference to the flow. This way a few elephant flows that
+ * landed on the same queue get spread out over time.
+ *
+ * The queue is read, checked and changed under the flow lock. A packet from
+ * another capture thread takes its flow reference before it gets here, so
+ * it either keeps the flow from moving or it reads the new queue.
+ *
+ * \param tv thread vars
+ * \param p packet
+ */
+void TmqhOutputFlowRebalance(ThreadVars *tv, Packet *p)
+{
+    int32_t qid = 0;
+
+    TmqhFlowCtx *ctx = (TmqhFlowCtx *)tv->outctx;
 
+    /* if no flow we use the first queue,
+     * should be rare */
+    if (p->flow != NULL) {
+        FLOWLOCK_WRLOCK(p->flow);
+        qid = SC_ATOMIC_GET(p->flow->autofp_tmqh_flow_qid);
+        if (qid == -1) {
+            qid = TmqhFlowLowestQueue(ctx, NULL);
+            (void) SC_ATOMIC_SET(p->flow->autofp_tmqh_flow_qid, qid);
+            (void) SC_ATOMIC_ADD(ctx->queues[qid].total_flows, 1);
+        } else if (SC_ATOMIC_GET(p->flow->use_cnt) == 1) {
+            qid = TmqhFlowRebalanceQueue(ctx, p->flow, qid);
+        }
+        FLOWLOCK_UNLOCK(p->flow);
+    } else {
+        qid = ctx->last++;
+
+        if (ctx->last == ctx->size)
+            ctx->last = 0;
+    }
+    (void) SC_ATOMIC_ADD(ctx->queues[qid].total_packets, 1);
+
+    TmqhFlowEnqueue(tv, &ctx->queues[qid], p);
     return;
 }
 
@@ -349,12 +930,7 @@ void TmqhOutputFlowHash(ThreadVars *tv, Packet *p)
     }
     (void) SC_ATOMIC_ADD(ctx->queues[qid].total_packets, 1);
 
-    PacketQueue *q = ctx->queues[qid].q;
-    SCMutexLock(&q->mutex_q);
-    PacketEnqueue(q, p);
-    SCCondSignal(&q->cond_q);
-    SCMutexUnlock(&q->mutex_q);
-
+    TmqhFlowEnqueue(tv, &ctx->queues[qid], p);
     return;
 }
 
@@ -496,6 +1072,290 @@ end:
     return retval;
 }
 
+/** \test ring FIFO order, wrap around and batched release */
+static int TmqhFlowRingTest01(void)
+{
+    int retval = 0;
+    uint32_t i, n = 0, out = 0;
+
+    TmqhFlowRing *r = FlowRingAlloc(4, 0);
+    if (r == NULL)
+        goto end;
+
+    for (i = 0; i < 10; i++) {
+        uint32_t j;
+        for (j = 0; j < 3; j++) {
+            if (FlowRingPut(r, (Packet *)(uintptr_t)(++n)) != 0)
+                goto end;
+        }
+        if (FlowRingPendingCount(r) != 3)
+            goto end;
+        for (j = 0; j < 3; j++) {
+            Packet *p = FlowRingGet(r);
+            if (p != (Packet *)(uintptr_t)(++out))
+                goto end;
+        }
+        if (FlowRingGet(r) != NULL)
+            goto end;
+        /* taken packets are pending until released */
+        if (FlowRingPendingCount(r) != 3)
+            goto end;
+        FlowRingRelease(r);
+        if (FlowRingPendingCount(r) != 0)
+            goto end;
+    }
+
+    retval = 1;
+end:
+    if (r != NULL)
+        FlowRingFree(r);
+    return retval;
+}
+
+/** \test full ring */
+static int TmqhFlowRingTest02(void)
+{
+    int retval = 0;
+    uint32_t i;
+
+    TmqhFlowRing *r = FlowRingAlloc(4, 0);
+    if (r == NULL)
+        goto end;
+
+    for (i = 1; i <= 4; i++) {
+        if (FlowRingPut(r, (Packet *)(uintptr_t)i) != 0)
+            goto end;
+    }
+    if (FlowRingPut(r, (Packet *)(uintptr_t)5) != -1)
+        goto end;
+
+    /* a taken slot is only free for the writer after the release */
+    if (FlowRingGet(r) != (Packet *)(uintptr_t)1)
+        goto end;
+    if (FlowRingPut(r, (Packet *)(uintptr_t)5) != -1)
+        goto end;
+    FlowRingRelease(r);
+    if (FlowRingPut(r, (Packet *)(uintptr_t)5) != 0)
+        goto end;
+
+    for (i = 2; i <= 5; i++) {
+        if (FlowRingGet(r) != (Packet *)(uintptr_t)i)
+            goto end;
+    }
+    if (FlowRingGet(r) != NULL)
+        goto end;
+
+    retval = 1;
+end:
+    if (r != NULL)
+        FlowRingFree(r);
+    return retval;
+}
+
+/** \test ring ctx setup and a reader serving two writers */
+static int TmqhOutputFlowRingSetupCtxTest01(void)
+{
+    int retval = 0;
+    TmqhFlowCtx *fctx1 = NULL, *fctx2 = NULL;
+    uint32_t i;
+
+    TmqResetQueues();
+    TmqhFlowRingCleanup();
+
+    fctx1 = (TmqhFlowCtx *)TmqhOutputFlowRingSetupCtx("queue1,queue2");
+    if (fctx1 == NULL)
+        goto end;
+    fctx2 = (TmqhFlowCtx *)TmqhOutputFlowRingSetupCtx("queue1,queue2");
+    if (fctx2 == NULL)
+        goto end;
+
+    if (fctx1->size != 2 || fctx2->size != 2)
+        goto end;
+    if (fctx1->queues[0].ring == NULL || fctx1->queues[1].ring == NULL)
+        goto end;
+    if (fctx1->queues[1].ring->qid != 1 || fctx2->queues[1].ring->qid != 1)
+        goto end;
+
+    TmqhFlowRingReader *rd = &flow_ring_readers[0];
+    if (rd->nrings != 2 || rd->rings != fctx1->queues[0].ring ||
+        rd->rings->next != fctx2->queues[0].ring)
+        goto end;
+
+    /* 2 full batches from writer 1, 1 from writer 2 */
+    for (i = 0; i < FLOW_RING_BATCH * 2; i++) {
+        if (FlowRingPut(fctx1->queues[0].ring, (Packet *)(uintptr_t)1) != 0)
+            goto end;
+    }
+    for (i = 0; i < FLOW_RING_BATCH; i++) {
+        if (FlowRingPut(fctx2->queues[0].ring, (Packet *)(uintptr_t)2) != 0)
+            goto end;
+    }
+    if (TmqhFlowRingPending(0) != FLOW_RING_BATCH * 3 || TmqhFlowRingPending(1) != 0)
+        goto end;
+
+    /* the reader alternates between the writers per batch */
+    uintptr_t expect[] = { 1, 2, 1 };
+    for (i = 0; i < FLOW_RING_BATCH * 3; i++) {
+        Packet *p = FlowRingReaderGet(rd);
+        if (p != (Packet *)expect[i / FLOW_RING_BATCH])
+            goto end;
+    }
+    if (FlowRingReaderGet(rd) != NULL)
+        goto end;
+    if (TmqhFlowRingPending(0) != 0)
+        goto end;
+
+    retval = 1;
+end:
+    if (fctx1 != NULL)
+        TmqhOutputFlowFreeCtx(fctx1);
+    if (fctx2 != NULL)
+        TmqhOutputFlowFreeCtx(fctx2);
+    TmqhFlowRingCleanup();
+    TmqResetQueues();
+    return retval;
+}
+
+#define SIM_QUEUES      4
+#define SIM_MICE        6
+#define SIM_PACKETS     512
+
+/** \internal
+ *  \brief simulate a skewed flow distribution
+ *
+ *  Two bursty elephant flows start out on queue 0, six mice send a
+ *  packet every other step. Each queue processes 2 packets per step,
+ *  so queue 0 can't keep up with both elephants.
+ *
+ *  \param OutHandler scheduler to use
+ *  \param ctx set to the flow handler ctx, caller frees it
+ *  \param e0,e1 set to the elephants' queues at the end
+ *  \param qlen set to the queue lengths at the end
+ */
+static int TmqhFlowSimulateSkew(void (*OutHandler)(ThreadVars *, Packet *),
+        TmqhFlowCtx **ctx, int *e0, int *e1, uint32_t *qlen)
+{
+    ThreadVars tv;
+    Flow flows[2 + SIM_MICE];
+    Packet *free_list[SIM_PACKETS];
+    int nfree = 0;
+    int retval = 0;
+    int i, step, q;
+
+    memset(&tv, 0x00, sizeof(tv));
+    memset(&flows, 0x00, sizeof(flows));
+
+    TmqResetQueues();
+    *ctx = TmqhOutputFlowSetupCtx("queue1,queue2,queue3,queue4");
+    if (*ctx == NULL)
+        return 0;
+    (*ctx)->rebalance_threshold = 8;
+    tv.outctx = *ctx;
+
+    for (i = 0; i < SIM_PACKETS; i++) {
+        Packet *p = PacketGetFromAlloc();
+        if (p == NULL)
+            goto end;
+        free_list[nfree++] = p;
+    }
+    for (i = 0; i < 2 + SIM_MICE; i++) {
+        FLOW_INITIALIZE(&flows[i]);
+    }
+    /* elephants were both assigned to queue 0 at first sight */
+    (void) SC_ATOMIC_SET(flows[0].autofp_tmqh_flow_qid, 0);
+    (void) SC_ATOMIC_SET(flows[1].autofp_tmqh_flow_qid, 0);
+
+    for (step = 0; step < 200; step++) {
+        for (i = 0; i < 2 + SIM_MICE; i++) {
+            int n = 0;
+            if (i == 0 && step % 8 == 0)
+                n = 12;
+            else if (i == 1 && step % 8 == 4)
+                n = 12;
+            else if (i >= 2 && step % 2 == 0)
+                n = 1;
+
+            while (n-- > 0) {
+                if (nfree == 0)
+                    goto end;
+                Packet *p = free_list[--nfree];
+                FlowReference(&p->flow, &flows[i]);
+                OutHandler(&tv, p);
+            }
+        }
+
+        for (q = 0; q < SIM_QUEUES; q++) {
+            PacketQueue *pq = &trans_q[q];
+            for (i = 0; i < 2 && pq->len > 0; i++) {
+                Packet *p = PacketDequeue(pq);
+                FlowDeReference(&p->flow);
+                free_list[nfree++] = p;
+            }
+        }
+    }
+
+    *e0 = SC_ATOMIC_GET(flows[0].autofp_tmqh_flow_qid);
+    *e1 = SC_ATOMIC_GET(flows[1].autofp_tmqh_flow_qid);
+    for (q = 0; q < SIM_QUEUES; q++) {
+        qlen[q] = trans_q[q].len;
+    }
+    retval = 1;
+end:
+    for (q = 0; q < SIM_QUEUES; q++) {
+        while (trans_q[q].len > 0) {
+            Packet *p = PacketDequeue(&trans_q[q]);
+            FlowDeReference(&p->flow);
+            free_list[nfree++] = p;
+        }
+    }
+    for (i = 0; i < nfree; i++) {
+        PacketFree(free_list[i]);
+    }
+    for (i = 0; i < 2 + SIM_MICE; i++) {
+        FLOW_DESTROY(&flows[i]);
+    }
+    TmqResetQueues();
+    return retval;
+}
+
+/** \test pinned elephants overload a queue with active packets, the
+ *        rebalance scheduler spreads them out */
+static int TmqhOutputFlowRebalanceTest01(void)
+{
+    int retval = 0;
+    TmqhFlowCtx *fctx = NULL;
+    int e0 = -1, e1 = -1;
+    uint32_t qlen[SIM_QUEUES];
+    int q;
+
+    if (TmqhFlowSimulateSkew(TmqhOutputFlowActivePackets, &fctx, &e0, &e1, qlen) == 0)
+        goto end;
+    /* elephants stay pinned and queue 0 keeps growing */
+    if (e0 != 0 || e1 != 0 || qlen[0] < 100)
+        goto end;
+    if (SC_ATOMIC_GET(fctx->queues[0].total_moved) != 0)
+        goto end;
+    TmqhOutputFlowFreeCtx(fctx);
+    fctx = NULL;
+
+    if (TmqhFlowSimulateSkew(TmqhOutputFlowRebalance, &fctx, &e0, &e1, qlen) == 0)
+        goto end;
+    if (e0 == e1)
+        goto end;
+    if (SC_ATOMIC_GET(fctx->queues[0].total_moved) == 0)
+        goto end;
+    for (q = 0; q < SIM_QUEUES; q++) {
+        if (qlen[q] >= 32)
+            goto end;
+    }
+
+    retval = 1;
+end:
+    if (fctx != NULL)
+        TmqhOutputFlowFreeCtx(fctx);
+    return retval;
+}
+
 #endif /* UNITTESTS */
 
 void TmqhFlowRegisterTests(void)
@@ -504,6 +1364,10 @@ void TmqhFlowRegisterTests(void)
     UtRegisterTest("TmqhOutputFlowSetupCtxTest01", TmqhOutputFlowSetupCtxTest01, 1);
     UtRegisterTest("TmqhOutputFlowSetupCtxTest02", TmqhOutputFlowSetupCtxTest02, 1);
     UtRegisterTest("TmqhOutputFlowSetupCtxTest03", TmqhOutputFlowSetupCtxTest03, 1);
+    UtRegisterTest("TmqhFlowRingTest01", TmqhFlowRingTest01, 1);
+    UtRegisterTest("TmqhFlowRingTest02", TmqhFlowRingTest02, 1);
+    UtRegisterTest("TmqhOutputFlowRingSetupCtxTest01", TmqhOutputFlowRingSetupCtxTest01, 1);
+    UtRegisterTest("TmqhOutputFlowRebalanceTest01", TmqhOutputFlowRebalanceTest01, 1);
 #endif
 
     return;
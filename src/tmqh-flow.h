@@ -24,10 +24,46 @@
 #ifndef __TMQH_FLOW_H__
 #define __TMQH_FLOW_H__
 
+/** \brief single producer, single consumer packet ring connecting one
+ *         flow handler writer thread to one reader queue.
+ *
+ *  Producer and consumer state live on their own cache lines. Both sides
+ *  cache the other side's index so they only touch the shared line when
+ *  the cached value says the ring is full or empty. */
+typedef struct TmqhFlowRing_ {
+    /** producer side, only written by the writer thread */
+    struct {
+        SC_ATOMIC_DECLARE(uint32_t, write);
+        uint32_t read_cache;        /**< last read index seen by writer */
+    } __attribute__((aligned(CLS))) prod;
+
+    /** consumer side, only written by the reader thread */
+    struct {
+        SC_ATOMIC_DECLARE(uint32_t, read);
+        uint32_t write_cache;       /**< last write index seen by reader */
+        uint32_t taken;             /**< dequeued, not yet released */
+    } __attribute__((aligned(CLS))) cons;
+
+    /** packets dropped because the ring was full */
+    SC_ATOMIC_DECLARE(uint64_t, drops);
+
+    uint32_t size;                  /**< number of slots, power of 2 */
+    uint32_t mask;
+    uint16_t qid;                   /**< reader queue id */
+
+    Packet **slots;
+
+    /** next ring feeding the same reader queue */
+    struct TmqhFlowRing_ *next;
+} TmqhFlowRing;
+
 typedef struct TmqhFlowMode_ {
     PacketQueue *q;
+    TmqhFlowRing *ring;     /**< set for the "flow-ring" handler */
     SC_ATOMIC_DECLARE(uint64_t, total_packets);
     SC_ATOMIC_DECLARE(uint64_t, total_flows);
+    /** flows moved away from this queue by the rebalance scheduler */
+    SC_ATOMIC_DECLARE(uint64_t, total_moved);
 } TmqhFlowMode;
 
 /** \brief Ctx for the flow queue handler
@@ -37,6 +73,10 @@ typedef struct TmqhFlowCtx_ {
     uint16_t size;
     uint16_t last;
 
+    /** queue length difference that makes the rebalance scheduler
+     *  move a flow */
+    uint32_t rebalance_threshold;
+
     TmqhFlowMode *queues;
 
     SC_ATOMIC_DECLARE(uint16_t, round_robin_idx);
@@ -45,4 +85,7 @@ typedef struct TmqhFlowCtx_ {
 void TmqhFlowRegister (void);
 void TmqhFlowRegisterTests(void);
 
+uint32_t TmqhFlowRingPending(uint16_t qid);
+void TmqhFlowRingCleanup(void);
+
 #endif /* __TMQH_FLOW_H__ */
@@ -83,6 +83,8 @@ uint32_t SCACSearch(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx,
 void SCACPrintInfo(MpmCtx *mpm_ctx);
 void SCACPrintSearchStats(MpmThreadCtx *mpm_thread_ctx);
 void SCACRegisterTests(void);
+int SCACCacheWrite(MpmCtx *mpm_ctx, FILE *fp);
+int SCACCacheMap(MpmCtx *mpm_ctx, const uint8_t *buf, uint64_t len);
 
 /* a placeholder to denote a failure transition in the goto table */
 #define SC_AC_FAIL (-1)
@@ -788,49 +790,62 @@ static inline void SCACCreateFailureTable(MpmCtx *mpm_ctx)
  * \internal
  * \brief Create the delta table.
  *
+ *        The goto table is indexed by the raw lowercased pattern bytes,
+ *        the delta table by the compressed alphabet. Uppercase letters
+ *        have no column of their own, so they are skipped here.
+ *
  * \param mpm_ctx Pointer to the mpm context.
  */
 static inline void SCACCreateDeltaTable(MpmCtx *mpm_ctx)
 {
     SCACCtx *ctx = (SCACCtx *)mpm_ctx->ctx;
+    uint16_t alphabet_size = ctx->alphabet_size;
+    uint8_t *translate_table = ctx->translate_table;
     int ascii_code = 0;
     int32_t r_state = 0;
 
     if ((ctx->state_count < 32767) || construct_both_16_and_32_state_tables) {
         ctx->state_table_u16 = SCMalloc(ctx->state_count *
-                                        sizeof(SC_AC_STATE_TYPE_U16) * 256);
+                                        sizeof(SC_AC_STATE_TYPE_U16) * alphabet_size);
         if (ctx->state_table_u16 == NULL) {
             SCLogError(SC_ERR_MEM_ALLOC, "Error allocating memory");
             exit(EXIT_FAILURE);
         }
         memset(ctx->state_table_u16, 0,
-               ctx->state_count * sizeof(SC_AC_STATE_TYPE_U16) * 256);
+               ctx->state_count * sizeof(SC_AC_STATE_TYPE_U16) * alphabet_size);
 
         mpm_ctx->memory_cnt++;
         mpm_ctx->memory_size += (ctx->state_count *
-                                 sizeof(SC_AC_STATE_TYPE_U16) * 256);
+                                 sizeof(SC_AC_STATE_TYPE_U16) * alphabet_size);
 
         StateQueue q;
         memset(&q, 0, sizeof(StateQueue));
 
         for (ascii_code = 0; ascii_code < 256; ascii_code++) {
+            if (isupper(ascii_code))
+                continue;
             SC_AC_STATE_TYPE_U16 temp_state = ctx->goto_table[0][ascii_code];
-            ctx->state_table_u16[0][ascii_code] = temp_state;
+            ctx->state_table_u16[translate_table[ascii_code]] = temp_state;
             if (temp_state != 0)
                 SCACEnqueue(&q, temp_state);
         }
 
         while (!SCACStateQueueIsEmpty(&q)) {
             r_state = SCACDequeue(&q);
+            SC_AC_STATE_TYPE_U16 *row = ctx->state_table_u16 + r_state * alphabet_size;
+            SC_AC_STATE_TYPE_U16 *fail_row = ctx->state_table_u16 +
+                ctx->failure_table[r_state] * alphabet_size;
 
             for (ascii_code = 0; ascii_code < 256; ascii_code++) {
+                if (isupper(ascii_code))
+                    continue;
+                uint8_t col = translate_table[ascii_code];
                 int32_t temp_state = ctx->goto_table[r_state][ascii_code];
                 if (temp_state != SC_AC_FAIL) {
                     SCACEnqueue(&q, temp_state);
-                    ctx->state_table_u16[r_state][ascii_code] = temp_state;
+                    row[col] = temp_state;
                 } else {
-                    ctx->state_table_u16[r_state][ascii_code] =
-                        ctx->state_table_u16[ctx->failure_table[r_state]][ascii_code];
+                    row[col] = fail_row[col];
                 }
             }
         }
@@ -841,39 +856,46 @@ static inline void SCACCreateDeltaTable(MpmCtx *mpm_ctx)
          * table, but since we have it set to hold 32 bit state values, we will create
          * a new state table here of type SC_AC_STATE_TYPE(current set to uint16_t) */
         ctx->state_table_u32 = SCMalloc(ctx->state_count *
-                                        sizeof(SC_AC_STATE_TYPE_U32) * 256);
+                                        sizeof(SC_AC_STATE_TYPE_U32) * alphabet_size);
         if (ctx->state_table_u32 == NULL) {
             SCLogError(SC_ERR_MEM_ALLOC, "Error allocating memory");
             exit(EXIT_FAILURE);
         }
         memset(ctx->state_table_u32, 0,
-               ctx->state_count * sizeof(SC_AC_STATE_TYPE_U32) * 256);
+               ctx->state_count * sizeof(SC_AC_STATE_TYPE_U32) * alphabet_size);
 
         mpm_ctx->memory_cnt++;
         mpm_ctx->memory_size += (ctx->state_count *
-                                 sizeof(SC_AC_STATE_TYPE_U32) * 256);
+                                 sizeof(SC_AC_STATE_TYPE_U32) * alphabet_size);
 
         StateQueue q;
         memset(&q, 0, sizeof(StateQueue));
 
         for (ascii_code = 0; ascii_code < 256; ascii_code++) {
+            if (isupper(ascii_code))
+                continue;
             SC_AC_STATE_TYPE_U32 temp_state = ctx->goto_table[0][ascii_code];
-            ctx->state_table_u32[0][ascii_code] = temp_state;
+            ctx->state_table_u32[translate_table[ascii_code]] = temp_state;
             if (temp_state != 0)
                 SCACEnqueue(&q, temp_state);
         }
 
         while (!SCACStateQueueIsEmpty(&q)) {
             r_state = SCACDequeue(&q);
+            SC_AC_STATE_TYPE_U32 *row = ctx->state_table_u32 + r_state * alphabet_size;
+            SC_AC_STATE_TYPE_U32 *fail_row = ctx->state_table_u32 +
+                ctx->failure_table[r_state] * alphabet_size;
 
             for (ascii_code = 0; ascii_code < 256; ascii_code++) {
+                if (isupper(ascii_code))
+                    continue;
+                uint8_t col = translate_table[ascii_code];
                 int32_t temp_state = ctx->goto_table[r_state][ascii_code];
                 if (temp_state != SC_AC_FAIL) {
                     SCACEnqueue(&q, temp_state);
-                    ctx->state_table_u32[r_state][ascii_code] = temp_state;
+                    row[col] = temp_state;
                 } else {
-                    ctx->state_table_u32[r_state][ascii_code] =
-                        ctx->state_table_u32[ctx->failure_table[r_state]][ascii_code];
+                    row[col] = fail_row[col];
                 }
             }
         }
@@ -885,27 +907,23 @@ static inline void SCACCreateDeltaTable(MpmCtx *mpm_ctx)
 static inline void SCACClubOutputStatePresenceWithDeltaTable(MpmCtx *mpm_ctx)
 {
     SCACCtx *ctx = (SCACCtx *)mpm_ctx->ctx;
-    int ascii_code = 0;
-    uint32_t state = 0;
+    uint32_t size = ctx->state_count * ctx->alphabet_size;
+    uint32_t u = 0;
     uint32_t temp_state = 0;
 
     if ((ctx->state_count < 32767) || construct_both_16_and_32_state_tables) {
-        for (state = 0; state < ctx->state_count; state++) {
-            for (ascii_code = 0; ascii_code < 256; ascii_code++) {
-                temp_state = ctx->state_table_u16[state & 0x7FFF][ascii_code];
-                if (ctx->output_table[temp_state & 0x7FFF].no_of_entries != 0)
-                    ctx->state_table_u16[state & 0x7FFF][ascii_code] |= (1 << 15);
-            }
+        for (u = 0; u < size; u++) {
+            temp_state = ctx->state_table_u16[u];
+            if (ctx->output_table[temp_state & 0x7FFF].no_of_entries != 0)
+                ctx->state_table_u16[u] |= (1 << 15);
         }
     }
 
     if (!(ctx->state_count < 32767) || construct_both_16_and_32_state_tables) {
-        for (state = 0; state < ctx->state_count; state++) {
-            for (ascii_code = 0; ascii_code < 256; ascii_code++) {
-                temp_state = ctx->state_table_u32[state & 0x00FFFFFF][ascii_code];
-                if (ctx->output_table[temp_state & 0x00FFFFFF].no_of_entries != 0)
-                    ctx->state_table_u32[state & 0x00FFFFFF][ascii_code] |= (1 << 24);
-            }
+        for (u = 0; u < size; u++) {
+            temp_state = ctx->state_table_u32[u];
+            if (ctx->output_table[temp_state & 0x00FFFFFF].no_of_entries != 0)
+                ctx->state_table_u32[u] |= (1 << 24);
         }
     }
 
@@ -953,6 +971,57 @@ static void SCACPrintDeltaTable(MpmCtx *mpm_ctx)
 }
 #endif
 
+/**
+ * \internal
+ * \brief Build the table compressing the input alphabet.
+ *
+ *        Every byte used in the (lowercased) patterns gets its own column
+ *        in the state table. All other bytes behave the same in every
+ *        state, so they share column 0. Uppercase letters use the column
+ *        of their lowercase version, which also replaces the u8_tolower()
+ *        call in the search.
+ *
+ *        The cuda kernel indexes the table with the raw byte, so for cuda
+ *        the full 256 columns are kept.
+ *
+ * \param mpm_ctx Pointer to the mpm context.
+ */
+static void SCACInitTranslateTable(MpmCtx *mpm_ctx)
+{
+    SCACCtx *ctx = (SCACCtx *)mpm_ctx->ctx;
+    uint8_t used[256];
+    uint32_t i, u;
+
+#ifdef __SC_CUDA_SUPPORT__
+    if (mpm_ctx->mpm_type == MPM_AC_CUDA) {
+        for (u = 0; u < 256; u++)
+            ctx->translate_table[u] = u8_tolower(u);
+        ctx->alphabet_size = 256;
+        return;
+    }
+#endif
+
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < mpm_ctx->pattern_cnt; i++) {
+        for (u = 0; u < ctx->parray[i]->len; u++)
+            used[ctx->parray[i]->ci[u]] = 1;
+    }
+
+    /* column 0 is for the bytes not in any pattern */
+    ctx->alphabet_size = 1;
+    for (u = 0; u < 256; u++) {
+        if (used[u])
+            ctx->translate_table[u] = ctx->alphabet_size++;
+        else
+            ctx->translate_table[u] = 0;
+    }
+    for (u = 'A'; u <= 'Z'; u++)
+        ctx->translate_table[u] = ctx->translate_table[u - 'A' + 'a'];
+
+    SCLogDebug("alphabet size %"PRIu16, ctx->alphabet_size);
+    return;
+}
+
 /**
  * \brief Process the patterns and prepare the state table.
  *
@@ -962,6 +1031,8 @@ static inline void SCACPrepareStateTable(MpmCtx *mpm_ctx)
 {
     SCACCtx *ctx = (SCACCtx *)mpm_ctx->ctx;
 
+    SCACInitTranslateTable(mpm_ctx);
+
     /* create the 0th state in the goto table and output_table */
     SCACInitNewState(mpm_ctx);
 
@@ -1206,26 +1277,28 @@ void SCACDestroyCtx(MpmCtx *mpm_ctx)
     }
 
     if (ctx->state_table_u16 != NULL) {
-        SCFree(ctx->state_table_u16);
+        if (!ctx->mapped)
+            SCFree(ctx->state_table_u16);
         ctx->state_table_u16 = NULL;
 
-        mpm_ctx->memory_cnt++;
+        mpm_ctx->memory_cnt--;
         mpm_ctx->memory_size -= (ctx->state_count *
-                                 sizeof(SC_AC_STATE_TYPE_U16) * 256);
+                                 sizeof(SC_AC_STATE_TYPE_U16) * ctx->alphabet_size);
     }
     if (ctx->state_table_u32 != NULL) {
-        SCFree(ctx->state_table_u32);
+        if (!ctx->mapped)
+            SCFree(ctx->state_table_u32);
         ctx->state_table_u32 = NULL;
 
-        mpm_ctx->memory_cnt++;
+        mpm_ctx->memory_cnt--;
         mpm_ctx->memory_size -= (ctx->state_count *
-                                 sizeof(SC_AC_STATE_TYPE_U32) * 256);
+                                 sizeof(SC_AC_STATE_TYPE_U32) * ctx->alphabet_size);
     }
 
     if (ctx->output_table != NULL) {
         uint32_t state_count;
         for (state_count = 0; state_count < ctx->state_count; state_count++) {
-            if (ctx->output_table[state_count].pids != NULL) {
+            if (ctx->output_table[state_count].pids != NULL && !ctx->mapped) {
                 SCFree(ctx->output_table[state_count].pids);
             }
         }
@@ -1235,7 +1308,7 @@ void SCACDestroyCtx(MpmCtx *mpm_ctx)
     if (ctx->pid_pat_list != NULL) {
         int i;
         for (i = 0; i < (ctx->max_pat_id + 1); i++) {
-            if (ctx->pid_pat_list[i].cs != NULL)
+            if (ctx->pid_pat_list[i].cs != NULL && !ctx->mapped)
                 SCFree(ctx->pid_pat_list[i].cs);
         }
         SCFree(ctx->pid_pat_list);
@@ -1248,6 +1321,230 @@ void SCACDestroyCtx(MpmCtx *mpm_ctx)
     return;
 }
 
+/** \brief header of a prepared ctx in the detect engine cache. It is
+ *         followed by the state table (padded to 4 bytes), the pid count
+ *         per state, the pids, the length per case sensitive pattern id
+ *         and the case sensitive pattern bytes. */
+typedef struct SCACCacheHeader_ {
+    uint32_t state_count;
+    uint32_t pids_cnt;
+    uint32_t pat_bytes;
+    uint16_t alphabet_size;
+    uint16_t max_pat_id;
+    uint8_t translate_table[256];
+} SCACCacheHeader;
+
+static inline uint64_t SCACCacheStateTableSize(const SCACCacheHeader *hdr)
+{
+    uint64_t size = (uint64_t)hdr->state_count * hdr->alphabet_size *
+        ((hdr->state_count < 32767) ? sizeof(SC_AC_STATE_TYPE_U16) :
+                                      sizeof(SC_AC_STATE_TYPE_U32));
+    return (size + 3) & ~3ULL;
+}
+
+/**
+ * \brief Write a prepared ctx to the detect engine cache.
+ *
+ * \retval 0 on success, -1 on error
+ */
+int SCACCacheWrite(MpmCtx *mpm_ctx, FILE *fp)
+{
+    SCACCtx *ctx = (SCACCtx *)mpm_ctx->ctx;
+    SCACCacheHeader hdr;
+    uint32_t u;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (ctx == NULL)
+        return -1;
+
+    /* nothing was prepared for an empty ctx */
+    if (ctx->state_count == 0 || ctx->output_table == NULL) {
+        if (mpm_ctx->pattern_cnt != 0)
+            return -1;
+        return (fwrite(&hdr, sizeof(hdr), 1, fp) == 1) ? 0 : -1;
+    }
+
+    hdr.state_count = ctx->state_count;
+    hdr.alphabet_size = ctx->alphabet_size;
+    hdr.max_pat_id = ctx->max_pat_id;
+    memcpy(hdr.translate_table, ctx->translate_table, sizeof(hdr.translate_table));
+    for (u = 0; u < ctx->state_count; u++)
+        hdr.pids_cnt += ctx->output_table[u].no_of_entries;
+    for (u = 0; u < (uint32_t)ctx->max_pat_id + 1; u++)
+        hdr.pat_bytes += ctx->pid_pat_list[u].cs ? ctx->pid_pat_list[u].patlen : 0;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return -1;
+
+    uint64_t size = SCACCacheStateTableSize(&hdr);
+    const void *table = (ctx->state_count < 32767) ?
+        (void *)ctx->state_table_u16 : (void *)ctx->state_table_u32;
+    if (table == NULL)
+        return -1;
+    uint64_t table_size = (uint64_t)ctx->state_count * ctx->alphabet_size *
+        ((ctx->state_count < 32767) ? sizeof(SC_AC_STATE_TYPE_U16) :
+                                      sizeof(SC_AC_STATE_TYPE_U32));
+    if (fwrite(table, 1, table_size, fp) != table_size)
+        return -1;
+    for ( ; table_size < size; table_size++) {
+        if (fputc(0, fp) == EOF)
+            return -1;
+    }
+
+    for (u = 0; u < ctx->state_count; u++) {
+        if (fwrite(&ctx->output_table[u].no_of_entries, sizeof(uint32_t), 1, fp) != 1)
+            return -1;
+    }
+    for (u = 0; u < ctx->state_count; u++) {
+        uint32_t cnt = ctx->output_table[u].no_of_entries;
+        if (cnt && fwrite(ctx->output_table[u].pids, sizeof(uint32_t), cnt, fp) != cnt)
+            return -1;
+    }
+    for (u = 0; u < (uint32_t)ctx->max_pat_id + 1; u++) {
+        uint32_t patlen = ctx->pid_pat_list[u].cs ? ctx->pid_pat_list[u].patlen : 0;
+        if (fwrite(&patlen, sizeof(uint32_t), 1, fp) != 1)
+            return -1;
+    }
+    for (u = 0; u < (uint32_t)ctx->max_pat_id + 1; u++) {
+        if (ctx->pid_pat_list[u].cs == NULL)
+            continue;
+        if (fwrite(ctx->pid_pat_list[u].cs, 1, ctx->pid_pat_list[u].patlen, fp) !=
+                ctx->pid_pat_list[u].patlen)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Use a block written by SCACCacheWrite() instead of preparing
+ *        the ctx. The block is checked before the ctx is touched, so on
+ *        failure the ctx can still be prepared the normal way.
+ *
+ * \param buf 4 byte aligned block, stays valid as long as the ctx lives.
+ *
+ * \retval 0 on success, -1 if the block can't be used
+ */
+int SCACCacheMap(MpmCtx *mpm_ctx, const uint8_t *buf, uint64_t len)
+{
+    SCACCtx *ctx = (SCACCtx *)mpm_ctx->ctx;
+    SCACCacheHeader hdr;
+    uint32_t u;
+
+    if (ctx == NULL || len < sizeof(hdr) || ((uintptr_t)buf & 3))
+        return -1;
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    if (hdr.state_count == 0)
+        return (mpm_ctx->pattern_cnt == 0 && len == sizeof(hdr)) ? 0 : -1;
+    if (mpm_ctx->pattern_cnt == 0 || ctx->init_hash == NULL ||
+        hdr.max_pat_id != ctx->max_pat_id || hdr.alphabet_size == 0 ||
+        hdr.alphabet_size > 256 || hdr.state_count > 0x00FFFFFF)
+        return -1;
+
+    uint64_t table_size = SCACCacheStateTableSize(&hdr);
+    uint64_t pats = (uint64_t)hdr.max_pat_id + 1;
+    if (len != sizeof(hdr) + table_size + (uint64_t)hdr.state_count * 4 +
+               (uint64_t)hdr.pids_cnt * 4 + pats * 4 + hdr.pat_bytes)
+        return -1;
+
+    const uint8_t *table = buf + sizeof(hdr);
+    const uint32_t *counts = (const uint32_t *)(table + table_size);
+    const uint32_t *pids = counts + hdr.state_count;
+    const uint32_t *patlens = pids + hdr.pids_cnt;
+    const uint8_t *pat_bytes = (const uint8_t *)(patlens + pats);
+
+    /* a broken file must not lead to reads out of the tables */
+    uint64_t sum = 0;
+    for (u = 0; u < hdr.state_count; u++)
+        sum += counts[u];
+    if (sum != hdr.pids_cnt)
+        return -1;
+    sum = 0;
+    for (u = 0; u < pats; u++)
+        sum += patlens[u];
+    if (sum != hdr.pat_bytes)
+        return -1;
+    for (u = 0; u < hdr.pids_cnt; u++) {
+        uint32_t pid = pids[u] & 0x0000FFFF;
+        if ((pids[u] & ~0x0001FFFF) || pid > hdr.max_pat_id)
+            return -1;
+        /* case sensitive entries are confirmed against the pattern */
+        if ((pids[u] & 0x00010000) && patlens[pid] == 0)
+            return -1;
+    }
+    uint64_t entries = (uint64_t)hdr.state_count * hdr.alphabet_size;
+    uint64_t e;
+    if (hdr.state_count < 32767) {
+        const SC_AC_STATE_TYPE_U16 *t = (const SC_AC_STATE_TYPE_U16 *)table;
+        for (e = 0; e < entries; e++) {
+            if ((t[e] & 0x7FFF) >= hdr.state_count)
+                return -1;
+        }
+    } else {
+        const SC_AC_STATE_TYPE_U32 *t = (const SC_AC_STATE_TYPE_U32 *)table;
+        for (e = 0; e < entries; e++) {
+            if ((t[e] & 0x00FFFFFF) >= hdr.state_count)
+                return -1;
+        }
+    }
+    for (u = 0; u < 256; u++) {
+        if (hdr.translate_table[u] >= hdr.alphabet_size)
+            return -1;
+    }
+
+    SCACOutputTable *output_table = SCMalloc(hdr.state_count * sizeof(SCACOutputTable));
+    if (output_table == NULL)
+        return -1;
+    SCACPatternList *pid_pat_list = SCMalloc(pats * sizeof(SCACPatternList));
+    if (pid_pat_list == NULL) {
+        SCFree(output_table);
+        return -1;
+    }
+
+    for (u = 0; u < hdr.state_count; u++) {
+        output_table[u].no_of_entries = counts[u];
+        output_table[u].pids = counts[u] ? (uint32_t *)pids : NULL;
+        pids += counts[u];
+    }
+    for (u = 0; u < pats; u++) {
+        pid_pat_list[u].patlen = patlens[u];
+        pid_pat_list[u].cs = patlens[u] ? (uint8_t *)pat_bytes : NULL;
+        pat_bytes += patlens[u];
+    }
+
+    /* the block is good, drop the patterns we would have prepared */
+    for (u = 0; u < INIT_HASH_SIZE; u++) {
+        SCACPattern *node = ctx->init_hash[u], *nnode = NULL;
+        while (node != NULL) {
+            nnode = node->next;
+            SCACFreePattern(mpm_ctx, node);
+            node = nnode;
+        }
+    }
+    SCFree(ctx->init_hash);
+    ctx->init_hash = NULL;
+    mpm_ctx->memory_cnt--;
+    mpm_ctx->memory_size -= (INIT_HASH_SIZE * sizeof(SCACPattern *));
+
+    ctx->mapped = 1;
+    ctx->state_count = hdr.state_count;
+    ctx->alphabet_size = hdr.alphabet_size;
+    memcpy(ctx->translate_table, hdr.translate_table, sizeof(ctx->translate_table));
+    ctx->output_table = output_table;
+    ctx->pid_pat_list = pid_pat_list;
+    if (hdr.state_count < 32767) {
+        ctx->state_table_u16 = (SC_AC_STATE_TYPE_U16 *)table;
+        mpm_ctx->memory_size += entries * sizeof(SC_AC_STATE_TYPE_U16);
+    } else {
+        ctx->state_table_u32 = (SC_AC_STATE_TYPE_U32 *)table;
+        mpm_ctx->memory_size += entries * sizeof(SC_AC_STATE_TYPE_U32);
+    }
+    mpm_ctx->memory_cnt++;
+
+    return 0;
+}
+
 /**
  * \brief The aho corasick search function.
  *
@@ -1271,12 +1568,15 @@ uint32_t SCACSearch(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx,
      * to dig deeper */
     /* \todo Change it for stateful MPM.  Supply the state using mpm_thread_ctx */
     SCACPatternList *pid_pat_list = ctx->pid_pat_list;
+    const uint8_t *translate_table = ctx->translate_table;
+    const uint32_t alphabet_size = ctx->alphabet_size;
 
     if (ctx->state_count < 32767) {
         register SC_AC_STATE_TYPE_U16 state = 0;
-        SC_AC_STATE_TYPE_U16 (*state_table_u16)[256] = ctx->state_table_u16;
+        SC_AC_STATE_TYPE_U16 *state_table_u16 = ctx->state_table_u16;
         for (i = 0; i < buflen; i++) {
-            state = state_table_u16[state & 0x7FFF][u8_tolower(buf[i])];
+            state = state_table_u16[(state & 0x7FFF) * alphabet_size +
+                                    translate_table[buf[i]]];
             if (state & 0x8000) {
                 uint32_t no_of_entries = ctx->output_table[state & 0x7FFF].no_of_entries;
                 uint32_t *pids = ctx->output_table[state & 0x7FFF].pids;
@@ -1313,9 +1613,10 @@ uint32_t SCACSearch(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx,
 
     } else {
         register SC_AC_STATE_TYPE_U32 state = 0;
-        SC_AC_STATE_TYPE_U32 (*state_table_u32)[256] = ctx->state_table_u32;
+        SC_AC_STATE_TYPE_U32 *state_table_u32 = ctx->state_table_u32;
         for (i = 0; i < buflen; i++) {
-            state = state_table_u32[state & 0x00FFFFFF][u8_tolower(buf[i])];
+            state = state_table_u32[(state & 0x00FFFFFF) * alphabet_size +
+                                    translate_table[buf[i]]];
             if (state & 0xFF000000) {
                 uint32_t no_of_entries = ctx->output_table[state & 0x00FFFFFF].no_of_entries;
                 uint32_t *pids = ctx->output_table[state & 0x00FFFFFF].pids;
@@ -1432,6 +1733,16 @@ void SCACPrintInfo(MpmCtx *mpm_ctx)
     printf("Smallest:        %" PRIu32 "\n", mpm_ctx->minlen);
     printf("Largest:         %" PRIu32 "\n", mpm_ctx->maxlen);
     printf("Total states in the state table:    %" PRIu32 "\n", ctx->state_count);
+    if (ctx->state_count > 0) {
+        uint32_t entry_size = (ctx->state_count < 32767) ?
+            sizeof(SC_AC_STATE_TYPE_U16) : sizeof(SC_AC_STATE_TYPE_U32);
+        uint64_t full_size = (uint64_t)ctx->state_count * 256 * entry_size;
+        uint64_t size = (uint64_t)ctx->state_count * ctx->alphabet_size * entry_size;
+        printf("Alphabet size:   %" PRIu16 "\n", ctx->alphabet_size);
+        printf("State table:     %" PRIu64 " bytes\n", size);
+        printf("Saved by alphabet compression: %" PRIu64 " bytes\n",
+               full_size - size);
+    }
     printf("\n");
 
     return;
@@ -2185,6 +2496,8 @@ void MpmACRegister(void)
     mpm_table[MPM_AC].PrintCtx = SCACPrintInfo;
     mpm_table[MPM_AC].PrintThreadCtx = SCACPrintSearchStats;
     mpm_table[MPM_AC].RegisterUnittests = SCACRegisterTests;
+    mpm_table[MPM_AC].CacheWrite = SCACCacheWrite;
+    mpm_table[MPM_AC].CacheMap = SCACCacheMap;
 
     return;
 }
@@ -3244,6 +3557,49 @@ end:
     return result;
 }
 
+/** \test alphabet compression: unused bytes share a column, uppercase
+ *        input uses the lowercase column */
+static int SCACTest30(void)
+{
+    int result = 0;
+    MpmCtx mpm_ctx;
+    MpmThreadCtx mpm_thread_ctx;
+    PatternMatcherQueue pmq;
+
+    memset(&mpm_ctx, 0, sizeof(MpmCtx));
+    memset(&mpm_thread_ctx, 0, sizeof(MpmThreadCtx));
+    MpmInitCtx(&mpm_ctx, MPM_AC);
+    SCACInitThreadCtx(&mpm_ctx, &mpm_thread_ctx, 0);
+
+    MpmAddPatternCI(&mpm_ctx, (uint8_t *)"abab", 4, 0, 0, 0, 0, 0);
+    MpmAddPatternCS(&mpm_ctx, (uint8_t *)"Bc", 2, 0, 0, 1, 0, 0);
+    PmqSetup(&pmq, 2);
+
+    SCACPreparePatterns(&mpm_ctx);
+
+    SCACCtx *ctx = (SCACCtx *)mpm_ctx.ctx;
+    /* a, b, c and the shared column */
+    if (ctx->alphabet_size != 4) {
+        printf("alphabet_size %"PRIu16" != 4 ", ctx->alphabet_size);
+        goto end;
+    }
+
+    char *buf = "xABaBabc\xff" "BcbC";
+    uint32_t cnt = SCACSearch(&mpm_ctx, &mpm_thread_ctx, &pmq,
+                               (uint8_t *)buf, strlen(buf));
+    if (cnt != 3) {
+        printf("3 != %" PRIu32 " ", cnt);
+        goto end;
+    }
+
+    result = 1;
+end:
+    SCACDestroyCtx(&mpm_ctx);
+    SCACDestroyThreadCtx(&mpm_ctx, &mpm_thread_ctx);
+    PmqFree(&pmq);
+    return result;
+}
+
 #endif /* UNITTESTS */
 
 void SCACRegisterTests(void)
@@ -3279,6 +3635,7 @@ void SCACRegisterTests(void)
     UtRegisterTest("SCACTest27", SCACTest27, 1);
     UtRegisterTest("SCACTest28", SCACTest28, 1);
     UtRegisterTest("SCACTest29", SCACTest29, 1);
+    UtRegisterTest("SCACTest30", SCACTest30, 1);
 #endif
 
     return;
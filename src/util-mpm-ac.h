@@ -76,10 +76,17 @@ typedef struct SCACCtx_ {
 
     /* no of states used by ac */
     uint32_t state_count;
+    /* the all important memory hungry state_table. Each state has a row
+     * of alphabet_size entries, indexed by translate_table[byte] */
+    SC_AC_STATE_TYPE_U16 *state_table_u16;
     /* the all important memory hungry state_table */
-    SC_AC_STATE_TYPE_U16 (*state_table_u16)[256];
-    /* the all important memory hungry state_table */
-    SC_AC_STATE_TYPE_U32 (*state_table_u32)[256];
+    SC_AC_STATE_TYPE_U32 *state_table_u32;
+
+    /* maps an input byte to its column in the state table. Bytes that
+     * are not in any pattern share column 0, uppercase maps to lowercase */
+    uint8_t translate_table[256];
+    /* number of columns in the state table */
+    uint16_t alphabet_size;
 
     /* goto_table, failure table and output table.  Needed to create state_table.
      * Will be freed, once we have created the state_table */
@@ -94,6 +101,10 @@ typedef struct SCACCtx_ {
 
     uint32_t allocated_state_count;
 
+    /* state table, output pids and case sensitive patterns point into
+     * a mapped detect engine cache file */
+    uint8_t mapped;
+
 #ifdef __SC_CUDA_SUPPORT__
     CUdeviceptr state_table_u16_cuda;
     CUdeviceptr state_table_u32_cuda;
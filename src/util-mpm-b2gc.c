@@ -318,35 +318,16 @@ static uint32_t B2gcHashPatternInitHash(HashListTable *ht, void *pattern, uint16
     return hash % ht->array_size;
 }
 
-#define B2GC_SORTHASH_MODE_LL   0
-#define B2GC_SORTHASH_MODE_LU   1
-#define B2GC_SORTHASH_MODE_UL   2
-#define B2GC_SORTHASH_MODE_UU   3
-#define B2GC_SORTHASH_MODE_CS   4
-
-/* copy of ctx->m for use in B2gcHashPatternSortHash */
-static B2GC_TYPE m;
-static int b2gc_sorthash_mode = B2GC_SORTHASH_MODE_LL;
-
+/* the sort hash of a pattern depends on ctx->m and on the case variant the
+ * pattern is added for. It's computed by the caller and stored in the
+ * pattern, so preparing ctxs in parallel doesn't share any state. */
 static uint32_t B2gcHashPatternSortHash(HashListTable *ht, void *pattern, uint16_t len)
 {
     BUG_ON(len != sizeof(B2gcPattern));
     BUG_ON(pattern == NULL);
 
     B2gcPattern *p = (B2gcPattern *)pattern;
-    uint32_t hash = 0;
-    if (b2gc_sorthash_mode == B2GC_SORTHASH_MODE_LL) {
-        hash = B2GC_HASH16(u8_tolower(p->pat[m - 2]), u8_tolower(p->pat[m - 1]));
-    } else if(b2gc_sorthash_mode == B2GC_SORTHASH_MODE_LU) {
-        hash = B2GC_HASH16(u8_tolower(p->pat[m - 2]), toupper(p->pat[m - 1]));
-    } else if(b2gc_sorthash_mode == B2GC_SORTHASH_MODE_UL) {
-        hash = B2GC_HASH16(toupper(p->pat[m - 2]), u8_tolower(p->pat[m - 1]));
-    } else if (b2gc_sorthash_mode == B2GC_SORTHASH_MODE_UU) {
-        hash = B2GC_HASH16(toupper(p->pat[m - 2]), toupper(p->pat[m - 1]));
-    } else {
-        hash = B2GC_HASH16(p->pat[m - 2], p->pat[m - 1]);
-    }
-    SCReturnUInt(hash);
+    SCReturnUInt(p->sort_hash);
 }
 
 static uint32_t B2gcHashPatternSortHash1(HashListTable *ht, void *pattern, uint16_t len)
@@ -459,10 +440,12 @@ int B2gcBuildMatchArray(MpmCtx *mpm_ctx, HashListTable *b2gc_sort_hash)
     SCReturnInt(0);
 }
 
-static void B2gcAddCopyToHash(MpmCtx *mpm_ctx, HashListTable *ht, B2gcPattern *p)
+static void B2gcAddCopyToHash(MpmCtx *mpm_ctx, HashListTable *ht, B2gcPattern *p,
+        uint16_t sort_hash)
 {
     B2gcPattern *pcopy = B2gcAllocPattern(mpm_ctx);
     BUG_ON(pcopy == NULL);
+    pcopy->sort_hash = sort_hash;
     pcopy->id = p->id;
     pcopy->flags = p->flags;
     pcopy->len = p->len;
@@ -484,29 +467,26 @@ static int B2gcAddToHash(MpmCtx *mpm_ctx, HashListTable *b2gc_sort_hash, B2gcPat
     if (p->flags & MPM_PATTERN_FLAG_NOCASE) {
         /* u, u */
         uint16_t uuidx = B2GC_HASH16(toupper(p->pat[ctx->m - 2]), toupper(p->pat[ctx->m - 1]));
-        b2gc_sorthash_mode = B2GC_SORTHASH_MODE_UU;
+        p->sort_hash = uuidx;
         HashListTableAdd(b2gc_sort_hash, (void *)p, sizeof(B2gcPattern));
         added++;
 
         /* l, l */
         uint16_t llidx = B2GC_HASH16(u8_tolower(p->pat[ctx->m - 2]), u8_tolower(p->pat[ctx->m - 1]));
         if (llidx != uuidx) {
-            b2gc_sorthash_mode = B2GC_SORTHASH_MODE_LL;
-            B2gcAddCopyToHash(mpm_ctx, b2gc_sort_hash, p);
+            B2gcAddCopyToHash(mpm_ctx, b2gc_sort_hash, p, llidx);
             added++;
         }
         /* u, l */
         uint16_t ulidx = B2GC_HASH16(toupper(p->pat[ctx->m - 2]), u8_tolower(p->pat[ctx->m - 1]));
         if (ulidx != llidx && ulidx != uuidx) {
-            b2gc_sorthash_mode = B2GC_SORTHASH_MODE_UL;
-            B2gcAddCopyToHash(mpm_ctx, b2gc_sort_hash, p);
+            B2gcAddCopyToHash(mpm_ctx, b2gc_sort_hash, p, ulidx);
             added++;
         }
         /* l, u */
         uint16_t luidx = B2GC_HASH16(u8_tolower(p->pat[ctx->m - 2]), toupper(p->pat[ctx->m - 1]));
         if (luidx != ulidx && luidx != llidx && luidx != uuidx) {
-            b2gc_sorthash_mode = B2GC_SORTHASH_MODE_LU;
-            B2gcAddCopyToHash(mpm_ctx, b2gc_sort_hash, p);
+            B2gcAddCopyToHash(mpm_ctx, b2gc_sort_hash, p, luidx);
             added++;
         }
 
@@ -524,7 +504,6 @@ static void B2gcPrepareHash(MpmCtx *mpm_ctx)
 
     /* make sure ctx->m is set */
     BUG_ON(ctx->m == 0);
-    m = ctx->m;
 
     /* convert b2gc_init_hash to b2gc_sort_hash and count size */
     uint32_t size = B2GC_ALIGN_PATTERNS;
@@ -554,7 +533,6 @@ static void B2gcPrepareHash(MpmCtx *mpm_ctx)
         if (p->len > 1) {
             uint32_t psize;
             if (p->flags & MPM_PATTERN_FLAG_NOCASE) {
-                //prt(p->pat, p->len);printf(" (m %u)\n", m);
                 int added = B2gcAddToHash(mpm_ctx, b2gc_sort_hash, p);
                 SCLogDebug("nocase pattern was added under different hash values %d times", added);
 
@@ -562,7 +540,7 @@ static void B2gcPrepareHash(MpmCtx *mpm_ctx)
                 //uint32_t one = sizeof(B2gcPatternHdr) + ((p->len + (p->len % B2GC_ALIGN_PATTERNS)) * 2);
                 psize = one * added;
             } else {
-                b2gc_sorthash_mode = B2GC_SORTHASH_MODE_CS;
+                p->sort_hash = B2GC_HASH16(p->pat[ctx->m - 2], p->pat[ctx->m - 1]);
                 HashListTableAdd(b2gc_sort_hash, (void *)p, sizeof(B2gcPattern));
 
                 psize = (sizeof(B2gcPatternHdr) + p->len + (p->len % B2GC_ALIGN_PATTERNS));
@@ -608,7 +586,7 @@ static void B2gcPrepareHash(MpmCtx *mpm_ctx)
                     BUG_ON(p == NULL);
                     BUG_ON(p->len == 1);
 
-                    uint16_t hash = a;//= B2GC_HASH16(u8_tolower(p->pat[m - 2]), u8_tolower(p->pat[m - 1]));
+                    uint16_t hash = a;
                     if (ctx->pminlen[hash] == 0) {
                         ctx->pminlen[hash] = p->len;
                     } else if (p->len < ctx->pminlen[hash]) {
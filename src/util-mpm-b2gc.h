@@ -100,6 +100,8 @@ typedef struct B2gcPattern_ {
     uint8_t flags;
     uint8_t pad0;
     PatIntId id;
+    /** hash the pattern is sorted by while preparing the ctx */
+    uint16_t sort_hash;
     uint8_t *pat;
 } B2gcPattern;
 
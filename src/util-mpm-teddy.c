@@ -0,0 +1,1099 @@
+/* Copyright (C) 2014 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Teddy style multi literal MPM.
+ *
+ * The patterns are split over 8 buckets. For each of the first
+ * SC_TEDDY_MASK_LEN bytes of a pattern, the low and the high nibble of
+ * the byte set the bucket bit in a nibble lookup table. The search looks
+ * up the nibbles of 16 (SSSE3) or 32 (AVX2) buffer positions at once
+ * using pshufb and ANDs the results of the mask positions. A position
+ * with a non zero result may start a pattern and is confirmed against
+ * the patterns that share its first bytes using SCMemcmp or
+ * SCMemcmpLowercase.
+ *
+ * Patterns shorter than SC_TEDDY_MASK_LEN are matched by a byte at a time
+ * loop. Without SSSE3 the filter runs as a scalar loop over the same
+ * tables.
+ *
+ * The filter works best with a few hundred patterns at most, so this
+ * MPM is meant to be used with the "full" sgh-mpm-context.
+ */
+
+#include "suricata-common.h"
+#include "suricata.h"
+
+#include "detect.h"
+#include "detect-parse.h"
+#include "detect-engine.h"
+
+#include "conf.h"
+#include "util-debug.h"
+#include "util-unittest.h"
+#include "util-unittest-helper.h"
+#include "util-memcmp.h"
+#include "util-memcpy.h"
+#include "util-mpm-teddy.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+void SCTeddyInitCtx(MpmCtx *);
+void SCTeddyInitThreadCtx(MpmCtx *, MpmThreadCtx *, uint32_t);
+void SCTeddyDestroyCtx(MpmCtx *);
+void SCTeddyDestroyThreadCtx(MpmCtx *, MpmThreadCtx *);
+int SCTeddyAddPatternCI(MpmCtx *, uint8_t *, uint16_t, uint16_t, uint16_t,
+                        uint32_t, uint32_t, uint8_t);
+int SCTeddyAddPatternCS(MpmCtx *, uint8_t *, uint16_t, uint16_t, uint16_t,
+                        uint32_t, uint32_t, uint8_t);
+int SCTeddyPreparePatterns(MpmCtx *mpm_ctx);
+uint32_t SCTeddySearch(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx,
+                       PatternMatcherQueue *pmq, uint8_t *buf, uint16_t buflen);
+void SCTeddyPrintInfo(MpmCtx *mpm_ctx);
+void SCTeddyPrintSearchStats(MpmThreadCtx *mpm_thread_ctx);
+void SCTeddyRegisterTests(void);
+
+/* size of the hash table used to speed up pattern insertions initially */
+#define INIT_HASH_SIZE 65536
+
+/**
+ * \internal
+ * \brief Creates a hash of the pattern, used to cull duplicates at
+ *        insertion time.
+ */
+static inline uint32_t SCTeddyInitHashRaw(uint8_t *pat, uint16_t patlen)
+{
+    uint32_t hash = patlen * pat[0];
+    if (patlen > 1)
+        hash += pat[1];
+
+    return (hash % INIT_HASH_SIZE);
+}
+
+/**
+ * \internal
+ * \brief Hash of the lowercased first SC_TEDDY_MASK_LEN bytes, used to
+ *        find the patterns to confirm for a filter hit.
+ */
+static inline uint32_t SCTeddyConfirmHash(const uint8_t *buf)
+{
+    uint32_t hash = (u8_tolower(buf[0]) << 16) |
+                    (u8_tolower(buf[1]) << 8) |
+                    u8_tolower(buf[2]);
+    hash *= 2654435761U;
+    return hash >> 8;
+}
+
+static inline SCTeddyPattern *SCTeddyInitHashLookup(SCTeddyCtx *ctx, uint8_t *pat,
+                                                    uint16_t patlen, uint32_t pid)
+{
+    uint32_t hash = SCTeddyInitHashRaw(pat, patlen);
+
+    if (ctx->init_hash == NULL) {
+        return NULL;
+    }
+
+    SCTeddyPattern *t = ctx->init_hash[hash];
+    for ( ; t != NULL; t = t->next) {
+        if (t->id == pid)
+            return t;
+    }
+
+    return NULL;
+}
+
+static inline void SCTeddyFreePattern(MpmCtx *mpm_ctx, SCTeddyPattern *p)
+{
+    if (p == NULL)
+        return;
+
+    if (p->cs != NULL && p->cs != p->ci) {
+        SCFree(p->cs);
+        mpm_ctx->memory_cnt--;
+        mpm_ctx->memory_size -= p->len;
+    }
+
+    if (p->ci != NULL) {
+        SCFree(p->ci);
+        mpm_ctx->memory_cnt--;
+        mpm_ctx->memory_size -= p->len;
+    }
+
+    SCFree(p);
+    mpm_ctx->memory_cnt--;
+    mpm_ctx->memory_size -= sizeof(SCTeddyPattern);
+}
+
+/**
+ * \internal
+ * \brief Add a pattern to the teddy context.
+ *
+ * \param mpm_ctx Mpm context.
+ * \param pat     Pointer to the pattern.
+ * \param patlen  Length of the pattern.
+ * \param pid     Pattern id
+ * \param sid     Signature id (internal id).
+ * \param flags   Pattern's MPM_PATTERN_* flags.
+ *
+ * \retval  0 On success.
+ * \retval -1 On failure.
+ */
+static int SCTeddyAddPattern(MpmCtx *mpm_ctx, uint8_t *pat, uint16_t patlen,
+                             uint16_t offset, uint16_t depth, uint32_t pid,
+                             uint32_t sid, uint8_t flags)
+{
+    SCTeddyCtx *ctx = (SCTeddyCtx *)mpm_ctx->ctx;
+
+    SCLogDebug("Adding pattern for ctx %p, patlen %"PRIu16" and pid %" PRIu32,
+               ctx, patlen, pid);
+
+    if (patlen == 0) {
+        SCLogWarning(SC_ERR_INVALID_ARGUMENTS, "pattern length 0");
+        return 0;
+    }
+
+    /* check if we have already inserted this pattern */
+    if (SCTeddyInitHashLookup(ctx, pat, patlen, pid) != NULL)
+        return 0;
+
+    SCTeddyPattern *p = SCMalloc(sizeof(SCTeddyPattern));
+    if (unlikely(p == NULL))
+        return -1;
+    memset(p, 0, sizeof(SCTeddyPattern));
+    mpm_ctx->memory_cnt++;
+    mpm_ctx->memory_size += sizeof(SCTeddyPattern);
+
+    p->len = patlen;
+    p->flags = flags;
+    p->id = pid;
+
+    p->ci = SCMalloc(patlen);
+    if (p->ci == NULL)
+        goto error;
+    mpm_ctx->memory_cnt++;
+    mpm_ctx->memory_size += patlen;
+    memcpy_tolower(p->ci, pat, patlen);
+
+    if ((p->flags & MPM_PATTERN_FLAG_NOCASE) || memcmp(p->ci, pat, patlen) == 0) {
+        p->cs = p->ci;
+    } else {
+        p->cs = SCMalloc(patlen);
+        if (p->cs == NULL)
+            goto error;
+        mpm_ctx->memory_cnt++;
+        mpm_ctx->memory_size += patlen;
+        memcpy(p->cs, pat, patlen);
+    }
+
+    /* put in the pattern hash, at the head: order doesn't matter */
+    uint32_t hash = SCTeddyInitHashRaw(pat, patlen);
+    p->next = ctx->init_hash[hash];
+    ctx->init_hash[hash] = p;
+
+    mpm_ctx->pattern_cnt++;
+
+    if (mpm_ctx->maxlen < patlen)
+        mpm_ctx->maxlen = patlen;
+
+    if (mpm_ctx->minlen == 0 || mpm_ctx->minlen > patlen)
+        mpm_ctx->minlen = patlen;
+
+    return 0;
+
+error:
+    SCTeddyFreePattern(mpm_ctx, p);
+    return -1;
+}
+
+/**
+ * \internal
+ * \brief qsort callback ordering patterns by their lowercased prefix, so
+ *        that patterns that look alike end up in the same bucket.
+ */
+static int SCTeddyPatternCmp(const void *a, const void *b)
+{
+    const SCTeddyPattern *pa = *(const SCTeddyPattern **)a;
+    const SCTeddyPattern *pb = *(const SCTeddyPattern **)b;
+    uint16_t len = pa->len < pb->len ? pa->len : pb->len;
+    if (len > SC_TEDDY_MASK_LEN)
+        len = SC_TEDDY_MASK_LEN;
+
+    int r = memcmp(pa->ci, pb->ci, len);
+    if (r != 0)
+        return r;
+    /* keep the order stable between runs */
+    if (pa->id < pb->id)
+        return -1;
+    return (pa->id > pb->id);
+}
+
+/**
+ * \internal
+ * \brief Set the bucket bit for a pattern byte at a mask position.
+ *        Case insensitive patterns set both cases of the byte.
+ */
+static inline void SCTeddySetMask(SCTeddyCtx *ctx, int pos, uint8_t c,
+                                  uint8_t bucket, int nocase)
+{
+    ctx->lo_mask[pos][c & 0x0f] |= (1 << bucket);
+    ctx->hi_mask[pos][c >> 4] |= (1 << bucket);
+
+    if (nocase && isalpha(c)) {
+        uint8_t u = toupper(c);
+        ctx->lo_mask[pos][u & 0x0f] |= (1 << bucket);
+        ctx->hi_mask[pos][u >> 4] |= (1 << bucket);
+    }
+}
+
+/**
+ * \brief Build the filter masks and the confirm tables.
+ *
+ * \param mpm_ctx Pointer to the mpm context.
+ *
+ * \retval  0 On success.
+ * \retval -1 On failure.
+ */
+int SCTeddyPreparePatterns(MpmCtx *mpm_ctx)
+{
+    SCTeddyCtx *ctx = (SCTeddyCtx *)mpm_ctx->ctx;
+    uint32_t i, p = 0;
+
+    if (mpm_ctx->pattern_cnt == 0 || ctx->init_hash == NULL) {
+        SCLogDebug("no patterns supplied to this mpm_ctx");
+        return 0;
+    }
+
+    ctx->parray = SCMalloc(mpm_ctx->pattern_cnt * sizeof(SCTeddyPattern *));
+    if (ctx->parray == NULL)
+        goto error;
+    memset(ctx->parray, 0, mpm_ctx->pattern_cnt * sizeof(SCTeddyPattern *));
+    mpm_ctx->memory_cnt++;
+    mpm_ctx->memory_size += (mpm_ctx->pattern_cnt * sizeof(SCTeddyPattern *));
+
+    for (i = 0; i < INIT_HASH_SIZE; i++) {
+        SCTeddyPattern *node = ctx->init_hash[i], *nnode = NULL;
+        while (node != NULL) {
+            nnode = node->next;
+            node->next = NULL;
+            ctx->parray[p++] = node;
+            node = nnode;
+        }
+    }
+    ctx->parray_cnt = p;
+
+    /* we no longer need the hash, so free it's memory */
+    SCFree(ctx->init_hash);
+    ctx->init_hash = NULL;
+    mpm_ctx->memory_cnt--;
+    mpm_ctx->memory_size -= (INIT_HASH_SIZE * sizeof(SCTeddyPattern *));
+
+    qsort(ctx->parray, ctx->parray_cnt, sizeof(SCTeddyPattern *),
+          SCTeddyPatternCmp);
+
+    for (i = 0; i < ctx->parray_cnt; i++) {
+        if (ctx->parray[i]->len >= SC_TEDDY_MASK_LEN)
+            ctx->long_cnt++;
+        else
+            ctx->short_cnt++;
+    }
+
+    if (ctx->long_cnt > 0) {
+        uint32_t size = 1;
+        while (size < ctx->long_cnt * 2)
+            size <<= 1;
+        ctx->confirm_hash = SCMalloc(size * sizeof(SCTeddyPattern *));
+        if (ctx->confirm_hash == NULL)
+            goto error;
+        memset(ctx->confirm_hash, 0, size * sizeof(SCTeddyPattern *));
+        ctx->confirm_hash_mask = size - 1;
+        mpm_ctx->memory_cnt++;
+        mpm_ctx->memory_size += (size * sizeof(SCTeddyPattern *));
+    }
+
+    /* the sorted long patterns are spread evenly over the buckets,
+     * so neighbouring (similar) patterns share a bucket */
+    uint32_t l = 0;
+    for (i = 0; i < ctx->parray_cnt; i++) {
+        SCTeddyPattern *pat = ctx->parray[i];
+        int nocase = (pat->flags & MPM_PATTERN_FLAG_NOCASE);
+
+        if (pat->len < SC_TEDDY_MASK_LEN) {
+            uint8_t c = pat->ci[0];
+            pat->next = ctx->short_table[c];
+            ctx->short_table[c] = pat;
+
+            c = pat->cs[0];
+            ctx->short_first[c >> 3] |= (1 << (c & 7));
+            if (nocase && isalpha(c)) {
+                c = toupper(c);
+                ctx->short_first[c >> 3] |= (1 << (c & 7));
+            }
+            continue;
+        }
+
+        pat->bucket = (uint8_t)((l++ * SC_TEDDY_BUCKETS) / ctx->long_cnt);
+        ctx->bucket_cnt[pat->bucket]++;
+
+        int pos;
+        for (pos = 0; pos < SC_TEDDY_MASK_LEN; pos++) {
+            SCTeddySetMask(ctx, pos, pat->cs[pos], pat->bucket, nocase);
+        }
+
+        uint32_t hash = SCTeddyConfirmHash(pat->ci) & ctx->confirm_hash_mask;
+        pat->next = ctx->confirm_hash[hash];
+        ctx->confirm_hash[hash] = pat;
+    }
+
+    return 0;
+
+error:
+    return -1;
+}
+
+/**
+ * \internal
+ * \brief Record a pattern match in the pmq.
+ */
+static inline void SCTeddyMatch(PatternMatcherQueue *pmq, uint32_t pid)
+{
+    if (!(pmq->pattern_id_bitarray[pid / 8] & (1 << (pid % 8)))) {
+        pmq->pattern_id_bitarray[pid / 8] |= (1 << (pid % 8));
+        pmq->pattern_id_array[pmq->pattern_id_array_cnt++] = pid;
+    }
+}
+
+/**
+ * \internal
+ * \brief Confirm the long patterns that may start at a filter hit.
+ *
+ * \retval matches number of patterns matching at pos
+ */
+static inline uint32_t SCTeddyConfirm(const SCTeddyCtx *ctx,
+        PatternMatcherQueue *pmq, uint8_t *buf, uint16_t buflen, uint32_t pos)
+{
+    uint32_t matches = 0;
+    uint32_t hash = SCTeddyConfirmHash(buf + pos) & ctx->confirm_hash_mask;
+    uint8_t c = u8_tolower(buf[pos]);
+    SCTeddyPattern *p;
+
+    for (p = ctx->confirm_hash[hash]; p != NULL; p = p->next) {
+        if (p->len > buflen - pos || p->ci[0] != c)
+            continue;
+
+        if (p->flags & MPM_PATTERN_FLAG_NOCASE) {
+            if (SCMemcmpLowercase(p->ci, buf + pos, p->len) != 0)
+                continue;
+        } else {
+            if (SCMemcmp(p->cs, buf + pos, p->len) != 0)
+                continue;
+        }
+
+        SCTeddyMatch(pmq, p->id);
+        matches++;
+    }
+
+    return matches;
+}
+
+/**
+ * \internal
+ * \brief Scalar version of the filter for a single position.
+ */
+static inline uint8_t SCTeddyFilter(const SCTeddyCtx *ctx, const uint8_t *buf)
+{
+    uint8_t r = 0xff;
+    int pos;
+
+    for (pos = 0; pos < SC_TEDDY_MASK_LEN; pos++) {
+        r &= ctx->lo_mask[pos][buf[pos] & 0x0f] & ctx->hi_mask[pos][buf[pos] >> 4];
+    }
+    return r;
+}
+
+/**
+ * \internal
+ * \brief Run the filter over the buffer and confirm the hits.
+ *
+ * \retval matches number of long pattern matches
+ */
+static uint32_t SCTeddySearchLong(const SCTeddyCtx *ctx, MpmThreadCtx *mpm_thread_ctx,
+        PatternMatcherQueue *pmq, uint8_t *buf, uint16_t buflen)
+{
+    uint32_t matches = 0;
+    uint32_t i = 0;
+    /* last position a long pattern can start at */
+    uint32_t end = buflen - SC_TEDDY_MASK_LEN + 1;
+#ifdef SC_TEDDY_COUNTERS
+    SCTeddyThreadCtx *tctx = (SCTeddyThreadCtx *)mpm_thread_ctx->ctx;
+#endif
+
+#if defined(__AVX2__)
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo[SC_TEDDY_MASK_LEN], hi[SC_TEDDY_MASK_LEN];
+    int pos;
+
+    for (pos = 0; pos < SC_TEDDY_MASK_LEN; pos++) {
+        lo[pos] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ctx->lo_mask[pos]));
+        hi[pos] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)ctx->hi_mask[pos]));
+    }
+
+    for ( ; i + 32 + SC_TEDDY_MASK_LEN - 1 <= buflen; i += 32) {
+        __m256i res = _mm256_set1_epi8((char)0xff);
+        for (pos = 0; pos < SC_TEDDY_MASK_LEN; pos++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i + pos));
+            __m256i l = _mm256_shuffle_epi8(lo[pos], _mm256_and_si256(v, nibble));
+            __m256i h = _mm256_shuffle_epi8(hi[pos],
+                    _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            res = _mm256_and_si256(res, _mm256_and_si256(l, h));
+        }
+        uint32_t bits = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(res, zero));
+        while (bits != 0) {
+            uint32_t k = __builtin_ctz(bits);
+            bits &= bits - 1;
+#ifdef SC_TEDDY_COUNTERS
+            tctx->total_candidates++;
+#endif
+            matches += SCTeddyConfirm(ctx, pmq, buf, buflen, i + k);
+        }
+    }
+#elif defined(__SSSE3__)
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo[SC_TEDDY_MASK_LEN], hi[SC_TEDDY_MASK_LEN];
+    int pos;
+
+    for (pos = 0; pos < SC_TEDDY_MASK_LEN; pos++) {
+        lo[pos] = _mm_load_si128((const __m128i *)ctx->lo_mask[pos]);
+        hi[pos] = _mm_load_si128((const __m128i *)ctx->hi_mask[pos]);
+    }
+
+    for ( ; i + 16 + SC_TEDDY_MASK_LEN - 1 <= buflen; i += 16) {
+        __m128i res = _mm_set1_epi8((char)0xff);
+        for (pos = 0; pos < SC_TEDDY_MASK_LEN; pos++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i + pos));
+            __m128i l = _mm_shuffle_epi8(lo[pos], _mm_and_si128(v, nibble));
+            __m128i h = _mm_shuffle_epi8(hi[pos],
+                    _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+            res = _mm_and_si128(res, _mm_and_si128(l, h));
+        }
+        uint32_t bits = 0xffff ^ (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(res, zero));
+        while (bits != 0) {
+            uint32_t k = __builtin_ctz(bits);
+            bits &= bits - 1;
+#ifdef SC_TEDDY_COUNTERS
+            tctx->total_candidates++;
+#endif
+            matches += SCTeddyConfirm(ctx, pmq, buf, buflen, i + k);
+        }
+    }
+#endif
+
+    /* the tail, or the whole buffer without SIMD */
+    for ( ; i < end; i++) {
+        if (SCTeddyFilter(ctx, buf + i) == 0)
+            continue;
+#ifdef SC_TEDDY_COUNTERS
+        tctx->total_candidates++;
+#endif
+        matches += SCTeddyConfirm(ctx, pmq, buf, buflen, i);
+    }
+
+    return matches;
+}
+
+/**
+ * \internal
+ * \brief Byte at a time search for the patterns too short for the filter.
+ *
+ * \retval matches number of short pattern matches
+ */
+static uint32_t SCTeddySearchShort(const SCTeddyCtx *ctx,
+        PatternMatcherQueue *pmq, uint8_t *buf, uint16_t buflen)
+{
+    uint32_t matches = 0;
+    uint32_t i;
+
+    for (i = 0; i < buflen; i++) {
+        uint8_t c = buf[i];
+        if (!(ctx->short_first[c >> 3] & (1 << (c & 7))))
+            continue;
+
+        SCTeddyPattern *p;
+        for (p = ctx->short_table[u8_tolower(c)]; p != NULL; p = p->next) {
+            if (p->len > buflen - i)
+                continue;
+
+            if (p->flags & MPM_PATTERN_FLAG_NOCASE) {
+                if (p->len == 2 && p->ci[1] != u8_tolower(buf[i + 1]))
+                    continue;
+            } else {
+                if (p->cs[0] != c || (p->len == 2 && p->cs[1] != buf[i + 1]))
+                    continue;
+            }
+
+            SCTeddyMatch(pmq, p->id);
+            matches++;
+        }
+    }
+
+    return matches;
+}
+
+/**
+ * \brief The teddy search function.
+ *
+ * \param mpm_ctx        Pointer to the mpm context.
+ * \param mpm_thread_ctx Pointer to the mpm thread context.
+ * \param pmq            Pointer to the Pattern Matcher Queue to hold
+ *                       search matches.
+ * \param buf            Buffer to be searched.
+ * \param buflen         Buffer length.
+ *
+ * \retval matches Match count.
+ */
+uint32_t SCTeddySearch(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx,
+                       PatternMatcherQueue *pmq, uint8_t *buf, uint16_t buflen)
+{
+    const SCTeddyCtx *ctx = (SCTeddyCtx *)mpm_ctx->ctx;
+    uint32_t matches = 0;
+
+#ifdef SC_TEDDY_COUNTERS
+    ((SCTeddyThreadCtx *)mpm_thread_ctx->ctx)->total_calls++;
+#endif
+
+    if (ctx->long_cnt > 0 && buflen >= SC_TEDDY_MASK_LEN)
+        matches += SCTeddySearchLong(ctx, mpm_thread_ctx, pmq, buf, buflen);
+    if (ctx->short_cnt > 0)
+        matches += SCTeddySearchShort(ctx, pmq, buf, buflen);
+
+#ifdef SC_TEDDY_COUNTERS
+    ((SCTeddyThreadCtx *)mpm_thread_ctx->ctx)->total_matches += matches;
+#endif
+    return matches;
+}
+
+/**
+ * \brief Init the mpm thread context.
+ *
+ * \param mpm_ctx        Pointer to the mpm context.
+ * \param mpm_thread_ctx Pointer to the mpm thread context.
+ * \param matchsize      We don't need this.
+ */
+void SCTeddyInitThreadCtx(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx, uint32_t matchsize)
+{
+    memset(mpm_thread_ctx, 0, sizeof(MpmThreadCtx));
+
+    mpm_thread_ctx->ctx = SCMalloc(sizeof(SCTeddyThreadCtx));
+    if (mpm_thread_ctx->ctx == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memset(mpm_thread_ctx->ctx, 0, sizeof(SCTeddyThreadCtx));
+    mpm_thread_ctx->memory_cnt++;
+    mpm_thread_ctx->memory_size += sizeof(SCTeddyThreadCtx);
+
+    return;
+}
+
+/**
+ * \brief Initialize the teddy context.
+ *
+ * \param mpm_ctx       Mpm context.
+ */
+void SCTeddyInitCtx(MpmCtx *mpm_ctx)
+{
+    if (mpm_ctx->ctx != NULL)
+        return;
+
+    if (posix_memalign(&mpm_ctx->ctx, 16, sizeof(SCTeddyCtx)) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    memset(mpm_ctx->ctx, 0, sizeof(SCTeddyCtx));
+
+    mpm_ctx->memory_cnt++;
+    mpm_ctx->memory_size += sizeof(SCTeddyCtx);
+
+    /* initialize the hash we use to speed up pattern insertions */
+    SCTeddyCtx *ctx = (SCTeddyCtx *)mpm_ctx->ctx;
+    ctx->init_hash = SCMalloc(sizeof(SCTeddyPattern *) * INIT_HASH_SIZE);
+    if (ctx->init_hash == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memset(ctx->init_hash, 0, sizeof(SCTeddyPattern *) * INIT_HASH_SIZE);
+    mpm_ctx->memory_cnt++;
+    mpm_ctx->memory_size += (INIT_HASH_SIZE * sizeof(SCTeddyPattern *));
+
+    SCReturn;
+}
+
+/**
+ * \brief Destroy the mpm thread context.
+ *
+ * \param mpm_ctx        Pointer to the mpm context.
+ * \param mpm_thread_ctx Pointer to the mpm thread context.
+ */
+void SCTeddyDestroyThreadCtx(MpmCtx *mpm_ctx, MpmThreadCtx *mpm_thread_ctx)
+{
+    SCTeddyPrintSearchStats(mpm_thread_ctx);
+
+    if (mpm_thread_ctx->ctx != NULL) {
+        SCFree(mpm_thread_ctx->ctx);
+        mpm_thread_ctx->ctx = NULL;
+        mpm_thread_ctx->memory_cnt--;
+        mpm_thread_ctx->memory_size -= sizeof(SCTeddyThreadCtx);
+    }
+
+    return;
+}
+
+/**
+ * \brief Destroy the mpm context.
+ *
+ * \param mpm_ctx Pointer to the mpm context.
+ */
+void SCTeddyDestroyCtx(MpmCtx *mpm_ctx)
+{
+    SCTeddyCtx *ctx = (SCTeddyCtx *)mpm_ctx->ctx;
+    uint32_t i;
+
+    if (ctx == NULL)
+        return;
+
+    /* not prepared: the patterns are still in the init hash */
+    if (ctx->init_hash != NULL) {
+        for (i = 0; i < INIT_HASH_SIZE; i++) {
+            SCTeddyPattern *node = ctx->init_hash[i], *nnode = NULL;
+            while (node != NULL) {
+                nnode = node->next;
+                SCTeddyFreePattern(mpm_ctx, node);
+                node = nnode;
+            }
+        }
+        SCFree(ctx->init_hash);
+        ctx->init_hash = NULL;
+        mpm_ctx->memory_cnt--;
+        mpm_ctx->memory_size -= (INIT_HASH_SIZE * sizeof(SCTeddyPattern *));
+    }
+
+    if (ctx->parray != NULL) {
+        for (i = 0; i < ctx->parray_cnt; i++) {
+            SCTeddyFreePattern(mpm_ctx, ctx->parray[i]);
+        }
+        SCFree(ctx->parray);
+        ctx->parray = NULL;
+        mpm_ctx->memory_cnt--;
+        mpm_ctx->memory_size -= (mpm_ctx->pattern_cnt * sizeof(SCTeddyPattern *));
+    }
+
+    if (ctx->confirm_hash != NULL) {
+        SCFree(ctx->confirm_hash);
+        ctx->confirm_hash = NULL;
+        mpm_ctx->memory_cnt--;
+        mpm_ctx->memory_size -= ((ctx->confirm_hash_mask + 1) * sizeof(SCTeddyPattern *));
+    }
+
+    free(mpm_ctx->ctx);
+    mpm_ctx->ctx = NULL;
+    mpm_ctx->memory_cnt--;
+    mpm_ctx->memory_size -= sizeof(SCTeddyCtx);
+
+    return;
+}
+
+/**
+ * \brief Add a case insensitive pattern.
+ *
+ * \param mpm_ctx Pointer to the mpm context.
+ * \param pat     The pattern to add.
+ * \param patnen  The pattern length.
+ * \param offset  Ignored.
+ * \param depth   Ignored.
+ * \param pid     The pattern id.
+ * \param sid     Ignored.
+ * \param flags   Flags associated with this pattern.
+ *
+ * \retval  0 On success.
+ * \retval -1 On failure.
+ */
+int SCTeddyAddPatternCI(MpmCtx *mpm_ctx, uint8_t *pat, uint16_t patlen,
+                        uint16_t offset, uint16_t depth, uint32_t pid,
+                        uint32_t sid, uint8_t flags)
+{
+    flags |= MPM_PATTERN_FLAG_NOCASE;
+    return SCTeddyAddPattern(mpm_ctx, pat, patlen, offset, depth, pid, sid, flags);
+}
+
+/**
+ * \brief Add a case sensitive pattern.
+ *
+ * \param mpm_ctx Pointer to the mpm context.
+ * \param pat     The pattern to add.
+ * \param patnen  The pattern length.
+ * \param offset  Ignored.
+ * \param depth   Ignored.
+ * \param pid     The pattern id.
+ * \param sid     Ignored.
+ * \param flags   Flags associated with this pattern.
+ *
+ * \retval  0 On success.
+ * \retval -1 On failure.
+ */
+int SCTeddyAddPatternCS(MpmCtx *mpm_ctx, uint8_t *pat, uint16_t patlen,
+                        uint16_t offset, uint16_t depth, uint32_t pid,
+                        uint32_t sid, uint8_t flags)
+{
+    return SCTeddyAddPattern(mpm_ctx, pat, patlen, offset, depth, pid, sid, flags);
+}
+
+void SCTeddyPrintSearchStats(MpmThreadCtx *mpm_thread_ctx)
+{
+#ifdef SC_TEDDY_COUNTERS
+    SCTeddyThreadCtx *ctx = (SCTeddyThreadCtx *)mpm_thread_ctx->ctx;
+    printf("Teddy Thread Search stats (ctx %p)\n", ctx);
+    printf("Total calls: %" PRIu32 "\n", ctx->total_calls);
+    printf("Total candidates: %" PRIu64 "\n", ctx->total_candidates);
+    printf("Total matches: %" PRIu64 "\n", ctx->total_matches);
+#endif /* SC_TEDDY_COUNTERS */
+
+    return;
+}
+
+void SCTeddyPrintInfo(MpmCtx *mpm_ctx)
+{
+    SCTeddyCtx *ctx = (SCTeddyCtx *)mpm_ctx->ctx;
+    int b;
+
+    printf("MPM Teddy Information:\n");
+#if defined(__AVX2__)
+    printf("Filter:          AVX2\n");
+#elif defined(__SSSE3__)
+    printf("Filter:          SSSE3\n");
+#else
+    printf("Filter:          scalar\n");
+#endif
+    printf("Memory allocs:   %" PRIu32 "\n", mpm_ctx->memory_cnt);
+    printf("Memory alloced:  %" PRIu32 "\n", mpm_ctx->memory_size);
+    printf(" Sizeof:\n");
+    printf("  MpmCtx         %" PRIuMAX "\n", (uintmax_t)sizeof(MpmCtx));
+    printf("  SCTeddyCtx:    %" PRIuMAX "\n", (uintmax_t)sizeof(SCTeddyCtx));
+    printf("  SCTeddyPattern %" PRIuMAX "\n", (uintmax_t)sizeof(SCTeddyPattern));
+    printf("Unique Patterns: %" PRIu32 "\n", mpm_ctx->pattern_cnt);
+    printf("Smallest:        %" PRIu32 "\n", mpm_ctx->minlen);
+    printf("Largest:         %" PRIu32 "\n", mpm_ctx->maxlen);
+    printf("Short patterns:  %" PRIu32 "\n", ctx->short_cnt);
+    printf("Buckets:        ");
+    for (b = 0; b < SC_TEDDY_BUCKETS; b++)
+        printf(" %" PRIu32, ctx->bucket_cnt[b]);
+    printf("\n\n");
+
+    return;
+}
+
+/**
+ * \brief Register the teddy mpm.
+ */
+void MpmTeddyRegister(void)
+{
+    mpm_table[MPM_TEDDY].name = "teddy";
+    mpm_table[MPM_TEDDY].max_pattern_length = 0;
+
+    mpm_table[MPM_TEDDY].InitCtx = SCTeddyInitCtx;
+    mpm_table[MPM_TEDDY].InitThreadCtx = SCTeddyInitThreadCtx;
+    mpm_table[MPM_TEDDY].DestroyCtx = SCTeddyDestroyCtx;
+    mpm_table[MPM_TEDDY].DestroyThreadCtx = SCTeddyDestroyThreadCtx;
+    mpm_table[MPM_TEDDY].AddPattern = SCTeddyAddPatternCS;
+    mpm_table[MPM_TEDDY].AddPatternNocase = SCTeddyAddPatternCI;
+    mpm_table[MPM_TEDDY].Prepare = SCTeddyPreparePatterns;
+    mpm_table[MPM_TEDDY].Search = SCTeddySearch;
+    mpm_table[MPM_TEDDY].Cleanup = NULL;
+    mpm_table[MPM_TEDDY].PrintCtx = SCTeddyPrintInfo;
+    mpm_table[MPM_TEDDY].PrintThreadCtx = SCTeddyPrintSearchStats;
+    mpm_table[MPM_TEDDY].RegisterUnittests = SCTeddyRegisterTests;
+
+    return;
+}
+
+/*************************************Unittests********************************/
+
+#ifdef UNITTESTS
+
+/** \test run a set of patterns over a buffer and check the match count */
+static int SCTeddyTestRun(char **pats, uint8_t nocase, char *buf,
+                          uint32_t expect)
+{
+    int result = 0;
+    MpmCtx mpm_ctx;
+    MpmThreadCtx mpm_thread_ctx;
+    PatternMatcherQueue pmq;
+    uint32_t i;
+
+    memset(&mpm_ctx, 0, sizeof(MpmCtx));
+    memset(&mpm_thread_ctx, 0, sizeof(MpmThreadCtx));
+    MpmInitCtx(&mpm_ctx, MPM_TEDDY);
+    SCTeddyInitThreadCtx(&mpm_ctx, &mpm_thread_ctx, 0);
+
+    for (i = 0; pats[i] != NULL; i++) {
+        if (nocase)
+            MpmAddPatternCI(&mpm_ctx, (uint8_t *)pats[i], strlen(pats[i]), 0, 0, i, 0, 0);
+        else
+            MpmAddPatternCS(&mpm_ctx, (uint8_t *)pats[i], strlen(pats[i]), 0, 0, i, 0, 0);
+    }
+    PmqSetup(&pmq, i);
+
+    SCTeddyPreparePatterns(&mpm_ctx);
+
+    uint32_t cnt = SCTeddySearch(&mpm_ctx, &mpm_thread_ctx, &pmq,
+                                 (uint8_t *)buf, strlen(buf));
+    if (cnt == expect)
+        result = 1;
+    else
+        printf("%" PRIu32 " != %" PRIu32 " ", expect, cnt);
+
+    SCTeddyDestroyCtx(&mpm_ctx);
+    SCTeddyDestroyThreadCtx(&mpm_ctx, &mpm_thread_ctx);
+    PmqFree(&pmq);
+    return result;
+}
+
+static int SCTeddyTest01(void)
+{
+    char *pats[] = { "abcd", NULL };
+    return SCTeddyTestRun(pats, 0, "abcdefghjiklmnopqrstuvwxyz", 1);
+}
+
+static int SCTeddyTest02(void)
+{
+    char *pats[] = { "abce", NULL };
+    return SCTeddyTestRun(pats, 0, "abcdefghjiklmnopqrstuvwxyz", 0);
+}
+
+static int SCTeddyTest03(void)
+{
+    char *pats[] = { "abcd", "bcde", "fghj", NULL };
+    return SCTeddyTestRun(pats, 0, "abcdefghjiklmnopqrstuvwxyz", 3);
+}
+
+static int SCTeddyTest04(void)
+{
+    char *pats[] = { "ABCD", "bCdEfG", "fghJikl", NULL };
+    return SCTeddyTestRun(pats, 1, "abcdefghjiklmnopqrstuvwxyz", 3);
+}
+
+/** \test case sensitive patterns must not match the other case */
+static int SCTeddyTest05(void)
+{
+    char *pats[] = { "ABCD", "bCdEfG", "fghJikl", NULL };
+    return SCTeddyTestRun(pats, 0, "abcdefghjiklmnopqrstuvwxyz", 0);
+}
+
+/** \test overlapping matches of patterns of all lengths */
+static int SCTeddyTest06(void)
+{
+    char *pats[] = { "A", "AA", "AAA", "AAAAA", "AAAAAAAAAA",
+                     "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAA", NULL };
+    return SCTeddyTestRun(pats, 0, "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAA", 135);
+}
+
+/** \test buffer shorter than the filter */
+static int SCTeddyTest07(void)
+{
+    char *pats[] = { "abcd", NULL };
+    return SCTeddyTestRun(pats, 0, "a", 0);
+}
+
+/** \test matches in the SIMD part and in the scalar tail */
+static int SCTeddyTest08(void)
+{
+    char *pats[] = { "abcdefgh", "56789", NULL };
+    return SCTeddyTestRun(pats, 0,
+            "01234567890123456789012345678901234567890123456789"
+            "01234567890123456789012345678901234567890123456789"
+            "abcdefgh"
+            "01234567890123456789012345678901234567890123456789"
+            "0123456789012345678901234567890123456789012345678", 20);
+}
+
+/** \test pattern at the very end of the buffer */
+static int SCTeddyTest09(void)
+{
+    char *pats[] = { "wxyz", "vwxyz", "yz", NULL };
+    return SCTeddyTestRun(pats, 0, "abcdefghijklmnopqrstuvwxyz", 3);
+}
+
+/** \test nocase short patterns */
+static int SCTeddyTest10(void)
+{
+    char *pats[] = { "x", "Yz", NULL };
+    return SCTeddyTestRun(pats, 1, "XyZ xyz", 4);
+}
+
+/** \test compare the match results with ac on a larger random set */
+static int SCTeddyTest11(void)
+{
+    int result = 0;
+    MpmCtx ac_ctx, teddy_ctx;
+    MpmThreadCtx ac_tctx, teddy_tctx;
+    PatternMatcherQueue ac_pmq, teddy_pmq;
+    uint8_t pats[500][8];
+    uint8_t buf[4096];
+    uint32_t i, j;
+
+    memset(&ac_ctx, 0, sizeof(MpmCtx));
+    memset(&teddy_ctx, 0, sizeof(MpmCtx));
+    MpmInitCtx(&ac_ctx, MPM_AC);
+    MpmInitCtx(&teddy_ctx, MPM_TEDDY);
+    MpmInitThreadCtx(&ac_tctx, MPM_AC, 0);
+    MpmInitThreadCtx(&teddy_tctx, MPM_TEDDY, 0);
+
+    /* small alphabet so that there are plenty of matches */
+    srandom(1);
+    for (i = 0; i < 500; i++) {
+        uint16_t len = 1 + (random() % 8);
+        for (j = 0; j < len; j++)
+            pats[i][j] = "abcdABCD"[random() % 8];
+        if (i % 2) {
+            MpmAddPatternCI(&ac_ctx, pats[i], len, 0, 0, i, 0, 0);
+            MpmAddPatternCI(&teddy_ctx, pats[i], len, 0, 0, i, 0, 0);
+        } else {
+            MpmAddPatternCS(&ac_ctx, pats[i], len, 0, 0, i, 0, 0);
+            MpmAddPatternCS(&teddy_ctx, pats[i], len, 0, 0, i, 0, 0);
+        }
+    }
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = "abcdABCDxy"[random() % 10];
+
+    PmqSetup(&ac_pmq, 500);
+    PmqSetup(&teddy_pmq, 500);
+    mpm_table[MPM_AC].Prepare(&ac_ctx);
+    mpm_table[MPM_TEDDY].Prepare(&teddy_ctx);
+
+    uint32_t ac_cnt = mpm_table[MPM_AC].Search(&ac_ctx, &ac_tctx, &ac_pmq,
+                                               buf, sizeof(buf));
+    uint32_t teddy_cnt = mpm_table[MPM_TEDDY].Search(&teddy_ctx, &teddy_tctx,
+                                                     &teddy_pmq, buf, sizeof(buf));
+    if (ac_cnt != teddy_cnt) {
+        printf("ac %" PRIu32 " != teddy %" PRIu32 " ", ac_cnt, teddy_cnt);
+        goto end;
+    }
+    if (ac_pmq.pattern_id_array_cnt != teddy_pmq.pattern_id_array_cnt ||
+        memcmp(ac_pmq.pattern_id_bitarray, teddy_pmq.pattern_id_bitarray,
+               ac_pmq.pattern_id_bitarray_size) != 0) {
+        printf("matched pattern ids differ: ");
+        goto end;
+    }
+
+    result = 1;
+end:
+    mpm_table[MPM_AC].DestroyCtx(&ac_ctx);
+    mpm_table[MPM_TEDDY].DestroyCtx(&teddy_ctx);
+    mpm_table[MPM_AC].DestroyThreadCtx(&ac_ctx, &ac_tctx);
+    mpm_table[MPM_TEDDY].DestroyThreadCtx(&teddy_ctx, &teddy_tctx);
+    PmqFree(&ac_pmq);
+    PmqFree(&teddy_pmq);
+    return result;
+}
+
+static int SCTeddyTest12(void)
+{
+    uint8_t *buf = (uint8_t *)"onetwothreefourfivesixseveneightnine";
+    uint16_t buflen = strlen((char *)buf);
+    Packet *p = NULL;
+    ThreadVars th_v;
+    DetectEngineThreadCtx *det_ctx = NULL;
+    int result = 0;
+
+    memset(&th_v, 0, sizeof(th_v));
+    p = UTHBuildPacket(buf, buflen, IPPROTO_TCP);
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    if (de_ctx == NULL)
+        goto end;
+
+    de_ctx->flags |= DE_QUIET;
+    de_ctx->mpm_matcher = MPM_TEDDY;
+
+    de_ctx->sig_list = SigInit(de_ctx, "alert tcp any any -> any any "
+                               "(content:\"onetwothreefourfivesixseveneightnine\"; sid:1;)");
+    if (de_ctx->sig_list == NULL)
+        goto end;
+    de_ctx->sig_list->next = SigInit(de_ctx, "alert tcp any any -> any any "
+                               "(content:\"SEVEN\"; nocase; sid:2;)");
+    if (de_ctx->sig_list->next == NULL)
+        goto end;
+    de_ctx->sig_list->next->next = SigInit(de_ctx, "alert tcp any any -> any any "
+                               "(content:\"SEVEN\"; sid:3;)");
+    if (de_ctx->sig_list->next->next == NULL)
+        goto end;
+
+    SigGroupBuild(de_ctx);
+    DetectEngineThreadCtxInit(&th_v, (void *)de_ctx, (void *)&det_ctx);
+
+    SigMatchSignatures(&th_v, de_ctx, det_ctx, p);
+    if (PacketAlertCheck(p, 1) != 1) {
+        printf("if (PacketAlertCheck(p, 1) != 1) failure\n");
+        goto end;
+    }
+    if (PacketAlertCheck(p, 2) != 1) {
+        printf("if (PacketAlertCheck(p, 2) != 1) failure\n");
+        goto end;
+    }
+    if (PacketAlertCheck(p, 3) != 0) {
+        printf("if (PacketAlertCheck(p, 3) != 0) failure\n");
+        goto end;
+    }
+
+    result = 1;
+end:
+    if (de_ctx != NULL) {
+        SigGroupCleanup(de_ctx);
+        SigCleanSignatures(de_ctx);
+
+        DetectEngineThreadCtxDeinit(&th_v, (void *)det_ctx);
+        DetectEngineCtxFree(de_ctx);
+    }
+
+    UTHFreePackets(&p, 1);
+    return result;
+}
+
+#endif /* UNITTESTS */
+
+void SCTeddyRegisterTests(void)
+{
+#ifdef UNITTESTS
+    UtRegisterTest("SCTeddyTest01", SCTeddyTest01, 1);
+    UtRegisterTest("SCTeddyTest02", SCTeddyTest02, 1);
+    UtRegisterTest("SCTeddyTest03", SCTeddyTest03, 1);
+    UtRegisterTest("SCTeddyTest04", SCTeddyTest04, 1);
+    UtRegisterTest("SCTeddyTest05", SCTeddyTest05, 1);
+    UtRegisterTest("SCTeddyTest06", SCTeddyTest06, 1);
+    UtRegisterTest("SCTeddyTest07", SCTeddyTest07, 1);
+    UtRegisterTest("SCTeddyTest08", SCTeddyTest08, 1);
+    UtRegisterTest("SCTeddyTest09", SCTeddyTest09, 1);
+    UtRegisterTest("SCTeddyTest10", SCTeddyTest10, 1);
+    UtRegisterTest("SCTeddyTest11", SCTeddyTest11, 1);
+    UtRegisterTest("SCTeddyTest12", SCTeddyTest12, 1);
+#endif
+
+    return;
+}
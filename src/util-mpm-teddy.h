@@ -0,0 +1,92 @@
+/* Copyright (C) 2014 Open Information Security Foundation
+ *
+ * You can copy, redistribute or modify this Program under the terms of
+ * the GNU General Public License version 2 as published by the Free
+ * Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/**
+ * \file
+ *
+ * Teddy style bucketed SIMD prefilter MPM.
+ */
+
+#ifndef __UTIL_MPM_TEDDY__H__
+#define __UTIL_MPM_TEDDY__H__
+
+#include "util-mpm.h"
+
+/** number of leading pattern bytes the SIMD filter looks at */
+#define SC_TEDDY_MASK_LEN   3
+/** number of buckets, one bit each in the filter masks */
+#define SC_TEDDY_BUCKETS    8
+
+typedef struct SCTeddyPattern_ {
+    /* length of the pattern */
+    uint16_t len;
+    /* flags decribing the pattern */
+    uint8_t flags;
+    /* filter bucket */
+    uint8_t bucket;
+    /* pattern id */
+    uint32_t id;
+    /* case sensitive */
+    uint8_t *cs;
+    /* case INsensitive */
+    uint8_t *ci;
+
+    /* init hash chain, confirm hash chain after prepare */
+    struct SCTeddyPattern_ *next;
+} SCTeddyPattern;
+
+typedef struct SCTeddyCtx_ {
+    /* nibble lookup tables for the filter, one set per mask position.
+     * Bit b is set if a pattern in bucket b can have the nibble there. */
+    uint8_t lo_mask[SC_TEDDY_MASK_LEN][16] __attribute__((aligned(16)));
+    uint8_t hi_mask[SC_TEDDY_MASK_LEN][16] __attribute__((aligned(16)));
+
+    /* hash used during ctx initialization */
+    SCTeddyPattern **init_hash;
+
+    /* all patterns, used for cleanup */
+    SCTeddyPattern **parray;
+    uint32_t parray_cnt;
+
+    /* patterns of SC_TEDDY_MASK_LEN bytes or more, hashed on their
+     * lowercased first bytes for the confirm stage */
+    SCTeddyPattern **confirm_hash;
+    uint32_t confirm_hash_mask;
+    uint32_t long_cnt;
+
+    /* patterns shorter than SC_TEDDY_MASK_LEN, by lowercased first byte */
+    SCTeddyPattern *short_table[256];
+    /* bitmap of bytes that can start a short pattern */
+    uint8_t short_first[32];
+    uint32_t short_cnt;
+
+    /* patterns per bucket, for the stats */
+    uint32_t bucket_cnt[SC_TEDDY_BUCKETS];
+} SCTeddyCtx;
+
+typedef struct SCTeddyThreadCtx_ {
+    /* the total calls we make to the search function */
+    uint32_t total_calls;
+    /* positions that passed the filter */
+    uint64_t total_candidates;
+    /* the total patterns that we ended up matching against */
+    uint64_t total_matches;
+} SCTeddyThreadCtx;
+
+void MpmTeddyRegister(void);
+
+#endif /* __UTIL_MPM_TEDDY__H__ */
@@ -37,6 +37,7 @@
 #include "util-mpm-ac-gfbs.h"
 #include "util-mpm-ac-bs.h"
 #include "util-mpm-ac-tile.h"
+#include "util-mpm-teddy.h"
 #include "util-hashlist.h"
 
 #include "detect-engine.h"
@@ -46,6 +47,7 @@
 #include "conf-yaml-loader.h"
 #include "queue.h"
 #include "util-unittest.h"
+#include "detect-engine-cache.h"
 #ifdef __SC_CUDA_SUPPORT__
 #include "util-cuda-handlers.h"
 #include "detect-engine-mpm.h"
@@ -217,6 +219,8 @@ MpmCtx *MpmFactoryGetMpmCtxForProfile(DetectEngineCtx *de_ctx, int32_t id, int d
             exit(EXIT_FAILURE);
         }
         memset(mpm_ctx, 0, sizeof(MpmCtx));
+        /* unique ctxs may be replaced by an identical one from the store */
+        mpm_ctx->flags |= MPM_CTX_FLAG_STORE_TRACK;
         return mpm_ctx;
     } else if (id < -1) {
         SCLogError(SC_ERR_INVALID_ARGUMENTS, "Invalid argument - %d\n", id);
@@ -237,6 +241,8 @@ void MpmFactoryReClaimMpmCtx(DetectEngineCtx *de_ctx, MpmCtx *mpm_ctx)
         return;
 
     if (!MpmFactoryIsMpmCtxAvailable(de_ctx, mpm_ctx)) {
+        if (mpm_ctx->store_patterns != NULL)
+            SCFree(mpm_ctx->store_patterns);
         if (mpm_ctx->mpm_type != MPM_NOTSET)
             mpm_table[mpm_ctx->mpm_type].DestroyCtx(mpm_ctx);
         SCFree(mpm_ctx);
@@ -274,6 +280,457 @@ void MpmFactoryDeRegisterAllMpmCtxProfiles(DetectEngineCtx *de_ctx)
     return;
 }
 
+/** \brief entry in the mpm store */
+typedef struct MpmStoreEntry_ {
+    MpmCtx *mpm_ctx;
+    uint16_t mpm_type;
+    uint32_t hash;
+
+    /* sorted, unique patterns of the ctx. NULL once the build is done */
+    MpmStorePattern *patterns;
+    uint32_t patterns_cnt;
+
+    /* number of lookups that returned this ctx */
+    uint32_t users;
+} MpmStoreEntry;
+
+static void MpmStoreRecordPattern(MpmCtx *mpm_ctx, uint16_t patlen,
+                                  uint32_t pid, uint8_t flags)
+{
+    if (mpm_ctx->store_patterns_cnt == mpm_ctx->store_patterns_size) {
+        uint32_t size = mpm_ctx->store_patterns_size ?
+            mpm_ctx->store_patterns_size * 2 : 32;
+        void *ptmp = SCRealloc(mpm_ctx->store_patterns,
+                               size * sizeof(MpmStorePattern));
+        if (ptmp == NULL) {
+            /* can't track this ctx, it will just not be shared */
+            SCFree(mpm_ctx->store_patterns);
+            mpm_ctx->store_patterns = NULL;
+            mpm_ctx->store_patterns_cnt = 0;
+            mpm_ctx->store_patterns_size = 0;
+            mpm_ctx->flags &= ~MPM_CTX_FLAG_STORE_TRACK;
+            return;
+        }
+        mpm_ctx->store_patterns = ptmp;
+        mpm_ctx->store_patterns_size = size;
+    }
+
+    MpmStorePattern *p = &mpm_ctx->store_patterns[mpm_ctx->store_patterns_cnt++];
+    p->pid = pid;
+    p->patlen = patlen;
+    p->flags = flags;
+}
+
+static void MpmStoreCtxPatternsFree(MpmCtx *mpm_ctx)
+{
+    if (mpm_ctx->store_patterns != NULL)
+        SCFree(mpm_ctx->store_patterns);
+    mpm_ctx->store_patterns = NULL;
+    mpm_ctx->store_patterns_cnt = 0;
+    mpm_ctx->store_patterns_size = 0;
+    mpm_ctx->flags &= ~MPM_CTX_FLAG_STORE_TRACK;
+}
+
+static int MpmStorePatternCmp(const void *a, const void *b)
+{
+    const MpmStorePattern *pa = a;
+    const MpmStorePattern *pb = b;
+
+    if (pa->pid != pb->pid)
+        return pa->pid < pb->pid ? -1 : 1;
+    if (pa->patlen != pb->patlen)
+        return pa->patlen < pb->patlen ? -1 : 1;
+    if (pa->flags != pb->flags)
+        return pa->flags < pb->flags ? -1 : 1;
+    return 0;
+}
+
+static uint32_t MpmStoreHashFunc(HashListTable *ht, void *data, uint16_t datalen)
+{
+    MpmStoreEntry *e = (MpmStoreEntry *)data;
+    return e->hash % ht->array_size;
+}
+
+static char MpmStoreCompareFunc(void *data1, uint16_t len1, void *data2, uint16_t len2)
+{
+    MpmStoreEntry *e1 = (MpmStoreEntry *)data1;
+    MpmStoreEntry *e2 = (MpmStoreEntry *)data2;
+
+    if (e1->hash != e2->hash || e1->mpm_type != e2->mpm_type ||
+        e1->patterns_cnt != e2->patterns_cnt)
+        return 0;
+    /* build is done, entries can't be compared anymore */
+    if (e1->patterns == NULL || e2->patterns == NULL)
+        return 0;
+
+    return (memcmp(e1->patterns, e2->patterns,
+                   e1->patterns_cnt * sizeof(MpmStorePattern)) == 0);
+}
+
+static void MpmStoreFreeFunc(void *data)
+{
+    MpmStoreEntry *e = (MpmStoreEntry *)data;
+
+    if (e->mpm_ctx != NULL) {
+        if (e->mpm_ctx->mpm_type != MPM_NOTSET)
+            mpm_table[e->mpm_ctx->mpm_type].DestroyCtx(e->mpm_ctx);
+        SCFree(e->mpm_ctx);
+    }
+    if (e->patterns != NULL)
+        SCFree(e->patterns);
+    SCFree(e);
+}
+
+/** \brief ctx waiting to be prepared */
+typedef struct MpmStorePrepareItem_ {
+    MpmCtx *mpm_ctx;
+    /* identifies the pattern set in the detect engine cache */
+    uint64_t digest;
+    /* set if the ctx was loaded from the detect engine cache */
+    uint8_t mapped;
+} MpmStorePrepareItem;
+
+static MpmStore *MpmStoreGet(DetectEngineCtx *de_ctx)
+{
+    if (de_ctx->mpm_store != NULL)
+        return de_ctx->mpm_store;
+
+    MpmStore *store = SCMalloc(sizeof(MpmStore));
+    if (store == NULL)
+        return NULL;
+    memset(store, 0, sizeof(MpmStore));
+
+    store->hash = HashListTableInit(4096, MpmStoreHashFunc,
+            MpmStoreCompareFunc, MpmStoreFreeFunc);
+    if (store->hash == NULL) {
+        SCFree(store);
+        return NULL;
+    }
+
+    de_ctx->mpm_store = store;
+    return store;
+}
+
+/** \brief FNV-1a 64 step, used for the detect engine cache digests */
+static inline uint64_t MpmStoreDigestUpdate(uint64_t digest, uint32_t v)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        digest ^= (v >> (i * 8)) & 0xff;
+        digest *= 0x100000001b3ULL;
+    }
+    return digest;
+}
+
+static int MpmStoreQueue(MpmStore *store, MpmCtx *mpm_ctx, uint64_t digest)
+{
+    if (store->prepare_queue_cnt == store->prepare_queue_size) {
+        uint32_t size = store->prepare_queue_size ?
+            store->prepare_queue_size * 2 : 256;
+        void *ptmp = SCRealloc(store->prepare_queue,
+                               size * sizeof(MpmStorePrepareItem));
+        if (ptmp == NULL)
+            return -1;
+        store->prepare_queue = ptmp;
+        store->prepare_queue_size = size;
+    }
+
+    MpmStorePrepareItem *item = &store->prepare_queue[store->prepare_queue_cnt++];
+    item->mpm_ctx = mpm_ctx;
+    item->digest = digest;
+    item->mapped = 0;
+    return 0;
+}
+
+/**
+ * \brief Queue a ctx that is not tracked by the store, like the "single"
+ *        mode factory ctxs, for MpmStorePrepareQueued().
+ */
+void MpmStoreQueueCtx(DetectEngineCtx *de_ctx, MpmCtx *mpm_ctx)
+{
+    MpmStore *store = MpmStoreGet(de_ctx);
+    uint64_t digest = 0xcbf29ce484222325ULL;
+    uint32_t u;
+
+    /* factory ctxs can be handed out more than once */
+    for (u = 0; store != NULL && u < store->prepare_queue_cnt; u++) {
+        if (store->prepare_queue[u].mpm_ctx == mpm_ctx)
+            return;
+    }
+
+    digest = MpmStoreDigestUpdate(digest, mpm_ctx->mpm_type);
+    digest = MpmStoreDigestUpdate(digest, mpm_ctx->pattern_cnt);
+    digest = MpmStoreDigestUpdate(digest, mpm_ctx->minlen);
+    digest = MpmStoreDigestUpdate(digest, mpm_ctx->maxlen);
+
+    if (store == NULL || MpmStoreQueue(store, mpm_ctx, digest) != 0) {
+        if (mpm_table[mpm_ctx->mpm_type].Prepare != NULL)
+            mpm_table[mpm_ctx->mpm_type].Prepare(mpm_ctx);
+    }
+}
+
+/**
+ * \brief Prepare a "full" mode mpm ctx, or replace it by an already
+ *        prepared one with the same patterns.
+ *
+ *        On a store hit the ctx passed in is destroyed. Ctxs in the store
+ *        are marked global, so the sgh cleanup leaves them alone; they
+ *        are freed by MpmStoreFree().
+ *
+ * \param de_ctx  Detection engine ctx.
+ * \param mpm_ctx Mpm ctx with all patterns added, not prepared yet.
+ *
+ * \retval mpm_ctx the ctx to use for the sgh
+ */
+MpmCtx *MpmStorePrepareCtx(DetectEngineCtx *de_ctx, MpmCtx *mpm_ctx)
+{
+    MpmStoreEntry *e = NULL;
+
+    if (!(mpm_ctx->flags & MPM_CTX_FLAG_STORE_TRACK) ||
+        mpm_ctx->store_patterns_cnt == 0)
+        goto prepare;
+
+    MpmStore *store = MpmStoreGet(de_ctx);
+    if (store == NULL)
+        goto prepare;
+
+    /* the same pattern is added once per sig using it */
+    qsort(mpm_ctx->store_patterns, mpm_ctx->store_patterns_cnt,
+          sizeof(MpmStorePattern), MpmStorePatternCmp);
+    uint32_t u, cnt = 1;
+    for (u = 1; u < mpm_ctx->store_patterns_cnt; u++) {
+        if (MpmStorePatternCmp(&mpm_ctx->store_patterns[cnt - 1],
+                               &mpm_ctx->store_patterns[u]) != 0)
+            mpm_ctx->store_patterns[cnt++] = mpm_ctx->store_patterns[u];
+    }
+
+    e = SCMalloc(sizeof(MpmStoreEntry));
+    if (e == NULL)
+        goto prepare;
+    memset(e, 0, sizeof(MpmStoreEntry));
+    e->mpm_type = mpm_ctx->mpm_type;
+    e->patterns = mpm_ctx->store_patterns;
+    e->patterns_cnt = cnt;
+    uint64_t digest = 0xcbf29ce484222325ULL;
+    digest = MpmStoreDigestUpdate(digest, e->mpm_type);
+    digest = MpmStoreDigestUpdate(digest, cnt);
+    e->hash = e->mpm_type;
+    for (u = 0; u < cnt; u++) {
+        uint32_t lf = (uint32_t)e->patterns[u].patlen << 8 | e->patterns[u].flags;
+        e->hash = e->hash * 31 + e->patterns[u].pid;
+        e->hash = e->hash * 31 + lf;
+        digest = MpmStoreDigestUpdate(digest, e->patterns[u].pid);
+        digest = MpmStoreDigestUpdate(digest, lf);
+    }
+    /* the entry owns the pattern array now */
+    mpm_ctx->store_patterns = NULL;
+    MpmStoreCtxPatternsFree(mpm_ctx);
+
+    store->total++;
+
+    MpmStoreEntry *r = HashListTableLookup(store->hash, e, sizeof(MpmStoreEntry));
+    if (r != NULL) {
+        SCLogDebug("mpm ctx %p replaced by shared ctx %p (%"PRIu32" patterns)",
+                   mpm_ctx, r->mpm_ctx, cnt);
+        r->users++;
+
+        if (mpm_ctx->mpm_type != MPM_NOTSET)
+            mpm_table[mpm_ctx->mpm_type].DestroyCtx(mpm_ctx);
+        SCFree(mpm_ctx);
+        SCFree(e->patterns);
+        SCFree(e);
+        return r->mpm_ctx;
+    }
+
+    e->mpm_ctx = mpm_ctx;
+    e->users = 1;
+    if (HashListTableAdd(store->hash, e, sizeof(MpmStoreEntry)) != 0) {
+        /* not shared, the sgh keeps owning the ctx */
+        e->mpm_ctx = NULL;
+        MpmStoreFreeFunc(e);
+        goto prepare;
+    }
+    mpm_ctx->global = 1;
+    mpm_ctx->flags |= MPM_CTX_FLAG_STORE_OWNED;
+    store->unique++;
+
+    /* the expensive part is done later for all ctxs at once */
+    if (MpmStoreQueue(store, mpm_ctx, digest) != 0) {
+        if (mpm_table[mpm_ctx->mpm_type].Prepare != NULL)
+            mpm_table[mpm_ctx->mpm_type].Prepare(mpm_ctx);
+    }
+    return mpm_ctx;
+
+prepare:
+    MpmStoreCtxPatternsFree(mpm_ctx);
+    if (mpm_table[mpm_ctx->mpm_type].Prepare != NULL)
+        mpm_table[mpm_ctx->mpm_type].Prepare(mpm_ctx);
+    return mpm_ctx;
+}
+
+typedef struct MpmStorePrepareThread_ {
+    MpmStore *store;
+    SC_ATOMIC_DECLARE(uint32_t, next);
+    SC_ATOMIC_DECLARE(uint32_t, failed);
+} MpmStorePrepareThread;
+
+static void *MpmStorePrepareWorker(void *arg)
+{
+    MpmStorePrepareThread *pt = (MpmStorePrepareThread *)arg;
+    MpmStore *store = pt->store;
+
+    while (1) {
+        uint32_t idx = SC_ATOMIC_ADD(pt->next, 1) - 1;
+        if (idx >= store->prepare_queue_cnt)
+            break;
+
+        if (store->prepare_queue[idx].mapped)
+            continue;
+
+        MpmCtx *mpm_ctx = store->prepare_queue[idx].mpm_ctx;
+        if (mpm_table[mpm_ctx->mpm_type].Prepare != NULL) {
+            if (mpm_table[mpm_ctx->mpm_type].Prepare(mpm_ctx) != 0)
+                (void)SC_ATOMIC_ADD(pt->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Prepare the ctxs queued by MpmStorePrepareCtx() and
+ *        MpmStoreQueueCtx().
+ *
+ *        Ctxs found in the detect engine cache are used from there, a new
+ *        cache file is written if any ctx had to be prepared.
+ *
+ *        Each ctx is prepared on its own and only touches its own data,
+ *        so they are handed out to de_ctx->prepare_threads threads. Which
+ *        ctx is used by which sgh was already decided while queueing, so
+ *        the result does not depend on the thread scheduling.
+ *
+ * \retval 0 on success, -1 if a ctx failed to prepare
+ */
+int MpmStorePrepareQueued(DetectEngineCtx *de_ctx)
+{
+    MpmStore *store = de_ctx->mpm_store;
+    if (store == NULL || store->prepare_queue_cnt == 0)
+        return 0;
+
+    uint32_t u, todo = 0;
+
+    DetectEngineCacheOpen(de_ctx);
+    for (u = 0; u < store->prepare_queue_cnt; u++) {
+        MpmStorePrepareItem *item = &store->prepare_queue[u];
+        if (DetectEngineCacheMapMpmCtx(de_ctx, u, item->mpm_ctx, item->digest) == 0)
+            item->mapped = 1;
+        else
+            todo++;
+    }
+    if (de_ctx->cache != NULL && !(de_ctx->flags & DE_QUIET)) {
+        SCLogInfo("%"PRIu32" of %"PRIu32" mpm ctxs loaded from detect engine "
+                  "cache %s", store->prepare_queue_cnt - todo,
+                  store->prepare_queue_cnt, de_ctx->cache->path);
+    }
+
+    MpmStorePrepareThread pt;
+    memset(&pt, 0, sizeof(pt));
+    pt.store = store;
+    SC_ATOMIC_INIT(pt.next);
+    SC_ATOMIC_INIT(pt.failed);
+
+    uint16_t threads = de_ctx->prepare_threads;
+#ifdef __SC_CUDA_SUPPORT__
+    /* the cuda ctx is only pushed for the calling thread */
+    if (de_ctx->mpm_matcher == MPM_AC_CUDA)
+        threads = 1;
+#endif
+    if (threads > todo)
+        threads = todo;
+    if (threads == 0)
+        threads = 1;
+
+    pthread_t tids[threads];
+    uint16_t started = 0;
+    /* the calling thread is worker 0 */
+    for ( ; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, MpmStorePrepareWorker, &pt) != 0) {
+            SCLogWarning(SC_ERR_THREAD_CREATE, "failed to start mpm prepare "
+                    "thread, continuing with %"PRIu16" threads", started + 1);
+            break;
+        }
+    }
+    MpmStorePrepareWorker(&pt);
+
+    uint16_t i;
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    SCLogDebug("prepared %"PRIu32" mpm ctxs using %"PRIu16" threads",
+               todo, started + 1);
+
+    int r = SC_ATOMIC_GET(pt.failed) ? -1 : 0;
+    SC_ATOMIC_DESTROY(pt.next);
+    SC_ATOMIC_DESTROY(pt.failed);
+
+    if (r == 0 && DetectEngineCacheWriteBegin(de_ctx) == 0) {
+        for (u = 0; u < store->prepare_queue_cnt; u++) {
+            MpmStorePrepareItem *item = &store->prepare_queue[u];
+            DetectEngineCacheWriteMpmCtx(de_ctx, item->mpm_ctx, item->digest);
+        }
+        DetectEngineCacheWriteEnd(de_ctx);
+    }
+
+    SCFree(store->prepare_queue);
+    store->prepare_queue = NULL;
+    store->prepare_queue_cnt = 0;
+    store->prepare_queue_size = 0;
+    return r;
+}
+
+/**
+ * \brief Log the store summary and drop the pattern sets, which are
+ *        only needed while building the sgh's.
+ */
+void MpmStoreReportStats(DetectEngineCtx *de_ctx)
+{
+    MpmStore *store = de_ctx->mpm_store;
+    if (store == NULL)
+        return;
+
+    store->memory_size = 0;
+    store->memory_saved = 0;
+
+    HashListTableBucket *htb = HashListTableGetListHead(store->hash);
+    for ( ; htb != NULL; htb = HashListTableGetListNext(htb)) {
+        MpmStoreEntry *e = HashListTableGetListData(htb);
+        if (e->patterns != NULL) {
+            SCFree(e->patterns);
+            e->patterns = NULL;
+        }
+        store->memory_size += e->mpm_ctx->memory_size;
+        store->memory_saved += (uint64_t)(e->users - 1) * e->mpm_ctx->memory_size;
+    }
+
+    if (!(de_ctx->flags & DE_QUIET)) {
+        SCLogInfo("mpm store: %"PRIu32" unique mpm contexts for %"PRIu32
+                  " buffers, using %"PRIu64" bytes, %"PRIu64" bytes saved "
+                  "by sharing", store->unique, store->total,
+                  store->memory_size, store->memory_saved);
+    }
+}
+
+void MpmStoreFree(DetectEngineCtx *de_ctx)
+{
+    if (de_ctx->mpm_store == NULL)
+        return;
+
+    HashListTableFree(de_ctx->mpm_store->hash);
+    if (de_ctx->mpm_store->prepare_queue != NULL)
+        SCFree(de_ctx->mpm_store->prepare_queue);
+    SCFree(de_ctx->mpm_store);
+    de_ctx->mpm_store = NULL;
+}
+
 #ifdef __SC_CUDA_SUPPORT__
 
 static void MpmCudaConfFree(void *conf)
@@ -590,6 +1047,7 @@ void MpmTableSetup(void)
     MpmACBSRegister();
     MpmACGfbsRegister();
     MpmACTileRegister();
+    MpmTeddyRegister();
 #ifdef __SC_CUDA_SUPPORT__
     MpmACCudaRegister();
 #endif /* __SC_CUDA_SUPPORT__ */
@@ -655,6 +1113,9 @@ int MpmAddPatternCS(struct MpmCtx_ *mpm_ctx, uint8_t *pat, uint16_t patlen,
                     uint16_t offset, uint16_t depth,
                     uint32_t pid, uint32_t sid, uint8_t flags)
 {
+    if (mpm_ctx->flags & MPM_CTX_FLAG_STORE_TRACK)
+        MpmStoreRecordPattern(mpm_ctx, patlen, pid, flags);
+
     return mpm_table[mpm_ctx->mpm_type].AddPattern(mpm_ctx, pat, patlen,
                                                    offset, depth,
                                                    pid, sid, flags);
@@ -664,6 +1125,9 @@ int MpmAddPatternCI(struct MpmCtx_ *mpm_ctx, uint8_t *pat, uint16_t patlen,
                     uint16_t offset, uint16_t depth,
                     uint32_t pid, uint32_t sid, uint8_t flags)
 {
+    if (mpm_ctx->flags & MPM_CTX_FLAG_STORE_TRACK)
+        MpmStoreRecordPattern(mpm_ctx, patlen, pid, flags | MPM_PATTERN_FLAG_NOCASE);
+
     return mpm_table[mpm_ctx->mpm_type].AddPatternNocase(mpm_ctx, pat, patlen,
                                                          offset, depth,
                                                          pid, sid, flags);
@@ -674,6 +1138,73 @@ int MpmAddPatternCI(struct MpmCtx_ *mpm_ctx, uint8_t *pat, uint16_t patlen,
 /************************************Unittests*********************************/
 
 #ifdef UNITTESTS
+/**
+ * \test ctxs with the same pattern set share one prepared ctx, regardless
+ *       of the order and duplication of the patterns.
+ */
+static int MpmStoreTest01(void)
+{
+    int result = 0;
+    MpmCtx *ctx[3];
+    int i;
+
+    DetectEngineCtx *de_ctx = DetectEngineCtxInit();
+    if (de_ctx == NULL)
+        return 0;
+
+    for (i = 0; i < 3; i++) {
+        ctx[i] = MpmFactoryGetMpmCtxForProfile(de_ctx,
+                MPM_CTX_FACTORY_UNIQUE_CONTEXT, 0);
+        if (ctx[i] == NULL)
+            goto end;
+        MpmInitCtx(ctx[i], MPM_AC);
+    }
+
+    MpmAddPatternCS(ctx[0], (uint8_t *)"abcd", 4, 0, 0, 0, 1, 0);
+    MpmAddPatternCI(ctx[0], (uint8_t *)"efgh", 4, 0, 0, 1, 2, 0);
+
+    MpmAddPatternCI(ctx[1], (uint8_t *)"efgh", 4, 0, 0, 1, 3, 0);
+    MpmAddPatternCS(ctx[1], (uint8_t *)"abcd", 4, 0, 0, 0, 4, 0);
+    MpmAddPatternCS(ctx[1], (uint8_t *)"abcd", 4, 0, 0, 0, 5, 0);
+
+    /* same pattern ids, but case sensitive */
+    MpmAddPatternCS(ctx[2], (uint8_t *)"abcd", 4, 0, 0, 0, 1, 0);
+    MpmAddPatternCS(ctx[2], (uint8_t *)"efgh", 4, 0, 0, 1, 2, 0);
+
+    for (i = 0; i < 3; i++)
+        ctx[i] = MpmStorePrepareCtx(de_ctx, ctx[i]);
+
+    if (ctx[0] != ctx[1] || ctx[0] == ctx[2]) {
+        printf("ctxs not shared as expected: %p %p %p: ",
+               ctx[0], ctx[1], ctx[2]);
+        goto end;
+    }
+    if (de_ctx->mpm_store->total != 3 || de_ctx->mpm_store->unique != 2) {
+        printf("total %"PRIu32" unique %"PRIu32", expected 3/2: ",
+               de_ctx->mpm_store->total, de_ctx->mpm_store->unique);
+        goto end;
+    }
+    if (!ctx[0]->global || !(ctx[0]->flags & MPM_CTX_FLAG_STORE_OWNED))
+        goto end;
+
+    /* the unique ctxs are prepared in one go */
+    if (de_ctx->mpm_store->prepare_queue_cnt != 2) {
+        printf("%"PRIu32" ctxs queued, expected 2: ",
+               de_ctx->mpm_store->prepare_queue_cnt);
+        goto end;
+    }
+    de_ctx->prepare_threads = 2;
+    if (MpmStorePrepareQueued(de_ctx) != 0)
+        goto end;
+    if (de_ctx->mpm_store->prepare_queue_cnt != 0)
+        goto end;
+
+    result = 1;
+end:
+    /* store owned ctxs are freed with the store */
+    DetectEngineCtxFree(de_ctx);
+    return result;
+}
 #endif /* UNITTESTS */
 
 void MpmRegisterTests(void)
@@ -681,6 +1212,8 @@ void MpmRegisterTests(void)
 #ifdef UNITTESTS
     uint16_t i;
 
+    UtRegisterTest("MpmStoreTest01", MpmStoreTest01, 1);
+
     for (i = 0; i < MPM_TABLE_SIZE; i++) {
         if (i == MPM_NOTSET)
             continue;
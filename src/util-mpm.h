@@ -72,6 +72,8 @@ enum {
     MPM_AC_GFBS,
     MPM_AC_BS,
     MPM_AC_TILE,
+    /* teddy style SIMD bucket filter */
+    MPM_TEDDY,
     /* table size */
     MPM_TABLE_SIZE,
 };
@@ -108,6 +110,20 @@ typedef struct PatternMatcherQueue_ {
     uint32_t pattern_id_bitarray_size; /**< size in bytes */
 } PatternMatcherQueue;
 
+/** pattern as added to a mpm ctx, recorded for the mpm store. The pattern
+ *  id identifies the (possibly chopped) content and its nocase setting,
+ *  so the bytes themselves are not needed. */
+typedef struct MpmStorePattern_ {
+    uint32_t pid;
+    uint16_t patlen;
+    uint8_t flags;
+} MpmStorePattern;
+
+/** mpm ctx records its patterns for the mpm store */
+#define MPM_CTX_FLAG_STORE_TRACK    0x01
+/** mpm ctx is owned by the mpm store */
+#define MPM_CTX_FLAG_STORE_OWNED    0x02
+
 typedef struct MpmCtx_ {
     void *ctx;
     uint16_t mpm_type;
@@ -126,8 +142,36 @@ typedef struct MpmCtx_ {
 
     uint32_t memory_cnt;
     uint32_t memory_size;
+
+    /* MPM_CTX_FLAG_* */
+    uint8_t flags;
+
+    /* patterns recorded for the mpm store lookup */
+    uint32_t store_patterns_cnt;
+    uint32_t store_patterns_size;
+    MpmStorePattern *store_patterns;
 } MpmCtx;
 
+/** \brief content addressed store of prepared mpm ctxs.
+ *
+ *  Mpm ctxs of sgh's (and buffers) that end up with the same pattern set
+ *  are prepared once and shared. The store owns the shared ctxs. */
+typedef struct MpmStore_ {
+    /* MpmStoreEntry's by pattern set */
+    struct HashListTable_ *hash;
+
+    /* ctxs waiting for MpmStorePrepareQueued() */
+    struct MpmStorePrepareItem_ *prepare_queue;
+    uint32_t prepare_queue_cnt;
+    uint32_t prepare_queue_size;
+
+    /* stats for the startup summary */
+    uint32_t total;         /**< ctxs looked up */
+    uint32_t unique;        /**< ctxs prepared */
+    uint64_t memory_size;   /**< memory used by the unique ctxs */
+    uint64_t memory_saved;  /**< memory the shared copies would have used */
+} MpmStore;
+
 /* if we want to retrieve an unique mpm context from the mpm context factory
  * we should supply this as the key */
 #define MPM_CTX_FACTORY_UNIQUE_CONTEXT -1
@@ -185,6 +229,12 @@ typedef struct MpmTableElmt_ {
     void (*PrintCtx)(struct MpmCtx_ *);
     void (*PrintThreadCtx)(struct MpmThreadCtx_ *);
     void (*RegisterUnittests)(void);
+    /** optional: write a prepared ctx to the detect engine cache */
+    int  (*CacheWrite)(struct MpmCtx_ *, FILE *);
+    /** optional: turn a ctx with its patterns added into a prepared one,
+     *  using a block written by CacheWrite. The block stays mapped for
+     *  the lifetime of the ctx. */
+    int  (*CacheMap)(struct MpmCtx_ *, const uint8_t *, uint64_t);
     uint8_t flags;
 } MpmTableElmt;
 
@@ -234,6 +284,12 @@ MpmCtx *MpmFactoryGetMpmCtxForProfile(struct DetectEngineCtx_ *, int32_t, int);
 void MpmFactoryDeRegisterAllMpmCtxProfiles(struct DetectEngineCtx_ *);
 int32_t MpmFactoryIsMpmCtxAvailable(struct DetectEngineCtx_ *, MpmCtx *);
 
+MpmCtx *MpmStorePrepareCtx(struct DetectEngineCtx_ *, MpmCtx *);
+void MpmStoreQueueCtx(struct DetectEngineCtx_ *, MpmCtx *);
+int MpmStorePrepareQueued(struct DetectEngineCtx_ *);
+void MpmStoreReportStats(struct DetectEngineCtx_ *);
+void MpmStoreFree(struct DetectEngineCtx_ *);
+
 int PmqSetup(PatternMatcherQueue *, uint32_t);
 void PmqMerge(PatternMatcherQueue *src, PatternMatcherQueue *dst);
 void PmqReset(PatternMatcherQueue *);
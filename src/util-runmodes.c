@@ -79,6 +79,29 @@ char *RunmodeAutoFpCreatePickupQueuesString(int n)
     return queues;
 }
 
+/**
+ * \brief get the queue handler autofp passes packets on with
+ *
+ * Set by "autofp-queue": "flow" for the mutex protected queues (default)
+ * or "ring" for the lock free flow rings.
+ *
+ * \retval name queue handler name
+ */
+char *RunmodeAutoFpGetQueueHandler(void)
+{
+    char *mode = NULL;
+
+    if (ConfGet("autofp-queue", &mode) == 1) {
+        if (strcasecmp(mode, "ring") == 0) {
+            return "flow-ring";
+        } else if (strcasecmp(mode, "flow") != 0) {
+            SCLogWarning(SC_ERR_INVALID_YAML_CONF_ENTRY, "Invalid entry \"%s\" "
+                    "for autofp-queue in conf, using \"flow\"", mode);
+        }
+    }
+    return "flow";
+}
+
 /**
  *  \param de_ctx detection engine, can be NULL
  */
@@ -92,6 +115,7 @@ int RunModeSetLiveCaptureAutoFp(DetectEngineCtx *de_ctx,
     char tname[TM_THREAD_NAME_MAX];
     char qname[TM_QUEUE_NAME_MAX];
     char *queues = NULL;
+    char *qhandler = RunmodeAutoFpGetQueueHandler();
     int thread = 0;
     /* Available cpus */
     uint16_t ncpus = UtilCpuGetNumProcessorsOnline();
@@ -137,7 +161,7 @@ int RunModeSetLiveCaptureAutoFp(DetectEngineCtx *de_ctx,
             ThreadVars *tv_receive =
                 TmThreadCreatePacketHandler(thread_name,
                         "packetpool", "packetpool",
-                        queues, "flow", "pktacqloop");
+                        queues, qhandler, "pktacqloop");
             if (tv_receive == NULL) {
                 SCLogError(SC_ERR_RUNMODE, "TmThreadsCreate failed");
                 exit(EXIT_FAILURE);
@@ -200,7 +224,7 @@ int RunModeSetLiveCaptureAutoFp(DetectEngineCtx *de_ctx,
                 ThreadVars *tv_receive =
                     TmThreadCreatePacketHandler(thread_name,
                             "packetpool", "packetpool",
-                            queues, "flow", "pktacqloop");
+                            queues, qhandler, "pktacqloop");
                 if (tv_receive == NULL) {
                     SCLogError(SC_ERR_RUNMODE, "TmThreadsCreate failed");
                     exit(EXIT_FAILURE);
@@ -242,7 +266,7 @@ int RunModeSetLiveCaptureAutoFp(DetectEngineCtx *de_ctx,
         }
         ThreadVars *tv_detect_ncpu =
             TmThreadCreatePacketHandler(thread_name,
-                                        qname, "flow",
+                                        qname, qhandler,
                                         "packetpool", "packetpool",
                                         "varslot");
         if (tv_detect_ncpu == NULL) {
@@ -480,6 +504,7 @@ int RunModeSetIPSAutoFp(DetectEngineCtx *de_ctx,
     TmModule *tm_module ;
     char *cur_queue = NULL;
     char *queues = NULL;
+    char *qhandler = RunmodeAutoFpGetQueueHandler();
     int thread;
 
     /* Available cpus */
@@ -517,7 +542,7 @@ int RunModeSetIPSAutoFp(DetectEngineCtx *de_ctx,
         ThreadVars *tv_receive =
             TmThreadCreatePacketHandler(thread_name,
                     "packetpool", "packetpool",
-                    queues, "flow", "pktacqloop");
+                    queues, qhandler, "pktacqloop");
         if (tv_receive == NULL) {
             SCLogError(SC_ERR_RUNMODE, "TmThreadsCreate failed");
             exit(EXIT_FAILURE);
@@ -557,7 +582,7 @@ int RunModeSetIPSAutoFp(DetectEngineCtx *de_ctx,
         }
         ThreadVars *tv_detect_ncpu =
             TmThreadCreatePacketHandler(thread_name,
-                                        qname, "flow",
+                                        qname, qhandler,
                                         "verdict-queue", "simple",
                                         "varslot");
         if (tv_detect_ncpu == NULL) {
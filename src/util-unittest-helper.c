@@ -434,7 +434,7 @@ Flow *UTHBuildFlow(int family, char *src, char *dst, Port sp, Port dp)
 {
     struct in_addr in;
 
-    Flow *f = SCMalloc(sizeof(Flow));
+    Flow *f = SCMallocAligned(sizeof(Flow), CLS);
     if (unlikely(f == NULL)) {
         printf("FlowAlloc failed\n");
         ;
@@ -454,7 +454,7 @@ Flow *UTHBuildFlow(int family, char *src, char *dst, Port sp, Port dp)
         if (family == AF_INET) {
             if (inet_pton(AF_INET, src, &in) != 1) {
                 printf("invalid address %s\n", src);
-                SCFree(f);
+                SCFreeAligned(f);
                 return NULL;
             }
             f->src.addr_data32[0] = in.s_addr;
@@ -466,7 +466,7 @@ Flow *UTHBuildFlow(int family, char *src, char *dst, Port sp, Port dp)
         if (family == AF_INET) {
             if (inet_pton(AF_INET, dst, &in) != 1) {
                 printf("invalid address %s\n", dst);
-                SCFree(f);
+                SCFreeAligned(f);
                 return NULL;
             }
             f->dst.addr_data32[0] = in.s_addr;
@@ -114,6 +114,7 @@ int VariableNameInitHash(DetectEngineCtx *de_ctx)
         return -1;
 
     de_ctx->variable_names_idx = 0;
+    de_ctx->variable_flowbits_idx = 0;
     return 0;
 }
 
@@ -130,6 +131,8 @@ void VariableNameFreeHash(DetectEngineCtx *de_ctx)
 }
 
 /** \brief Get a name idx for a name. If the name is already used reuse the idx.
+ *         Flowbits are numbered separately from the other types so that
+ *         their idx's are dense and can index the per flow bitmap.
  *  \param name nul terminated string with the name
  *  \param type variable type (DETECT_FLOWBITS, DETECT_PKTVAR, etc)
  *  \retval 0 in case of error
@@ -152,9 +155,11 @@ uint16_t VariableNameGetIdx(DetectEngineCtx *de_ctx, char *name, uint8_t type)
 
     VariableName *lookup_fn = (VariableName *)HashListTableLookup(de_ctx->variable_names, (void *)fn, 0);
     if (lookup_fn == NULL) {
-        de_ctx->variable_names_idx++;
-
-        idx = fn->idx = de_ctx->variable_names_idx;
+        if (type == DETECT_FLOWBITS) {
+            idx = fn->idx = ++de_ctx->variable_flowbits_idx;
+        } else {
+            idx = fn->idx = ++de_ctx->variable_names_idx;
+        }
         HashListTableAdd(de_ctx->variable_names, (void *)fn, 0);
         HashListTableAdd(de_ctx->variable_idxs, (void *)fn, 0);
     } else {
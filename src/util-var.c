@@ -29,7 +29,6 @@
 #include "util-var.h"
 
 #include "flow-var.h"
-#include "flow-bit.h"
 #include "pkt-var.h"
 
 #include "util-debug.h"
@@ -43,13 +42,6 @@ void GenericVarFree(GenericVar *gv)
     GenericVar *next_gv = gv->next;
 
     switch (gv->type) {
-        case DETECT_FLOWBITS:
-        {
-            FlowBit *fb = (FlowBit *)gv;
-            //printf("GenericVarFree: fb %p, removing\n", fb);
-            FlowBitFree(fb);
-            break;
-        }
         case DETECT_FLOWVAR:
         {
             FlowVar *fv = (FlowVar *)gv;
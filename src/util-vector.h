@@ -40,4 +40,19 @@ typedef struct Vector_ {
 
 #endif /* defined(__SSE3__) */
 
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+typedef struct Vector256_ {
+    union {
+        __m256i v;          /**< vector */
+        uint8_t c[32];      /**< character */
+        uint32_t dw[8];     /**< double word */
+        uint64_t qw[4];     /**< quad word */
+    };
+} Vector256 __attribute((aligned(32)));
+
+#endif /* defined(__AVX2__) */
+
 #endif /* __UTIL_VECTOR_H__ */